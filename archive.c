@@ -0,0 +1,738 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "archive.h"
+#include "drm-utils.h"
+#include "hash.h"
+#include "image.h"
+#include "io.h"
+#include "lz4.h"
+#include "utils.h"
+
+/* slot buffers hold the packed planes of a frame until they're written */
+struct vde_archive_slot {
+	uint8_t *buffer;
+	/* plane writes in flight and their sizes */
+	unsigned int pending;
+	uint64_t sizes[3];
+	/* being packed by a thread */
+	bool busy;
+};
+
+struct vde_archive {
+	pthread_mutex_t lock;
+	unsigned int flags;
+	int fd;
+	uint64_t offset;
+	/* first error encountered while writing, stops the archive */
+	int err;
+
+	struct vde_archive_entry *index;
+	unsigned int num_frames;
+	unsigned int max_frames;
+
+	/* asynchronous writes, the slots are set up by the first frame */
+	struct vde_io *io;
+	struct vde_archive_slot *slots;
+	unsigned int num_slots;
+	uint8_t *buffers;
+	size_t slot_size;
+	int buffer_index;
+};
+
+static int vde_archive_pwrite(int fd, const void *data, size_t size,
+			      uint64_t offset)
+{
+	const uint8_t *ptr = data;
+	ssize_t count;
+
+	while (size > 0) {
+		count = pwrite(fd, ptr, size, offset);
+		if (count < 0) {
+			if (errno == EINTR)
+				continue;
+
+			return -errno;
+		}
+
+		if (count == 0)
+			return -EIO;
+
+		ptr += count;
+		offset += count;
+		size -= count;
+	}
+
+	return 0;
+}
+
+int vde_archive_create(struct vde_archive **archivep, const char *filename,
+		       unsigned int flags)
+{
+	struct vde_archive *archive;
+
+	archive = calloc(1, sizeof(*archive));
+	if (!archive)
+		return -ENOMEM;
+
+	pthread_mutex_init(&archive->lock, NULL);
+	archive->flags = flags;
+
+	archive->fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+			   0644);
+	if (archive->fd < 0) {
+		int err = -errno;
+
+		pthread_mutex_destroy(&archive->lock);
+		free(archive);
+		return err;
+	}
+
+	/* the header is written when the archive is finished */
+	archive->offset = sizeof(struct vde_archive_header);
+	*archivep = archive;
+
+	return 0;
+}
+
+int vde_archive_set_async(struct vde_archive *archive, unsigned int depth)
+{
+	int err;
+
+	if (depth == 0 || archive->io || archive->num_frames > 0)
+		return -EINVAL;
+
+	archive->slots = calloc(depth, sizeof(*archive->slots));
+	if (!archive->slots)
+		return -ENOMEM;
+
+	/* one write per plane */
+	err = vde_io_create(&archive->io, depth * 3);
+	if (err < 0) {
+		free(archive->slots);
+		archive->slots = NULL;
+		return err;
+	}
+
+	archive->num_slots = depth;
+
+	return 0;
+}
+
+static void vde_archive_plane_size(const struct drm_format_info *info,
+				   unsigned int plane, unsigned int width,
+				   unsigned int height, unsigned int *bytes,
+				   unsigned int *rows)
+{
+	if (plane > 0) {
+		width /= info->hsub;
+		height /= info->vsub;
+	}
+
+	*bytes = width * info->cpp[plane];
+	*rows = height;
+}
+
+/* reserves room for the planes and adds the frame to the index */
+static int vde_archive_append(struct vde_archive *archive,
+			      struct vde_archive_entry *entry)
+{
+	unsigned int i;
+
+	if (archive->num_frames == archive->max_frames) {
+		unsigned int max = archive->max_frames * 2 ?: 256;
+		struct vde_archive_entry *index;
+
+		index = realloc(archive->index, max * sizeof(*index));
+		if (!index)
+			return -ENOMEM;
+
+		archive->index = index;
+		archive->max_frames = max;
+	}
+
+	/* padding is left as a hole, which reads back as zeroes */
+	for (i = 0; i < entry->num_planes; i++) {
+		entry->offsets[i] = archive->offset;
+		archive->offset += ALIGN(entry->sizes[i], 8);
+	}
+
+	archive->index[archive->num_frames++] = *entry;
+
+	return 0;
+}
+
+static int vde_archive_reap(struct vde_archive *archive, bool wait)
+{
+	struct vde_archive_slot *slot;
+	int err, result;
+	uint64_t user;
+
+	err = vde_io_complete(archive->io, &user, &result, wait);
+	if (err < 0)
+		return err;
+
+	slot = &archive->slots[user / 3];
+
+	if (result < 0)
+		archive->err = archive->err ?: result;
+	else if (result != slot->sizes[user % 3])
+		archive->err = archive->err ?: -EIO;
+
+	slot->pending--;
+
+	return 0;
+}
+
+/*
+ * Slots are sized for the first frame. Frames that are bigger, after a
+ * change of resolution, are written synchronously instead.
+ */
+static int vde_archive_setup_slots(struct vde_archive *archive, size_t size)
+{
+	unsigned int i;
+	int err;
+
+	archive->slot_size = ALIGN(size, 4096);
+
+	err = posix_memalign((void **)&archive->buffers, 4096,
+			     archive->num_slots * archive->slot_size);
+	if (err) {
+		archive->buffers = NULL;
+		return -err;
+	}
+
+	for (i = 0; i < archive->num_slots; i++)
+		archive->slots[i].buffer = archive->buffers +
+					   i * archive->slot_size;
+
+	archive->buffer_index = vde_io_register_buffer(archive->io,
+						       archive->buffers,
+						       archive->num_slots *
+						       archive->slot_size);
+
+	return 0;
+}
+
+/* picks an idle slot, waiting for writes to complete if there is none */
+static struct vde_archive_slot *vde_archive_get_slot(struct vde_archive *archive,
+						     size_t size)
+{
+	unsigned int i;
+
+	if (!archive->buffers && vde_archive_setup_slots(archive, size) < 0)
+		return NULL;
+
+	if (size > archive->slot_size)
+		return NULL;
+
+	while (true) {
+		for (i = 0; i < archive->num_slots; i++) {
+			struct vde_archive_slot *slot = &archive->slots[i];
+
+			if (!slot->busy && slot->pending == 0) {
+				slot->busy = true;
+				return slot;
+			}
+		}
+
+		/* all slots are being packed by other threads */
+		if (vde_archive_reap(archive, true) < 0)
+			return NULL;
+	}
+}
+
+static int vde_archive_submit(struct vde_archive *archive,
+			      struct vde_archive_slot *slot,
+			      const struct vde_archive_entry *entry,
+			      uint8_t *const planes[3])
+{
+	unsigned int i, index = slot - archive->slots;
+	int err;
+
+	for (i = 0; i < entry->num_planes; i++) {
+		err = vde_io_write(archive->io, archive->fd, planes[i],
+				   entry->sizes[i], entry->offsets[i],
+				   archive->buffer_index, index * 3 + i);
+		if (err < 0)
+			return err;
+
+		slot->sizes[i] = entry->sizes[i];
+		slot->pending++;
+	}
+
+	err = vde_io_submit(archive->io);
+	if (err < 0)
+		return err;
+
+	/* pick up whatever has completed in the meantime */
+	while (vde_archive_reap(archive, false) == 0)
+		;
+
+	return 0;
+}
+
+static int vde_archive_write_planes(struct vde_archive *archive,
+				    const struct vde_archive_entry *entry,
+				    uint8_t *const planes[3])
+{
+	unsigned int i;
+	int err;
+
+	for (i = 0; i < entry->num_planes; i++) {
+		err = vde_archive_pwrite(archive->fd, planes[i],
+					 entry->sizes[i], entry->offsets[i]);
+		if (err < 0)
+			return err;
+	}
+
+	return 0;
+}
+
+/*
+ * Packs and compresses the planes outside of the lock, so that threads only
+ * serialize on reserving space in the file. Asynchronous archives pack into
+ * slot buffers that stay around until the kernel has written them.
+ */
+int vde_archive_add(struct vde_archive *archive, const struct image *image,
+		    uint64_t frame, int32_t poc)
+{
+	struct vde_archive_slot *slot = NULL;
+	const struct drm_format_info *info;
+	struct vde_archive_entry entry;
+	unsigned int i, j, bytes, rows;
+	uint8_t *buffer, *planes[3];
+	size_t size, length, needed;
+	uint8_t *raw, *lz4;
+	int err;
+
+	info = drm_format_get_info(image->format);
+	if (!info)
+		return -EINVAL;
+
+	memset(&entry, 0, sizeof(entry));
+	entry.frame = frame;
+	entry.poc = poc;
+	entry.format = image->format;
+	entry.width = image->width;
+	entry.height = image->height;
+	entry.num_planes = info->num_planes;
+
+	for (i = 0, size = 0; i < info->num_planes; i++) {
+		vde_archive_plane_size(info, i, image->width, image->height,
+				       &bytes, &rows);
+		entry.raw_sizes[i] = (uint64_t)bytes * rows;
+		size += entry.raw_sizes[i];
+	}
+
+	/* raw planes back to back, followed by their compressed versions */
+	needed = archive->flags & VDE_ARCHIVE_LZ4 ? size * 2 : size;
+
+	if (archive->io) {
+		pthread_mutex_lock(&archive->lock);
+		slot = vde_archive_get_slot(archive, needed);
+		pthread_mutex_unlock(&archive->lock);
+	}
+
+	if (slot) {
+		buffer = slot->buffer;
+	} else {
+		buffer = malloc(needed);
+		if (!buffer)
+			return -ENOMEM;
+	}
+
+	raw = buffer;
+	lz4 = buffer + size;
+
+	for (i = 0; i < info->num_planes; i++) {
+		vde_archive_plane_size(info, i, image->width, image->height,
+				       &bytes, &rows);
+
+		for (j = 0; j < rows; j++)
+			memcpy(raw + j * bytes,
+			       image->planes[i] + j * image->pitches[i], bytes);
+
+		entry.hash = xxh64(raw, entry.raw_sizes[i], entry.hash);
+		entry.sizes[i] = entry.raw_sizes[i];
+		planes[i] = raw;
+
+		/* planes that don't shrink are stored as they are */
+		if (archive->flags & VDE_ARCHIVE_LZ4) {
+			length = lz4_compress(lz4, entry.raw_sizes[i] - 1, raw,
+					      entry.raw_sizes[i]);
+			if (length > 0) {
+				entry.compressed |= 1 << i;
+				entry.sizes[i] = length;
+				planes[i] = lz4;
+			}
+
+			lz4 += entry.raw_sizes[i];
+		}
+
+		raw += entry.raw_sizes[i];
+	}
+
+	pthread_mutex_lock(&archive->lock);
+
+	if (!archive->err)
+		archive->err = vde_archive_append(archive, &entry);
+
+	if (!archive->err && slot)
+		archive->err = vde_archive_submit(archive, slot, &entry,
+						  planes);
+
+	if (slot)
+		slot->busy = false;
+
+	err = archive->err;
+
+	pthread_mutex_unlock(&archive->lock);
+
+	/* the space is reserved, so frames can be written in any order */
+	if (!slot) {
+		if (err == 0)
+			err = vde_archive_write_planes(archive, &entry, planes);
+
+		free(buffer);
+
+		if (err < 0) {
+			pthread_mutex_lock(&archive->lock);
+			archive->err = archive->err ?: err;
+			pthread_mutex_unlock(&archive->lock);
+		}
+	}
+
+	return err;
+}
+
+/*
+ * Waits for outstanding writes, writes the index and the header, closes the
+ * file and frees the writer. Returns the first error, if any.
+ */
+int vde_archive_finish(struct vde_archive *archive)
+{
+	struct vde_archive_header header;
+	int err;
+
+	if (!archive)
+		return 0;
+
+	if (archive->io) {
+		while (vde_io_pending(archive->io) > 0)
+			if (vde_archive_reap(archive, true) < 0)
+				break;
+
+		vde_io_free(archive->io);
+		free(archive->buffers);
+		free(archive->slots);
+	}
+
+	err = archive->err;
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, VDE_ARCHIVE_MAGIC, sizeof(header.magic));
+	header.version = VDE_ARCHIVE_VERSION;
+	header.num_frames = archive->num_frames;
+	header.index = archive->offset;
+
+	if (err == 0)
+		err = vde_archive_pwrite(archive->fd, archive->index,
+					 archive->num_frames *
+					 sizeof(*archive->index),
+					 archive->offset);
+
+	/* an archive without a valid header is rejected by the reader */
+	if (err == 0)
+		err = vde_archive_pwrite(archive->fd, &header, sizeof(header),
+					 0);
+
+	if (close(archive->fd) < 0 && err == 0)
+		err = -errno;
+
+	pthread_mutex_destroy(&archive->lock);
+	free(archive->index);
+	free(archive);
+
+	return err;
+}
+
+int vde_archive_open(struct vde_archive_file **filep, const char *filename)
+{
+	const struct vde_archive_header *header;
+	struct vde_archive_file *file;
+	struct stat st;
+	void *ptr;
+	int err;
+
+	file = calloc(1, sizeof(*file));
+	if (!file)
+		return -ENOMEM;
+
+	file->fd = open(filename, O_RDONLY | O_CLOEXEC);
+	if (file->fd < 0) {
+		err = -errno;
+		goto free;
+	}
+
+	if (fstat(file->fd, &st) < 0) {
+		err = -errno;
+		goto close;
+	}
+
+	if (!S_ISREG(st.st_mode) || st.st_size < sizeof(*header)) {
+		err = -EINVAL;
+		goto close;
+	}
+
+	ptr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, file->fd, 0);
+	if (ptr == MAP_FAILED) {
+		err = -errno;
+		goto close;
+	}
+
+	file->data = ptr;
+	file->size = st.st_size;
+	header = ptr;
+
+	if (memcmp(header->magic, VDE_ARCHIVE_MAGIC, sizeof(header->magic)) ||
+	    header->version != VDE_ARCHIVE_VERSION ||
+	    header->index % 8 || header->index > file->size ||
+	    (file->size - header->index) / sizeof(struct vde_archive_entry) <
+	    header->num_frames) {
+		err = -EINVAL;
+		goto unmap;
+	}
+
+	file->header = header;
+	file->index = (const void *)(file->data + header->index);
+
+	*filep = file;
+
+	return 0;
+
+unmap:
+	munmap(ptr, st.st_size);
+close:
+	close(file->fd);
+free:
+	free(file);
+	return err;
+}
+
+void vde_archive_close(struct vde_archive_file *file)
+{
+	if (!file)
+		return;
+
+	munmap((void *)file->data, file->size);
+	close(file->fd);
+	free(file->lookup);
+	free(file);
+}
+
+/* checks that the entry describes its format and lies within the payload */
+int vde_archive_get(struct vde_archive_file *file, unsigned int index,
+		    const struct vde_archive_entry **entryp)
+{
+	const struct vde_archive_entry *entry;
+	const struct drm_format_info *info;
+	unsigned int i, bytes, rows;
+	uint64_t offset, size;
+
+	if (index >= file->header->num_frames)
+		return -ENOENT;
+
+	entry = &file->index[index];
+
+	info = drm_format_get_info(entry->format);
+	if (!info || entry->num_planes != info->num_planes ||
+	    entry->width == 0 || entry->height == 0 ||
+	    entry->width % info->hsub || entry->height % info->vsub)
+		return -EINVAL;
+
+	for (i = 0; i < entry->num_planes; i++) {
+		vde_archive_plane_size(info, i, entry->width, entry->height,
+				       &bytes, &rows);
+
+		offset = entry->offsets[i];
+		size = entry->sizes[i];
+
+		if (entry->raw_sizes[i] != (uint64_t)bytes * rows ||
+		    offset < sizeof(*file->header) ||
+		    offset > file->header->index ||
+		    file->header->index - offset < size)
+			return -EINVAL;
+
+		if (!(entry->compressed & (1 << i)) &&
+		    size != entry->raw_sizes[i])
+			return -EINVAL;
+	}
+
+	*entryp = entry;
+
+	return 0;
+}
+
+struct vde_archive_lookup {
+	uint64_t frame;
+	unsigned int index;
+};
+
+static int vde_archive_lookup_compare(const void *a, const void *b)
+{
+	const struct vde_archive_lookup *x = a, *y = b;
+
+	if (x->frame != y->frame)
+		return x->frame < y->frame ? -1 : 1;
+
+	return x->index < y->index ? -1 : x->index > y->index;
+}
+
+static struct vde_archive_lookup *
+vde_archive_build_lookup(struct vde_archive_file *file)
+{
+	unsigned int i, count = file->header->num_frames;
+	struct vde_archive_lookup *lookup;
+
+	lookup = malloc(MAX(count, 1u) * sizeof(*lookup));
+	if (!lookup)
+		return NULL;
+
+	for (i = 0; i < count; i++) {
+		lookup[i].frame = file->index[i].frame;
+		lookup[i].index = i;
+	}
+
+	qsort(lookup, count, sizeof(*lookup), vde_archive_lookup_compare);
+
+	return lookup;
+}
+
+/* returns the index of the frame, or -ENOENT */
+int vde_archive_find(struct vde_archive_file *file, uint64_t frame)
+{
+	unsigned int i, low = 0, high = file->header->num_frames;
+
+	/* frames are usually added in order, starting at 0 */
+	if (frame < file->header->num_frames &&
+	    file->index[frame].frame == frame)
+		return frame;
+
+	/*
+	 * Archives written by several threads are out of order, so look the
+	 * frame up in a sorted copy of the index rather than scanning it.
+	 */
+	if (!file->lookup) {
+		file->lookup = vde_archive_build_lookup(file);
+		if (!file->lookup) {
+			for (i = 0; i < file->header->num_frames; i++)
+				if (file->index[i].frame == frame)
+					return i;
+
+			return -ENOENT;
+		}
+	}
+
+	while (low < high) {
+		i = low + (high - low) / 2;
+
+		if (file->lookup[i].frame < frame)
+			low = i + 1;
+		else
+			high = i;
+	}
+
+	if (low < file->header->num_frames && file->lookup[low].frame == frame)
+		return file->lookup[low].index;
+
+	return -ENOENT;
+}
+
+/*
+ * Decompresses a single frame into a new image. Returns -EBADMSG if its
+ * contents don't match the hash.
+ */
+int vde_archive_extract(struct vde_archive_file *file, unsigned int index,
+			struct image **imagep)
+{
+	const struct vde_archive_entry *entry;
+	const struct drm_format_info *info;
+	unsigned int i, j, bytes, rows;
+	uint8_t *buffer = NULL;
+	const uint8_t *plane;
+	struct image *image;
+	uint64_t hash = 0, max = 0;
+	ssize_t size;
+	int err;
+
+	err = vde_archive_get(file, index, &entry);
+	if (err < 0)
+		return err;
+
+	info = drm_format_get_info(entry->format);
+
+	err = image_create(&image, entry->width, entry->height, entry->format);
+	if (err < 0)
+		return err;
+
+	for (i = 0; i < entry->num_planes; i++)
+		if (entry->compressed & (1 << i) && entry->raw_sizes[i] > max)
+			max = entry->raw_sizes[i];
+
+	if (max > 0) {
+		buffer = malloc(max);
+		if (!buffer) {
+			err = -ENOMEM;
+			goto free;
+		}
+	}
+
+	for (i = 0; i < entry->num_planes; i++) {
+		vde_archive_plane_size(info, i, entry->width, entry->height,
+				       &bytes, &rows);
+
+		plane = file->data + entry->offsets[i];
+
+		if (entry->compressed & (1 << i)) {
+			size = lz4_decompress(buffer, entry->raw_sizes[i],
+					      plane, entry->sizes[i]);
+			if (size < 0 || size != entry->raw_sizes[i]) {
+				err = -EINVAL;
+				goto free;
+			}
+
+			plane = buffer;
+		}
+
+		hash = xxh64(plane, entry->raw_sizes[i], hash);
+
+		for (j = 0; j < rows; j++)
+			memcpy(image->planes[i] + j * image->pitches[i],
+			       plane + j * bytes, bytes);
+	}
+
+	if (hash != entry->hash) {
+		err = -EBADMSG;
+		goto free;
+	}
+
+	free(buffer);
+	*imagep = image;
+
+	return 0;
+
+free:
+	free(buffer);
+	image_free(image);
+	return err;
+}
@@ -0,0 +1,98 @@
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct image;
+
+/*
+ * Frame archives store decoded pictures in binary, as a replacement for the
+ * hexdumps of the frame dumps. The file starts with a header, followed by
+ * the planes of every frame and an index with one entry per frame:
+ *
+ *   header | planes of frame 0 | planes of frame 1 | ... | index
+ *
+ * Planes are stored without the padding of their pitches, each one either
+ * raw or as an LZ4 block, padded to 8 bytes. The hash covers the raw planes
+ * in order, so archives can be compared by their index alone, no matter
+ * whether they are compressed. All values are in native byte order.
+ */
+
+#define VDE_ARCHIVE_MAGIC "VDEARCH\0"
+#define VDE_ARCHIVE_VERSION 1
+
+/* compress planes that get smaller with LZ4 */
+#define VDE_ARCHIVE_LZ4 (1 << 0)
+
+/* the decoder doesn't know the picture order count of the frame */
+#define VDE_ARCHIVE_POC_UNKNOWN INT32_MIN
+
+struct vde_archive_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t num_frames;
+	/* offset of the index, an array of num_frames entries */
+	uint64_t index;
+};
+
+struct vde_archive_entry {
+	uint64_t frame;
+	int32_t poc;
+	uint32_t format;
+	uint32_t width;
+	uint32_t height;
+	uint32_t num_planes;
+	/* bit N is set if plane N is LZ4-compressed */
+	uint32_t compressed;
+	/* XXH64 of the raw planes, each one seeded with the previous hash */
+	uint64_t hash;
+	uint64_t offsets[3];
+	/* stored and raw sizes of the planes */
+	uint64_t sizes[3];
+	uint64_t raw_sizes[3];
+};
+
+/*
+ * Writers are streaming: every frame is written out as it is added and only
+ * the index is kept in memory until the archive is finished. Frames can be
+ * added from several threads at once.
+ */
+struct vde_archive;
+
+int vde_archive_create(struct vde_archive **archivep, const char *filename,
+		       unsigned int flags);
+
+/*
+ * Writes frames with io_uring, keeping up to depth frames in flight, instead
+ * of blocking the adding thread on the write. Must be called before the
+ * first frame is added.
+ */
+int vde_archive_set_async(struct vde_archive *archive, unsigned int depth);
+int vde_archive_add(struct vde_archive *archive, const struct image *image,
+		    uint64_t frame, int32_t poc);
+int vde_archive_finish(struct vde_archive *archive);
+
+struct vde_archive_lookup;
+
+/* read-only mapping of a finished archive */
+struct vde_archive_file {
+	const struct vde_archive_header *header;
+	const struct vde_archive_entry *index;
+	const uint8_t *data;
+	size_t size;
+	int fd;
+
+	/* index sorted by frame, built by the first vde_archive_find() miss */
+	struct vde_archive_lookup *lookup;
+};
+
+int vde_archive_open(struct vde_archive_file **filep, const char *filename);
+void vde_archive_close(struct vde_archive_file *file);
+int vde_archive_get(struct vde_archive_file *file, unsigned int index,
+		    const struct vde_archive_entry **entryp);
+int vde_archive_find(struct vde_archive_file *file, uint64_t frame);
+int vde_archive_extract(struct vde_archive_file *file, unsigned int index,
+			struct image **imagep);
+
+#endif
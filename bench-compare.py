@@ -0,0 +1,77 @@
+#!/usr/bin/env python3
+#
+# Compares the results of vde-bench against a baseline and fails if any
+# benchmark got slower by more than the noise threshold. The threshold is
+# widened for benchmarks whose rounds are spread further apart than that.
+#
+
+import argparse
+import json
+import sys
+
+
+def load(filename):
+    with open(filename) as f:
+        data = json.load(f)
+
+    return {b['name']: b for b in data['benchmarks']}
+
+
+def spread(result):
+    if result['median_ns'] <= 0:
+        return 0.0
+
+    return (result['max_ns'] - result['min_ns']) / result['median_ns']
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('baseline')
+    parser.add_argument('results')
+    parser.add_argument('-t', '--threshold', type=float, default=0.10,
+                        help='relative slowdown that is considered noise '
+                             '(default: 0.10)')
+    args = parser.parse_args()
+
+    baseline = load(args.baseline)
+    results = load(args.results)
+    regressions = 0
+
+    print('%-16s %12s %12s %8s' % ('benchmark', 'baseline', 'current',
+                                   'change'))
+
+    for name, result in results.items():
+        if name not in baseline:
+            print('%-16s %12s %12.1f %8s' % (name, '-', result['median_ns'],
+                                             'new'))
+            continue
+
+        base = baseline[name]
+        change = result['median_ns'] / base['median_ns'] - 1
+        threshold = max(args.threshold, spread(base), spread(result))
+        status = ''
+
+        if change > threshold:
+            status = '  REGRESSION'
+            regressions += 1
+        elif change < -threshold:
+            status = '  improved'
+
+        print('%-16s %12.1f %12.1f %+7.1f%%%s' % (name, base['median_ns'],
+                                                  result['median_ns'],
+                                                  change * 100, status))
+
+    for name in baseline:
+        if name not in results:
+            print('%-16s %12.1f %12s %8s' % (name, baseline[name]['median_ns'],
+                                             '-', 'missing'))
+
+    if regressions:
+        print('%u regression(s) beyond the noise threshold' % regressions)
+        return 1
+
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -172,12 +172,140 @@ int bitstream_read_se(struct bitstream *bs, int32_t *valuep, size_t *lengthp)
 	if (err < 0)
 		return err;
 
-	code = (code + 1) / 2;
-
+	/* odd codes map to positive values, even codes to negative ones */
 	if (code % 2 == 0)
-		*valuep = -code;
+		*valuep = -(int32_t)(code / 2);
+	else
+		*valuep = (code + 1) / 2;
+
+	return 0;
+}
+
+void bitstream_writer_init(struct bitstream_writer *bw, uint8_t *data,
+			   size_t size, bool escape)
+{
+	bw->data = data;
+	bw->size = size;
+	bw->offset = 0;
+	bw->cache = 0;
+	bw->bits = 0;
+	bw->escape = escape;
+	bw->zeros = 0;
+	bw->err = 0;
+}
+
+/*
+ * Returns the number of bytes written, not counting a partial byte, or the
+ * first error that occurred.
+ */
+ssize_t bitstream_writer_finish(struct bitstream_writer *bw)
+{
+	if (bw->err < 0)
+		return bw->err;
+
+	return bw->offset;
+}
+
+static int bitstream_write_byte(struct bitstream_writer *bw, uint8_t byte)
+{
+	/* 00 00 0x is escaped as 00 00 03 0x */
+	if (bw->escape && bw->zeros >= 2 && byte <= 3) {
+		if (bw->offset >= bw->size)
+			return -ENOSPC;
+
+		bw->data[bw->offset++] = 0x03;
+		bw->zeros = 0;
+	}
+
+	if (bw->offset >= bw->size)
+		return -ENOSPC;
+
+	bw->data[bw->offset++] = byte;
+
+	if (byte == 0)
+		bw->zeros++;
 	else
-		*valuep = code;
+		bw->zeros = 0;
+
+	return 0;
+}
+
+int bitstream_write_u32(struct bitstream_writer *bw, uint32_t value,
+			size_t length)
+{
+	int err;
+
+	if (bw->err < 0)
+		return bw->err;
+
+	if (length > 32) {
+		bw->err = -EINVAL;
+		return bw->err;
+	}
+
+	while (length > 0) {
+		bw->cache = (bw->cache << 1) | ((value >> --length) & 1);
+
+		if (++bw->bits == 8) {
+			err = bitstream_write_byte(bw, bw->cache);
+			if (err < 0) {
+				bw->err = err;
+				return err;
+			}
+
+			bw->cache = 0;
+			bw->bits = 0;
+		}
+	}
+
+	return 0;
+}
+
+int bitstream_write_ue(struct bitstream_writer *bw, uint32_t value)
+{
+	uint64_t code = (uint64_t)value + 1;
+	size_t length = 63 - __builtin_clzll(code);
+	int err;
+
+	err = bitstream_write_u32(bw, 0, length);
+	if (err < 0)
+		return err;
+
+	/* the leading one bit and the suffix don't fit into 32 bits */
+	if (length == 32) {
+		err = bitstream_write_u32(bw, 1, 1);
+		if (err < 0)
+			return err;
+
+		return bitstream_write_u32(bw, code, 32);
+	}
+
+	return bitstream_write_u32(bw, code, length + 1);
+}
+
+int bitstream_write_se(struct bitstream_writer *bw, int32_t value)
+{
+	uint32_t code;
+
+	if (value > 0)
+		code = (uint32_t)value * 2 - 1;
+	else
+		code = -(int64_t)value * 2;
+
+	return bitstream_write_ue(bw, code);
+}
+
+/* rbsp_trailing_bits(): a one bit followed by zero bits up to the next byte */
+int bitstream_write_trailing_bits(struct bitstream_writer *bw)
+{
+	int err;
+
+	err = bitstream_write_u32(bw, 1, 1);
+	if (err < 0)
+		return err;
+
+	if (bw->bits > 0)
+		return bitstream_write_u32(bw, 0, 8 - bw->bits);
 
 	return 0;
 }
@@ -5,6 +5,8 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#include <sys/types.h>
+
 struct bitstream {
 	const uint8_t *data;
 	size_t offset, bit;
@@ -21,4 +23,35 @@ int bitstream_read_u32(struct bitstream *bs, uint32_t *valuep, size_t length);
 int bitstream_read_ue(struct bitstream *bs, uint32_t *valuep, size_t *lengthp);
 int bitstream_read_se(struct bitstream *bs, int32_t *valuep, size_t *lengthp);
 
+/*
+ * Writes an RBSP, optionally inserting emulation prevention bytes so that the
+ * result can be used as the payload of a NAL unit. Errors are sticky: once a
+ * write fails, all subsequent writes fail the same way, so that a sequence of
+ * writes can be checked once with bitstream_writer_finish().
+ */
+struct bitstream_writer {
+	uint8_t *data;
+	size_t offset;
+	size_t size;
+
+	/* bits not yet written out, MSB first */
+	uint8_t cache;
+	unsigned int bits;
+
+	bool escape;
+	/* number of consecutive zero bytes written */
+	unsigned int zeros;
+
+	int err;
+};
+
+void bitstream_writer_init(struct bitstream_writer *bw, uint8_t *data,
+			   size_t size, bool escape);
+ssize_t bitstream_writer_finish(struct bitstream_writer *bw);
+int bitstream_write_u32(struct bitstream_writer *bw, uint32_t value,
+			size_t length);
+int bitstream_write_ue(struct bitstream_writer *bw, uint32_t value);
+int bitstream_write_se(struct bitstream_writer *bw, int32_t value);
+int bitstream_write_trailing_bits(struct bitstream_writer *bw);
+
 #endif
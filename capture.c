@@ -0,0 +1,334 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "capture.h"
+#include "vde.h"
+
+bool vde_capture_enabled;
+
+static pthread_mutex_t vde_capture_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct {
+	FILE *fp;
+	uint64_t start;
+	uint64_t offset;
+	/* first error encountered while writing, stops the capture */
+	int err;
+
+	uint64_t *index;
+	unsigned int num_records;
+	unsigned int max_records;
+} vde_capture;
+
+uint64_t vde_capture_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int vde_capture_write(const void *data, size_t size)
+{
+	if (fwrite(data, 1, size, vde_capture.fp) != size)
+		return -EIO;
+
+	vde_capture.offset += size;
+
+	return 0;
+}
+
+int vde_capture_start(const char *filename)
+{
+	struct vde_capture_header header;
+	int err;
+
+	memset(&vde_capture, 0, sizeof(vde_capture));
+
+	vde_capture.fp = fopen(filename, "wb");
+	if (!vde_capture.fp)
+		return -errno;
+
+	/* filled in when the capture is stopped */
+	memset(&header, 0, sizeof(header));
+
+	err = vde_capture_write(&header, sizeof(header));
+	if (err < 0) {
+		fclose(vde_capture.fp);
+		return err;
+	}
+
+	vde_capture.start = vde_capture_now();
+	vde_capture_enabled = true;
+
+	return 0;
+}
+
+static int vde_capture_append(struct tegra_vde *vde,
+			      const struct tegra_vde_h264_decoder_ctx *args,
+			      struct tegra_vde_frame **frames, size_t size,
+			      uint64_t start, int status)
+{
+	const struct tegra_vde_h264_frame *dpb = (const void *)(uintptr_t)args->dpb_frames_ptr;
+	static const uint8_t padding[8];
+	struct vde_capture_record record;
+	struct vde_capture_frame frame;
+	unsigned int i;
+	void *ptr;
+	int err;
+
+	if (args->dpb_frames_nb > VDE_CAPTURE_MAX_FRAMES)
+		return -E2BIG;
+
+	if (vde_capture.num_records == vde_capture.max_records) {
+		unsigned int max = vde_capture.max_records * 2 ?: 1024;
+		uint64_t *index;
+
+		index = realloc(vde_capture.index, max * sizeof(*index));
+		if (!index)
+			return -ENOMEM;
+
+		vde_capture.index = index;
+		vde_capture.max_records = max;
+	}
+
+	memset(&record, 0, sizeof(record));
+	/* decodes that were already running when the capture started */
+	if (start > vde_capture.start)
+		record.time = start - vde_capture.start;
+
+	record.frame = vde->frame;
+	record.stream = vde->id;
+	record.status = status;
+	record.size = size;
+	record.ctx = *args;
+	record.ctx.bitstream_data_fd = 0;
+	record.ctx.secure_fd = 0;
+	record.ctx.dpb_frames_ptr = 0;
+
+	vde_capture.index[vde_capture.num_records] = vde_capture.offset;
+
+	err = vde_capture_write(&record, sizeof(record));
+	if (err < 0)
+		return err;
+
+	for (i = 0; i < args->dpb_frames_nb; i++) {
+		memset(&frame, 0, sizeof(frame));
+		frame.frame = dpb[i];
+		frame.frame.y_fd = 0;
+		frame.frame.cb_fd = 0;
+		frame.frame.cr_fd = 0;
+		frame.frame.aux_fd = 0;
+		frame.width = frames[i]->width;
+		frame.height = frames[i]->height;
+		frame.format = frames[i]->format;
+		frame.pitch = frames[i]->pitch;
+		frame.size = frames[i]->size;
+
+		err = vde_capture_write(&frame, sizeof(frame));
+		if (err < 0)
+			return err;
+	}
+
+	err = tegra_vde_buffer_map(vde->bitstream, &ptr);
+	if (err < 0)
+		return err;
+
+	err = vde_capture_write(ptr + args->bitstream_data_offset, size);
+	tegra_vde_buffer_unmap(vde->bitstream);
+	if (err < 0)
+		return err;
+
+	err = vde_capture_write(padding, -size & 7);
+	if (err < 0)
+		return err;
+
+	vde_capture.num_records++;
+
+	return 0;
+}
+
+/*
+ * Appends a decode call to the capture. frames holds the DPB frames in the
+ * same order as the descriptors that args points to, start is the time at
+ * which the decode was submitted.
+ */
+void vde_capture_record(struct tegra_vde *vde,
+			const struct tegra_vde_h264_decoder_ctx *args,
+			struct tegra_vde_frame **frames, size_t size,
+			uint64_t start, int status)
+{
+	pthread_mutex_lock(&vde_capture_lock);
+
+	if (vde_capture.fp && !vde_capture.err)
+		vde_capture.err = vde_capture_append(vde, args, frames, size,
+						     start, status);
+
+	pthread_mutex_unlock(&vde_capture_lock);
+}
+
+/* writes the index and closes the file, returns the first error, if any */
+int vde_capture_stop(void)
+{
+	struct vde_capture_header header;
+	int err;
+
+	pthread_mutex_lock(&vde_capture_lock);
+
+	vde_capture_enabled = false;
+
+	if (!vde_capture.fp) {
+		pthread_mutex_unlock(&vde_capture_lock);
+		return 0;
+	}
+
+	err = vde_capture.err;
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, VDE_CAPTURE_MAGIC, sizeof(header.magic));
+	header.version = VDE_CAPTURE_VERSION;
+	header.num_records = vde_capture.num_records;
+	header.index = vde_capture.offset;
+
+	if (err == 0)
+		err = vde_capture_write(vde_capture.index,
+					vde_capture.num_records *
+					sizeof(*vde_capture.index));
+
+	/* a capture without a valid header is rejected by the replay */
+	if (err == 0) {
+		if (fseek(vde_capture.fp, 0, SEEK_SET) < 0)
+			err = -errno;
+		else if (fwrite(&header, 1, sizeof(header),
+				vde_capture.fp) != sizeof(header))
+			err = -EIO;
+	}
+
+	if (fclose(vde_capture.fp) != 0 && err == 0)
+		err = -errno;
+
+	free(vde_capture.index);
+	memset(&vde_capture, 0, sizeof(vde_capture));
+
+	pthread_mutex_unlock(&vde_capture_lock);
+
+	return err;
+}
+
+int vde_capture_open(struct vde_capture_file **filep, const char *filename)
+{
+	const struct vde_capture_header *header;
+	struct vde_capture_file *file;
+	struct stat st;
+	void *ptr;
+	int err;
+
+	file = calloc(1, sizeof(*file));
+	if (!file)
+		return -ENOMEM;
+
+	file->fd = open(filename, O_RDONLY | O_CLOEXEC);
+	if (file->fd < 0) {
+		err = -errno;
+		goto free;
+	}
+
+	if (fstat(file->fd, &st) < 0) {
+		err = -errno;
+		goto close;
+	}
+
+	if (!S_ISREG(st.st_mode) || st.st_size < sizeof(*header)) {
+		err = -EINVAL;
+		goto close;
+	}
+
+	ptr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, file->fd, 0);
+	if (ptr == MAP_FAILED) {
+		err = -errno;
+		goto close;
+	}
+
+	file->data = ptr;
+	file->size = st.st_size;
+	header = ptr;
+
+	if (memcmp(header->magic, VDE_CAPTURE_MAGIC, sizeof(header->magic)) ||
+	    header->version != VDE_CAPTURE_VERSION ||
+	    header->index % 8 || header->index > file->size ||
+	    (file->size - header->index) / sizeof(uint64_t) <
+	    header->num_records) {
+		err = -EINVAL;
+		goto unmap;
+	}
+
+	file->header = header;
+	file->index = (const void *)(file->data + header->index);
+
+	*filep = file;
+
+	return 0;
+
+unmap:
+	munmap(ptr, st.st_size);
+close:
+	close(file->fd);
+free:
+	free(file);
+	return err;
+}
+
+void vde_capture_close(struct vde_capture_file *file)
+{
+	if (!file)
+		return;
+
+	munmap((void *)file->data, file->size);
+	close(file->fd);
+	free(file);
+}
+
+int vde_capture_get(struct vde_capture_file *file, unsigned int index,
+		    struct vde_capture_entry *entry)
+{
+	const struct vde_capture_record *record;
+	uint64_t offset, size;
+
+	if (index >= file->header->num_records)
+		return -ENOENT;
+
+	offset = file->index[index];
+
+	if (offset > file->header->index ||
+	    file->header->index - offset < sizeof(*record))
+		return -EINVAL;
+
+	record = (const void *)(file->data + offset);
+
+	if (record->ctx.dpb_frames_nb == 0 ||
+	    record->ctx.dpb_frames_nb > VDE_CAPTURE_MAX_FRAMES)
+		return -EINVAL;
+
+	size = sizeof(*record) +
+	       record->ctx.dpb_frames_nb * sizeof(struct vde_capture_frame) +
+	       record->size;
+
+	if (file->header->index - offset < size)
+		return -EINVAL;
+
+	entry->record = record;
+	entry->frames = (const void *)(record + 1);
+	entry->data = entry->frames + record->ctx.dpb_frames_nb;
+
+	return 0;
+}
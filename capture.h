@@ -0,0 +1,104 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "tegra-vde.h"
+
+struct tegra_vde;
+struct tegra_vde_frame;
+
+/*
+ * Capture files record every call into the decoder backend so that it can be
+ * replayed without demuxing or parsing anything. The file starts with a
+ * header, followed by the records and an index of their offsets:
+ *
+ *   header | record 0 | record 1 | ... | index
+ *
+ * Each record is made up of a struct vde_capture_record, one
+ * struct vde_capture_frame per DPB frame and the staged bitstream, padded to
+ * 8 bytes. All values are in native byte order, file descriptors and
+ * pointers are cleared.
+ */
+
+#define VDE_CAPTURE_MAGIC "VDECAPT\0"
+#define VDE_CAPTURE_VERSION 1
+
+/* at most 16 reference frames plus the one being decoded */
+#define VDE_CAPTURE_MAX_FRAMES 17
+
+struct vde_capture_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t num_records;
+	/* offset of the index, an array of num_records 64-bit offsets */
+	uint64_t index;
+};
+
+struct vde_capture_record {
+	/* nanoseconds since the capture was started */
+	uint64_t time;
+	/* stream and picture, as in struct tegra_vde */
+	uint64_t frame;
+	uint32_t stream;
+	/* result of the original decode */
+	int32_t status;
+	/* number of bitstream bytes */
+	uint32_t size;
+	uint32_t reserved;
+	struct tegra_vde_h264_decoder_ctx ctx;
+	/* keeps the DPB frames aligned */
+	uint8_t padding[3];
+} __attribute__((packed));
+
+struct vde_capture_frame {
+	struct tegra_vde_h264_frame frame;
+	uint32_t width;
+	uint32_t height;
+	uint32_t format;
+	uint32_t pitch;
+	uint64_t size;
+} __attribute__((packed));
+
+/*
+ * Recording is global, records of all decoder contexts end up in the same
+ * file. It costs one branch per decode unless a capture has been started.
+ */
+extern bool vde_capture_enabled;
+
+uint64_t vde_capture_now(void);
+
+static inline uint64_t vde_capture_begin(void)
+{
+	return vde_capture_enabled ? vde_capture_now() : 0;
+}
+
+int vde_capture_start(const char *filename);
+void vde_capture_record(struct tegra_vde *vde,
+			const struct tegra_vde_h264_decoder_ctx *args,
+			struct tegra_vde_frame **frames, size_t size,
+			uint64_t start, int status);
+int vde_capture_stop(void);
+
+struct vde_capture_file {
+	const struct vde_capture_header *header;
+	const uint64_t *index;
+	const uint8_t *data;
+	size_t size;
+	int fd;
+};
+
+struct vde_capture_entry {
+	const struct vde_capture_record *record;
+	const struct vde_capture_frame *frames;
+	const void *data;
+};
+
+int vde_capture_open(struct vde_capture_file **filep, const char *filename);
+void vde_capture_close(struct vde_capture_file *file);
+int vde_capture_get(struct vde_capture_file *file, unsigned int index,
+		    struct vde_capture_entry *entry);
+
+#endif
@@ -0,0 +1,394 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "frame.h"
+#include "protocol.h"
+#include "vde.h"
+#include "vde-decode.h"
+
+/*
+ * Client side of the decode daemon. Frames received from the daemon look just
+ * like those of a local session, except that their buffers are mapped from
+ * the dmabuf passed along with the frame message.
+ */
+
+struct vde_client {
+	int fd;
+};
+
+struct vde_client_frame {
+	struct vde_frame_object object;
+	struct vde_client *client;
+	uint64_t id;
+};
+
+static inline struct vde_client_frame *
+to_client_frame(struct vde_frame_object *object)
+{
+	return container_of(object, struct vde_client_frame, object);
+}
+
+static int vde_client_send(struct vde_client *client, uint32_t type,
+			   const void *body, size_t size, const void *data,
+			   size_t length, int fd)
+{
+	char control[CMSG_SPACE(sizeof(int))];
+	struct vde_message_header header;
+	struct msghdr msg = { 0 };
+	struct cmsghdr *cmsg;
+	struct iovec iov[3];
+
+	if (length > VDE_MESSAGE_MAX_DATA)
+		return -E2BIG;
+
+	header.type = type;
+	header.size = size + length;
+
+	iov[0].iov_base = &header;
+	iov[0].iov_len = sizeof(header);
+	iov[1].iov_base = (void *)body;
+	iov[1].iov_len = size;
+	iov[2].iov_base = (void *)data;
+	iov[2].iov_len = length;
+
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 3;
+
+	if (fd >= 0) {
+		memset(control, 0, sizeof(control));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+	}
+
+	if (sendmsg(client->fd, &msg, MSG_NOSIGNAL) < 0)
+		return -errno;
+
+	return 0;
+}
+
+static void vde_client_frame_release(struct vde_frame_object *object)
+{
+	struct vde_client_frame *frame = to_client_frame(object);
+	struct vde_message_release release;
+
+	release.id = frame->id;
+
+	/* nothing to recycle if the daemon has gone away */
+	vde_client_send(frame->client, VDE_MESSAGE_RELEASE, &release,
+			sizeof(release), NULL, 0, -1);
+
+	tegra_vde_frame_free(object->frame);
+	free(frame);
+}
+
+int vde_client_connect(struct vde_client **clientp, const char *path)
+{
+	int size = VDE_MESSAGE_MAX_SIZE * 2;
+	struct sockaddr_un address;
+	struct vde_client *client;
+	int err;
+
+	if (strlen(path) >= sizeof(address.sun_path))
+		return -ENAMETOOLONG;
+
+	client = calloc(1, sizeof(*client));
+	if (!client)
+		return -ENOMEM;
+
+	client->fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (client->fd < 0) {
+		err = -errno;
+		goto free;
+	}
+
+	/* access units are sent as a single message */
+	setsockopt(client->fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strcpy(address.sun_path, path);
+
+	if (connect(client->fd, (struct sockaddr *)&address,
+		    sizeof(address)) < 0) {
+		err = -errno;
+		goto close;
+	}
+
+	*clientp = client;
+
+	return 0;
+
+close:
+	close(client->fd);
+free:
+	free(client);
+	return err;
+}
+
+/* all frames must have been released before the client is closed */
+void vde_client_close(struct vde_client *client)
+{
+	if (client)
+		close(client->fd);
+
+	free(client);
+}
+
+/* file descriptor that becomes readable when frames are available */
+int vde_client_get_fd(struct vde_client *client)
+{
+	return client->fd;
+}
+
+/*
+ * Sets the SPS and PPS from an avcC record. If the daemon rejects them, all
+ * access units submitted after this are reported as failed.
+ */
+int vde_client_set_parameter_sets(struct vde_client *client, const void *avcc,
+				  size_t size)
+{
+	return vde_client_send(client, VDE_MESSAGE_PARAMETER_SETS, NULL, 0,
+			       avcc, size, -1);
+}
+
+/*
+ * Changes how the stream is scheduled by the daemon. If a live stream can't
+ * be admitted, all access units submitted after this are reported as failed
+ * with -EBUSY.
+ */
+int vde_client_set_stream(struct vde_client *client,
+			  const struct vde_stream_params *params)
+{
+	struct vde_message_stream stream;
+
+	memset(&stream, 0, sizeof(stream));
+	stream.priority = params->priority;
+	stream.weight = params->weight;
+	stream.frame_rate = params->frame_rate;
+
+	return vde_client_send(client, VDE_MESSAGE_STREAM, &stream,
+			       sizeof(stream), NULL, 0, -1);
+}
+
+/*
+ * Sends an access unit to the daemon. Blocks if the daemon is not keeping up,
+ * so frames need to be received in between. Every access unit results in one
+ * call to vde_client_receive(), successful or not. Access units larger than
+ * a message are copied to a memfd first.
+ */
+int vde_client_submit(struct vde_client *client, const void *data, size_t size,
+		      unsigned long flags, uint64_t user)
+{
+	struct vde_message_decode decode;
+	const uint8_t *ptr = data;
+	ssize_t count;
+	size_t done;
+	int fd, err;
+
+	memset(&decode, 0, sizeof(decode));
+	decode.user = user;
+	decode.flags = flags;
+
+	if (size <= VDE_MESSAGE_MAX_DATA)
+		return vde_client_send(client, VDE_MESSAGE_DECODE, &decode,
+				       sizeof(decode), data, size, -1);
+
+	if (size > VDE_MESSAGE_MAX_FD_DATA)
+		return -E2BIG;
+
+	/* too large for a message, pass the access unit in a memfd */
+	fd = memfd_create("vde-unit", MFD_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	for (done = 0; done < size; done += count) {
+		count = write(fd, ptr + done, size - done);
+		if (count < 0) {
+			if (errno == EINTR) {
+				count = 0;
+				continue;
+			}
+
+			err = -errno;
+			goto close;
+		}
+	}
+
+	err = vde_client_send(client, VDE_MESSAGE_DECODE_FD, &decode,
+			      sizeof(decode), NULL, 0, fd);
+
+close:
+	close(fd);
+	return err;
+}
+
+static int vde_client_import(struct vde_client *client,
+			     const struct vde_message_frame *body, int fd,
+			     struct vde_frame **framep)
+{
+	struct vde_client_frame *frame;
+	struct tegra_vde_frame *vde;
+	unsigned int i;
+	int err;
+
+	if (body->size == 0 || body->pitch == 0)
+		return -EINVAL;
+
+	for (i = 0; i < 3; i++)
+		if (body->offsets[i] >= body->size)
+			return -EINVAL;
+
+	if ((uint64_t)body->crop_x + body->crop_width > body->width ||
+	    (uint64_t)body->crop_y + body->crop_height > body->height)
+		return -EINVAL;
+
+	frame = calloc(1, sizeof(*frame));
+	if (!frame)
+		return -ENOMEM;
+
+	vde = calloc(1, sizeof(*vde));
+	if (!vde) {
+		err = -ENOMEM;
+		goto free;
+	}
+
+	err = tegra_vde_buffer_import(&vde->buffer, fd, body->size);
+	if (err < 0)
+		goto free_vde;
+
+	vde->width = body->width;
+	vde->height = body->height;
+	vde->format = body->format;
+	vde->modifier = body->modifier;
+	vde->pitch = body->pitch;
+
+	for (i = 0; i < 3; i++)
+		vde->offsets[i] = body->offsets[i];
+
+	vde->size = body->size;
+	vde->sequence = body->sequence;
+
+	vde->crop.x = body->crop_x;
+	vde->crop.y = body->crop_y;
+	vde->crop.width = body->crop_width;
+	vde->crop.height = body->crop_height;
+
+	vde_frame_object_init(&frame->object, vde, vde_client_frame_release);
+	frame->object.base.sequence = body->sequence;
+	frame->object.base.user = body->user;
+	frame->client = client;
+	frame->id = body->id;
+
+	*framep = &frame->object.base;
+
+	return 0;
+
+free_vde:
+	free(vde);
+free:
+	free(frame);
+	return err;
+}
+
+/*
+ * Returns the next frame, in submission order. The timeout works the same as
+ * for vde_session_receive(). Returns -ENODATA if the daemon has gone away, or
+ * the error that occurred while decoding the access unit.
+ */
+int vde_client_receive(struct vde_client *client, struct vde_frame **framep,
+		       int timeout)
+{
+	char control[CMSG_SPACE(sizeof(int))];
+	struct vde_message_header header;
+	struct vde_message_frame body;
+	struct pollfd pfd = { 0 };
+	struct msghdr msg = { 0 };
+	struct cmsghdr *cmsg;
+	struct iovec iov[2];
+	ssize_t length;
+	int fd = -1;
+	int err;
+
+	pfd.fd = client->fd;
+	pfd.events = POLLIN;
+
+	do {
+		err = poll(&pfd, 1, timeout);
+	} while (err < 0 && errno == EINTR);
+
+	if (err < 0)
+		return -errno;
+
+	if (err == 0)
+		return -EAGAIN;
+
+	iov[0].iov_base = &header;
+	iov[0].iov_len = sizeof(header);
+	iov[1].iov_base = &body;
+	iov[1].iov_len = sizeof(body);
+
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 2;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	length = recvmsg(client->fd, &msg, MSG_CMSG_CLOEXEC);
+	if (length < 0)
+		return -errno;
+
+	if (length == 0)
+		return -ENODATA;
+
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+		if (cmsg->cmsg_level == SOL_SOCKET &&
+		    cmsg->cmsg_type == SCM_RIGHTS)
+			memcpy(&fd, CMSG_DATA(cmsg), sizeof(fd));
+
+	if (length != sizeof(header) + sizeof(body) ||
+	    header.type != VDE_MESSAGE_FRAME || header.size != sizeof(body) ||
+	    (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC))) {
+		err = -EPROTO;
+		goto close;
+	}
+
+	if (body.status < 0) {
+		err = body.status;
+		goto close;
+	}
+
+	if (fd < 0)
+		return -EPROTO;
+
+	err = vde_client_import(client, &body, fd, framep);
+	if (err < 0) {
+		struct vde_message_release release = { .id = body.id };
+
+		/* let the daemon recycle the frame right away */
+		vde_client_send(client, VDE_MESSAGE_RELEASE, &release,
+				sizeof(release), NULL, 0, -1);
+		goto close;
+	}
+
+	return 0;
+
+close:
+	if (fd >= 0)
+		close(fd);
+
+	return err;
+}
@@ -0,0 +1,134 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__arm__)
+#include <sys/auxv.h>
+#endif
+
+#include "cpu.h"
+#include "utils.h"
+
+/* CPU_ISA_COUNT until the first kernel call or cpu_isa_force() */
+enum cpu_isa cpu_isa_active = CPU_ISA_COUNT;
+
+static const char *const cpu_isa_names[CPU_ISA_COUNT] = {
+	[CPU_ISA_SCALAR] = "scalar",
+	[CPU_ISA_SSE2] = "sse2",
+	[CPU_ISA_AVX2] = "avx2",
+	[CPU_ISA_NEON] = "neon",
+};
+
+/* ARMv7 reports NEON in the hardware capabilities */
+#ifndef HWCAP_NEON
+#define HWCAP_NEON (1 << 12)
+#endif
+
+bool cpu_isa_supported(enum cpu_isa isa)
+{
+	switch (isa) {
+	case CPU_ISA_SCALAR:
+		return true;
+
+#if defined(CPU_HAVE_SSE2)
+	case CPU_ISA_SSE2:
+		__builtin_cpu_init();
+		return __builtin_cpu_supports("sse2");
+
+	case CPU_ISA_AVX2:
+		__builtin_cpu_init();
+		return __builtin_cpu_supports("avx2");
+#endif
+
+#if defined(__aarch64__)
+	case CPU_ISA_NEON:
+		return true;
+#elif defined(__arm__)
+	case CPU_ISA_NEON:
+		return (getauxval(AT_HWCAP) & HWCAP_NEON) != 0;
+#endif
+
+	default:
+		return false;
+	}
+}
+
+const char *cpu_isa_name(enum cpu_isa isa)
+{
+	if (isa >= CPU_ISA_COUNT)
+		return "unknown";
+
+	return cpu_isa_names[isa];
+}
+
+static enum cpu_isa cpu_isa_best(void)
+{
+	static const enum cpu_isa preference[] = {
+		CPU_ISA_AVX2, CPU_ISA_SSE2, CPU_ISA_NEON,
+	};
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(preference); i++)
+		if (cpu_isa_supported(preference[i]))
+			return preference[i];
+
+	return CPU_ISA_SCALAR;
+}
+
+static int cpu_isa_lookup(const char *name, enum cpu_isa *isap)
+{
+	unsigned int i;
+
+	if (strcmp(name, "auto") == 0) {
+		*isap = cpu_isa_best();
+		return 0;
+	}
+
+	for (i = 0; i < CPU_ISA_COUNT; i++) {
+		if (strcmp(name, cpu_isa_names[i]) == 0) {
+			if (!cpu_isa_supported(i))
+				return -ENOTSUP;
+
+			*isap = i;
+			return 0;
+		}
+	}
+
+	return -EINVAL;
+}
+
+/*
+ * Detection is idempotent, so threads that race here all store the same
+ * value. VDE_ISA in the environment overrides it, like cpu_isa_force().
+ */
+enum cpu_isa cpu_isa_init(void)
+{
+	const char *name = getenv("VDE_ISA");
+	enum cpu_isa isa = cpu_isa_best();
+	int err;
+
+	if (name) {
+		err = cpu_isa_lookup(name, &isa);
+		if (err < 0)
+			fprintf(stderr, "ignoring VDE_ISA=%s: %d\n", name, err);
+	}
+
+	__atomic_store_n(&cpu_isa_active, isa, __ATOMIC_RELAXED);
+
+	return isa;
+}
+
+int cpu_isa_force(const char *name)
+{
+	enum cpu_isa isa;
+	int err;
+
+	err = cpu_isa_lookup(name, &isa);
+	if (err < 0)
+		return err;
+
+	__atomic_store_n(&cpu_isa_active, isa, __ATOMIC_RELAXED);
+
+	return 0;
+}
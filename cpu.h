@@ -0,0 +1,82 @@
+#ifndef CPU_H
+#define CPU_H
+
+#include <stdbool.h>
+
+/*
+ * Instruction set extensions that hot kernels have implementations for. The
+ * best one the CPU supports is picked on first use, so one binary runs at
+ * full speed on the Tegra boards as well as on x86. Forcing another one (or
+ * scalar code) is meant for A/B benchmarks and bit-exactness tests.
+ */
+enum cpu_isa {
+	CPU_ISA_SCALAR,
+	CPU_ISA_SSE2,
+	CPU_ISA_AVX2,
+	CPU_ISA_NEON,
+	CPU_ISA_COUNT,
+};
+
+/*
+ * Kernels are written once with GCC vector extensions and built for every
+ * ISA of the architecture using these target attributes.
+ */
+#if defined(__x86_64__) || defined(__i386__)
+#define CPU_HAVE_SSE2 1
+#define CPU_HAVE_AVX2 1
+#define CPU_TARGET_SSE2 __attribute__((target("sse2")))
+#define CPU_TARGET_AVX2 __attribute__((target("avx2")))
+#elif defined(__aarch64__)
+#define CPU_HAVE_NEON 1
+#define CPU_TARGET_NEON
+#elif defined(__arm__)
+#define CPU_HAVE_NEON 1
+#define CPU_TARGET_NEON __attribute__((target("fpu=neon")))
+#endif
+
+#define CPU_INLINE static inline __attribute__((always_inline))
+
+/*
+ * Entries of kernel tables indexed by ISA, which expand to nothing on other
+ * architectures. ISAs without a dedicated implementation of a kernel point
+ * at the next best one.
+ */
+#if defined(CPU_HAVE_SSE2)
+#define CPU_IMPL_SSE2(fn) [CPU_ISA_SSE2] = fn,
+#define CPU_IMPL_AVX2(fn) [CPU_ISA_AVX2] = fn,
+#else
+#define CPU_IMPL_SSE2(fn)
+#define CPU_IMPL_AVX2(fn)
+#endif
+
+#if defined(CPU_HAVE_NEON)
+#define CPU_IMPL_NEON(fn) [CPU_ISA_NEON] = fn,
+#else
+#define CPU_IMPL_NEON(fn)
+#endif
+
+extern enum cpu_isa cpu_isa_active;
+
+enum cpu_isa cpu_isa_init(void);
+
+/* the ISA whose kernels are in use */
+static inline enum cpu_isa cpu_isa(void)
+{
+	enum cpu_isa isa = __atomic_load_n(&cpu_isa_active, __ATOMIC_RELAXED);
+
+	if (__builtin_expect(isa == CPU_ISA_COUNT, 0))
+		isa = cpu_isa_init();
+
+	return isa;
+}
+
+bool cpu_isa_supported(enum cpu_isa isa);
+const char *cpu_isa_name(enum cpu_isa isa);
+
+/*
+ * Selects the kernels by ISA name, "auto" goes back to the best supported
+ * one. Returns -EINVAL for unknown names and -ENOTSUP if the CPU lacks it.
+ */
+int cpu_isa_force(const char *name);
+
+#endif
@@ -0,0 +1,771 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "protocol.h"
+#include "vde-decode.h"
+
+/*
+ * Decode daemon. Owns the decoder and its frame pools and serves any number of
+ * clients, each of which gets a session of its own. All sessions share one
+ * scheduler, which decides whose access unit is decoded next. The daemon
+ * itself runs on one thread and only shuffles messages between the sockets
+ * and the sessions.
+ */
+
+/* access unit in flight, results are reported in this order */
+struct vde_daemon_unit {
+	uint64_t sequence;
+	uint64_t user;
+	/* set if the unit was rejected before it reached the decoder */
+	int status;
+
+	struct vde_daemon_unit *next;
+};
+
+/* frame that was passed to the client and not released yet */
+struct vde_daemon_frame {
+	uint64_t id;
+	struct vde_frame *frame;
+
+	struct vde_daemon_frame *next;
+};
+
+struct vde_daemon_client {
+	int fd;
+	struct vde_session *session;
+	/* error from the last set of parameter sets, if any */
+	int status;
+	/* error from the last change of stream parameters, if any */
+	int admission;
+	bool dead;
+
+	struct vde_daemon_unit *head;
+	struct vde_daemon_unit *tail;
+	uint64_t sequence;
+
+	struct vde_daemon_frame *frames;
+	uint64_t id;
+
+	/*
+	 * message that could not be handled yet, because the queue was full
+	 * or units before a change of parameter sets are still in flight
+	 */
+	uint8_t *pending;
+	size_t pending_size;
+
+	struct vde_daemon_client *next;
+};
+
+struct vde_daemon {
+	struct vde_session_config config;
+	struct vde_scheduler *scheduler;
+	struct sockaddr_un address;
+	int socket;
+	int event;
+
+	struct vde_daemon_client *clients;
+	unsigned int num_clients;
+
+	uint8_t *buffer;
+};
+
+static int vde_daemon_send_frame(struct vde_daemon_client *client,
+				 const struct vde_message_frame *body, int fd)
+{
+	char control[CMSG_SPACE(sizeof(int))];
+	struct vde_message_header header;
+	struct msghdr msg = { 0 };
+	struct cmsghdr *cmsg;
+	struct iovec iov[2];
+
+	header.type = VDE_MESSAGE_FRAME;
+	header.size = sizeof(*body);
+
+	iov[0].iov_base = &header;
+	iov[0].iov_len = sizeof(header);
+	iov[1].iov_base = (void *)body;
+	iov[1].iov_len = sizeof(*body);
+
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 2;
+
+	if (fd >= 0) {
+		memset(control, 0, sizeof(control));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+	}
+
+	if (sendmsg(client->fd, &msg, MSG_NOSIGNAL) < 0)
+		return -errno;
+
+	return 0;
+}
+
+static struct vde_daemon_unit *
+vde_daemon_client_pop(struct vde_daemon_client *client)
+{
+	struct vde_daemon_unit *unit = client->head;
+
+	if (unit) {
+		client->head = unit->next;
+		if (!client->head)
+			client->tail = NULL;
+	}
+
+	return unit;
+}
+
+/* reports units that were rejected once all units before them are done */
+static void vde_daemon_client_flush(struct vde_daemon_client *client)
+{
+	struct vde_message_frame body;
+	struct vde_daemon_unit *unit;
+	int err;
+
+	while (client->head && client->head->status < 0) {
+		unit = vde_daemon_client_pop(client);
+
+		memset(&body, 0, sizeof(body));
+		body.sequence = unit->sequence;
+		body.user = unit->user;
+		body.status = unit->status;
+
+		err = vde_daemon_send_frame(client, &body, -1);
+		if (err < 0)
+			client->dead = true;
+
+		free(unit);
+	}
+}
+
+static int vde_daemon_client_submit(struct vde_daemon_client *client,
+				    const uint8_t *data, size_t size)
+{
+	const struct vde_message_decode *decode = (const void *)data;
+	struct vde_daemon_unit *unit;
+	int err;
+
+	if (size < sizeof(*decode))
+		return -EINVAL;
+
+	unit = calloc(1, sizeof(*unit));
+	if (!unit)
+		return -ENOMEM;
+
+	unit->user = decode->user;
+
+	if (client->status < 0) {
+		err = client->status;
+	} else if (client->admission < 0) {
+		err = client->admission;
+	} else {
+		err = vde_session_submit(client->session, decode + 1,
+					 size - sizeof(*decode),
+					 decode->flags, decode->user);
+		if (err == -EAGAIN) {
+			free(unit);
+			return err;
+		}
+	}
+
+	unit->sequence = client->sequence++;
+	unit->status = err;
+
+	if (client->tail)
+		client->tail->next = unit;
+	else
+		client->head = unit;
+
+	client->tail = unit;
+
+	vde_daemon_client_flush(client);
+
+	return 0;
+}
+
+static void vde_daemon_client_release(struct vde_daemon_client *client,
+				      uint64_t id)
+{
+	struct vde_daemon_frame **framep = &client->frames, *frame;
+
+	while ((frame = *framep) != NULL) {
+		if (frame->id == id) {
+			*framep = frame->next;
+			vde_frame_release(frame->frame);
+			free(frame);
+			return;
+		}
+
+		framep = &frame->next;
+	}
+
+	fprintf(stderr, "client %d released unknown frame %llu\n", client->fd,
+		(unsigned long long)id);
+}
+
+static int vde_daemon_client_handle(struct vde_daemon_client *client,
+				    const uint8_t *data, size_t size)
+{
+	const struct vde_message_header *header = (const void *)data;
+	const struct vde_message_release *release;
+	const struct vde_message_stream *stream;
+	struct vde_stream_params params;
+
+	if (size < sizeof(*header) || header->size != size - sizeof(*header))
+		return -EINVAL;
+
+	data += sizeof(*header);
+	size -= sizeof(*header);
+
+	switch (header->type) {
+	case VDE_MESSAGE_PARAMETER_SETS:
+		/*
+		 * The session would block until the units before the switch
+		 * are decoded, so wait for them like for a full queue. Units
+		 * after it report whether the switch succeeded.
+		 */
+		if (client->head)
+			return -EAGAIN;
+
+		client->status = vde_session_set_parameter_sets(client->session,
+								data, size);
+		return 0;
+
+	case VDE_MESSAGE_DECODE:
+		return vde_daemon_client_submit(client, data, size);
+
+	case VDE_MESSAGE_STREAM:
+		if (size < sizeof(*stream))
+			return -EINVAL;
+
+		stream = (const void *)data;
+
+		params.priority = stream->priority;
+		params.weight = stream->weight;
+		params.frame_rate = stream->frame_rate;
+
+		/* units are rejected until the stream is admitted */
+		client->admission = vde_session_set_stream(client->session,
+							   &params);
+		return 0;
+
+	case VDE_MESSAGE_RELEASE:
+		if (size < sizeof(*release))
+			return -EINVAL;
+
+		release = (const void *)data;
+		vde_daemon_client_release(client, release->id);
+		return 0;
+	}
+
+	return -EINVAL;
+}
+
+/*
+ * Queues a message for later if the session cannot take it right now, which
+ * also stops reading from the client until it is retried.
+ */
+static int vde_daemon_client_process(struct vde_daemon_client *client,
+				     const uint8_t *data, size_t size)
+{
+	int err;
+
+	err = vde_daemon_client_handle(client, data, size);
+	if (err == -EAGAIN) {
+		client->pending = malloc(size);
+		if (!client->pending)
+			return -ENOMEM;
+
+		memcpy(client->pending, data, size);
+		client->pending_size = size;
+		return 0;
+	}
+
+	return err;
+}
+
+/*
+ * Reads an access unit that was passed in a memfd because it didn't fit into
+ * a message, and handles it like one that was sent inline.
+ */
+static int vde_daemon_client_process_fd(struct vde_daemon_client *client,
+					const uint8_t *data, size_t size,
+					int fd)
+{
+	const struct vde_message_header *header = (const void *)data;
+	struct vde_message_header *message;
+	size_t length, done;
+	ssize_t count;
+	struct stat st;
+	int err;
+
+	if (size != sizeof(*header) + sizeof(struct vde_message_decode) ||
+	    header->type != VDE_MESSAGE_DECODE_FD ||
+	    header->size != size - sizeof(*header))
+		return -EINVAL;
+
+	if (fstat(fd, &st) < 0)
+		return -errno;
+
+	if (st.st_size <= 0 || st.st_size > VDE_MESSAGE_MAX_FD_DATA)
+		return -EINVAL;
+
+	length = size + st.st_size;
+
+	message = malloc(length);
+	if (!message)
+		return -ENOMEM;
+
+	memcpy(message, data, size);
+	message->type = VDE_MESSAGE_DECODE;
+	message->size = length - sizeof(*header);
+
+	for (done = 0; done < st.st_size; done += count) {
+		count = pread(fd, (uint8_t *)message + size + done,
+			      st.st_size - done, done);
+		if (count <= 0) {
+			err = count < 0 ? -errno : -EINVAL;
+			goto free;
+		}
+	}
+
+	err = vde_daemon_client_process(client, (const void *)message, length);
+
+free:
+	free(message);
+	return err;
+}
+
+/* receives one message, along with the memfd of a large access unit */
+static int vde_daemon_client_receive(struct vde_daemon *daemon,
+				     struct vde_daemon_client *client)
+{
+	char control[CMSG_SPACE(sizeof(int))];
+	struct msghdr msg = { 0 };
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	ssize_t length;
+	int fd = -1;
+	int err;
+
+	iov.iov_base = daemon->buffer;
+	iov.iov_len = VDE_MESSAGE_MAX_SIZE;
+
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	length = recvmsg(client->fd, &msg, MSG_CMSG_CLOEXEC);
+	if (length <= 0)
+		return -EPIPE;
+
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+		if (cmsg->cmsg_level == SOL_SOCKET &&
+		    cmsg->cmsg_type == SCM_RIGHTS)
+			memcpy(&fd, CMSG_DATA(cmsg), sizeof(fd));
+
+	if (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC))
+		err = -EINVAL;
+	else if (fd >= 0)
+		err = vde_daemon_client_process_fd(client, daemon->buffer,
+						   length, fd);
+	else
+		err = vde_daemon_client_process(client, daemon->buffer,
+						length);
+
+	if (fd >= 0)
+		close(fd);
+
+	return err;
+}
+
+static int vde_daemon_client_retry(struct vde_daemon_client *client)
+{
+	int err;
+
+	err = vde_daemon_client_handle(client, client->pending,
+				       client->pending_size);
+	if (err == -EAGAIN)
+		return 0;
+
+	free(client->pending);
+	client->pending = NULL;
+	client->pending_size = 0;
+
+	return err;
+}
+
+/* passes decoded frames on to the client, along with their dmabuf */
+static void vde_daemon_client_output(struct vde_daemon_client *client)
+{
+	struct vde_daemon_frame *output;
+	struct vde_message_frame body;
+	struct vde_daemon_unit *unit;
+	struct vde_frame *frame;
+	unsigned int i;
+	int err;
+
+	while (!client->dead) {
+		err = vde_session_receive(client->session, &frame, 0);
+		if (err == -EAGAIN || err == -ENODATA)
+			break;
+
+		unit = vde_daemon_client_pop(client);
+		if (!unit) {
+			/* can't happen, every result belongs to a unit */
+			if (err == 0)
+				vde_frame_release(frame);
+
+			client->dead = true;
+			break;
+		}
+
+		memset(&body, 0, sizeof(body));
+		body.sequence = unit->sequence;
+		body.user = unit->user;
+		body.status = err;
+		free(unit);
+
+		if (err < 0) {
+			err = vde_daemon_send_frame(client, &body, -1);
+			if (err < 0)
+				client->dead = true;
+
+			vde_daemon_client_flush(client);
+			continue;
+		}
+
+		output = calloc(1, sizeof(*output));
+		if (!output) {
+			vde_frame_release(frame);
+			body.status = -ENOMEM;
+			vde_daemon_send_frame(client, &body, -1);
+			continue;
+		}
+
+		output->id = ++client->id;
+		output->frame = frame;
+
+		body.id = output->id;
+		body.width = frame->width;
+		body.height = frame->height;
+		body.format = frame->format;
+		body.modifier = frame->modifier;
+		body.pitch = frame->pitch;
+
+		for (i = 0; i < 3; i++)
+			body.offsets[i] = frame->offsets[i];
+
+		body.size = frame->size;
+
+		body.crop_x = frame->crop.x;
+		body.crop_y = frame->crop.y;
+		body.crop_width = frame->crop.width;
+		body.crop_height = frame->crop.height;
+
+		err = vde_daemon_send_frame(client, &body, frame->fd);
+		if (err < 0) {
+			vde_frame_release(frame);
+			free(output);
+			client->dead = true;
+			break;
+		}
+
+		output->next = client->frames;
+		client->frames = output;
+
+		vde_daemon_client_flush(client);
+	}
+}
+
+static int vde_daemon_accept(struct vde_daemon *daemon)
+{
+	struct vde_daemon_client *client;
+	int err;
+
+	client = calloc(1, sizeof(*client));
+	if (!client)
+		return -ENOMEM;
+
+	client->fd = accept4(daemon->socket, NULL, NULL, SOCK_CLOEXEC);
+	if (client->fd < 0) {
+		err = -errno;
+		goto free;
+	}
+
+	err = vde_session_open(&client->session, &daemon->config);
+	if (err < 0)
+		goto close;
+
+	/* rejected until the client sends parameter sets */
+	client->status = -EINVAL;
+
+	client->next = daemon->clients;
+	daemon->clients = client;
+	daemon->num_clients++;
+
+	if (daemon->config.verbose)
+		printf("client %d connected\n", client->fd);
+
+	return 0;
+
+close:
+	close(client->fd);
+free:
+	free(client);
+	return err;
+}
+
+static void vde_daemon_client_free(struct vde_daemon_client *client)
+{
+	struct vde_daemon_frame *frame;
+	struct vde_daemon_unit *unit;
+	struct vde_frame *output;
+	int err;
+
+	/* frames still held by the client are reclaimed */
+	while ((frame = client->frames) != NULL) {
+		client->frames = frame->next;
+		vde_frame_release(frame->frame);
+		free(frame);
+	}
+
+	/* wait for the access units in flight and drop their frames */
+	while ((err = vde_session_receive(client->session, &output, -1)) != -ENODATA)
+		if (err == 0)
+			vde_frame_release(output);
+
+	while ((unit = vde_daemon_client_pop(client)) != NULL)
+		free(unit);
+
+	vde_session_close(client->session);
+	close(client->fd);
+	free(client->pending);
+	free(client);
+}
+
+static void vde_daemon_disconnect(struct vde_daemon *daemon,
+				  struct vde_daemon_client *client)
+{
+	struct vde_daemon_client **clientp = &daemon->clients;
+
+	while (*clientp != client)
+		clientp = &(*clientp)->next;
+
+	*clientp = client->next;
+	daemon->num_clients--;
+
+	if (daemon->config.verbose)
+		printf("client %d disconnected\n", client->fd);
+
+	vde_daemon_client_free(client);
+}
+
+int vde_daemon_create(struct vde_daemon **daemonp, const char *path,
+		      const struct vde_session_config *config)
+{
+	struct vde_daemon *daemon;
+	int err;
+
+	if (strlen(path) >= sizeof(daemon->address.sun_path))
+		return -ENAMETOOLONG;
+
+	daemon = calloc(1, sizeof(*daemon));
+	if (!daemon)
+		return -ENOMEM;
+
+	if (config)
+		daemon->config = *config;
+
+	err = vde_scheduler_create(&daemon->scheduler, NULL);
+	if (err < 0)
+		goto free;
+
+	daemon->config.scheduler = daemon->scheduler;
+
+	daemon->buffer = malloc(VDE_MESSAGE_MAX_SIZE);
+	if (!daemon->buffer) {
+		err = -ENOMEM;
+		goto free;
+	}
+
+	daemon->event = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (daemon->event < 0) {
+		err = -errno;
+		goto free;
+	}
+
+	daemon->socket = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (daemon->socket < 0) {
+		err = -errno;
+		goto close_event;
+	}
+
+	daemon->address.sun_family = AF_UNIX;
+	strcpy(daemon->address.sun_path, path);
+
+	/* remove a stale socket left behind by a previous instance */
+	unlink(path);
+
+	if (bind(daemon->socket, (struct sockaddr *)&daemon->address,
+		 sizeof(daemon->address)) < 0) {
+		err = -errno;
+		goto close;
+	}
+
+	if (listen(daemon->socket, 16) < 0) {
+		err = -errno;
+		goto unlink;
+	}
+
+	*daemonp = daemon;
+
+	return 0;
+
+unlink:
+	unlink(path);
+close:
+	close(daemon->socket);
+close_event:
+	close(daemon->event);
+free:
+	vde_scheduler_free(daemon->scheduler);
+	free(daemon->buffer);
+	free(daemon);
+	return err;
+}
+
+void vde_daemon_free(struct vde_daemon *daemon)
+{
+	if (!daemon)
+		return;
+
+	while (daemon->clients)
+		vde_daemon_disconnect(daemon, daemon->clients);
+
+	unlink(daemon->address.sun_path);
+	close(daemon->socket);
+	close(daemon->event);
+	vde_scheduler_free(daemon->scheduler);
+	free(daemon->buffer);
+	free(daemon);
+}
+
+/* makes vde_daemon_run() return, safe to call from a signal handler */
+void vde_daemon_stop(struct vde_daemon *daemon)
+{
+	eventfd_write(daemon->event, 1);
+}
+
+/* serves clients until vde_daemon_stop() is called */
+int vde_daemon_run(struct vde_daemon *daemon)
+{
+	struct vde_daemon_client *client, *next;
+	struct pollfd *fds = NULL, *pfd;
+	unsigned int num_fds, size = 0;
+	int err = 0;
+
+	while (true) {
+		num_fds = 2 + daemon->num_clients * 2;
+
+		if (num_fds > size) {
+			pfd = realloc(fds, num_fds * sizeof(*fds));
+			if (!pfd) {
+				err = -ENOMEM;
+				break;
+			}
+
+			size = num_fds;
+			fds = pfd;
+		}
+
+		fds[0].fd = daemon->event;
+		fds[0].events = POLLIN;
+		fds[1].fd = daemon->socket;
+		fds[1].events = POLLIN;
+		pfd = &fds[2];
+
+		for (client = daemon->clients; client; client = client->next) {
+			/* stop reading while a message is waiting for the queue */
+			pfd[0].fd = client->fd;
+			pfd[0].events = client->pending ? 0 : POLLIN;
+			pfd[1].fd = vde_session_get_fd(client->session);
+			pfd[1].events = POLLIN;
+			pfd += 2;
+		}
+
+		if (poll(fds, num_fds, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+
+			err = -errno;
+			break;
+		}
+
+		if (fds[0].revents & POLLIN)
+			break;
+
+		pfd = &fds[2];
+
+		for (client = daemon->clients; client; client = next, pfd += 2) {
+			next = client->next;
+
+			if (pfd[1].revents & POLLIN) {
+				vde_daemon_client_output(client);
+
+				if (client->pending) {
+					err = vde_daemon_client_retry(client);
+					if (err < 0)
+						client->dead = true;
+				}
+			}
+
+			if (pfd[0].revents & POLLIN) {
+				err = vde_daemon_client_receive(daemon, client);
+				if (err == -EPIPE) {
+					client->dead = true;
+				} else if (err < 0) {
+					fprintf(stderr, "client %d: invalid message: %d\n",
+						client->fd, err);
+					client->dead = true;
+				}
+			} else if (pfd[0].revents & (POLLHUP | POLLERR)) {
+				client->dead = true;
+			}
+
+			if (client->dead)
+				vde_daemon_disconnect(daemon, client);
+		}
+
+		/* new clients are only added once the client list was walked */
+		if (fds[1].revents & POLLIN) {
+			err = vde_daemon_accept(daemon);
+			if (err < 0)
+				fprintf(stderr, "failed to accept client: %d\n", err);
+		}
+
+		err = 0;
+	}
+
+	free(fds);
+
+	return err;
+}
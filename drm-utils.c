@@ -3,25 +3,55 @@
 #include <drm_fourcc.h>
 
 #include "drm-utils.h"
-#include "utils.h"
 
-static const struct drm_format_info formats[] = {
-	{
+/*
+ * Formats are stored at a slot derived from a multiplicative hash of their
+ * FourCC code, so that lookups take constant time. The multiplier happens to
+ * map all of the formats below to distinct slots; check that this still
+ * holds when adding a format.
+ *
+ * Only 4:2:0 formats are listed because that is all the VDE can decode.
+ */
+#define DRM_FORMAT_SLOTS 16
+#define DRM_FORMAT_SLOT(format) ((uint32_t)((format) * 0x9e3779b9u) >> 28)
+
+static const struct drm_format_info formats[DRM_FORMAT_SLOTS] = {
+	[DRM_FORMAT_SLOT(DRM_FORMAT_YUV420)] = {
 		.format = DRM_FORMAT_YUV420,
 		.num_planes = 3,
 		.cpp = { 1, 1, 1 },
 		.hsub = 2,
 		.vsub = 2,
 	},
+	[DRM_FORMAT_SLOT(DRM_FORMAT_YVU420)] = {
+		.format = DRM_FORMAT_YVU420,
+		.num_planes = 3,
+		.cpp = { 1, 1, 1 },
+		.hsub = 2,
+		.vsub = 2,
+	},
+	[DRM_FORMAT_SLOT(DRM_FORMAT_NV12)] = {
+		.format = DRM_FORMAT_NV12,
+		.num_planes = 2,
+		.cpp = { 1, 2, 0 },
+		.hsub = 2,
+		.vsub = 2,
+	},
+	[DRM_FORMAT_SLOT(DRM_FORMAT_NV21)] = {
+		.format = DRM_FORMAT_NV21,
+		.num_planes = 2,
+		.cpp = { 1, 2, 0 },
+		.hsub = 2,
+		.vsub = 2,
+	},
 };
 
 const struct drm_format_info *drm_format_get_info(uint32_t format)
 {
-	unsigned int i;
+	const struct drm_format_info *info = &formats[DRM_FORMAT_SLOT(format)];
 
-	for (i = 0; i < ARRAY_SIZE(formats); i++)
-		if (formats[i].format == format)
-			return &formats[i];
+	if (format == 0 || info->format != format)
+		return NULL;
 
-	return NULL;
+	return info;
 }
@@ -0,0 +1,81 @@
+#include <string.h>
+
+#include "frame.h"
+#include "vde.h"
+
+void vde_frame_object_init(struct vde_frame_object *object,
+			   struct tegra_vde_frame *frame,
+			   void (*release)(struct vde_frame_object *object))
+{
+	object->frame = frame;
+	object->release = release;
+
+	object->base.fd = frame->buffer->fd;
+	object->base.width = frame->width;
+	object->base.height = frame->height;
+	object->base.format = frame->format;
+	object->base.modifier = frame->modifier;
+	object->base.pitch = frame->pitch;
+	memcpy(object->base.offsets, frame->offsets,
+	       sizeof(object->base.offsets));
+	object->base.size = frame->size;
+
+	object->base.crop.x = frame->crop.x;
+	object->base.crop.y = frame->crop.y;
+	object->base.crop.width = frame->crop.width;
+	object->base.crop.height = frame->crop.height;
+}
+
+int vde_frame_detile(struct vde_frame *frame, struct image **imagep)
+{
+	return tegra_vde_frame_detile(to_frame_object(frame)->frame, imagep);
+}
+
+int vde_frame_detile_to(struct vde_frame *frame, const struct vde_rect *rect,
+			uint32_t format, struct image **imagep)
+{
+	struct tegra_vde_rect r;
+
+	if (rect) {
+		r.x = rect->x;
+		r.y = rect->y;
+		r.width = rect->width;
+		r.height = rect->height;
+	}
+
+	return tegra_vde_frame_detile_to(to_frame_object(frame)->frame,
+					 rect ? &r : NULL, format, imagep);
+}
+
+int vde_frame_detile_rect(struct vde_frame *frame, const struct vde_rect *rect,
+			  struct image **imagep)
+{
+	return vde_frame_detile_to(frame, rect, frame->format, imagep);
+}
+
+int vde_frame_hash(struct vde_frame *frame, struct vde_hash *hash)
+{
+	return tegra_vde_frame_hash(to_frame_object(frame)->frame, hash);
+}
+
+int vde_frame_thumbnail(struct vde_frame *frame, unsigned int width,
+			unsigned int height, struct image **imagep)
+{
+	return tegra_vde_frame_thumbnail(to_frame_object(frame)->frame, width,
+					 height, imagep);
+}
+
+void vde_frame_dump(struct vde_frame *frame, FILE *fp)
+{
+	tegra_vde_frame_dump(to_frame_object(frame)->frame, fp);
+}
+
+void vde_frame_release(struct vde_frame *frame)
+{
+	struct vde_frame_object *object;
+
+	if (frame) {
+		object = to_frame_object(frame);
+		object->release(object);
+	}
+}
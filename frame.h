@@ -0,0 +1,30 @@
+#ifndef FRAME_H
+#define FRAME_H
+
+#include "utils.h"
+#include "vde-decode.h"
+
+struct tegra_vde_frame;
+
+/*
+ * Backing object of the frames handed out by the library. Frames either come
+ * from a local session or were received from a decode daemon, and the release
+ * callback takes care of returning them to where they came from.
+ */
+struct vde_frame_object {
+	struct vde_frame base;
+	struct tegra_vde_frame *frame;
+
+	void (*release)(struct vde_frame_object *object);
+};
+
+static inline struct vde_frame_object *to_frame_object(struct vde_frame *frame)
+{
+	return container_of(frame, struct vde_frame_object, base);
+}
+
+void vde_frame_object_init(struct vde_frame_object *object,
+			   struct tegra_vde_frame *frame,
+			   void (*release)(struct vde_frame_object *object));
+
+#endif
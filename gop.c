@@ -0,0 +1,441 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gop.h"
+#include "h264-parser.h"
+#include "image.h"
+#include "vde.h"
+
+/*
+ * Closed GOPs can be decoded independently of each other, so the input is
+ * split into segments at IDR access units and each segment is decoded as a
+ * whole by one of several decoder contexts. Completed segments are kept in a
+ * reorder window until all preceding segments have been emitted, so frames
+ * are output in display order.
+ */
+
+struct gop_packet {
+	uint8_t *data;
+	size_t size;
+};
+
+struct gop_segment {
+	unsigned int index;
+	unsigned int first_frame;
+
+	struct gop_packet *packets;
+	unsigned int num_packets;
+	unsigned int max_packets;
+
+	struct image **images;
+	bool done;
+	int err;
+
+	struct gop_segment *next;
+};
+
+struct gop_worker {
+	struct gop_decoder *decoder;
+	struct tegra_vde *vde;
+	pthread_t thread;
+};
+
+struct gop_decoder {
+	struct h264_context *ctx;
+	gop_output_t output;
+	void *data;
+
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	pthread_cond_t done;
+	bool stop;
+
+	/* segments waiting for a decoder context */
+	struct gop_segment *head;
+	struct gop_segment *tail;
+
+	/* reorder window, indexed by segment index modulo depth */
+	struct gop_segment **window;
+	unsigned int depth;
+	unsigned int count;
+	unsigned int next;
+
+	struct gop_segment *current;
+	unsigned int frames;
+	int err;
+
+	struct gop_worker *workers;
+	unsigned int num_workers;
+};
+
+static void gop_segment_free(struct gop_segment *segment)
+{
+	unsigned int i;
+
+	if (segment) {
+		for (i = 0; i < segment->num_packets; i++) {
+			if (segment->images)
+				image_free(segment->images[i]);
+
+			free(segment->packets[i].data);
+		}
+
+		free(segment->images);
+		free(segment->packets);
+	}
+
+	free(segment);
+}
+
+static int gop_segment_append(struct gop_segment *segment, const void *data,
+			      size_t size)
+{
+	struct gop_packet *packet;
+
+	if (segment->num_packets == segment->max_packets) {
+		unsigned int max = segment->max_packets ? segment->max_packets * 2 : 16;
+
+		packet = realloc(segment->packets, max * sizeof(*packet));
+		if (!packet)
+			return -ENOMEM;
+
+		segment->packets = packet;
+		segment->max_packets = max;
+	}
+
+	packet = &segment->packets[segment->num_packets];
+
+	packet->data = malloc(size);
+	if (!packet->data)
+		return -ENOMEM;
+
+	memcpy(packet->data, data, size);
+	packet->size = size;
+
+	segment->num_packets++;
+
+	return 0;
+}
+
+static int gop_segment_decode(struct gop_segment *segment,
+			      struct tegra_vde *vde, struct h264_context *ctx)
+{
+	struct tegra_vde_frame *frame;
+	unsigned int i;
+	int err;
+
+	segment->images = calloc(segment->num_packets,
+				 sizeof(*segment->images));
+	if (!segment->images)
+		return -ENOMEM;
+
+	for (i = 0; i < segment->num_packets; i++) {
+		struct gop_packet *packet = &segment->packets[i];
+
+		vde->frame = segment->first_frame + i;
+
+		err = tegra_vde_decode(vde, &frame, ctx, packet->data,
+				       packet->size);
+		if (err < 0)
+			return err;
+
+		err = tegra_vde_frame_detile(frame, &segment->images[i]);
+		tegra_vde_frame_free(frame);
+
+		if (err < 0)
+			return err;
+	}
+
+	return 0;
+}
+
+static void *gop_worker_run(void *arg)
+{
+	struct gop_worker *worker = arg;
+	struct gop_decoder *decoder = worker->decoder;
+	struct gop_segment *segment;
+	int err;
+
+	pthread_mutex_lock(&decoder->lock);
+
+	while (true) {
+		while (!decoder->stop && !decoder->head)
+			pthread_cond_wait(&decoder->work, &decoder->lock);
+
+		segment = decoder->head;
+		if (!segment)
+			break;
+
+		decoder->head = segment->next;
+		if (!decoder->head)
+			decoder->tail = NULL;
+
+		pthread_mutex_unlock(&decoder->lock);
+
+		err = gop_segment_decode(segment, worker->vde, decoder->ctx);
+
+		pthread_mutex_lock(&decoder->lock);
+		segment->err = err;
+		segment->done = true;
+		pthread_cond_broadcast(&decoder->done);
+	}
+
+	pthread_mutex_unlock(&decoder->lock);
+
+	return NULL;
+}
+
+/* emits completed segments in order, must be called with the lock held */
+static void gop_decoder_emit(struct gop_decoder *decoder)
+{
+	struct gop_segment *segment;
+	unsigned int i;
+
+	while (decoder->next != decoder->count) {
+		segment = decoder->window[decoder->next % decoder->depth];
+		if (!segment->done)
+			break;
+
+		decoder->window[decoder->next % decoder->depth] = NULL;
+		decoder->next++;
+
+		pthread_mutex_unlock(&decoder->lock);
+
+		if (segment->err < 0) {
+			fprintf(stderr, "failed to decode GOP %u: %d\n",
+				segment->index, segment->err);
+
+			if (decoder->err == 0)
+				decoder->err = segment->err;
+		} else {
+			for (i = 0; i < segment->num_packets; i++)
+				decoder->output(segment->images[i],
+						segment->first_frame + i,
+						decoder->data);
+		}
+
+		gop_segment_free(segment);
+
+		pthread_mutex_lock(&decoder->lock);
+	}
+}
+
+static int gop_decoder_submit(struct gop_decoder *decoder)
+{
+	struct gop_segment *segment = decoder->current;
+
+	if (!segment)
+		return 0;
+
+	decoder->current = NULL;
+
+	pthread_mutex_lock(&decoder->lock);
+
+	/* bound the number of segments in flight */
+	while (decoder->count - decoder->next >= decoder->depth) {
+		gop_decoder_emit(decoder);
+
+		if (decoder->count - decoder->next >= decoder->depth)
+			pthread_cond_wait(&decoder->done, &decoder->lock);
+	}
+
+	segment->index = decoder->count++;
+	decoder->window[segment->index % decoder->depth] = segment;
+
+	if (decoder->tail)
+		decoder->tail->next = segment;
+	else
+		decoder->head = segment;
+
+	decoder->tail = segment;
+	pthread_cond_signal(&decoder->work);
+
+	gop_decoder_emit(decoder);
+
+	pthread_mutex_unlock(&decoder->lock);
+
+	return decoder->err;
+}
+
+int gop_decoder_push(struct gop_decoder *decoder, const void *data,
+		     size_t size)
+{
+	struct gop_segment *segment = decoder->current;
+	int err;
+
+	if (segment && h264_access_unit_is_idr(data, size)) {
+		err = gop_decoder_submit(decoder);
+		if (err < 0)
+			return err;
+
+		segment = NULL;
+	}
+
+	if (!segment) {
+		segment = calloc(1, sizeof(*segment));
+		if (!segment)
+			return -ENOMEM;
+
+		segment->first_frame = decoder->frames;
+		decoder->current = segment;
+	}
+
+	err = gop_segment_append(segment, data, size);
+	if (err < 0)
+		return err;
+
+	decoder->frames++;
+
+	return 0;
+}
+
+int gop_decoder_flush(struct gop_decoder *decoder)
+{
+	int err;
+
+	err = gop_decoder_submit(decoder);
+	if (err < 0)
+		return err;
+
+	pthread_mutex_lock(&decoder->lock);
+
+	while (decoder->next != decoder->count) {
+		gop_decoder_emit(decoder);
+
+		if (decoder->next != decoder->count)
+			pthread_cond_wait(&decoder->done, &decoder->lock);
+	}
+
+	pthread_mutex_unlock(&decoder->lock);
+
+	return decoder->err;
+}
+
+int gop_decoder_create(struct gop_decoder **decoderp,
+		       struct h264_context *ctx, struct drm_tegra *drm,
+		       const struct tegra_vde_ops *ops, unsigned int jobs,
+		       gop_output_t output, void *data)
+{
+	struct tegra_vde_limits limits;
+	struct gop_decoder *decoder;
+	unsigned int i;
+	int err;
+
+	if (jobs == 0 || ctx->num_sps == 0)
+		return -EINVAL;
+
+	err = tegra_vde_get_limits(ctx, 0, &limits);
+	if (err < 0)
+		return err;
+
+	decoder = calloc(1, sizeof(*decoder));
+	if (!decoder)
+		return -ENOMEM;
+
+	decoder->ctx = ctx;
+	decoder->output = output;
+	decoder->data = data;
+	decoder->depth = jobs * 2;
+
+	pthread_mutex_init(&decoder->lock, NULL);
+	pthread_cond_init(&decoder->work, NULL);
+	pthread_cond_init(&decoder->done, NULL);
+
+	decoder->window = calloc(decoder->depth, sizeof(*decoder->window));
+	if (!decoder->window) {
+		err = -ENOMEM;
+		goto free;
+	}
+
+	decoder->workers = calloc(jobs, sizeof(*decoder->workers));
+	if (!decoder->workers) {
+		err = -ENOMEM;
+		goto free;
+	}
+
+	for (i = 0; i < jobs; i++) {
+		struct gop_worker *worker = &decoder->workers[i];
+
+		worker->decoder = decoder;
+
+		err = tegra_vde_open(&worker->vde, drm, ops);
+		if (err < 0) {
+			fprintf(stderr, "failed to open decoder context %u: %d\n",
+				i, err);
+			goto free;
+		}
+
+		err = tegra_vde_resize_bitstream(worker->vde,
+						 limits.bitstream_size);
+		if (err < 0) {
+			tegra_vde_close(worker->vde);
+			goto free;
+		}
+
+		err = pthread_create(&worker->thread, NULL, gop_worker_run,
+				     worker);
+		if (err != 0) {
+			tegra_vde_close(worker->vde);
+			err = -err;
+			goto free;
+		}
+
+		decoder->num_workers++;
+	}
+
+	*decoderp = decoder;
+
+	return 0;
+
+free:
+	gop_decoder_free(decoder);
+	return err;
+}
+
+void gop_decoder_free(struct gop_decoder *decoder)
+{
+	struct gop_segment *segment;
+	unsigned int i;
+
+	if (!decoder)
+		return;
+
+	pthread_mutex_lock(&decoder->lock);
+	decoder->stop = true;
+
+	/* drop work that has not been picked up yet */
+	while (decoder->head) {
+		segment = decoder->head;
+		decoder->head = segment->next;
+		segment->done = true;
+		segment->err = -ECANCELED;
+	}
+
+	decoder->tail = NULL;
+	pthread_cond_broadcast(&decoder->work);
+	pthread_mutex_unlock(&decoder->lock);
+
+	for (i = 0; i < decoder->num_workers; i++) {
+		pthread_join(decoder->workers[i].thread, NULL);
+		tegra_vde_close(decoder->workers[i].vde);
+	}
+
+	if (decoder->window) {
+		for (i = 0; i < decoder->depth; i++)
+			gop_segment_free(decoder->window[i]);
+	}
+
+	gop_segment_free(decoder->current);
+	free(decoder->workers);
+	free(decoder->window);
+
+	pthread_cond_destroy(&decoder->done);
+	pthread_cond_destroy(&decoder->work);
+	pthread_mutex_destroy(&decoder->lock);
+	free(decoder);
+}
@@ -0,0 +1,29 @@
+#ifndef GOP_H
+#define GOP_H
+
+#include <stddef.h>
+
+struct drm_tegra;
+struct gop_decoder;
+struct h264_context;
+struct image;
+struct tegra_vde_ops;
+
+/*
+ * Called from the thread that pushes access units, in display order, for
+ * every decoded frame. The image is owned by the caller and freed after the
+ * callback returns.
+ */
+typedef void (*gop_output_t)(struct image *image, unsigned int frame,
+			     void *data);
+
+int gop_decoder_create(struct gop_decoder **decoderp,
+		       struct h264_context *ctx, struct drm_tegra *drm,
+		       const struct tegra_vde_ops *ops, unsigned int jobs,
+		       gop_output_t output, void *data);
+void gop_decoder_free(struct gop_decoder *decoder);
+int gop_decoder_push(struct gop_decoder *decoder, const void *data,
+		     size_t size);
+int gop_decoder_flush(struct gop_decoder *decoder);
+
+#endif
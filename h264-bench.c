@@ -0,0 +1,533 @@
+#include <errno.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cpu.h"
+#include "h264-generator.h"
+#include "h264-parser.h"
+#include "stats.h"
+#include "utils.h"
+
+/*
+ * Benchmarks the H.264 parser on a corpus of generated parameter sets and
+ * slices. Every parsed header is first checked against the values it was
+ * generated from, then the corpus is parsed repeatedly to measure throughput.
+ */
+
+static const struct option options[] = {
+	{ "count", required_argument, NULL, 'n' },
+	{ "isa", required_argument, NULL, 'I' },
+	{ "iterations", required_argument, NULL, 'i' },
+	{ "seed", required_argument, NULL, 'S' },
+	{ "help", no_argument, NULL, 'h' },
+	{ NULL, 0, NULL, 0 },
+};
+
+static void usage(const char *program, FILE *fp)
+{
+	fprintf(fp, "usage: %s [options]\n", program);
+	fprintf(fp, "\n");
+	fprintf(fp, "options:\n");
+	fprintf(fp, "  -n, --count N       number of headers of each kind to generate (default: 1000)\n");
+	fprintf(fp, "  -I, --isa NAME      use the scalar, sse2, avx2 or neon kernels (default: auto)\n");
+	fprintf(fp, "  -i, --iterations N  number of passes over the headers (default: 100)\n");
+	fprintf(fp, "  -S, --seed N        seed of the generator (default: 1)\n");
+	fprintf(fp, "  -h, --help          display this help screen and exit\n");
+}
+
+/* size of the buffer that each generated NAL unit or avcC record gets */
+#define BENCH_UNIT_SIZE 256
+/* bytes of slice data that follow each slice header */
+#define BENCH_SLICE_DATA 1024
+
+struct bench {
+	struct h264_generator gen;
+	unsigned int count;
+	unsigned int iterations;
+
+	struct h264_sps *sps;
+	struct h264_pps *pps;
+
+	/* NAL units and avcC records, BENCH_UNIT_SIZE bytes apart */
+	uint8_t *sps_units;
+	size_t *sps_sizes;
+	uint8_t *pps_units;
+	size_t *pps_sizes;
+	uint8_t *avcc;
+	size_t *avcc_sizes;
+
+	/* Annex B stream of parameter sets and slices */
+	uint8_t *stream;
+	size_t stream_size;
+	unsigned int stream_units;
+};
+
+#define CHECK_FIELD(index, a, b, field)					\
+	do {								\
+		if ((a)->field != (b)->field) {				\
+			fprintf(stderr, "%u: %s: parsed %lld, expected %lld\n", \
+				index, #field, (long long)(a)->field,	\
+				(long long)(b)->field);			\
+			return -EINVAL;					\
+		}							\
+	} while (0)
+
+static int check_hrd(unsigned int index, const struct h264_hrd_parameters *a,
+		     const struct h264_hrd_parameters *b)
+{
+	unsigned int i;
+
+	CHECK_FIELD(index, a, b, cpb_cnt_minus1);
+	CHECK_FIELD(index, a, b, bit_rate_scale);
+	CHECK_FIELD(index, a, b, cpb_size_scale);
+
+	for (i = 0; i <= a->cpb_cnt_minus1; i++) {
+		CHECK_FIELD(index, a, b, bit_rate_value_minus1[i]);
+		CHECK_FIELD(index, a, b, cpb_size_value_minus1[i]);
+		CHECK_FIELD(index, a, b, cbr_flag[i]);
+	}
+
+	CHECK_FIELD(index, a, b, initial_cpb_removal_delay_length_minus1);
+	CHECK_FIELD(index, a, b, cpb_removal_delay_length_minus1);
+	CHECK_FIELD(index, a, b, dpb_output_delay_length_minus1);
+	CHECK_FIELD(index, a, b, time_offset_length);
+
+	return 0;
+}
+
+static int check_sps(unsigned int index, const struct h264_sps *a,
+		     const struct h264_sps *b)
+{
+	CHECK_FIELD(index, a, b, profile_idc);
+	CHECK_FIELD(index, a, b, flags);
+	CHECK_FIELD(index, a, b, level_idc);
+	CHECK_FIELD(index, a, b, seq_parameter_set_id);
+	CHECK_FIELD(index, a, b, log2_max_frame_num_minus4);
+	CHECK_FIELD(index, a, b, pic_order_cnt_type);
+	CHECK_FIELD(index, a, b, max_num_ref_frames);
+	CHECK_FIELD(index, a, b, gaps_in_frame_num_value_allowed_flag);
+	CHECK_FIELD(index, a, b, pic_width_in_mbs_minus1);
+	CHECK_FIELD(index, a, b, pic_height_in_map_units_minus1);
+	CHECK_FIELD(index, a, b, frame_mbs_only_flag);
+	CHECK_FIELD(index, a, b, mb_adaptive_frame_field_flag);
+	CHECK_FIELD(index, a, b, direct_8x8_inference_flag);
+	CHECK_FIELD(index, a, b, frame_cropping_flag);
+	CHECK_FIELD(index, a, b, frame_crop_left_offset);
+	CHECK_FIELD(index, a, b, frame_crop_right_offset);
+	CHECK_FIELD(index, a, b, frame_crop_top_offset);
+	CHECK_FIELD(index, a, b, frame_crop_bottom_offset);
+	CHECK_FIELD(index, a, b, vui_parameters_present_flag);
+	CHECK_FIELD(index, a, b, vui_parameters.aspect_ratio_info_present_flag);
+	CHECK_FIELD(index, a, b, vui_parameters.aspect_ratio_idc);
+	CHECK_FIELD(index, a, b, vui_parameters.sar_width);
+	CHECK_FIELD(index, a, b, vui_parameters.sar_height);
+	CHECK_FIELD(index, a, b, vui_parameters.overscan_info_present_flag);
+	CHECK_FIELD(index, a, b, vui_parameters.overscan_appropriate_flag);
+	CHECK_FIELD(index, a, b, vui_parameters.video_signal_type_present_flag);
+	CHECK_FIELD(index, a, b, vui_parameters.video_format);
+	CHECK_FIELD(index, a, b, vui_parameters.video_full_range_flag);
+	CHECK_FIELD(index, a, b, vui_parameters.colour_description_present_flag);
+	CHECK_FIELD(index, a, b, vui_parameters.colour_primaries);
+	CHECK_FIELD(index, a, b, vui_parameters.transfer_characteristics);
+	CHECK_FIELD(index, a, b, vui_parameters.matrix_coefficients);
+	CHECK_FIELD(index, a, b, vui_parameters.chroma_loc_info_present_flag);
+	CHECK_FIELD(index, a, b, vui_parameters.chroma_sample_loc_type_top_field);
+	CHECK_FIELD(index, a, b, vui_parameters.chroma_sample_loc_type_bottom_field);
+	CHECK_FIELD(index, a, b, vui_parameters.timing_info_present_flag);
+	CHECK_FIELD(index, a, b, vui_parameters.num_units_in_tick);
+	CHECK_FIELD(index, a, b, vui_parameters.time_scale);
+	CHECK_FIELD(index, a, b, vui_parameters.fixed_frame_rate_flag);
+	CHECK_FIELD(index, a, b, vui_parameters.nal_hrd_parameters_present_flag);
+	CHECK_FIELD(index, a, b, vui_parameters.vcl_hrd_parameters_present_flag);
+	CHECK_FIELD(index, a, b, vui_parameters.low_delay_hrd_flag);
+	CHECK_FIELD(index, a, b, vui_parameters.pic_struct_present_flag);
+	CHECK_FIELD(index, a, b, vui_parameters.bitstream_restriction_flag);
+	CHECK_FIELD(index, a, b, vui_parameters.motion_vectors_over_pic_boundaries_flag);
+	CHECK_FIELD(index, a, b, vui_parameters.max_bytes_per_pic_denom);
+	CHECK_FIELD(index, a, b, vui_parameters.max_bits_per_mb_denom);
+	CHECK_FIELD(index, a, b, vui_parameters.log2_max_mv_length_horizontal);
+	CHECK_FIELD(index, a, b, vui_parameters.log2_max_mv_length_vertical);
+	CHECK_FIELD(index, a, b, vui_parameters.max_num_reorder_frames);
+	CHECK_FIELD(index, a, b, vui_parameters.max_dec_frame_buffering);
+
+	if (check_hrd(index, &a->vui_parameters.nal_hrd_parameters,
+		      &b->vui_parameters.nal_hrd_parameters) < 0 ||
+	    check_hrd(index, &a->vui_parameters.vcl_hrd_parameters,
+		      &b->vui_parameters.vcl_hrd_parameters) < 0)
+		return -EINVAL;
+
+	return 0;
+}
+
+static int check_pps(unsigned int index, const struct h264_pps *a,
+		     const struct h264_pps *b)
+{
+	CHECK_FIELD(index, a, b, pic_parameter_set_id);
+	CHECK_FIELD(index, a, b, seq_parameter_set_id);
+	CHECK_FIELD(index, a, b, entropy_coding_mode_flag);
+	CHECK_FIELD(index, a, b, bottom_field_pic_order_in_frame_present_flag);
+	CHECK_FIELD(index, a, b, num_slice_groups_minus1);
+	CHECK_FIELD(index, a, b, num_ref_idx_l0_default_active_minus1);
+	CHECK_FIELD(index, a, b, num_ref_idx_l1_default_active_minus1);
+	CHECK_FIELD(index, a, b, weighted_pred_flag);
+	CHECK_FIELD(index, a, b, weighted_bipred_idc);
+	CHECK_FIELD(index, a, b, pic_init_qp_minus26);
+	CHECK_FIELD(index, a, b, pic_init_qs_minus26);
+	CHECK_FIELD(index, a, b, chroma_qp_index_offset);
+	CHECK_FIELD(index, a, b, deblocking_filter_control_present_flag);
+	CHECK_FIELD(index, a, b, constrained_intra_pred_flag);
+	CHECK_FIELD(index, a, b, redundant_pic_cnt_present_flag);
+	CHECK_FIELD(index, a, b, transform_8x8_mode_flag);
+	CHECK_FIELD(index, a, b, pic_scaling_matrix_present_flag);
+	CHECK_FIELD(index, a, b, second_chroma_qp_index_offset);
+
+	return 0;
+}
+
+static int bench_generate(struct bench *bench)
+{
+	struct h264_slice_header slice;
+	unsigned int i, count = bench->count;
+	size_t size, offset = 0;
+	ssize_t length;
+
+	bench->sps = calloc(count, sizeof(*bench->sps));
+	bench->pps = calloc(count, sizeof(*bench->pps));
+	bench->sps_units = malloc(count * BENCH_UNIT_SIZE);
+	bench->sps_sizes = calloc(count, sizeof(size_t));
+	bench->pps_units = malloc(count * BENCH_UNIT_SIZE);
+	bench->pps_sizes = calloc(count, sizeof(size_t));
+	bench->avcc = malloc(count * BENCH_UNIT_SIZE);
+	bench->avcc_sizes = calloc(count, sizeof(size_t));
+
+	/* an IDR slice per parameter set pair with a start code each */
+	size = count * (BENCH_UNIT_SIZE * 2 + BENCH_SLICE_DATA * 2 + 12);
+	bench->stream = malloc(size);
+
+	if (!bench->sps || !bench->pps || !bench->sps_units ||
+	    !bench->sps_sizes || !bench->pps_units || !bench->pps_sizes ||
+	    !bench->avcc || !bench->avcc_sizes || !bench->stream)
+		return -ENOMEM;
+
+	for (i = 0; i < count; i++) {
+		uint8_t *sps = bench->sps_units + i * BENCH_UNIT_SIZE;
+		uint8_t *pps = bench->pps_units + i * BENCH_UNIT_SIZE;
+
+		h264_generate_sps(&bench->gen, &bench->sps[i]);
+		h264_generate_pps(&bench->gen, &bench->pps[i], &bench->sps[i]);
+
+		length = h264_write_sps(&bench->sps[i], sps, BENCH_UNIT_SIZE);
+		if (length < 0)
+			return length;
+
+		bench->sps_sizes[i] = length;
+
+		length = h264_write_pps(&bench->pps[i], pps, BENCH_UNIT_SIZE);
+		if (length < 0)
+			return length;
+
+		bench->pps_sizes[i] = length;
+
+		length = h264_write_avcc(&bench->sps[i], 1, &bench->pps[i], 1,
+					 bench->avcc + i * BENCH_UNIT_SIZE,
+					 BENCH_UNIT_SIZE);
+		if (length < 0)
+			return length;
+
+		bench->avcc_sizes[i] = length;
+
+		memcpy(bench->stream + offset, "\x00\x00\x00\x01", 4);
+		memcpy(bench->stream + offset + 4, sps, bench->sps_sizes[i]);
+		offset += 4 + bench->sps_sizes[i];
+
+		memcpy(bench->stream + offset, "\x00\x00\x00\x01", 4);
+		memcpy(bench->stream + offset + 4, pps, bench->pps_sizes[i]);
+		offset += 4 + bench->pps_sizes[i];
+
+		h264_generate_slice_header(&bench->gen, &slice, &bench->sps[i],
+					   &bench->pps[i], true);
+
+		memcpy(bench->stream + offset, "\x00\x00\x01", 3);
+		length = h264_write_slice(&bench->gen, &slice, &bench->sps[i],
+					  &bench->pps[i], BENCH_SLICE_DATA,
+					  bench->stream + offset + 3,
+					  size - offset - 3);
+		if (length < 0)
+			return length;
+
+		offset += 3 + length;
+		bench->stream_units += 3;
+	}
+
+	bench->stream_size = offset;
+
+	return 0;
+}
+
+static void bench_free(struct bench *bench)
+{
+	free(bench->sps);
+	free(bench->pps);
+	free(bench->sps_units);
+	free(bench->sps_sizes);
+	free(bench->pps_units);
+	free(bench->pps_sizes);
+	free(bench->avcc);
+	free(bench->avcc_sizes);
+	free(bench->stream);
+}
+
+static int bench_parse_sps(struct bench *bench, unsigned int i,
+			   struct h264_sps *sps)
+{
+	uint8_t rbsp[BENCH_UNIT_SIZE];
+	size_t size;
+
+	/* skip the NAL unit header */
+	size = h264_nal_unescape(rbsp, bench->sps_units + i * BENCH_UNIT_SIZE + 1,
+				 bench->sps_sizes[i] - 1);
+
+	memset(sps, 0, sizeof(*sps));
+
+	return h264_sps_parse(sps, rbsp, size, NULL);
+}
+
+static int bench_parse_pps(struct bench *bench, unsigned int i,
+			   struct h264_pps *pps)
+{
+	uint8_t rbsp[BENCH_UNIT_SIZE];
+	size_t size;
+
+	size = h264_nal_unescape(rbsp, bench->pps_units + i * BENCH_UNIT_SIZE + 1,
+				 bench->pps_sizes[i] - 1);
+
+	memset(pps, 0, sizeof(*pps));
+
+	return h264_pps_parse(pps, rbsp, size);
+}
+
+static int bench_parse_avcc(struct bench *bench, unsigned int i,
+			    struct h264_context *h264)
+{
+	memset(h264, 0, sizeof(*h264));
+
+	return h264_context_parse(h264, bench->avcc + i * BENCH_UNIT_SIZE,
+				  bench->avcc_sizes[i], NULL);
+}
+
+static int bench_scan(struct bench *bench, unsigned int *countp)
+{
+	const uint8_t *ptr = bench->stream, *end = ptr + bench->stream_size;
+	static const uint8_t types[] = {
+		H264_NAL_SPS, H264_NAL_PPS, H264_NAL_IDR,
+	};
+	struct h264_nal_unit nal;
+	unsigned int count = 0;
+
+	while (h264_nal_unit_next(&nal, &ptr, end) == 0) {
+		if (nal.type != types[count % ARRAY_SIZE(types)])
+			return -EINVAL;
+
+		count++;
+	}
+
+	*countp = count;
+
+	return 0;
+}
+
+/* checks that every generated header parses back to what it was made from */
+static int bench_verify(struct bench *bench)
+{
+	struct h264_context h264;
+	struct h264_sps sps;
+	struct h264_pps pps;
+	unsigned int i, count;
+	int err = 0;
+
+	for (i = 0; i < bench->count; i++) {
+		err = bench_parse_sps(bench, i, &sps);
+		if (err < 0) {
+			fprintf(stderr, "%u: failed to parse SPS: %d\n", i, err);
+			break;
+		}
+
+		err = check_sps(i, &sps, &bench->sps[i]);
+		if (err < 0)
+			break;
+
+		err = bench_parse_pps(bench, i, &pps);
+		if (err < 0) {
+			fprintf(stderr, "%u: failed to parse PPS: %d\n", i, err);
+			break;
+		}
+
+		err = check_pps(i, &pps, &bench->pps[i]);
+		if (err < 0)
+			break;
+
+		err = bench_parse_avcc(bench, i, &h264);
+		if (err == 0) {
+			if (h264.num_sps != 1 || h264.num_pps != 1 ||
+			    h264.nal_size != 4 ||
+			    h264.profile != bench->sps[i].profile_idc ||
+			    h264.level != bench->sps[i].level_idc) {
+				fprintf(stderr, "%u: avcC header mismatch\n", i);
+				err = -EINVAL;
+			} else {
+				err = check_sps(i, &h264.sps[0], &bench->sps[i]);
+				if (err == 0)
+					err = check_pps(i, &h264.pps[0],
+							&bench->pps[i]);
+			}
+		} else {
+			fprintf(stderr, "%u: failed to parse avcC: %d\n", i, err);
+		}
+
+		h264_context_free(&h264);
+
+		if (err < 0)
+			break;
+	}
+
+	if (err < 0)
+		return err;
+
+	err = bench_scan(bench, &count);
+	if (err < 0 || count != bench->stream_units) {
+		fprintf(stderr, "found %u of %u NAL units: %d\n", count,
+			bench->stream_units, err);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+static void bench_report(const char *name, unsigned int count, uint64_t time,
+			 const char *unit)
+{
+	printf("  %-6s %10u %-8s in %8.3f ms, %12.0f %s/s\n", name, count, unit,
+	       time / 1e6, time ? count * 1e9 / time : 0.0, unit);
+}
+
+static void bench_run(struct bench *bench)
+{
+	uint64_t start, sps_time, pps_time, avcc_time, scan_time;
+	unsigned int i, j, count = bench->count * bench->iterations;
+	struct h264_context h264;
+	struct h264_sps sps;
+	struct h264_pps pps;
+	unsigned int units;
+
+	start = vde_stats_now();
+
+	for (j = 0; j < bench->iterations; j++)
+		for (i = 0; i < bench->count; i++)
+			bench_parse_sps(bench, i, &sps);
+
+	sps_time = vde_stats_now() - start;
+	start = vde_stats_now();
+
+	for (j = 0; j < bench->iterations; j++)
+		for (i = 0; i < bench->count; i++)
+			bench_parse_pps(bench, i, &pps);
+
+	pps_time = vde_stats_now() - start;
+	start = vde_stats_now();
+
+	for (j = 0; j < bench->iterations; j++) {
+		for (i = 0; i < bench->count; i++) {
+			bench_parse_avcc(bench, i, &h264);
+			h264_context_free(&h264);
+		}
+	}
+
+	avcc_time = vde_stats_now() - start;
+	start = vde_stats_now();
+
+	for (j = 0; j < bench->iterations; j++)
+		bench_scan(bench, &units);
+
+	scan_time = vde_stats_now() - start;
+
+	bench_report("SPS", count, sps_time, "headers");
+	bench_report("PPS", count, pps_time, "headers");
+	bench_report("avcC", count, avcc_time, "headers");
+	bench_report("scan", bench->stream_units * bench->iterations,
+		     scan_time, "NALs");
+	printf("  scan throughput: %.1f MiB/s\n", scan_time ?
+	       (double)bench->stream_size * bench->iterations * 1e9 /
+	       scan_time / (1024 * 1024) : 0.0);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned long long seed = 1;
+	struct bench bench;
+	int opt, err;
+
+	memset(&bench, 0, sizeof(bench));
+	bench.count = 1000;
+	bench.iterations = 100;
+
+	while ((opt = getopt_long(argc, argv, "hI:i:n:S:", options, NULL)) != -1) {
+		switch (opt) {
+		case 'h':
+			usage(argv[0], stdout);
+			return 0;
+
+		case 'I':
+			err = cpu_isa_force(optarg);
+			if (err < 0) {
+				fprintf(stderr, "unsupported ISA: %s\n", optarg);
+				return 1;
+			}
+			break;
+
+		case 'i':
+			bench.iterations = strtoul(optarg, NULL, 0);
+			break;
+
+		case 'n':
+			bench.count = strtoul(optarg, NULL, 0);
+			if (bench.count == 0) {
+				fprintf(stderr, "invalid count: %s\n", optarg);
+				return 1;
+			}
+			break;
+
+		case 'S':
+			seed = strtoull(optarg, NULL, 0);
+			break;
+
+		default:
+			usage(argv[0], stderr);
+			return 1;
+		}
+	}
+
+	h264_generator_init(&bench.gen, seed);
+
+	err = bench_generate(&bench);
+	if (err < 0) {
+		fprintf(stderr, "failed to generate headers: %d\n", err);
+		goto free;
+	}
+
+	err = bench_verify(&bench);
+	if (err < 0) {
+		fprintf(stderr, "round trip failed\n");
+		goto free;
+	}
+
+	printf("%u SPS/PPS pairs and slices verified, seed %llu, %s kernels\n",
+	       bench.count, seed, cpu_isa_name(cpu_isa()));
+
+	bench_run(&bench);
+
+free:
+	bench_free(&bench);
+	return err < 0 ? 1 : 0;
+}
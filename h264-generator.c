@@ -0,0 +1,566 @@
+#include <errno.h>
+#include <string.h>
+
+#include "bitstream.h"
+#include "h264-generator.h"
+#include "utils.h"
+
+static const uint8_t h264_generator_levels[] = {
+	10, 11, 12, 13, 20, 21, 22, 30, 31, 32, 40, 41, 42, 50, 51, 52,
+};
+
+/* P, I and their all-slices-alike variants */
+static const uint32_t h264_generator_slice_types[] = { 0, 2, 5, 7 };
+
+void h264_generator_init(struct h264_generator *gen, uint64_t seed)
+{
+	/* xorshift must not start out with all bits cleared */
+	gen->state = seed ?: 0x9e3779b97f4a7c15ull;
+}
+
+/* returns a value in [0, max) using xorshift64* */
+uint32_t h264_generator_random(struct h264_generator *gen, uint32_t max)
+{
+	uint64_t x = gen->state;
+
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	gen->state = x;
+
+	if (max == 0)
+		return 0;
+
+	return ((x * 0x2545f4914f6cdd1dull) >> 32) % max;
+}
+
+/* returns a value in [min, max] */
+static int32_t h264_generator_range(struct h264_generator *gen, int32_t min,
+				    int32_t max)
+{
+	return min + (int32_t)h264_generator_random(gen, max - min + 1);
+}
+
+static void h264_generate_hrd(struct h264_generator *gen,
+			      struct h264_hrd_parameters *hrd)
+{
+	unsigned int i;
+
+	hrd->cpb_cnt_minus1 = h264_generator_random(gen, 4);
+	hrd->bit_rate_scale = h264_generator_random(gen, 16);
+	hrd->cpb_size_scale = h264_generator_random(gen, 16);
+
+	for (i = 0; i <= hrd->cpb_cnt_minus1; i++) {
+		hrd->bit_rate_value_minus1[i] = h264_generator_random(gen, 100000);
+		hrd->cpb_size_value_minus1[i] = h264_generator_random(gen, 100000);
+		hrd->cbr_flag[i] = h264_generator_random(gen, 2);
+	}
+
+	hrd->initial_cpb_removal_delay_length_minus1 = h264_generator_random(gen, 32);
+	hrd->cpb_removal_delay_length_minus1 = h264_generator_random(gen, 32);
+	hrd->dpb_output_delay_length_minus1 = h264_generator_random(gen, 32);
+	hrd->time_offset_length = h264_generator_random(gen, 32);
+}
+
+void h264_generate_sps(struct h264_generator *gen, struct h264_sps *sps)
+{
+	struct h264_vui_parameters *vui = &sps->vui_parameters;
+	const struct h264_level *level;
+	unsigned int width, height;
+
+	memset(sps, 0, sizeof(*sps));
+
+	sps->profile_idc = 66;
+	/* constraint_set0_flag to constraint_set5_flag, reserved_zero_2bits */
+	sps->flags = h264_generator_random(gen, 64) << 2;
+	sps->level_idc = h264_generator_levels[h264_generator_random(gen,
+						ARRAY_SIZE(h264_generator_levels))];
+	sps->seq_parameter_set_id = h264_generator_random(gen, 32);
+	sps->log2_max_frame_num_minus4 = h264_generator_random(gen, 13);
+	/* the parser only supports picture order count type 2 */
+	sps->pic_order_cnt_type = 2;
+	sps->max_num_ref_frames = h264_generator_random(gen, 17);
+	sps->gaps_in_frame_num_value_allowed_flag = h264_generator_random(gen, 2);
+
+	/* any frame size that the level allows */
+	level = h264_level_find(sps->level_idc);
+	width = h264_generator_range(gen, 1, level->max_fs < 255 ?
+					     level->max_fs : 255);
+	height = h264_generator_range(gen, 1, level->max_fs / width);
+
+	sps->pic_width_in_mbs_minus1 = width - 1;
+	sps->pic_height_in_map_units_minus1 = height - 1;
+	/* required for baseline */
+	sps->frame_mbs_only_flag = 1;
+	sps->direct_8x8_inference_flag = h264_generator_random(gen, 2);
+
+	/*
+	 * Offsets are in units of two pixels for 4:2:0 frames, and at least
+	 * one unit of the picture must remain in each direction (7.4.2.1.1).
+	 */
+	sps->frame_cropping_flag = h264_generator_random(gen, 2);
+	if (sps->frame_cropping_flag) {
+		sps->frame_crop_left_offset = h264_generator_random(gen, width * 8);
+		sps->frame_crop_right_offset =
+			h264_generator_random(gen, width * 8 -
+						   sps->frame_crop_left_offset);
+		sps->frame_crop_top_offset = h264_generator_random(gen, height * 8);
+		sps->frame_crop_bottom_offset =
+			h264_generator_random(gen, height * 8 -
+						   sps->frame_crop_top_offset);
+	}
+
+	sps->vui_parameters_present_flag = h264_generator_random(gen, 2);
+	if (sps->vui_parameters_present_flag) {
+		vui->aspect_ratio_info_present_flag = h264_generator_random(gen, 2);
+		if (vui->aspect_ratio_info_present_flag) {
+			/* Extended_SAR every so often */
+			if (h264_generator_random(gen, 4) == 0) {
+				vui->aspect_ratio_idc = 255;
+				vui->sar_width = h264_generator_range(gen, 1, 65535);
+				vui->sar_height = h264_generator_range(gen, 1, 65535);
+			} else {
+				vui->aspect_ratio_idc = h264_generator_random(gen, 17);
+			}
+		}
+
+		vui->overscan_info_present_flag = h264_generator_random(gen, 2);
+		if (vui->overscan_info_present_flag)
+			vui->overscan_appropriate_flag = h264_generator_random(gen, 2);
+
+		vui->video_signal_type_present_flag = h264_generator_random(gen, 2);
+		if (vui->video_signal_type_present_flag) {
+			vui->video_format = h264_generator_random(gen, 6);
+			vui->video_full_range_flag = h264_generator_random(gen, 2);
+			vui->colour_description_present_flag =
+				h264_generator_random(gen, 2);
+
+			if (vui->colour_description_present_flag) {
+				vui->colour_primaries = h264_generator_random(gen, 256);
+				vui->transfer_characteristics =
+					h264_generator_random(gen, 256);
+				vui->matrix_coefficients =
+					h264_generator_random(gen, 256);
+			}
+		}
+
+		vui->chroma_loc_info_present_flag = h264_generator_random(gen, 2);
+		if (vui->chroma_loc_info_present_flag) {
+			vui->chroma_sample_loc_type_top_field =
+				h264_generator_random(gen, 6);
+			vui->chroma_sample_loc_type_bottom_field =
+				h264_generator_random(gen, 6);
+		}
+
+		vui->timing_info_present_flag = h264_generator_random(gen, 2);
+		if (vui->timing_info_present_flag) {
+			vui->num_units_in_tick = h264_generator_range(gen, 1, 1001);
+			vui->time_scale = h264_generator_range(gen, 1, 120000);
+			vui->fixed_frame_rate_flag = h264_generator_random(gen, 2);
+		}
+
+		vui->nal_hrd_parameters_present_flag = h264_generator_random(gen, 2);
+		if (vui->nal_hrd_parameters_present_flag)
+			h264_generate_hrd(gen, &vui->nal_hrd_parameters);
+
+		vui->vcl_hrd_parameters_present_flag = h264_generator_random(gen, 2);
+		if (vui->vcl_hrd_parameters_present_flag)
+			h264_generate_hrd(gen, &vui->vcl_hrd_parameters);
+
+		if (vui->nal_hrd_parameters_present_flag ||
+		    vui->vcl_hrd_parameters_present_flag)
+			vui->low_delay_hrd_flag = h264_generator_random(gen, 2);
+
+		vui->pic_struct_present_flag = h264_generator_random(gen, 2);
+
+		vui->bitstream_restriction_flag = h264_generator_random(gen, 2);
+		if (vui->bitstream_restriction_flag) {
+			vui->motion_vectors_over_pic_boundaries_flag =
+				h264_generator_random(gen, 2);
+			vui->max_bytes_per_pic_denom = h264_generator_random(gen, 17);
+			vui->max_bits_per_mb_denom = h264_generator_random(gen, 17);
+			vui->log2_max_mv_length_horizontal =
+				h264_generator_random(gen, 17);
+			vui->log2_max_mv_length_vertical =
+				h264_generator_random(gen, 17);
+			vui->max_dec_frame_buffering =
+				h264_generator_range(gen, sps->max_num_ref_frames, 16);
+			vui->max_num_reorder_frames =
+				h264_generator_random(gen, vui->max_dec_frame_buffering + 1);
+		}
+	}
+}
+
+void h264_generate_pps(struct h264_generator *gen, struct h264_pps *pps,
+		       const struct h264_sps *sps)
+{
+	memset(pps, 0, sizeof(*pps));
+
+	pps->pic_parameter_set_id = h264_generator_random(gen, 256);
+	pps->seq_parameter_set_id = sps->seq_parameter_set_id;
+	pps->bottom_field_pic_order_in_frame_present_flag = h264_generator_random(gen, 2);
+	pps->num_ref_idx_l0_default_active_minus1 = h264_generator_random(gen, 32);
+	pps->num_ref_idx_l1_default_active_minus1 = h264_generator_random(gen, 32);
+	pps->pic_init_qp_minus26 = h264_generator_range(gen, -26, 25);
+	pps->pic_init_qs_minus26 = h264_generator_range(gen, -26, 25);
+	pps->chroma_qp_index_offset = h264_generator_range(gen, -12, 12);
+	pps->deblocking_filter_control_present_flag = h264_generator_random(gen, 2);
+	pps->constrained_intra_pred_flag = h264_generator_random(gen, 2);
+	pps->redundant_pic_cnt_present_flag = h264_generator_random(gen, 2);
+}
+
+void h264_generate_slice_header(struct h264_generator *gen,
+				struct h264_slice_header *slice,
+				const struct h264_sps *sps,
+				const struct h264_pps *pps, bool idr)
+{
+	unsigned int mbs = (sps->pic_width_in_mbs_minus1 + 1) *
+			   (sps->pic_height_in_map_units_minus1 + 1);
+	int32_t qp = 26 + pps->pic_init_qp_minus26;
+
+	memset(slice, 0, sizeof(*slice));
+
+	if (idr) {
+		slice->nal_unit_type = H264_NAL_IDR;
+		slice->nal_ref_idc = h264_generator_range(gen, 1, 3);
+		/* I or I-only */
+		slice->slice_type = h264_generator_random(gen, 2) ? 7 : 2;
+		slice->idr_pic_id = h264_generator_random(gen, 65536);
+	} else {
+		slice->nal_unit_type = H264_NAL_SLICE;
+		slice->nal_ref_idc = h264_generator_random(gen, 4);
+		slice->slice_type = h264_generator_slice_types[h264_generator_random(gen, 4)];
+		slice->frame_num = h264_generator_random(gen,
+				1 << (sps->log2_max_frame_num_minus4 + 4));
+	}
+
+	slice->first_mb_in_slice = h264_generator_random(gen, mbs);
+	slice->pic_parameter_set_id = pps->pic_parameter_set_id;
+	/* keeps QPY within [0, 51] */
+	slice->slice_qp_delta = h264_generator_range(gen, -qp, 51 - qp);
+
+	if (pps->deblocking_filter_control_present_flag) {
+		slice->disable_deblocking_filter_idc = h264_generator_random(gen, 3);
+
+		if (slice->disable_deblocking_filter_idc != 1) {
+			slice->slice_alpha_c0_offset_div2 = h264_generator_range(gen, -6, 6);
+			slice->slice_beta_offset_div2 = h264_generator_range(gen, -6, 6);
+		}
+	}
+}
+
+static int h264_write_nal_header(struct bitstream_writer *bw, uint8_t ref_idc,
+				 uint8_t type)
+{
+	/* forbidden_zero_bit, nal_ref_idc, nal_unit_type */
+	return bitstream_write_u32(bw, (ref_idc << 5) | type, 8);
+}
+
+static void h264_write_hrd(struct bitstream_writer *bw,
+			   const struct h264_hrd_parameters *hrd)
+{
+	unsigned int i;
+
+	bitstream_write_ue(bw, hrd->cpb_cnt_minus1);
+	bitstream_write_u32(bw, hrd->bit_rate_scale, 4);
+	bitstream_write_u32(bw, hrd->cpb_size_scale, 4);
+
+	for (i = 0; i <= hrd->cpb_cnt_minus1; i++) {
+		bitstream_write_ue(bw, hrd->bit_rate_value_minus1[i]);
+		bitstream_write_ue(bw, hrd->cpb_size_value_minus1[i]);
+		bitstream_write_u32(bw, hrd->cbr_flag[i], 1);
+	}
+
+	bitstream_write_u32(bw, hrd->initial_cpb_removal_delay_length_minus1, 5);
+	bitstream_write_u32(bw, hrd->cpb_removal_delay_length_minus1, 5);
+	bitstream_write_u32(bw, hrd->dpb_output_delay_length_minus1, 5);
+	bitstream_write_u32(bw, hrd->time_offset_length, 5);
+}
+
+ssize_t h264_write_sps(const struct h264_sps *sps, void *buffer, size_t size)
+{
+	const struct h264_vui_parameters *vui = &sps->vui_parameters;
+	struct bitstream_writer bw;
+
+	bitstream_writer_init(&bw, buffer, size, true);
+
+	h264_write_nal_header(&bw, 3, H264_NAL_SPS);
+	bitstream_write_u32(&bw, sps->profile_idc, 8);
+	bitstream_write_u32(&bw, sps->flags, 8);
+	bitstream_write_u32(&bw, sps->level_idc, 8);
+	bitstream_write_ue(&bw, sps->seq_parameter_set_id);
+
+	/* baseline has no chroma_format_idc and friends */
+	if (sps->profile_idc != 66)
+		return -ENOTSUP;
+
+	bitstream_write_ue(&bw, sps->log2_max_frame_num_minus4);
+	bitstream_write_ue(&bw, sps->pic_order_cnt_type);
+
+	if (sps->pic_order_cnt_type != 2)
+		return -ENOTSUP;
+
+	bitstream_write_ue(&bw, sps->max_num_ref_frames);
+	bitstream_write_u32(&bw, sps->gaps_in_frame_num_value_allowed_flag, 1);
+	bitstream_write_ue(&bw, sps->pic_width_in_mbs_minus1);
+	bitstream_write_ue(&bw, sps->pic_height_in_map_units_minus1);
+	bitstream_write_u32(&bw, sps->frame_mbs_only_flag, 1);
+
+	if (!sps->frame_mbs_only_flag)
+		bitstream_write_u32(&bw, sps->mb_adaptive_frame_field_flag, 1);
+
+	bitstream_write_u32(&bw, sps->direct_8x8_inference_flag, 1);
+	bitstream_write_u32(&bw, sps->frame_cropping_flag, 1);
+
+	if (sps->frame_cropping_flag) {
+		bitstream_write_ue(&bw, sps->frame_crop_left_offset);
+		bitstream_write_ue(&bw, sps->frame_crop_right_offset);
+		bitstream_write_ue(&bw, sps->frame_crop_top_offset);
+		bitstream_write_ue(&bw, sps->frame_crop_bottom_offset);
+	}
+
+	bitstream_write_u32(&bw, sps->vui_parameters_present_flag, 1);
+
+	if (sps->vui_parameters_present_flag) {
+		bitstream_write_u32(&bw, vui->aspect_ratio_info_present_flag, 1);
+
+		if (vui->aspect_ratio_info_present_flag) {
+			bitstream_write_u32(&bw, vui->aspect_ratio_idc, 8);
+
+			if (vui->aspect_ratio_idc == 255) {
+				bitstream_write_u32(&bw, vui->sar_width, 16);
+				bitstream_write_u32(&bw, vui->sar_height, 16);
+			}
+		}
+
+		bitstream_write_u32(&bw, vui->overscan_info_present_flag, 1);
+
+		if (vui->overscan_info_present_flag)
+			bitstream_write_u32(&bw, vui->overscan_appropriate_flag, 1);
+
+		bitstream_write_u32(&bw, vui->video_signal_type_present_flag, 1);
+
+		if (vui->video_signal_type_present_flag) {
+			bitstream_write_u32(&bw, vui->video_format, 3);
+			bitstream_write_u32(&bw, vui->video_full_range_flag, 1);
+			bitstream_write_u32(&bw, vui->colour_description_present_flag, 1);
+
+			if (vui->colour_description_present_flag) {
+				bitstream_write_u32(&bw, vui->colour_primaries, 8);
+				bitstream_write_u32(&bw, vui->transfer_characteristics, 8);
+				bitstream_write_u32(&bw, vui->matrix_coefficients, 8);
+			}
+		}
+
+		bitstream_write_u32(&bw, vui->chroma_loc_info_present_flag, 1);
+
+		if (vui->chroma_loc_info_present_flag) {
+			bitstream_write_ue(&bw, vui->chroma_sample_loc_type_top_field);
+			bitstream_write_ue(&bw, vui->chroma_sample_loc_type_bottom_field);
+		}
+
+		bitstream_write_u32(&bw, vui->timing_info_present_flag, 1);
+
+		if (vui->timing_info_present_flag) {
+			bitstream_write_u32(&bw, vui->num_units_in_tick, 32);
+			bitstream_write_u32(&bw, vui->time_scale, 32);
+			bitstream_write_u32(&bw, vui->fixed_frame_rate_flag, 1);
+		}
+
+		bitstream_write_u32(&bw, vui->nal_hrd_parameters_present_flag, 1);
+
+		if (vui->nal_hrd_parameters_present_flag)
+			h264_write_hrd(&bw, &vui->nal_hrd_parameters);
+
+		bitstream_write_u32(&bw, vui->vcl_hrd_parameters_present_flag, 1);
+
+		if (vui->vcl_hrd_parameters_present_flag)
+			h264_write_hrd(&bw, &vui->vcl_hrd_parameters);
+
+		if (vui->nal_hrd_parameters_present_flag ||
+		    vui->vcl_hrd_parameters_present_flag)
+			bitstream_write_u32(&bw, vui->low_delay_hrd_flag, 1);
+
+		bitstream_write_u32(&bw, vui->pic_struct_present_flag, 1);
+		bitstream_write_u32(&bw, vui->bitstream_restriction_flag, 1);
+
+		if (vui->bitstream_restriction_flag) {
+			bitstream_write_u32(&bw, vui->motion_vectors_over_pic_boundaries_flag, 1);
+			bitstream_write_ue(&bw, vui->max_bytes_per_pic_denom);
+			bitstream_write_ue(&bw, vui->max_bits_per_mb_denom);
+			bitstream_write_ue(&bw, vui->log2_max_mv_length_horizontal);
+			bitstream_write_ue(&bw, vui->log2_max_mv_length_vertical);
+			bitstream_write_ue(&bw, vui->max_num_reorder_frames);
+			bitstream_write_ue(&bw, vui->max_dec_frame_buffering);
+		}
+	}
+
+	bitstream_write_trailing_bits(&bw);
+
+	return bitstream_writer_finish(&bw);
+}
+
+ssize_t h264_write_pps(const struct h264_pps *pps, void *buffer, size_t size)
+{
+	struct bitstream_writer bw;
+
+	/* slice groups and CABAC aren't part of constrained baseline */
+	if (pps->num_slice_groups_minus1 > 0 || pps->entropy_coding_mode_flag)
+		return -ENOTSUP;
+
+	bitstream_writer_init(&bw, buffer, size, true);
+
+	h264_write_nal_header(&bw, 3, H264_NAL_PPS);
+	bitstream_write_ue(&bw, pps->pic_parameter_set_id);
+	bitstream_write_ue(&bw, pps->seq_parameter_set_id);
+	bitstream_write_u32(&bw, pps->entropy_coding_mode_flag, 1);
+	bitstream_write_u32(&bw, pps->bottom_field_pic_order_in_frame_present_flag, 1);
+	bitstream_write_ue(&bw, pps->num_slice_groups_minus1);
+	bitstream_write_ue(&bw, pps->num_ref_idx_l0_default_active_minus1);
+	bitstream_write_ue(&bw, pps->num_ref_idx_l1_default_active_minus1);
+	bitstream_write_u32(&bw, pps->weighted_pred_flag, 1);
+	bitstream_write_u32(&bw, pps->weighted_bipred_idc, 2);
+	bitstream_write_se(&bw, pps->pic_init_qp_minus26);
+	bitstream_write_se(&bw, pps->pic_init_qs_minus26);
+	bitstream_write_se(&bw, pps->chroma_qp_index_offset);
+	bitstream_write_u32(&bw, pps->deblocking_filter_control_present_flag, 1);
+	bitstream_write_u32(&bw, pps->constrained_intra_pred_flag, 1);
+	bitstream_write_u32(&bw, pps->redundant_pic_cnt_present_flag, 1);
+	bitstream_write_trailing_bits(&bw);
+
+	return bitstream_writer_finish(&bw);
+}
+
+/*
+ * Writes a slice NAL unit with the given header, followed by payload bytes of
+ * random slice data.
+ */
+ssize_t h264_write_slice(struct h264_generator *gen,
+			 const struct h264_slice_header *slice,
+			 const struct h264_sps *sps,
+			 const struct h264_pps *pps, size_t payload,
+			 void *buffer, size_t size)
+{
+	bool idr = slice->nal_unit_type == H264_NAL_IDR;
+	struct bitstream_writer bw;
+	size_t i;
+
+	bitstream_writer_init(&bw, buffer, size, true);
+
+	h264_write_nal_header(&bw, slice->nal_ref_idc,
+				     slice->nal_unit_type);
+	bitstream_write_ue(&bw, slice->first_mb_in_slice);
+	bitstream_write_ue(&bw, slice->slice_type);
+	bitstream_write_ue(&bw, slice->pic_parameter_set_id);
+	bitstream_write_u32(&bw, slice->frame_num,
+				   sps->log2_max_frame_num_minus4 + 4);
+
+	if (idr)
+		bitstream_write_ue(&bw, slice->idr_pic_id);
+
+	/* redundant_pic_cnt */
+	if (pps->redundant_pic_cnt_present_flag)
+		bitstream_write_ue(&bw, 0);
+
+	/*
+	 * num_ref_idx_active_override_flag and
+	 * ref_pic_list_modification_flag_l0 for P slices
+	 */
+	if (slice->slice_type % 5 == 0)
+		bitstream_write_u32(&bw, 0, 2);
+
+	/*
+	 * dec_ref_pic_marking(): no_output_of_prior_pics_flag and
+	 * long_term_reference_flag for IDR pictures,
+	 * adaptive_ref_pic_marking_mode_flag otherwise
+	 */
+	if (slice->nal_ref_idc)
+		bitstream_write_u32(&bw, 0, idr ? 2 : 1);
+
+	bitstream_write_se(&bw, slice->slice_qp_delta);
+
+	if (pps->deblocking_filter_control_present_flag) {
+		bitstream_write_ue(&bw, slice->disable_deblocking_filter_idc);
+
+		if (slice->disable_deblocking_filter_idc != 1) {
+			bitstream_write_se(&bw, slice->slice_alpha_c0_offset_div2);
+			bitstream_write_se(&bw, slice->slice_beta_offset_div2);
+		}
+	}
+
+	for (i = 0; i < payload; i++)
+		bitstream_write_u32(&bw, h264_generator_random(gen, 256), 8);
+
+	bitstream_write_trailing_bits(&bw);
+
+	return bitstream_writer_finish(&bw);
+}
+
+/* prefixes a NAL unit written at ptr + 2 by its 16-bit length */
+static ssize_t h264_avcc_unit(uint8_t *ptr, ssize_t length)
+{
+	if (length < 0)
+		return length;
+
+	ptr[0] = length >> 8;
+	ptr[1] = length;
+
+	return length + 2;
+}
+
+/* writes an avcC record with 4-byte NAL unit lengths */
+ssize_t h264_write_avcc(const struct h264_sps *sps, unsigned int num_sps,
+			const struct h264_pps *pps, unsigned int num_pps,
+			void *buffer, size_t size)
+{
+	uint8_t *ptr = buffer;
+	size_t offset = 0;
+	ssize_t length;
+	unsigned int i;
+
+	if (num_sps == 0 || num_sps > 31 || num_pps > 255)
+		return -EINVAL;
+
+	if (size < 7)
+		return -ENOSPC;
+
+	ptr[offset++] = 1;
+	ptr[offset++] = sps[0].profile_idc;
+	ptr[offset++] = sps[0].flags;
+	ptr[offset++] = sps[0].level_idc;
+	ptr[offset++] = 0xfc | 3;
+	ptr[offset++] = 0xe0 | num_sps;
+
+	for (i = 0; i < num_sps; i++) {
+		if (size - offset < 2)
+			return -ENOSPC;
+
+		length = h264_write_sps(&sps[i], ptr + offset + 2,
+					size - offset - 2);
+		length = h264_avcc_unit(ptr + offset, length);
+		if (length < 0)
+			return length;
+
+		offset += length;
+	}
+
+	if (offset >= size)
+		return -ENOSPC;
+
+	ptr[offset++] = num_pps;
+
+	for (i = 0; i < num_pps; i++) {
+		if (size - offset < 2)
+			return -ENOSPC;
+
+		length = h264_write_pps(&pps[i], ptr + offset + 2,
+					size - offset - 2);
+		length = h264_avcc_unit(ptr + offset, length);
+		if (length < 0)
+			return length;
+
+		offset += length;
+	}
+
+	return offset;
+}
@@ -0,0 +1,62 @@
+#ifndef H264_GENERATOR_H
+#define H264_GENERATOR_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <sys/types.h>
+
+#include "h264-parser.h"
+
+/*
+ * Generates random but valid constrained baseline parameter sets and slice
+ * headers, for exercising the parser. Parameter sets are limited to what
+ * h264_sps_parse() and h264_pps_parse() support, fields that the parser
+ * doesn't read are left zeroed. The same seed always yields the same
+ * sequence.
+ */
+struct h264_generator {
+	uint64_t state;
+};
+
+struct h264_slice_header {
+	uint8_t nal_unit_type;
+	uint8_t nal_ref_idc;
+	uint32_t first_mb_in_slice;
+	uint32_t slice_type;
+	uint32_t pic_parameter_set_id;
+	uint32_t frame_num;
+	/* only for IDR pictures */
+	uint32_t idr_pic_id;
+	int32_t slice_qp_delta;
+	/* only for deblocking_filter_control_present_flag */
+	uint32_t disable_deblocking_filter_idc;
+	int32_t slice_alpha_c0_offset_div2;
+	int32_t slice_beta_offset_div2;
+};
+
+void h264_generator_init(struct h264_generator *gen, uint64_t seed);
+uint32_t h264_generator_random(struct h264_generator *gen, uint32_t max);
+
+void h264_generate_sps(struct h264_generator *gen, struct h264_sps *sps);
+void h264_generate_pps(struct h264_generator *gen, struct h264_pps *pps,
+		       const struct h264_sps *sps);
+void h264_generate_slice_header(struct h264_generator *gen,
+				struct h264_slice_header *slice,
+				const struct h264_sps *sps,
+				const struct h264_pps *pps, bool idr);
+
+/* these write complete NAL units, including the NAL header */
+ssize_t h264_write_sps(const struct h264_sps *sps, void *buffer, size_t size);
+ssize_t h264_write_pps(const struct h264_pps *pps, void *buffer, size_t size);
+ssize_t h264_write_slice(struct h264_generator *gen,
+			 const struct h264_slice_header *slice,
+			 const struct h264_sps *sps,
+			 const struct h264_pps *pps, size_t payload,
+			 void *buffer, size_t size);
+ssize_t h264_write_avcc(const struct h264_sps *sps, unsigned int num_sps,
+			const struct h264_pps *pps, unsigned int num_pps,
+			void *buffer, size_t size);
+
+#endif
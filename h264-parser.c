@@ -1,446 +1,1600 @@
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
-#include "bitstream.h"
+#include "cpu.h"
 #include "h264-parser.h"
+#include "mem.h"
+#include "utils.h"
+
+/*
+ * Parameter sets are described by tables of syntax elements in the order of
+ * the bitstream, interpreted by h264_syntax_walk(). Conditional elements and
+ * loop bodies follow the entry that controls them with a greater depth.
+ */
+enum h264_syntax_type {
+	/* u(n), ue(v) and se(v) fields */
+	H264_SYNTAX_U,
+	H264_SYNTAX_UE,
+	H264_SYNTAX_SE,
+	/* the body is only present if the condition holds */
+	H264_SYNTAX_IF,
+	/* the body repeats field + bits times, at most value times */
+	H264_SYNTAX_LOOP,
+	/* parsed by a function of its own, value is the most bits it reads */
+	H264_SYNTAX_CALL,
+};
+
+enum h264_syntax_cond {
+	H264_COND_EQ,
+	H264_COND_NE,
+	H264_COND_LT,
+	H264_COND_GT,
+	/* either the field or the flag at offset value is set */
+	H264_COND_EITHER,
+	/* profile_idc of a profile that signals chroma_format_idc and friends */
+	H264_COND_HIGH,
+	/* more_rbsp_data() */
+	H264_COND_MORE_DATA,
+};
+
+/* field is an array indexed by the iteration of the enclosing loop */
+#define H264_SYNTAX_ARRAY (1 << 0)
+
+struct h264_reader;
+
+struct h264_syntax {
+	int (*parse)(const struct h264_syntax *s, void *base,
+		     struct h264_reader *reader);
+	const char *name;
+	uint16_t offset;
+	uint8_t size;
+	uint8_t type;
+	uint8_t bits;
+	uint8_t depth;
+	uint8_t cond;
+	uint8_t flags;
+	/* maximum of a field, operand of a condition or maximum loop count */
+	uint32_t value;
+};
+
+#define H264_FIELD_SIZE(s, field) sizeof(((s *)0)->field)
+
+#define H264_SYNTAX(s, _type, field, _bits, _depth, _max)		\
+	{								\
+		.name = #field,						\
+		.offset = offsetof(s, field),				\
+		.size = H264_FIELD_SIZE(s, field),			\
+		.type = _type,						\
+		.bits = _bits,						\
+		.depth = _depth,					\
+		.value = _max,						\
+	}
 
-int h264_sps_parse(struct h264_sps *sps, const void *data, size_t size)
-{
-	struct bitstream bs;
-	size_t len;
-	int err;
+#define H264_SYNTAX_ARRAY_FIELD(s, _type, field, _bits, _depth)	\
+	{								\
+		.name = #field,						\
+		.offset = offsetof(s, field),				\
+		.size = H264_FIELD_SIZE(s, field[0]),			\
+		.type = _type,						\
+		.bits = _bits,						\
+		.depth = _depth,					\
+		.flags = H264_SYNTAX_ARRAY,				\
+		.value = UINT32_MAX,					\
+	}
 
-	bitstream_init(&bs, data, size);
+#define H264_IF(s, field, _depth, _cond, _value)			\
+	{								\
+		.offset = offsetof(s, field),				\
+		.size = H264_FIELD_SIZE(s, field),			\
+		.type = H264_SYNTAX_IF,					\
+		.depth = _depth,					\
+		.cond = _cond,						\
+		.value = _value,					\
+	}
 
-	err = bitstream_read_u8(&bs, &sps->profile_idc, 8);
-	if (err < 0)
-		return err;
+#define H264_LOOP(s, field, _bias, _depth, _max)			\
+	{								\
+		.offset = offsetof(s, field),				\
+		.size = H264_FIELD_SIZE(s, field),			\
+		.type = H264_SYNTAX_LOOP,				\
+		.bits = _bias,						\
+		.depth = _depth,					\
+		.value = _max,						\
+	}
 
-	err = bitstream_read_u8(&bs, &sps->flags, 8);
-	if (err < 0)
-		return err;
+#define H264_CALL(_parse, _depth, _max)				\
+	{								\
+		.parse = _parse,					\
+		.type = H264_SYNTAX_CALL,				\
+		.depth = _depth,					\
+		.value = _max,						\
+	}
 
-	err = bitstream_read_u8(&bs, &sps->level_idc, 8);
-	if (err < 0)
-		return err;
+/* 6 4x4 and 6 8x8 lists for 4:4:4, with delta_scale of 17 bits */
+#define H264_SCALING_LISTS_MAX_BITS (6 * (1 + 16 * 17) + 6 * (1 + 64 * 17))
+
+static int h264_sps_scaling_lists(const struct h264_syntax *s, void *base,
+				  struct h264_reader *reader);
+static int h264_pps_scaling_lists(const struct h264_syntax *s, void *base,
+				  struct h264_reader *reader);
+static int h264_pps_slice_group_ids(const struct h264_syntax *s, void *base,
+				    struct h264_reader *reader);
+
+#define H264_U(s, field, bits, depth) \
+	H264_SYNTAX(s, H264_SYNTAX_U, field, bits, depth, UINT32_MAX)
+#define H264_UE(s, field, depth, max) \
+	H264_SYNTAX(s, H264_SYNTAX_UE, field, 0, depth, max)
+#define H264_SE(s, field, depth) \
+	H264_SYNTAX(s, H264_SYNTAX_SE, field, 0, depth, UINT32_MAX)
+
+#define H264_HRD(hrd, depth)						\
+	H264_UE(struct h264_sps, hrd.cpb_cnt_minus1, depth,		\
+		H264_MAX_CPB_CNT - 1),					\
+	H264_U(struct h264_sps, hrd.bit_rate_scale, 4, depth),		\
+	H264_U(struct h264_sps, hrd.cpb_size_scale, 4, depth),		\
+	H264_LOOP(struct h264_sps, hrd.cpb_cnt_minus1, 1, depth,	\
+		  H264_MAX_CPB_CNT),					\
+	H264_SYNTAX_ARRAY_FIELD(struct h264_sps, H264_SYNTAX_UE,	\
+				hrd.bit_rate_value_minus1, 0, depth + 1), \
+	H264_SYNTAX_ARRAY_FIELD(struct h264_sps, H264_SYNTAX_UE,	\
+				hrd.cpb_size_value_minus1, 0, depth + 1), \
+	H264_SYNTAX_ARRAY_FIELD(struct h264_sps, H264_SYNTAX_U,		\
+				hrd.cbr_flag, 1, depth + 1),		\
+	H264_U(struct h264_sps, hrd.initial_cpb_removal_delay_length_minus1, \
+	       5, depth),						\
+	H264_U(struct h264_sps, hrd.cpb_removal_delay_length_minus1, 5, depth), \
+	H264_U(struct h264_sps, hrd.dpb_output_delay_length_minus1, 5, depth), \
+	H264_U(struct h264_sps, hrd.time_offset_length, 5, depth)
+
+#define SPS_U(field, bits, depth) H264_U(struct h264_sps, field, bits, depth)
+#define SPS_UE(field, depth, max) H264_UE(struct h264_sps, field, depth, max)
+#define SPS_SE(field, depth) H264_SE(struct h264_sps, field, depth)
+#define SPS_IF(field, depth, cond, value) \
+	H264_IF(struct h264_sps, field, depth, cond, value)
+#define VUI(field) vui_parameters.field
+
+/* seq_parameter_set_data() from 7.3.2.1.1 */
+static const struct h264_syntax h264_sps_syntax[] = {
+	SPS_U(profile_idc, 8, 0),
+	SPS_U(flags, 8, 0),
+	SPS_U(level_idc, 8, 0),
+	SPS_UE(seq_parameter_set_id, 0, 31),
+	SPS_IF(profile_idc, 0, H264_COND_HIGH, 0),
+		SPS_UE(chroma_format_idc, 1, 3),
+		SPS_IF(chroma_format_idc, 1, H264_COND_EQ, 3),
+			SPS_U(separate_colour_plane_flag, 1, 2),
+		SPS_UE(bit_depth_luma_minus8, 1, 6),
+		SPS_UE(bit_depth_chroma_minus8, 1, 6),
+		SPS_U(qpprime_y_zero_transform_bypass_flag, 1, 1),
+		SPS_U(seq_scaling_matrix_present_flag, 1, 1),
+		SPS_IF(seq_scaling_matrix_present_flag, 1, H264_COND_NE, 0),
+			H264_CALL(h264_sps_scaling_lists, 2,
+				  H264_SCALING_LISTS_MAX_BITS),
+	SPS_UE(log2_max_frame_num_minus4, 0, 12),
+	SPS_UE(pic_order_cnt_type, 0, 2),
+	SPS_IF(pic_order_cnt_type, 0, H264_COND_EQ, 0),
+		SPS_UE(log2_max_pic_order_cnt_lsb_minus4, 1, 12),
+	SPS_IF(pic_order_cnt_type, 0, H264_COND_EQ, 1),
+		SPS_U(delta_pic_order_always_zero_flag, 1, 1),
+		SPS_SE(offset_for_non_ref_pic, 1),
+		SPS_SE(offset_for_top_to_bottom_field, 1),
+		SPS_UE(num_ref_frames_in_pic_order_cnt_cycle, 1,
+		       H264_MAX_POC_CYCLE),
+		H264_LOOP(struct h264_sps, num_ref_frames_in_pic_order_cnt_cycle,
+			  0, 1, H264_MAX_POC_CYCLE),
+			H264_SYNTAX_ARRAY_FIELD(struct h264_sps, H264_SYNTAX_SE,
+						offset_for_ref_frame, 0, 2),
+	SPS_UE(max_num_ref_frames, 0, UINT32_MAX),
+	SPS_U(gaps_in_frame_num_value_allowed_flag, 1, 0),
+	SPS_UE(pic_width_in_mbs_minus1, 0, H264_MAX_FRAME_MBS - 1),
+	SPS_UE(pic_height_in_map_units_minus1, 0, H264_MAX_FRAME_MBS - 1),
+	SPS_U(frame_mbs_only_flag, 1, 0),
+	SPS_IF(frame_mbs_only_flag, 0, H264_COND_EQ, 0),
+		SPS_U(mb_adaptive_frame_field_flag, 1, 1),
+	SPS_U(direct_8x8_inference_flag, 1, 0),
+	SPS_U(frame_cropping_flag, 1, 0),
+	SPS_IF(frame_cropping_flag, 0, H264_COND_NE, 0),
+		SPS_UE(frame_crop_left_offset, 1, UINT32_MAX),
+		SPS_UE(frame_crop_right_offset, 1, UINT32_MAX),
+		SPS_UE(frame_crop_top_offset, 1, UINT32_MAX),
+		SPS_UE(frame_crop_bottom_offset, 1, UINT32_MAX),
+	SPS_U(vui_parameters_present_flag, 1, 0),
+	/* vui_parameters() from E.1.1 */
+	SPS_IF(vui_parameters_present_flag, 0, H264_COND_NE, 0),
+		SPS_U(VUI(aspect_ratio_info_present_flag), 1, 1),
+		SPS_IF(VUI(aspect_ratio_info_present_flag), 1, H264_COND_NE, 0),
+			SPS_U(VUI(aspect_ratio_idc), 8, 2),
+			SPS_IF(VUI(aspect_ratio_idc), 2, H264_COND_EQ, 255),
+				SPS_U(VUI(sar_width), 16, 3),
+				SPS_U(VUI(sar_height), 16, 3),
+		SPS_U(VUI(overscan_info_present_flag), 1, 1),
+		SPS_IF(VUI(overscan_info_present_flag), 1, H264_COND_NE, 0),
+			SPS_U(VUI(overscan_appropriate_flag), 1, 2),
+		SPS_U(VUI(video_signal_type_present_flag), 1, 1),
+		SPS_IF(VUI(video_signal_type_present_flag), 1, H264_COND_NE, 0),
+			SPS_U(VUI(video_format), 3, 2),
+			SPS_U(VUI(video_full_range_flag), 1, 2),
+			SPS_U(VUI(colour_description_present_flag), 1, 2),
+			SPS_IF(VUI(colour_description_present_flag), 2,
+			       H264_COND_NE, 0),
+				SPS_U(VUI(colour_primaries), 8, 3),
+				SPS_U(VUI(transfer_characteristics), 8, 3),
+				SPS_U(VUI(matrix_coefficients), 8, 3),
+		SPS_U(VUI(chroma_loc_info_present_flag), 1, 1),
+		SPS_IF(VUI(chroma_loc_info_present_flag), 1, H264_COND_NE, 0),
+			SPS_UE(VUI(chroma_sample_loc_type_top_field), 2, 5),
+			SPS_UE(VUI(chroma_sample_loc_type_bottom_field), 2, 5),
+		SPS_U(VUI(timing_info_present_flag), 1, 1),
+		SPS_IF(VUI(timing_info_present_flag), 1, H264_COND_NE, 0),
+			SPS_U(VUI(num_units_in_tick), 32, 2),
+			SPS_U(VUI(time_scale), 32, 2),
+			SPS_U(VUI(fixed_frame_rate_flag), 1, 2),
+		SPS_U(VUI(nal_hrd_parameters_present_flag), 1, 1),
+		SPS_IF(VUI(nal_hrd_parameters_present_flag), 1, H264_COND_NE, 0),
+			H264_HRD(VUI(nal_hrd_parameters), 2),
+		SPS_U(VUI(vcl_hrd_parameters_present_flag), 1, 1),
+		SPS_IF(VUI(vcl_hrd_parameters_present_flag), 1, H264_COND_NE, 0),
+			H264_HRD(VUI(vcl_hrd_parameters), 2),
+		SPS_IF(VUI(nal_hrd_parameters_present_flag), 1, H264_COND_EITHER,
+		       offsetof(struct h264_sps,
+				VUI(vcl_hrd_parameters_present_flag))),
+			SPS_U(VUI(low_delay_hrd_flag), 1, 2),
+		SPS_U(VUI(pic_struct_present_flag), 1, 1),
+		SPS_U(VUI(bitstream_restriction_flag), 1, 1),
+		SPS_IF(VUI(bitstream_restriction_flag), 1, H264_COND_NE, 0),
+			SPS_U(VUI(motion_vectors_over_pic_boundaries_flag), 1, 2),
+			SPS_UE(VUI(max_bytes_per_pic_denom), 2, 16),
+			SPS_UE(VUI(max_bits_per_mb_denom), 2, 16),
+			SPS_UE(VUI(log2_max_mv_length_horizontal), 2, 16),
+			SPS_UE(VUI(log2_max_mv_length_vertical), 2, 16),
+			SPS_UE(VUI(max_num_reorder_frames), 2, UINT32_MAX),
+			SPS_UE(VUI(max_dec_frame_buffering), 2, UINT32_MAX),
+};
+
+#define PPS_U(field, bits, depth) H264_U(struct h264_pps, field, bits, depth)
+#define PPS_UE(field, depth, max) H264_UE(struct h264_pps, field, depth, max)
+#define PPS_SE(field, depth) H264_SE(struct h264_pps, field, depth)
+#define PPS_IF(field, depth, cond, value) \
+	H264_IF(struct h264_pps, field, depth, cond, value)
+
+/* pic_parameter_set_rbsp() from 7.3.2.2 */
+static const struct h264_syntax h264_pps_syntax[] = {
+	PPS_UE(pic_parameter_set_id, 0, 255),
+	PPS_UE(seq_parameter_set_id, 0, 31),
+	PPS_U(entropy_coding_mode_flag, 1, 0),
+	PPS_U(bottom_field_pic_order_in_frame_present_flag, 1, 0),
+	PPS_UE(num_slice_groups_minus1, 0, H264_MAX_SLICE_GROUPS - 1),
+	PPS_IF(num_slice_groups_minus1, 0, H264_COND_NE, 0),
+		PPS_UE(slice_group_map_type, 1, 6),
+		PPS_IF(slice_group_map_type, 1, H264_COND_EQ, 0),
+			H264_LOOP(struct h264_pps, num_slice_groups_minus1, 1, 2,
+				  H264_MAX_SLICE_GROUPS),
+				H264_SYNTAX_ARRAY_FIELD(struct h264_pps, H264_SYNTAX_UE,
+							run_length_minus1, 0, 3),
+		PPS_IF(slice_group_map_type, 1, H264_COND_EQ, 2),
+			H264_LOOP(struct h264_pps, num_slice_groups_minus1, 0, 2,
+				  H264_MAX_SLICE_GROUPS - 1),
+				H264_SYNTAX_ARRAY_FIELD(struct h264_pps, H264_SYNTAX_UE,
+							top_left, 0, 3),
+				H264_SYNTAX_ARRAY_FIELD(struct h264_pps, H264_SYNTAX_UE,
+							bottom_right, 0, 3),
+		PPS_IF(slice_group_map_type, 1, H264_COND_GT, 2),
+			PPS_IF(slice_group_map_type, 2, H264_COND_LT, 6),
+				PPS_U(slice_group_change_direction_flag, 1, 3),
+				PPS_UE(slice_group_change_rate_minus1, 3, UINT32_MAX),
+			PPS_IF(slice_group_map_type, 2, H264_COND_EQ, 6),
+				PPS_UE(pic_size_in_map_units_minus1, 3, UINT32_MAX),
+				H264_CALL(h264_pps_slice_group_ids, 3, 0),
+	PPS_UE(num_ref_idx_l0_default_active_minus1, 0, 31),
+	PPS_UE(num_ref_idx_l1_default_active_minus1, 0, 31),
+	PPS_U(weighted_pred_flag, 1, 0),
+	PPS_U(weighted_bipred_idc, 2, 0),
+	PPS_SE(pic_init_qp_minus26, 0),
+	PPS_SE(pic_init_qs_minus26, 0),
+	PPS_SE(chroma_qp_index_offset, 0),
+	PPS_U(deblocking_filter_control_present_flag, 1, 0),
+	PPS_U(constrained_intra_pred_flag, 1, 0),
+	PPS_U(redundant_pic_cnt_present_flag, 1, 0),
+	{ .type = H264_SYNTAX_IF, .cond = H264_COND_MORE_DATA },
+		PPS_U(transform_8x8_mode_flag, 1, 1),
+		PPS_U(pic_scaling_matrix_present_flag, 1, 1),
+		PPS_IF(pic_scaling_matrix_present_flag, 1, H264_COND_NE, 0),
+			H264_CALL(h264_pps_scaling_lists, 2,
+				  H264_SCALING_LISTS_MAX_BITS),
+		PPS_SE(second_chroma_qp_index_offset, 1),
+};
+
+/*
+ * Reads from a buffer that is known to extend past anything the syntax can
+ * consume, so no read needs to check the bounds. Running past the end of the
+ * data is detected once, after the whole syntax has been read.
+ */
+struct h264_reader {
+	const uint8_t *data;
+	size_t size;
+	size_t pos;
+	int err;
 
-	printf("      profile: %u\n", sps->profile_idc);
-	printf("      flags: %02x\n", sps->flags);
-	printf("      level: %u\n", sps->level_idc);
+	/* parameter sets that a PPS may refer to */
+	const struct h264_sps *sps;
+	unsigned int num_sps;
+};
 
-	err = bitstream_read_ue(&bs, &sps->seq_parameter_set_id, &len);
-	if (err < 0)
-		return err;
+/* the next 57 or more bits, MSB first */
+static inline uint64_t h264_reader_peek(const struct h264_reader *reader)
+{
+	uint64_t word;
 
-	printf("      ID: %u (%zu bits)\n", sps->seq_parameter_set_id, len);
+	memcpy(&word, reader->data + (reader->pos >> 3), sizeof(word));
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	word = __builtin_bswap64(word);
+#endif
 
-	/* currently only supports baseline */
-	if (sps->profile_idc != 66) {
-		return -ENOTSUP;
-	}
+	return word << (reader->pos & 7);
+}
 
-	err = bitstream_read_ue(&bs, &sps->log2_max_frame_num_minus4, &len);
-	if (err < 0)
-		return err;
+/* up to 32 bits */
+static inline uint32_t h264_reader_u(struct h264_reader *reader,
+				     unsigned int bits)
+{
+	uint64_t word = h264_reader_peek(reader);
 
-	printf("      max frames: %u/%u (%zu bits)\n", sps->log2_max_frame_num_minus4, 2 << (sps->log2_max_frame_num_minus4 + 4), len);
+	reader->pos += bits;
 
-	err = bitstream_read_ue(&bs, &sps->pic_order_cnt_type, &len);
-	if (err < 0)
-		return err;
+	/* shifting by 64 is undefined, so shift in two steps for 0 bits */
+	return (word >> 1) >> (63 - bits);
+}
 
-	printf("      pic_order_cnt_type: %u (%zu bits)\n", sps->pic_order_cnt_type, len);
+static inline uint32_t h264_reader_ue(struct h264_reader *reader)
+{
+	uint64_t word = h264_reader_peek(reader);
+	unsigned int zeros;
 
-	if (sps->pic_order_cnt_type == 0) {
-		return -ENOTSUP;
+	if (word < (1ull << 32)) {
+		reader->err = -ERANGE;
+		reader->pos += 32;
+		return 0;
 	}
 
-	if (sps->pic_order_cnt_type == 1) {
-		return -ENOTSUP;
+	zeros = __builtin_clzll(word);
+
+	/* short codes are entirely within the word that was just read */
+	if (zeros <= 28) {
+		reader->pos += zeros * 2 + 1;
+		return (word >> (63 - zeros * 2)) - 1;
 	}
 
-	err = bitstream_read_ue(&bs, &sps->max_num_ref_frames, &len);
-	if (err < 0)
-		return err;
+	reader->pos += zeros + 1;
 
-	printf("      max_num_ref_frames: %u (%zu bits)\n", sps->max_num_ref_frames, len);
+	return (1u << zeros) - 1 + h264_reader_u(reader, zeros);
+}
 
-	err = bitstream_read_u8(&bs, &sps->gaps_in_frame_num_value_allowed_flag, 1);
-	if (err < 0)
-		return err;
+static inline int32_t h264_reader_se(struct h264_reader *reader)
+{
+	uint32_t code = h264_reader_ue(reader);
 
-	printf("      gaps_in_frame_num_value_allowed_flag: %u\n", sps->gaps_in_frame_num_value_allowed_flag);
+	/* odd codes map to positive values, even codes to negative ones */
+	if (code % 2 == 0)
+		return -(int32_t)(code / 2);
 
-	err = bitstream_read_ue(&bs, &sps->pic_width_in_mbs_minus1, &len);
-	if (err < 0)
-		return err;
+	return (code + 1) / 2;
+}
 
-	printf("      pic_width_in_mbs_minus1: %u (%zu bits)\n", sps->pic_width_in_mbs_minus1, len);
+static bool h264_reader_more_data(const struct h264_reader *reader)
+{
+	size_t end = reader->size * 8;
+	uint8_t last;
 
-	err = bitstream_read_ue(&bs, &sps->pic_height_in_map_units_minus1, &len);
-	if (err < 0)
-		return err;
+	if (reader->pos >= end)
+		return false;
 
-	printf("      pic_height_in_map_units_minus1: %u (%zu bits)\n", sps->pic_height_in_map_units_minus1, len);
+	/* stop at the rbsp_stop_one_bit */
+	last = reader->data[reader->size - 1];
+	if (last && reader->pos == end - 1 - __builtin_ctz(last))
+		return false;
 
-	err = bitstream_read_u8(&bs, &sps->frame_mbs_only_flag, 1);
-	if (err < 0)
-		return err;
+	return true;
+}
 
-	printf("      frame_mbs_only_flag: %u\n", sps->frame_mbs_only_flag);
+/* scaling_list() from 7.3.2.1.1.1, only the presence of lists is kept */
+static int h264_skip_scaling_list(struct h264_reader *reader,
+				  unsigned int size)
+{
+	unsigned int i, zeros, code, last = 8, next = 8;
+	int32_t delta;
+	uint64_t word;
 
-	if (!sps->frame_mbs_only_flag) {
-		err = bitstream_read_u8(&bs, &sps->mb_adaptive_frame_field_flag, 1);
-		if (err < 0)
-			return err;
+	for (i = 0; i < size && next != 0; i++) {
+		word = h264_reader_peek(reader);
+
+		/*
+		 * delta_scale is within [-128, 127], which takes 8 zeros at
+		 * most. More than that are the padding if the data ends.
+		 */
+		if (word < (1ull << 55)) {
+			if (reader->pos + 9 > reader->size * 8)
+				return -ENOSPC;
+
+			return -EINVAL;
+		}
 
-		printf("        mb_adaptive_frame_field_flag: %u\n", sps->mb_adaptive_frame_field_flag);
+		zeros = __builtin_clzll(word);
+		code = (word >> (63 - zeros * 2)) - 1;
+		reader->pos += zeros * 2 + 1;
+
+		if (code > 256) {
+			if (reader->pos > reader->size * 8)
+				return -ENOSPC;
+
+			return -EINVAL;
+		}
+
+		delta = code % 2 ? (int32_t)(code + 1) / 2 : -(int32_t)(code / 2);
+		next = (last + delta + 256) % 256;
+		if (next != 0)
+			last = next;
 	}
 
-	err = bitstream_read_u8(&bs, &sps->direct_8x8_inference_flag, 1);
-	if (err < 0)
-		return err;
+	return 0;
+}
 
-	printf("      direct_8x8_inference_flag: %u\n", sps->direct_8x8_inference_flag);
+static int h264_parse_scaling_lists(struct h264_reader *reader,
+				    uint8_t *present, unsigned int count)
+{
+	unsigned int i;
+	int err;
 
-	err = bitstream_read_u8(&bs, &sps->frame_cropping_flag, 1);
-	if (err < 0)
-		return err;
+	for (i = 0; i < count; i++) {
+		present[i] = h264_reader_u(reader, 1);
+		if (!present[i])
+			continue;
 
-	if (sps->frame_cropping_flag) {
-		err = bitstream_read_ue(&bs, &sps->frame_crop_left_offset, NULL);
+		err = h264_skip_scaling_list(reader, i < 6 ? 16 : 64);
 		if (err < 0)
 			return err;
+	}
 
-		err = bitstream_read_ue(&bs, &sps->frame_crop_right_offset, NULL);
-		if (err < 0)
-			return err;
+	return 0;
+}
 
-		err = bitstream_read_ue(&bs, &sps->frame_crop_top_offset, NULL);
-		if (err < 0)
-			return err;
+static int h264_sps_scaling_lists(const struct h264_syntax *s, void *base,
+				  struct h264_reader *reader)
+{
+	struct h264_sps *sps = base;
 
-		err = bitstream_read_ue(&bs, &sps->frame_crop_bottom_offset, NULL);
-		if (err < 0)
-			return err;
+	return h264_parse_scaling_lists(reader,
+					sps->seq_scaling_list_present_flag,
+					sps->chroma_format_idc != 3 ? 8 : 12);
+}
+
+static int h264_pps_scaling_lists(const struct h264_syntax *s, void *base,
+				  struct h264_reader *reader)
+{
+	unsigned int i, chroma_format_idc = 1, count;
+	struct h264_pps *pps = base;
 
-		printf("        left: %u right: %u top: %u bottom: %u\n", sps->frame_crop_left_offset, sps->frame_crop_right_offset, sps->frame_crop_top_offset, sps->frame_crop_bottom_offset);
+	for (i = 0; i < reader->num_sps; i++)
+		if (reader->sps[i].seq_parameter_set_id ==
+		    pps->seq_parameter_set_id)
+			chroma_format_idc = reader->sps[i].chroma_format_idc;
+
+	count = 6 + (chroma_format_idc != 3 ? 2 : 6) *
+		    pps->transform_8x8_mode_flag;
+
+	return h264_parse_scaling_lists(reader,
+					pps->pic_scaling_list_present_flag,
+					count);
+}
+
+/* slice_group_id[] is skipped, its length is checked against the data */
+static int h264_pps_slice_group_ids(const struct h264_syntax *s, void *base,
+				    struct h264_reader *reader)
+{
+	struct h264_pps *pps = base;
+	unsigned int bits = 0;
+	uint64_t length;
+
+	/* Ceil(Log2(num_slice_groups_minus1 + 1)) */
+	while ((1u << bits) < pps->num_slice_groups_minus1 + 1)
+		bits++;
+
+	length = ((uint64_t)pps->pic_size_in_map_units_minus1 + 1) * bits;
+	if (reader->pos + length > reader->size * 8)
+		return -ENOSPC;
+
+	reader->pos += length;
+
+	return 0;
+}
+
+static bool h264_profile_is_high(unsigned int profile_idc)
+{
+	static const uint8_t profiles[] = {
+		100, 110, 122, 244, 44, 83, 86, 118, 128, 138, 139, 134, 135,
+	};
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(profiles); i++)
+		if (profiles[i] == profile_idc)
+			return true;
+
+	return false;
+}
+
+static uint32_t h264_syntax_load(const void *field, unsigned int size)
+{
+	switch (size) {
+	case 1:
+		return *(const uint8_t *)field;
+
+	case 2:
+		return *(const uint16_t *)field;
+
+	default:
+		return *(const uint32_t *)field;
 	}
+}
 
-	err = bitstream_read_u8(&bs, &sps->vui_parameters_present_flag, 1);
-	if (err < 0)
-		return err;
+static void h264_syntax_store(void *field, unsigned int size, uint32_t value)
+{
+	switch (size) {
+	case 1:
+		*(uint8_t *)field = value;
+		break;
+
+	case 2:
+		*(uint16_t *)field = value;
+		break;
+
+	default:
+		*(uint32_t *)field = value;
+		break;
+	}
+}
 
-	printf("      vui_parameters_present_flag: %u\n", sps->vui_parameters_present_flag);
+/* index of the last entry in the body of an IF or LOOP entry */
+static unsigned int h264_syntax_end(const struct h264_syntax *syntax,
+				    unsigned int count, unsigned int index)
+{
+	unsigned int end = index;
 
-	if (sps->vui_parameters_present_flag) {
-		err = bitstream_read_u8(&bs, &sps->vui_parameters.aspect_ratio_info_present_flag, 1);
-		if (err < 0)
-			return err;
+	while (end + 1 < count && syntax[end + 1].depth > syntax[index].depth)
+		end++;
 
-		printf("        aspect_ratio_info_present_flag: %u\n", sps->vui_parameters.aspect_ratio_info_present_flag);
+	return end;
+}
 
-		if (sps->vui_parameters.aspect_ratio_info_present_flag) {
-			err = bitstream_read_u8(&bs, &sps->vui_parameters.aspect_ratio_idc, 8);
-			if (err < 0)
-				return err;
+/* most bits that the syntax can consume, taking every branch */
+static size_t h264_syntax_max_bits(const struct h264_syntax *syntax,
+				   unsigned int count)
+{
+	unsigned int i, end;
+	size_t bits = 0;
+
+	for (i = 0; i < count; i++) {
+		switch (syntax[i].type) {
+		case H264_SYNTAX_U:
+			bits += syntax[i].bits;
+			break;
+
+		case H264_SYNTAX_UE:
+		case H264_SYNTAX_SE:
+			/* 31 leading zeros, the one bit and a 31 bit suffix */
+			bits += 63;
+			break;
+
+		case H264_SYNTAX_CALL:
+			bits += syntax[i].value;
+			break;
+
+		case H264_SYNTAX_LOOP:
+			end = h264_syntax_end(syntax, count, i);
+			bits += syntax[i].value *
+				h264_syntax_max_bits(&syntax[i + 1], end - i);
+			i = end;
+			break;
+		}
+	}
+
+	return bits;
+}
 
-			printf("          aspect_ratio_idc: %u\n", sps->vui_parameters.aspect_ratio_idc);
+static bool h264_syntax_test(const struct h264_syntax *s, const void *base,
+			     const struct h264_reader *reader)
+{
+	uint32_t value = 0;
 
-			if (sps->vui_parameters.aspect_ratio_idc == 255) {
-				err = bitstream_read_u16(&bs, &sps->vui_parameters.sar_width, 16);
-				if (err < 0)
-					return err;
+	if (s->size)
+		value = h264_syntax_load(base + s->offset, s->size);
+
+	switch (s->cond) {
+	case H264_COND_EQ:
+		return value == s->value;
+
+	case H264_COND_NE:
+		return value != s->value;
+
+	case H264_COND_LT:
+		return value < s->value;
+
+	case H264_COND_GT:
+		return value > s->value;
+
+	case H264_COND_EITHER:
+		return value || *(const uint8_t *)(base + s->value);
+
+	case H264_COND_HIGH:
+		return h264_profile_is_high(value);
+
+	case H264_COND_MORE_DATA:
+		return h264_reader_more_data(reader);
+	}
+
+	return false;
+}
+
+/* writes the decimal digits of value backwards, ending at end */
+static char *h264_format_u32(char *end, uint32_t value)
+{
+	do {
+		*--end = '0' + value % 10;
+		value /= 10;
+	} while (value);
+
+	return end;
+}
+
+/*
+ * Lines are put together by hand and written out in batches, because stdio
+ * would otherwise take longer than parsing the whole parameter set.
+ */
+struct h264_syntax_dump {
+	FILE *fp;
+	size_t length;
+	char buffer[2048];
+};
+
+static void h264_syntax_flush(struct h264_syntax_dump *dump)
+{
+	fwrite(dump->buffer, 1, dump->length, dump->fp);
+	dump->length = 0;
+}
+
+static void h264_syntax_print(struct h264_syntax_dump *dump,
+			      const struct h264_syntax *s, unsigned int index,
+			      uint32_t value)
+{
+	const char *name = strrchr(s->name, '.');
+	char number[16], *end = number + sizeof(number);
+	size_t length, indent;
+	char *digits, *ptr;
+
+	/* only the member, not the path to it */
+	name = name ? name + 1 : s->name;
+	length = strlen(name);
+
+	/* indentation, name, index, sign, digits and newline */
+	if (dump->length + 128 > sizeof(dump->buffer))
+		h264_syntax_flush(dump);
+
+	ptr = dump->buffer + dump->length;
+
+	indent = 6 + s->depth * 2;
+	memset(ptr, ' ', indent);
+	ptr += indent;
+
+	memcpy(ptr, name, length);
+	ptr += length;
+
+	if (s->flags & H264_SYNTAX_ARRAY) {
+		digits = h264_format_u32(end, index);
+		*ptr++ = '[';
+		memcpy(ptr, digits, end - digits);
+		ptr += end - digits;
+		*ptr++ = ']';
+	}
+
+	*ptr++ = ':';
+	*ptr++ = ' ';
+
+	if (s->type == H264_SYNTAX_SE && (int32_t)value < 0) {
+		*ptr++ = '-';
+		value = -value;
+	}
+
+	digits = h264_format_u32(end, value);
+	memcpy(ptr, digits, end - digits);
+	ptr += end - digits;
+	*ptr++ = '\n';
+
+	dump->length = ptr - dump->buffer;
+}
+
+static int h264_syntax_walk(const struct h264_syntax *syntax,
+			    unsigned int count, void *base, unsigned int index,
+			    struct h264_reader *reader,
+			    struct h264_syntax_dump *dump)
+{
+	unsigned int i, j, end, loops;
+	uint32_t value;
+	int err;
+
+	for (i = 0; i < count; i++) {
+		const struct h264_syntax *s = &syntax[i];
+
+		switch (s->type) {
+		case H264_SYNTAX_U:
+			value = h264_reader_u(reader, s->bits);
+			break;
+
+		case H264_SYNTAX_UE:
+			value = h264_reader_ue(reader);
+			break;
+
+		case H264_SYNTAX_SE:
+			value = h264_reader_se(reader);
+			break;
+
+		case H264_SYNTAX_IF:
+			if (!h264_syntax_test(s, base, reader))
+				i = h264_syntax_end(syntax, count, i);
 
-				err = bitstream_read_u16(&bs, &sps->vui_parameters.sar_height, 16);
+			continue;
+
+		case H264_SYNTAX_LOOP:
+			loops = h264_syntax_load(base + s->offset, s->size) +
+				s->bits;
+			if (loops > s->value)
+				return -EINVAL;
+
+			end = h264_syntax_end(syntax, count, i);
+
+			for (j = 0; j < loops; j++) {
+				err = h264_syntax_walk(&syntax[i + 1], end - i,
+						       base, j, reader, dump);
 				if (err < 0)
 					return err;
 			}
+
+			i = end;
+			continue;
+
+		default:
+			err = s->parse(s, base, reader);
+			if (err < 0)
+				return err;
+
+			continue;
 		}
+
+		if (s->type != H264_SYNTAX_SE && value > s->value)
+			return -EINVAL;
+
+		h264_syntax_store(base + s->offset + index * s->size, s->size,
+				  value);
+
+		if (dump)
+			h264_syntax_print(dump, s, index, value);
 	}
 
 	return 0;
 }
 
-int h264_pps_parse(struct h264_pps *pps, const void *data, size_t size)
+/* parameter sets up to a few KiB are parsed without an allocation */
+#define H264_SYNTAX_BUFFER_SIZE 8192
+
+static int h264_syntax_parse(const struct h264_syntax *syntax,
+			     unsigned int count, size_t *max_bits, void *base,
+			     struct h264_reader *reader, const void *data,
+			     size_t size, FILE *fp)
 {
-	struct bitstream bs;
-	size_t len;
+	uint8_t buffer[H264_SYNTAX_BUFFER_SIZE], *padded = buffer;
+	struct h264_syntax_dump dump;
+	size_t max, needed;
 	int err;
 
+	max = __atomic_load_n(max_bits, __ATOMIC_RELAXED);
+	if (!max) {
+		max = h264_syntax_max_bits(syntax, count);
+		__atomic_store_n(max_bits, max, __ATOMIC_RELAXED);
+	}
+
 	/*
-	printf("  PPS:\n");
-	*/
+	 * Reads start no further than the end of the data plus what the syntax
+	 * can consume, and the last one may load a full word from there. Pad
+	 * the data to that length so that the reads can remain unchecked.
+	 */
+	needed = size + max / 8 + 8;
+
+	if (needed > sizeof(buffer)) {
+		padded = malloc(needed);
+		if (!padded)
+			return -ENOMEM;
 
-	bitstream_init(&bs, data, size);
+		vde_mem_alloc(VDE_MEM_PARSER, needed);
+	}
 
-	err = bitstream_read_ue(&bs, &pps->pic_parameter_set_id, &len);
-	if (err < 0)
-		return err;
+	memcpy(padded, data, size);
+	memset(padded + size, 0, needed - size);
 
-	/*
-	printf("    pic_parameter_set_id: %u (%zu bits)\n", pps->pic_parameter_set_id, len);
-	*/
+	reader->data = padded;
+	reader->size = size;
+	reader->pos = 0;
+	reader->err = 0;
 
-	err = bitstream_read_ue(&bs, &pps->seq_parameter_set_id, &len);
-	if (err < 0)
-		return err;
+	dump.fp = fp;
+	dump.length = 0;
 
-	/*
-	printf("    seq_parameter_set_id: %u (%zu bits)\n", pps->seq_parameter_set_id, len);
-	*/
+	err = h264_syntax_walk(syntax, count, base, 0, reader,
+			       fp ? &dump : NULL);
 
-	err = bitstream_read_u8(&bs, &pps->entropy_coding_mode_flag, 1);
-	if (err < 0)
-		return err;
+	if (fp)
+		h264_syntax_flush(&dump);
 
-	/*
-	printf("    entropy_coding_mode_flag: %u\n", pps->entropy_coding_mode_flag);
-	*/
+	if (padded != buffer) {
+		vde_mem_free(VDE_MEM_PARSER, needed);
+		free(padded);
+	}
+
+	/* running out of data trumps whatever it caused */
+	if (reader->pos > size * 8)
+		return -ENOSPC;
 
-	err = bitstream_read_u8(&bs, &pps->bottom_field_pic_order_in_frame_present_flag, 1);
 	if (err < 0)
 		return err;
 
-	/*
-	printf("    bottom_field_pic_order_in_frame_present_flag: %u\n", pps->bottom_field_pic_order_in_frame_present_flag);
-	*/
+	return reader->err;
+}
+
+int h264_sps_parse_syntax(struct h264_sps *sps, const void *data, size_t size,
+			  FILE *fp)
+{
+	static size_t max_bits;
+	struct h264_reader reader;
+	int err;
 
-	err = bitstream_read_ue(&bs, &pps->num_slice_groups_minus1, &len);
+	memset(&reader, 0, sizeof(reader));
+
+	err = h264_syntax_parse(h264_sps_syntax, ARRAY_SIZE(h264_sps_syntax),
+				&max_bits, sps, &reader, data, size, fp);
 	if (err < 0)
 		return err;
 
-	/*
-	printf("    num_slice_groups_minus1: %u (%zu bits)\n", pps->num_slice_groups_minus1, len);
-	*/
+	/* 4:2:0 unless signalled otherwise */
+	if (!h264_profile_is_high(sps->profile_idc))
+		sps->chroma_format_idc = 1;
 
-	if (pps->num_slice_groups_minus1 > 0) {
-		return -ENOTSUP;
-	}
+	return 0;
+}
 
-	err = bitstream_read_ue(&bs, &pps->num_ref_idx_l0_default_active_minus1, &len);
-	if (err < 0)
-		return err;
+int h264_pps_parse_syntax(struct h264_pps *pps, const void *data, size_t size,
+			  const struct h264_sps *sps, unsigned int num_sps,
+			  FILE *fp)
+{
+	static size_t max_bits;
+	struct h264_reader reader;
 
-	/*
-	printf("    num_ref_idx_l0_default_active_minus1: %u (%zu bits)\n", pps->num_ref_idx_l0_default_active_minus1, len);
-	*/
+	memset(&reader, 0, sizeof(reader));
+	reader.sps = sps;
+	reader.num_sps = num_sps;
 
-	err = bitstream_read_ue(&bs, &pps->num_ref_idx_l1_default_active_minus1, &len);
-	if (err < 0)
-		return err;
+	return h264_syntax_parse(h264_pps_syntax, ARRAY_SIZE(h264_pps_syntax),
+				 &max_bits, pps, &reader, data, size, fp);
+}
 
-	/*
-	printf("    num_ref_idx_l1_default_active_minus1: %u (%zu bits)\n", pps->num_ref_idx_l1_default_active_minus1, len);
-	*/
+int h264_sps_parse(struct h264_sps *sps, const void *data, size_t size,
+		   FILE *fp)
+{
+	int err;
 
-	err = bitstream_read_u8(&bs, &pps->weighted_pred_flag, 1);
+	err = h264_sps_parse_syntax(sps, data, size, fp);
 	if (err < 0)
 		return err;
 
-	/*
-	printf("    weighted_pred_flag: %u\n", pps->weighted_pred_flag);
-	*/
+	/* currently only supports baseline */
+	if (sps->profile_idc != 66 || sps->pic_order_cnt_type != 2)
+		return -ENOTSUP;
 
-	err = bitstream_read_u8(&bs, &pps->weighted_bipred_idc, 2);
-	if (err < 0)
-		return err;
+	return 0;
+}
 
-	/*
-	printf("    weighted_bipred_idc: %u\n", pps->weighted_bipred_idc);
-	*/
+int h264_pps_parse(struct h264_pps *pps, const void *data, size_t size)
+{
+	int err;
 
-	err = bitstream_read_se(&bs, &pps->pic_init_qp_minus26, &len);
+	err = h264_pps_parse_syntax(pps, data, size, NULL, 0, NULL);
 	if (err < 0)
 		return err;
 
-	/*
-	printf("    pic_init_qp_minus26: %d (%zu bits)\n", pps->pic_init_qp_minus26, len);
-	*/
+	/* slice groups and scaling matrices aren't supported */
+	if (pps->num_slice_groups_minus1 > 0 ||
+	    pps->pic_scaling_matrix_present_flag)
+		return -ENOTSUP;
 
-	err = bitstream_read_se(&bs, &pps->pic_init_qs_minus26, &len);
-	if (err < 0)
-		return err;
+	return 0;
+}
 
-	/*
-	printf("    pic_init_qs_minus26: %d (%zu bits)\n", pps->pic_init_qs_minus26, len);
-	*/
+typedef uint8_t h264_u8x16 __attribute__((vector_size(16)));
+typedef uint8_t h264_u8x32 __attribute__((vector_size(32)));
 
-	err = bitstream_read_se(&bs, &pps->chroma_qp_index_offset, &len);
-	if (err < 0)
-		return err;
+typedef const uint8_t *(*h264_scan_fn)(const uint8_t *ptr, const uint8_t *end);
+typedef size_t (*h264_unescape_fn)(uint8_t *dst, const uint8_t *src,
+				   size_t size);
 
-	/*
-	printf("    chroma_qp_index_offset: %d (%zu bits)\n", pps->chroma_qp_index_offset, len);
-	*/
+/* returns the first two consecutive zero bytes in [ptr, end), or end */
+static const uint8_t *h264_zero_scan_scalar(const uint8_t *ptr,
+					    const uint8_t *end)
+{
+	while (end - ptr >= 2) {
+		if (ptr[1] != 0)
+			ptr += 2;
+		else if (ptr[0] != 0)
+			ptr++;
+		else
+			return ptr;
+	}
 
-	err = bitstream_read_u8(&bs, &pps->deblocking_filter_control_present_flag, 1);
-	if (err < 0)
-		return err;
+	return end;
+}
 
-	/*
-	printf("    deblocking_filter_control_present_flag: %u\n", pps->deblocking_filter_control_present_flag);
-	*/
+/*
+ * Defines a zero scan that tests a vector of positions at a time, which is
+ * what start codes and emulation prevention bytes are searched for with.
+ */
+#define H264_DEFINE_ZERO_SCAN(name, type, target)			\
+target static const uint8_t *name(const uint8_t *ptr,			\
+				  const uint8_t *end)			\
+{									\
+	uint64_t mask[sizeof(type) / 8], any;				\
+	const type zero = { 0 };					\
+	unsigned int i;							\
+	type a, b;							\
+									\
+	while ((size_t)(end - ptr) > sizeof(type)) {			\
+		memcpy(&a, ptr, sizeof(a));				\
+		memcpy(&b, ptr + 1, sizeof(b));				\
+		a = (type)((a == zero) & (b == zero));			\
+		memcpy(mask, &a, sizeof(mask));				\
+									\
+		for (i = 0, any = 0; i < ARRAY_SIZE(mask); i++)		\
+			any |= mask[i];					\
+									\
+		if (any)						\
+			for (i = 0; i < ARRAY_SIZE(mask); i++)		\
+				if (mask[i])				\
+					return ptr + i * 8 +		\
+					       __builtin_ctzll(mask[i]) / 8; \
+									\
+		ptr += sizeof(type);					\
+	}								\
+									\
+	return h264_zero_scan_scalar(ptr, end);				\
+}
 
-	err = bitstream_read_u8(&bs, &pps->constrained_intra_pred_flag, 1);
-	if (err < 0)
-		return err;
+CPU_INLINE const uint8_t *h264_find_start_code_with(const uint8_t *ptr,
+						    const uint8_t *end,
+						    h264_scan_fn scan)
+{
+	while ((ptr = scan(ptr, end)) != end) {
+		if (end - ptr >= 3 && ptr[2] == 0x01)
+			return ptr;
 
-	/*
-	printf("    constrained_intra_pred_flag: %u\n", pps->constrained_intra_pred_flag);
-	*/
+		ptr++;
+	}
 
-	err = bitstream_read_u8(&bs, &pps->redundant_pic_cnt_present_flag, 1);
-	if (err < 0)
-		return err;
+	return end;
+}
 
-	/*
-	printf("    redundant_pic_cnt_present_flag: %u\n", pps->redundant_pic_cnt_present_flag);
-	*/
+/* copies everything between emulation prevention bytes in one go */
+CPU_INLINE size_t h264_nal_unescape_with(uint8_t *dst, const uint8_t *src,
+					 size_t size, h264_scan_fn scan)
+{
+	const uint8_t *ptr = src, *copy = src, *end = src + size;
+	size_t length = 0, n;
 
-	if (bitstream_more_rbsp_data(&bs)) {
-		err = bitstream_read_u8(&bs, &pps->transform_8x8_mode_flag, 1);
-		if (err < 0)
-			return err;
+	while ((ptr = scan(ptr, end)) != end) {
+		if (end - ptr < 3 || ptr[2] != 0x03) {
+			ptr++;
+			continue;
+		}
 
-		/*
-		printf("    transform_8x8_mode_flag: %u\n", pps->transform_8x8_mode_flag);
-		*/
+		n = ptr + 2 - copy;
+		memmove(dst + length, copy, n);
+		length += n;
 
-		err = bitstream_read_u8(&bs, &pps->pic_scaling_matrix_present_flag, 1);
-		if (err < 0)
-			return err;
+		copy = ptr = ptr + 3;
+	}
 
-		/*
-		printf("    pic_scaling_matrix_present_flag: %u\n", pps->pic_scaling_matrix_present_flag);
-		*/
+	n = end - copy;
+	memmove(dst + length, copy, n);
 
-		if (pps->pic_scaling_matrix_present_flag)
-			return -ENOTSUP;
+	return length + n;
+}
 
-		err = bitstream_read_se(&bs, &pps->second_chroma_qp_index_offset, &len);
-		if (err < 0)
-			return err;
+#define H264_DEFINE_KERNELS(isa, type, target)				\
+H264_DEFINE_ZERO_SCAN(h264_zero_scan_##isa, type, target)		\
+									\
+target static const uint8_t *						\
+h264_find_start_code_##isa(const uint8_t *ptr, const uint8_t *end)	\
+{									\
+	return h264_find_start_code_with(ptr, end, h264_zero_scan_##isa); \
+}									\
+									\
+target static size_t h264_nal_unescape_##isa(uint8_t *dst,		\
+					     const uint8_t *src,	\
+					     size_t size)		\
+{									\
+	return h264_nal_unescape_with(dst, src, size,			\
+				      h264_zero_scan_##isa);		\
+}
 
-		/*
-		printf("    second_chroma_qp_index_offset: %u (%zu bits)\n", pps->second_chroma_qp_index_offset, len);
-		*/
+#if defined(CPU_HAVE_SSE2)
+H264_DEFINE_KERNELS(sse2, h264_u8x16, CPU_TARGET_SSE2)
+H264_DEFINE_KERNELS(avx2, h264_u8x32, CPU_TARGET_AVX2)
+#endif
+
+#if defined(CPU_HAVE_NEON)
+H264_DEFINE_KERNELS(neon, h264_u8x16, CPU_TARGET_NEON)
+#endif
+
+static size_t h264_nal_unescape_scalar(uint8_t *dst, const uint8_t *src,
+				       size_t size)
+{
+	unsigned int zeros = 0;
+	size_t i, length = 0;
+
+	for (i = 0; i < size; i++) {
+		if (zeros >= 2 && src[i] == 0x03) {
+			zeros = 0;
+			continue;
+		}
+
+		if (src[i] == 0)
+			zeros++;
+		else
+			zeros = 0;
+
+		dst[length++] = src[i];
 	}
 
+	return length;
+}
+
+static const h264_unescape_fn h264_nal_unescape_impls[CPU_ISA_COUNT] = {
+	[CPU_ISA_SCALAR] = h264_nal_unescape_scalar,
+	CPU_IMPL_SSE2(h264_nal_unescape_sse2)
+	CPU_IMPL_AVX2(h264_nal_unescape_avx2)
+	CPU_IMPL_NEON(h264_nal_unescape_neon)
+};
+
+/*
+ * Strips emulation prevention bytes from the payload of a NAL unit. dst may be
+ * the same as src. Returns the size of the RBSP.
+ */
+size_t h264_nal_unescape(uint8_t *dst, const uint8_t *src, size_t size)
+{
+	return h264_nal_unescape_impls[cpu_isa()](dst, src, size);
+}
+
+/*
+ * Returns the next NAL unit of an avcC record. The record comes from files
+ * and clients, so none of its lengths are trusted.
+ */
+static int h264_avcc_next(const uint8_t **ptrp, const uint8_t *end,
+			  const uint8_t **nalp, size_t *lengthp)
+{
+	const uint8_t *ptr = *ptrp;
+	size_t length;
+
+	if (end - ptr < 2)
+		return -ENOSPC;
+
+	length = (ptr[0] << 8) | ptr[1];
+	ptr += 2;
+
+	if (length == 0)
+		return -EINVAL;
+
+	if (length > (size_t)(end - ptr))
+		return -ENOSPC;
+
+	*nalp = ptr;
+	*lengthp = length;
+	*ptrp = ptr + length;
+
 	return 0;
 }
 
 int h264_context_parse(struct h264_context *context, const void *data,
-		       size_t size)
+		       size_t size, FILE *fp)
 {
-	const uint8_t *ptr = data;
+	const uint8_t *ptr = data, *end = ptr + size, *nal;
 	unsigned int i;
+	size_t length;
+	uint8_t *rbsp;
+	int err = 0;
+
+	context->sps = NULL;
+	context->pps = NULL;
+	context->num_sps = 0;
+	context->num_pps = 0;
+
+	/* configuration version, profile, level, NAL size and SPS count */
+	if (size < 6)
+		return -ENOSPC;
+
+	if (ptr[0] != 1)
+		return -EINVAL;
+
+	/* parameter sets are parsed from a copy without emulation prevention */
+	rbsp = malloc(size);
+	if (!rbsp)
+		return -ENOMEM;
+
+	vde_mem_alloc(VDE_MEM_PARSER, size);
+
+	context->extradata = data;
+	context->extradata_size = size;
+
+	context->profile = ptr[1];
+	context->compatibility = ptr[2];
+	context->level = ptr[3];
+
+	context->nal_size = (ptr[4] & 0x3) + 1;
+	context->num_sps = ptr[5] & 0x1f;
+
+	if (fp) {
+		fprintf(fp, "extra data: %zu bytes\n", size);
+		fprintf(fp, "profile: %u compatibility: %u level: %u\n",
+			context->profile, context->compatibility,
+			context->level);
+		fprintf(fp, "NAL size: %u\n", context->nal_size);
+		fprintf(fp, "SPS: %u\n", context->num_sps);
+	}
 
-	printf("extra data: %zu bytes\n", size);
+	context->sps = calloc(context->num_sps, sizeof(*context->sps));
+	if (!context->sps) {
+		err = -ENOMEM;
+		goto free;
+	}
 
-	if (ptr[0] == 1) {
-		context->profile = ptr[1];
-		context->compatibility = ptr[2];
-		context->level = ptr[3];
+	vde_mem_alloc(VDE_MEM_PARSER,
+		      context->num_sps * sizeof(*context->sps));
 
-		context->nal_size = (ptr[4] & 0x3) + 1;
-		context->num_sps = ptr[5] & 0x1f;
+	ptr = data + 6;
 
-		printf("profile: %u compatibility: %u level: %u\n", context->profile, context->compatibility, context->level);
-		printf("NAL size: %u\n", context->nal_size);
-		printf("SPS: %u\n", context->num_sps);
+	for (i = 0; i < context->num_sps; i++) {
+		uint8_t unit_type;
 
-		context->sps = calloc(context->num_sps, sizeof(*context->sps));
-		if (!context->sps)
-			return -ENOMEM;
+		err = h264_avcc_next(&ptr, end, &nal, &length);
+		if (err < 0) {
+			fprintf(stderr, "truncated SPS: %d\n", err);
+			goto free;
+		}
 
-		ptr = data + 6;
+		unit_type = nal[0] & 0x1f;
 
-		for (i = 0; i < context->num_sps; i++) {
-			uint16_t length = (ptr[0] << 8) | (ptr[1] << 0);
-			uint8_t ref_idc, unit_type;
-			int err;
+		/* SPS */
+		if (unit_type == 7) {
+			size_t rbsp_size = h264_nal_unescape(rbsp, &nal[1],
+							     length - 1);
 
-			ptr += 2;
+			err = h264_sps_parse(&context->sps[i], rbsp,
+					     rbsp_size, fp);
+			if (err < 0) {
+				fprintf(stderr, "failed to parse SPS: %d\n", err);
+				goto free;
+			}
+		} else {
+			fprintf(stderr, "non-SPS NAL found\n");
+		}
+	}
 
-			/*
-			printf("  %u: %u bytes\n", i, length);
-			hexdump(ptr, length, "    ", stdout);
-			*/
+	if (ptr >= end) {
+		fprintf(stderr, "PPS count missing\n");
+		err = -ENOSPC;
+		goto free;
+	}
 
-			ref_idc = (ptr[0] >> 5) & 0x3;
-			unit_type = ptr[0] & 0x1f;
+	context->num_pps = ptr[0];
 
-			if (0) {
-				printf("    NAL:\n");
-				printf("      ref_idc: %u\n", ref_idc);
-				printf("      type: %u\n", unit_type);
-			}
+	if (fp)
+		fprintf(fp, "PPS: %u\n", context->num_pps);
 
-			/* SPS */
-			if (unit_type == 7) {
-				err = h264_sps_parse(&context->sps[i], &ptr[1],
-						     length - 1);
-				if (err < 0) {
-					fprintf(stderr, "failed to parse SPS: %d\n", err);
-					return err;
-				}
-			} else {
-				fprintf(stderr, "non-SPS NAL found\n");
-			}
+	context->pps = calloc(context->num_pps, sizeof(*context->pps));
+	if (!context->pps) {
+		err = -ENOMEM;
+		goto free;
+	}
 
-			ptr += length;
+	vde_mem_alloc(VDE_MEM_PARSER,
+		      context->num_pps * sizeof(*context->pps));
+
+	ptr++;
+
+	for (i = 0; i < context->num_pps; i++) {
+		uint8_t unit_type;
+
+		err = h264_avcc_next(&ptr, end, &nal, &length);
+		if (err < 0) {
+			fprintf(stderr, "truncated PPS: %d\n", err);
+			goto free;
 		}
 
-		printf("ptr: %p (%lu)\n", ptr, (unsigned long)ptr - (unsigned long)data);
-		context->num_pps = ptr[0];
+		unit_type = nal[0] & 0x1f;
 
-		printf("PPS: %u\n", context->num_pps);
+		if (unit_type == 8) {
+			size_t rbsp_size = h264_nal_unescape(rbsp, &nal[1],
+							     length - 1);
 
-		context->pps = calloc(context->num_pps, sizeof(*context->pps));
-		if (!context->pps)
-			return -ENOMEM;
+			err = h264_pps_parse(&context->pps[i], rbsp,
+					     rbsp_size);
+			if (err < 0) {
+				fprintf(stderr, "failed to parse PPS: %d\n", err);
+				goto free;
+			}
+		} else {
+			fprintf(stderr, "non-PPS NAL unit found\n");
+		}
+	}
 
-		ptr++;
+free:
+	/* don't leave parameter sets behind that nobody is going to free */
+	if (err < 0)
+		h264_context_free(context);
+
+	vde_mem_free(VDE_MEM_PARSER, size);
+	free(rbsp);
+	return err;
+}
+
+void h264_context_free(struct h264_context *context)
+{
+	if (context->sps)
+		vde_mem_free(VDE_MEM_PARSER,
+			     context->num_sps * sizeof(*context->sps));
+
+	if (context->pps)
+		vde_mem_free(VDE_MEM_PARSER,
+			     context->num_pps * sizeof(*context->pps));
+
+	free(context->sps);
+	free(context->pps);
+
+	context->sps = NULL;
+	context->pps = NULL;
+	context->num_sps = 0;
+	context->num_pps = 0;
+}
+
+/* level limits of table A-1, with level 1b as 9 */
+static const struct h264_level h264_levels[] = {
+	{ 10,    1485,    99,    396,     64,    175 },
+	{  9,    1485,    99,    396,    128,    350 },
+	{ 11,    3000,   396,    900,    192,    500 },
+	{ 12,    6000,   396,   2376,    384,   1000 },
+	{ 13,   11880,   396,   2376,    768,   2000 },
+	{ 20,   11880,   396,   2376,   2000,   2000 },
+	{ 21,   19800,   792,   4752,   4000,   4000 },
+	{ 22,   20250,  1620,   8100,   4000,   4000 },
+	{ 30,   40500,  1620,   8100,  10000,  10000 },
+	{ 31,  108000,  3600,  18000,  14000,  14000 },
+	{ 32,  216000,  5120,  20480,  20000,  20000 },
+	{ 40,  245760,  8192,  32768,  20000,  25000 },
+	{ 41,  245760,  8192,  32768,  50000,  62500 },
+	{ 42,  522240,  8704,  34816,  50000,  62500 },
+	{ 50,  589824, 22080, 110400, 135000, 135000 },
+	{ 51,  983040, 36864, 184320, 240000, 240000 },
+	{ 52, 2073600, 36864, 184320, 240000, 240000 },
+};
+
+const struct h264_level *h264_level_find(unsigned int level_idc)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(h264_levels); i++)
+		if (h264_levels[i].level_idc == level_idc)
+			return &h264_levels[i];
+
+	return NULL;
+}
+
+/* level_idc of an SPS, taking into account that 1b is signalled as 1.1 */
+unsigned int h264_sps_level_idc(const struct h264_sps *sps)
+{
+	/* constraint_set3_flag */
+	bool set3 = (sps->flags & 0x10) != 0;
+
+	if (sps->level_idc == 11 && set3 &&
+	    (sps->profile_idc == 66 || sps->profile_idc == 77 ||
+	     sps->profile_idc == 88))
+		return 9;
+
+	return sps->level_idc;
+}
+
+/*
+ * Number of frames the DPB holds, from the bitstream restrictions if the
+ * VUI has them and from MaxDpbMbs of the level otherwise (A.3.1 h). Fails
+ * with -EINVAL for pictures that no level allows.
+ */
+int h264_sps_max_dpb_frames(const struct h264_sps *sps)
+{
+	const struct h264_vui_parameters *vui = &sps->vui_parameters;
+	const struct h264_level *level;
+	unsigned int frames = 16;
+	uint64_t mbs;
+
+	mbs = (uint64_t)(sps->pic_width_in_mbs_minus1 + 1) *
+	      (sps->pic_height_in_map_units_minus1 + 1) *
+	      (2 - sps->frame_mbs_only_flag);
 
-		for (i = 0; i < context->num_pps; i++) {
-			uint16_t length = (ptr[0] << 8) | (ptr[1] << 0);
-			uint8_t ref_idc, unit_type;
-			int err;
+	if (mbs == 0 || mbs > H264_MAX_FRAME_MBS)
+		return -EINVAL;
 
+	level = h264_level_find(h264_sps_level_idc(sps));
+
+	if (sps->vui_parameters_present_flag &&
+	    vui->bitstream_restriction_flag)
+		frames = MIN(vui->max_dec_frame_buffering, frames);
+	else if (level)
+		frames = MIN(level->max_dpb_mbs / mbs, frames);
+
+	/* valid streams never reference more frames than that */
+	frames = MAX(frames, sps->max_num_ref_frames);
+
+	return MIN(frames, 16u);
+}
+
+static uint64_t h264_hrd_max_cpb_size(const struct h264_hrd_parameters *hrd)
+{
+	uint64_t size, max = 0;
+	unsigned int i;
+
+	for (i = 0; i <= hrd->cpb_cnt_minus1; i++) {
+		size = ((uint64_t)hrd->cpb_size_value_minus1[i] + 1) <<
+		       (4 + hrd->cpb_size_scale);
+		max = MAX(max, size);
+	}
+
+	return max;
+}
+
+/*
+ * Size of the coded picture buffer in bits. The HRD parameters give the
+ * actual size, otherwise it is MaxCPB of the level in NAL units (A.3.1 j),
+ * or 0 for unknown levels.
+ */
+uint64_t h264_sps_max_cpb_size(const struct h264_sps *sps)
+{
+	const struct h264_vui_parameters *vui = &sps->vui_parameters;
+	const struct h264_level *level;
+
+	if (sps->vui_parameters_present_flag) {
+		if (vui->nal_hrd_parameters_present_flag)
+			return h264_hrd_max_cpb_size(&vui->nal_hrd_parameters);
+
+		/* VCL HRD sizes exclude the NAL overhead, cpbBrNalFactor */
+		if (vui->vcl_hrd_parameters_present_flag)
+			return h264_hrd_max_cpb_size(&vui->vcl_hrd_parameters) *
+			       6 / 5;
+	}
+
+	level = h264_level_find(h264_sps_level_idc(sps));
+	if (!level)
+		return 0;
+
+	return (uint64_t)level->max_cpb * 1200;
+}
+
+/* frames per second from the VUI timing information, rounded up, or 0 */
+unsigned int h264_sps_frame_rate(const struct h264_sps *sps)
+{
+	const struct h264_vui_parameters *vui = &sps->vui_parameters;
+	uint64_t ticks;
+
+	if (!sps->vui_parameters_present_flag ||
+	    !vui->timing_info_present_flag || vui->num_units_in_tick == 0)
+		return 0;
+
+	/* a frame lasts two ticks, one for each field */
+	ticks = 2ull * vui->num_units_in_tick;
+
+	return DIV_ROUND_UP(vui->time_scale, ticks);
+}
+
+static const uint8_t *h264_find_start_code_scalar(const uint8_t *ptr,
+						 const uint8_t *end)
+{
+	while (end - ptr >= 3) {
+		if (ptr[2] > 1)
+			ptr += 3;
+		else if (ptr[1] != 0)
 			ptr += 2;
+		else if (ptr[0] != 0 || ptr[2] != 1)
+			ptr++;
+		else
+			return ptr;
+	}
 
-			/*
-			printf("  %u: %u bytes\n", i, length);
-			hexdump(ptr, length, "    ", stdout);
-			*/
+	return end;
+}
 
-			ref_idc = (ptr[0] >> 5) & 0x3;
-			unit_type = ptr[0] & 0x1f;
+static const h264_scan_fn h264_find_start_code_impls[CPU_ISA_COUNT] = {
+	[CPU_ISA_SCALAR] = h264_find_start_code_scalar,
+	CPU_IMPL_SSE2(h264_find_start_code_sse2)
+	CPU_IMPL_AVX2(h264_find_start_code_avx2)
+	CPU_IMPL_NEON(h264_find_start_code_neon)
+};
 
-			if (0) {
-				printf("    NAL:\n");
-				printf("      ref_idc: %u\n", ref_idc);
-				printf("      type: %u\n", unit_type);
-			}
+/* returns a pointer to the next 00 00 01 start code or end if there is none */
+const uint8_t *h264_find_start_code(const uint8_t *ptr, const uint8_t *end)
+{
+	return h264_find_start_code_impls[cpu_isa()](ptr, end);
+}
 
-			if (unit_type == 8) {
-				err = h264_pps_parse(&context->pps[i], &ptr[1],
-						     length - 1);
-				if (err < 0) {
-					fprintf(stderr, "failed to parse PPS: %d\n", err);
-					return err;
-				}
-			} else {
-				fprintf(stderr, "non-PPS NAL unit found\n");
-			}
+int h264_nal_unit_next(struct h264_nal_unit *nal, const uint8_t **ptrp,
+		       const uint8_t *end)
+{
+	const uint8_t *start, *next;
+
+	start = h264_find_start_code(*ptrp, end);
+	if (start == end)
+		return -ENOENT;
+
+	start += 3;
 
+	next = h264_find_start_code(start, end);
+	*ptrp = next;
+
+	/* drop trailing zero bytes, including the first byte of 4-byte start codes */
+	while (next > start && next[-1] == 0)
+		next--;
+
+	if (next == start)
+		return -EINVAL;
+
+	nal->data = start;
+	nal->size = next - start;
+	nal->ref_idc = (start[0] >> 5) & 0x3;
+	nal->type = start[0] & 0x1f;
+
+	return 0;
+}
+
+bool h264_access_unit_is_idr(const void *data, size_t size)
+{
+	const uint8_t *ptr = data, *end = ptr + size;
+	struct h264_nal_unit nal;
+
+	while (h264_nal_unit_next(&nal, &ptr, end) == 0) {
+		if (nal.type == H264_NAL_IDR)
+			return true;
+
+		/* the first VCL NAL unit determines the picture type */
+		if (nal.type == H264_NAL_SLICE)
+			return false;
+	}
+
+	return false;
+}
+
+static const uint8_t h264_start_code[4] = { 0x00, 0x00, 0x00, 0x01 };
+
+/* copies the parameter sets of an avcC record in Annex B format */
+static ssize_t h264_avcc_to_annexb(const struct h264_context *context,
+				   uint8_t *buffer, size_t size)
+{
+	const uint8_t *ptr = context->extradata, *end = ptr + context->extradata_size;
+	unsigned int i, j, count;
+	size_t offset = 0;
+
+	if (context->extradata_size < 6 || ptr[0] != 1)
+		return 0;
+
+	count = ptr[5] & 0x1f;
+	ptr += 6;
+
+	for (j = 0; j < 2; j++) {
+		for (i = 0; i < count; i++) {
+			uint16_t length;
+
+			if (end - ptr < 2)
+				return -EINVAL;
+
+			length = (ptr[0] << 8) | ptr[1];
+			ptr += 2;
+
+			if (end - ptr < length)
+				return -EINVAL;
+
+			if (offset + sizeof(h264_start_code) + length > size)
+				return -ENOSPC;
+
+			memcpy(buffer + offset, h264_start_code, sizeof(h264_start_code));
+			offset += sizeof(h264_start_code);
+			memcpy(buffer + offset, ptr, length);
+			offset += length;
 			ptr += length;
 		}
-	} else {
-		/* XXX */
+
+		/* PPS follow the SPS, prefixed by their count */
+		if (ptr >= end)
+			break;
+
+		count = *ptr++;
 	}
 
-	return 0;
+	return offset;
+}
+
+/*
+ * Converts a sample of length-prefixed NAL units, as stored in MP4 files, to
+ * an Annex B byte stream. Like the h264_mp4toannexb bitstream filter, the
+ * parameter sets from the avcC record are inserted before IDR pictures.
+ * Returns the number of bytes written to buffer.
+ */
+ssize_t h264_sample_to_annexb(const struct h264_context *context, void *buffer,
+			      size_t size, const void *data, size_t length)
+{
+	const uint8_t *ptr = data, *end = ptr + length;
+	unsigned int nal_size = context->nal_size;
+	uint8_t *dst = buffer;
+	size_t offset = 0;
+	bool idr = false;
+	ssize_t err;
+
+	if (nal_size < 1 || nal_size > 4)
+		return -EINVAL;
+
+	/* validate the sample and look for IDR slices first */
+	while (ptr < end) {
+		size_t unit = 0;
+		unsigned int i;
+
+		if ((size_t)(end - ptr) < nal_size)
+			return -EINVAL;
+
+		for (i = 0; i < nal_size; i++)
+			unit = (unit << 8) | *ptr++;
+
+		if (unit == 0 || (size_t)(end - ptr) < unit)
+			return -EINVAL;
+
+		if ((ptr[0] & 0x1f) == H264_NAL_IDR)
+			idr = true;
+
+		ptr += unit;
+	}
+
+	if (idr) {
+		err = h264_avcc_to_annexb(context, dst, size);
+		if (err < 0)
+			return err;
+
+		offset = err;
+	}
+
+	ptr = data;
+
+	while (ptr < end) {
+		size_t unit = 0;
+		unsigned int i;
+
+		for (i = 0; i < nal_size; i++)
+			unit = (unit << 8) | *ptr++;
+
+		if (offset + sizeof(h264_start_code) + unit > size)
+			return -ENOSPC;
+
+		memcpy(dst + offset, h264_start_code, sizeof(h264_start_code));
+		offset += sizeof(h264_start_code);
+		memcpy(dst + offset, ptr, unit);
+		offset += unit;
+		ptr += unit;
+	}
+
+	return offset;
 }
@@ -1,8 +1,67 @@
 #ifndef H264_PARSER_H
 #define H264_PARSER_H
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
+
+#include <sys/types.h>
+
+#define H264_NAL_SLICE 1
+#define H264_NAL_IDR 5
+#define H264_NAL_SEI 6
+#define H264_NAL_SPS 7
+#define H264_NAL_PPS 8
+#define H264_NAL_AUD 9
+
+/* limits of a level from table A-1, level 1b uses a level_idc of 9 */
+struct h264_level {
+	uint8_t level_idc;
+	/* macroblocks per second */
+	uint32_t max_mbps;
+	/* macroblocks */
+	uint32_t max_fs;
+	uint32_t max_dpb_mbs;
+	/* in units of 1000 bits (per second) */
+	uint32_t max_br;
+	uint32_t max_cpb;
+};
+
+/* NAL unit within an Annex B byte stream, data points at the NAL header */
+struct h264_nal_unit {
+	const uint8_t *data;
+	size_t size;
+
+	uint8_t ref_idc;
+	uint8_t type;
+};
+
+/* maximum number of CPB specifications in HRD parameters */
+#define H264_MAX_CPB_CNT 32
+
+/* maximum of num_ref_frames_in_pic_order_cnt_cycle */
+#define H264_MAX_POC_CYCLE 255
+
+/* MaxFS of level 6.2, no picture of any level has more macroblocks */
+#define H264_MAX_FRAME_MBS 139264
+
+/* maximum number of slice groups of a PPS */
+#define H264_MAX_SLICE_GROUPS 8
+
+struct h264_hrd_parameters {
+	uint32_t cpb_cnt_minus1;
+	uint8_t bit_rate_scale;
+	uint8_t cpb_size_scale;
+	/* one per CPB specification */
+	uint32_t bit_rate_value_minus1[H264_MAX_CPB_CNT];
+	uint32_t cpb_size_value_minus1[H264_MAX_CPB_CNT];
+	uint8_t cbr_flag[H264_MAX_CPB_CNT];
+	uint8_t initial_cpb_removal_delay_length_minus1;
+	uint8_t cpb_removal_delay_length_minus1;
+	uint8_t dpb_output_delay_length_minus1;
+	uint8_t time_offset_length;
+};
 
 struct h264_vui_parameters {
 	uint8_t aspect_ratio_info_present_flag;
@@ -25,14 +84,30 @@ struct h264_vui_parameters {
 	uint8_t matrix_coefficients;
 	/* ... */
 	uint8_t chroma_loc_info_present_flag;
+	/* only for chroma_loc_info_present_flag == 1 */
 	uint32_t chroma_sample_loc_type_top_field;
-	uint32_t choram_sample_loc_type_bottom_field;
+	uint32_t chroma_sample_loc_type_bottom_field;
 	uint8_t timing_info_present_flag;
+	/* only for timing_info_present_flag == 1 */
 	uint32_t num_units_in_tick;
 	uint32_t time_scale;
 	uint8_t fixed_frame_rate_flag;
 	uint8_t nal_hrd_parameters_present_flag;
-	/* XXX complete this */
+	struct h264_hrd_parameters nal_hrd_parameters;
+	uint8_t vcl_hrd_parameters_present_flag;
+	struct h264_hrd_parameters vcl_hrd_parameters;
+	/* only if either of the HRD parameters is present */
+	uint8_t low_delay_hrd_flag;
+	uint8_t pic_struct_present_flag;
+	uint8_t bitstream_restriction_flag;
+	/* only for bitstream_restriction_flag == 1 */
+	uint8_t motion_vectors_over_pic_boundaries_flag;
+	uint32_t max_bytes_per_pic_denom;
+	uint32_t max_bits_per_mb_denom;
+	uint32_t log2_max_mv_length_horizontal;
+	uint32_t log2_max_mv_length_vertical;
+	uint32_t max_num_reorder_frames;
+	uint32_t max_dec_frame_buffering;
 };
 
 struct h264_sps {
@@ -56,6 +131,8 @@ struct h264_sps {
 	uint32_t bit_depth_chroma_minus8;
 	uint8_t qpprime_y_zero_transform_bypass_flag;
 	uint8_t seq_scaling_matrix_present_flag;
+	/* only whether each list is present, the lists themselves are skipped */
+	uint8_t seq_scaling_list_present_flag[12];
 	uint32_t log2_max_frame_num_minus4;
 	uint32_t pic_order_cnt_type;
 	/* only for pic_order_cnt_type == 0 */
@@ -65,7 +142,7 @@ struct h264_sps {
 	int32_t offset_for_non_ref_pic;
 	int32_t offset_for_top_to_bottom_field;
 	uint32_t num_ref_frames_in_pic_order_cnt_cycle;
-	int32_t *offset_for_ref_frame;
+	int32_t offset_for_ref_frame[H264_MAX_POC_CYCLE];
 	/* ... */
 	uint32_t max_num_ref_frames;
 	uint8_t gaps_in_frame_num_value_allowed_flag;
@@ -94,13 +171,13 @@ struct h264_pps {
 	uint8_t bottom_field_pic_order_in_frame_present_flag;
 	uint32_t num_slice_groups_minus1;
 	uint32_t slice_group_map_type;
-	uint32_t *run_length_minus1;
-	uint32_t *top_left;
-	uint32_t *bottom_right;
+	uint32_t run_length_minus1[H264_MAX_SLICE_GROUPS];
+	uint32_t top_left[H264_MAX_SLICE_GROUPS];
+	uint32_t bottom_right[H264_MAX_SLICE_GROUPS];
 	uint8_t slice_group_change_direction_flag;
 	uint32_t slice_group_change_rate_minus1;
 	uint32_t pic_size_in_map_units_minus1;
-	uint32_t *slice_group_id;
+	/* slice_group_id[] is skipped */
 	uint32_t num_ref_idx_l0_default_active_minus1;
 	uint32_t num_ref_idx_l1_default_active_minus1;
 	uint8_t weighted_pred_flag;
@@ -113,7 +190,8 @@ struct h264_pps {
 	uint8_t redundant_pic_cnt_present_flag;
 	uint8_t transform_8x8_mode_flag;
 	uint8_t pic_scaling_matrix_present_flag;
-	/* XXX complete this with scaling matrix */
+	/* only whether each list is present, the lists themselves are skipped */
+	uint8_t pic_scaling_list_present_flag[12];
 	int32_t second_chroma_qp_index_offset;
 };
 
@@ -127,11 +205,52 @@ struct h264_context {
 
 	struct h264_sps *sps;
 	struct h264_pps *pps;
+
+	/* avcC record the context was parsed from */
+	const uint8_t *extradata;
+	size_t extradata_size;
 };
 
-int h264_sps_parse(struct h264_sps *sps, const void *data, size_t size);
+size_t h264_nal_unescape(uint8_t *dst, const uint8_t *src, size_t size);
+
+/*
+ * Parse the complete syntax of parameter sets of any profile, printing the
+ * fields to fp if it isn't NULL. A PPS looks up the SPS it refers to among
+ * the given ones for the number of scaling lists, or assumes 4:2:0.
+ */
+int h264_sps_parse_syntax(struct h264_sps *sps, const void *data, size_t size,
+			  FILE *fp);
+int h264_pps_parse_syntax(struct h264_pps *pps, const void *data, size_t size,
+			  const struct h264_sps *sps, unsigned int num_sps,
+			  FILE *fp);
+
+/*
+ * As above, but fail with -ENOTSUP for the syntax that the decoder refuses.
+ * vde_probe_parameter_sets() tells everything that keeps the VDE from
+ * decoding a stream.
+ */
+int h264_sps_parse(struct h264_sps *sps, const void *data, size_t size,
+		   FILE *fp);
 int h264_pps_parse(struct h264_pps *pps, const void *data, size_t size);
+/*
+ * Fills in the context, which only needs to be freed if this succeeds. The
+ * record and its SPSs are described on fp if it isn't NULL.
+ */
 int h264_context_parse(struct h264_context *context, const void *data,
-		       size_t size);
+		       size_t size, FILE *fp);
+void h264_context_free(struct h264_context *context);
+
+const struct h264_level *h264_level_find(unsigned int level_idc);
+unsigned int h264_sps_level_idc(const struct h264_sps *sps);
+int h264_sps_max_dpb_frames(const struct h264_sps *sps);
+uint64_t h264_sps_max_cpb_size(const struct h264_sps *sps);
+unsigned int h264_sps_frame_rate(const struct h264_sps *sps);
+
+const uint8_t *h264_find_start_code(const uint8_t *ptr, const uint8_t *end);
+int h264_nal_unit_next(struct h264_nal_unit *nal, const uint8_t **ptrp,
+		       const uint8_t *end);
+bool h264_access_unit_is_idr(const void *data, size_t size);
+ssize_t h264_sample_to_annexb(const struct h264_context *context, void *buffer,
+			      size_t size, const void *data, size_t length);
 
 #endif
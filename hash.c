@@ -0,0 +1,355 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+#include "hash.h"
+#include "utils.h"
+
+#define XXH_PRIME1 0x9e3779b185ebca87ull
+#define XXH_PRIME2 0xc2b2ae3d27d4eb4full
+#define XXH_PRIME3 0x165667b19e3779f9ull
+#define XXH_PRIME4 0x85ebca77c2b2ae63ull
+#define XXH_PRIME5 0x27d4eb2f165667c5ull
+
+static inline uint64_t xxh64_rotl(uint64_t value, unsigned int bits)
+{
+	return (value << bits) | (value >> (64 - bits));
+}
+
+static inline uint64_t xxh64_read64(const uint8_t *ptr)
+{
+	uint64_t value;
+
+	memcpy(&value, ptr, sizeof(value));
+
+	return value;
+}
+
+static inline uint64_t xxh64_round(uint64_t acc, uint64_t input)
+{
+	acc += input * XXH_PRIME2;
+	acc = xxh64_rotl(acc, 31);
+
+	return acc * XXH_PRIME1;
+}
+
+static inline uint64_t xxh64_merge(uint64_t acc, uint64_t value)
+{
+	acc ^= xxh64_round(0, value);
+
+	return acc * XXH_PRIME1 + XXH_PRIME4;
+}
+
+static inline void xxh64_init(uint64_t v[4], uint64_t seed)
+{
+	v[0] = seed + XXH_PRIME1 + XXH_PRIME2;
+	v[1] = seed + XXH_PRIME2;
+	v[2] = seed;
+	v[3] = seed - XXH_PRIME1;
+}
+
+/* consumes whole 32-byte stripes, returns the number of bytes consumed */
+static inline size_t xxh64_stripes(uint64_t v[4], const uint8_t *ptr,
+				   size_t size)
+{
+	const uint8_t *start = ptr, *end = ptr + size;
+
+	while (end - ptr >= 32) {
+		v[0] = xxh64_round(v[0], xxh64_read64(ptr + 0));
+		v[1] = xxh64_round(v[1], xxh64_read64(ptr + 8));
+		v[2] = xxh64_round(v[2], xxh64_read64(ptr + 16));
+		v[3] = xxh64_round(v[3], xxh64_read64(ptr + 24));
+		ptr += 32;
+	}
+
+	return ptr - start;
+}
+
+/* mixes in the length and the remaining bytes, less than a stripe's worth */
+static uint64_t xxh64_finish(const uint64_t v[4], uint64_t seed,
+			     uint64_t length, const uint8_t *ptr,
+			     const uint8_t *end)
+{
+	uint64_t hash;
+	uint32_t word;
+
+	if (length >= 32) {
+		hash = xxh64_rotl(v[0], 1) + xxh64_rotl(v[1], 7) +
+		       xxh64_rotl(v[2], 12) + xxh64_rotl(v[3], 18);
+		hash = xxh64_merge(hash, v[0]);
+		hash = xxh64_merge(hash, v[1]);
+		hash = xxh64_merge(hash, v[2]);
+		hash = xxh64_merge(hash, v[3]);
+	} else {
+		hash = seed + XXH_PRIME5;
+	}
+
+	hash += length;
+
+	while (end - ptr >= 8) {
+		hash ^= xxh64_round(0, xxh64_read64(ptr));
+		hash = xxh64_rotl(hash, 27) * XXH_PRIME1 + XXH_PRIME4;
+		ptr += 8;
+	}
+
+	if (end - ptr >= 4) {
+		memcpy(&word, ptr, sizeof(word));
+		hash ^= word * XXH_PRIME1;
+		hash = xxh64_rotl(hash, 23) * XXH_PRIME2 + XXH_PRIME3;
+		ptr += 4;
+	}
+
+	while (ptr < end) {
+		hash ^= *ptr++ * XXH_PRIME5;
+		hash = xxh64_rotl(hash, 11) * XXH_PRIME1;
+	}
+
+	hash ^= hash >> 33;
+	hash *= XXH_PRIME2;
+	hash ^= hash >> 29;
+	hash *= XXH_PRIME3;
+	hash ^= hash >> 32;
+
+	return hash;
+}
+
+/* XXH64, little-endian input as on all supported targets */
+uint64_t xxh64(const void *data, size_t size, uint64_t seed)
+{
+	const uint8_t *ptr = data;
+	uint64_t v[4];
+	size_t done;
+
+	xxh64_init(v, seed);
+	done = xxh64_stripes(v, ptr, size);
+
+	return xxh64_finish(v, seed, size, ptr + done, ptr + size);
+}
+
+#define MD5_F(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+#define MD5_G(x, y, z) ((y) ^ ((z) & ((x) ^ (y))))
+#define MD5_H(x, y, z) ((x) ^ (y) ^ (z))
+#define MD5_I(x, y, z) ((y) ^ ((x) | ~(z)))
+
+#define MD5_STEP(f, a, b, c, d, m, k, s)				\
+	do {								\
+		(a) += f((b), (c), (d)) + (m) + (k);			\
+		(a) = ((a) << (s) | (a) >> (32 - (s))) + (b);		\
+	} while (0)
+
+/* RFC 1321, little-endian input as on all supported targets */
+static void md5_blocks(uint32_t state[4], const uint8_t *ptr, size_t count)
+{
+	uint32_t a, b, c, d, m[16];
+
+	while (count--) {
+		memcpy(m, ptr, sizeof(m));
+
+		a = state[0];
+		b = state[1];
+		c = state[2];
+		d = state[3];
+
+		MD5_STEP(MD5_F, a, b, c, d, m[0], 0xd76aa478, 7);
+		MD5_STEP(MD5_F, d, a, b, c, m[1], 0xe8c7b756, 12);
+		MD5_STEP(MD5_F, c, d, a, b, m[2], 0x242070db, 17);
+		MD5_STEP(MD5_F, b, c, d, a, m[3], 0xc1bdceee, 22);
+		MD5_STEP(MD5_F, a, b, c, d, m[4], 0xf57c0faf, 7);
+		MD5_STEP(MD5_F, d, a, b, c, m[5], 0x4787c62a, 12);
+		MD5_STEP(MD5_F, c, d, a, b, m[6], 0xa8304613, 17);
+		MD5_STEP(MD5_F, b, c, d, a, m[7], 0xfd469501, 22);
+		MD5_STEP(MD5_F, a, b, c, d, m[8], 0x698098d8, 7);
+		MD5_STEP(MD5_F, d, a, b, c, m[9], 0x8b44f7af, 12);
+		MD5_STEP(MD5_F, c, d, a, b, m[10], 0xffff5bb1, 17);
+		MD5_STEP(MD5_F, b, c, d, a, m[11], 0x895cd7be, 22);
+		MD5_STEP(MD5_F, a, b, c, d, m[12], 0x6b901122, 7);
+		MD5_STEP(MD5_F, d, a, b, c, m[13], 0xfd987193, 12);
+		MD5_STEP(MD5_F, c, d, a, b, m[14], 0xa679438e, 17);
+		MD5_STEP(MD5_F, b, c, d, a, m[15], 0x49b40821, 22);
+
+		MD5_STEP(MD5_G, a, b, c, d, m[1], 0xf61e2562, 5);
+		MD5_STEP(MD5_G, d, a, b, c, m[6], 0xc040b340, 9);
+		MD5_STEP(MD5_G, c, d, a, b, m[11], 0x265e5a51, 14);
+		MD5_STEP(MD5_G, b, c, d, a, m[0], 0xe9b6c7aa, 20);
+		MD5_STEP(MD5_G, a, b, c, d, m[5], 0xd62f105d, 5);
+		MD5_STEP(MD5_G, d, a, b, c, m[10], 0x02441453, 9);
+		MD5_STEP(MD5_G, c, d, a, b, m[15], 0xd8a1e681, 14);
+		MD5_STEP(MD5_G, b, c, d, a, m[4], 0xe7d3fbc8, 20);
+		MD5_STEP(MD5_G, a, b, c, d, m[9], 0x21e1cde6, 5);
+		MD5_STEP(MD5_G, d, a, b, c, m[14], 0xc33707d6, 9);
+		MD5_STEP(MD5_G, c, d, a, b, m[3], 0xf4d50d87, 14);
+		MD5_STEP(MD5_G, b, c, d, a, m[8], 0x455a14ed, 20);
+		MD5_STEP(MD5_G, a, b, c, d, m[13], 0xa9e3e905, 5);
+		MD5_STEP(MD5_G, d, a, b, c, m[2], 0xfcefa3f8, 9);
+		MD5_STEP(MD5_G, c, d, a, b, m[7], 0x676f02d9, 14);
+		MD5_STEP(MD5_G, b, c, d, a, m[12], 0x8d2a4c8a, 20);
+
+		MD5_STEP(MD5_H, a, b, c, d, m[5], 0xfffa3942, 4);
+		MD5_STEP(MD5_H, d, a, b, c, m[8], 0x8771f681, 11);
+		MD5_STEP(MD5_H, c, d, a, b, m[11], 0x6d9d6122, 16);
+		MD5_STEP(MD5_H, b, c, d, a, m[14], 0xfde5380c, 23);
+		MD5_STEP(MD5_H, a, b, c, d, m[1], 0xa4beea44, 4);
+		MD5_STEP(MD5_H, d, a, b, c, m[4], 0x4bdecfa9, 11);
+		MD5_STEP(MD5_H, c, d, a, b, m[7], 0xf6bb4b60, 16);
+		MD5_STEP(MD5_H, b, c, d, a, m[10], 0xbebfbc70, 23);
+		MD5_STEP(MD5_H, a, b, c, d, m[13], 0x289b7ec6, 4);
+		MD5_STEP(MD5_H, d, a, b, c, m[0], 0xeaa127fa, 11);
+		MD5_STEP(MD5_H, c, d, a, b, m[3], 0xd4ef3085, 16);
+		MD5_STEP(MD5_H, b, c, d, a, m[6], 0x04881d05, 23);
+		MD5_STEP(MD5_H, a, b, c, d, m[9], 0xd9d4d039, 4);
+		MD5_STEP(MD5_H, d, a, b, c, m[12], 0xe6db99e5, 11);
+		MD5_STEP(MD5_H, c, d, a, b, m[15], 0x1fa27cf8, 16);
+		MD5_STEP(MD5_H, b, c, d, a, m[2], 0xc4ac5665, 23);
+
+		MD5_STEP(MD5_I, a, b, c, d, m[0], 0xf4292244, 6);
+		MD5_STEP(MD5_I, d, a, b, c, m[7], 0x432aff97, 10);
+		MD5_STEP(MD5_I, c, d, a, b, m[14], 0xab9423a7, 15);
+		MD5_STEP(MD5_I, b, c, d, a, m[5], 0xfc93a039, 21);
+		MD5_STEP(MD5_I, a, b, c, d, m[12], 0x655b59c3, 6);
+		MD5_STEP(MD5_I, d, a, b, c, m[3], 0x8f0ccc92, 10);
+		MD5_STEP(MD5_I, c, d, a, b, m[10], 0xffeff47d, 15);
+		MD5_STEP(MD5_I, b, c, d, a, m[1], 0x85845dd1, 21);
+		MD5_STEP(MD5_I, a, b, c, d, m[8], 0x6fa87e4f, 6);
+		MD5_STEP(MD5_I, d, a, b, c, m[15], 0xfe2ce6e0, 10);
+		MD5_STEP(MD5_I, c, d, a, b, m[6], 0xa3014314, 15);
+		MD5_STEP(MD5_I, b, c, d, a, m[13], 0x4e0811a1, 21);
+		MD5_STEP(MD5_I, a, b, c, d, m[4], 0xf7537e82, 6);
+		MD5_STEP(MD5_I, d, a, b, c, m[11], 0xbd3af235, 10);
+		MD5_STEP(MD5_I, c, d, a, b, m[2], 0x2ad7d2bb, 15);
+		MD5_STEP(MD5_I, b, c, d, a, m[9], 0xeb86d391, 21);
+
+		state[0] += a;
+		state[1] += b;
+		state[2] += c;
+		state[3] += d;
+		ptr += 64;
+	}
+}
+
+static const char * const vde_hash_names[] = {
+	[VDE_HASH_MD5] = "MD5",
+	[VDE_HASH_XXH64] = "XXH64",
+};
+
+int vde_hash_parse(const char *name, enum vde_hash_type *typep)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(vde_hash_names); i++) {
+		if (strcasecmp(name, vde_hash_names[i]) == 0) {
+			*typep = i;
+			return 0;
+		}
+	}
+
+	return -EINVAL;
+}
+
+const char *vde_hash_name(enum vde_hash_type type)
+{
+	return vde_hash_names[type];
+}
+
+void vde_hash_init(struct vde_hash *hash, enum vde_hash_type type)
+{
+	memset(hash, 0, sizeof(*hash));
+	hash->type = type;
+
+	switch (type) {
+	case VDE_HASH_MD5:
+		hash->state.md5[0] = 0x67452301;
+		hash->state.md5[1] = 0xefcdab89;
+		hash->state.md5[2] = 0x98badcfe;
+		hash->state.md5[3] = 0x10325476;
+		break;
+
+	case VDE_HASH_XXH64:
+		xxh64_init(hash->state.xxh64, 0);
+		break;
+	}
+}
+
+static size_t vde_hash_blocks(struct vde_hash *hash, const uint8_t *ptr,
+			      size_t size)
+{
+	if (hash->type == VDE_HASH_MD5) {
+		md5_blocks(hash->state.md5, ptr, size / 64);
+		return size & ~63;
+	}
+
+	return xxh64_stripes(hash->state.xxh64, ptr, size);
+}
+
+void vde_hash_update(struct vde_hash *hash, const void *data, size_t size)
+{
+	size_t block = hash->type == VDE_HASH_MD5 ? 64 : 32;
+	const uint8_t *ptr = data;
+	size_t count;
+
+	hash->length += size;
+
+	/* top up a partial block first */
+	if (hash->used) {
+		count = MIN(block - hash->used, size);
+		memcpy(hash->buffer + hash->used, ptr, count);
+		hash->used += count;
+		ptr += count;
+		size -= count;
+
+		if (hash->used < block)
+			return;
+
+		vde_hash_blocks(hash, hash->buffer, block);
+		hash->used = 0;
+	}
+
+	/* whole blocks are hashed in place */
+	count = vde_hash_blocks(hash, ptr, size);
+	ptr += count;
+	size -= count;
+
+	memcpy(hash->buffer, ptr, size);
+	hash->used = size;
+}
+
+void vde_hash_final(struct vde_hash *hash, char *text)
+{
+	uint64_t bits = hash->length * 8, value;
+	uint8_t digest[VDE_HASH_MAX_SIZE];
+	size_t size, i;
+
+	switch (hash->type) {
+	case VDE_HASH_MD5:
+		/* a one bit, zeroes up to 56 mod 64, and the length in bits */
+		hash->buffer[hash->used++] = 0x80;
+
+		if (hash->used > 56) {
+			memset(hash->buffer + hash->used, 0, 64 - hash->used);
+			md5_blocks(hash->state.md5, hash->buffer, 1);
+			hash->used = 0;
+		}
+
+		memset(hash->buffer + hash->used, 0, 56 - hash->used);
+		memcpy(hash->buffer + 56, &bits, sizeof(bits));
+		md5_blocks(hash->state.md5, hash->buffer, 1);
+
+		memcpy(digest, hash->state.md5, 16);
+		size = 16;
+		break;
+
+	default:
+		value = xxh64_finish(hash->state.xxh64, 0, hash->length,
+				     hash->buffer, hash->buffer + hash->used);
+
+		/* canonical XXH64 output is big-endian */
+		for (i = 0; i < 8; i++)
+			digest[i] = value >> (56 - 8 * i);
+
+		size = 8;
+		break;
+	}
+
+	for (i = 0; i < size; i++)
+		sprintf(text + 2 * i, "%02x", digest[i]);
+}
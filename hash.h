@@ -0,0 +1,49 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+uint64_t xxh64(const void *data, size_t size, uint64_t seed);
+
+enum vde_hash_type {
+	/* what ffmpeg's framemd5 muxer writes */
+	VDE_HASH_MD5,
+	VDE_HASH_XXH64,
+};
+
+/* longest digest, in bytes */
+#define VDE_HASH_MAX_SIZE 16
+
+/*
+ * Incremental hash for data that is produced piecewise, such as the rows of
+ * a frame while it is being detiled. The digest is the same as that of the
+ * concatenated data.
+ */
+struct vde_hash {
+	enum vde_hash_type type;
+
+	union {
+		uint32_t md5[4];
+		uint64_t xxh64[4];
+	} state;
+
+	/* partial block and the total number of bytes hashed */
+	uint8_t buffer[64];
+	size_t used;
+	uint64_t length;
+};
+
+int vde_hash_parse(const char *name, enum vde_hash_type *typep);
+const char *vde_hash_name(enum vde_hash_type type);
+
+void vde_hash_init(struct vde_hash *hash, enum vde_hash_type type);
+void vde_hash_update(struct vde_hash *hash, const void *data, size_t size);
+
+/*
+ * Writes the digest in lowercase hex, as framemd5 does. The text must have
+ * room for 2 * VDE_HASH_MAX_SIZE + 1 characters.
+ */
+void vde_hash_final(struct vde_hash *hash, char *text);
+
+#endif
@@ -1,16 +1,129 @@
 #include <errno.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
+#include <sys/mman.h>
+
+#include "cpu.h"
 #include "drm-utils.h"
 #include "image.h"
+#include "mem.h"
+#include "utils.h"
+
+/* maximum number of idle images kept around for reuse */
+#define IMAGE_POOL_MAX 64
+
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+static struct {
+	pthread_mutex_t lock;
+	struct image *idle;
+	unsigned int count;
+	bool huge_pages;
+} pool = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+void image_pool_set_huge_pages(bool enable)
+{
+	pthread_mutex_lock(&pool.lock);
+	pool.huge_pages = enable;
+	pthread_mutex_unlock(&pool.lock);
+}
+
+static void image_release(struct image *image)
+{
+	vde_mem_free(VDE_MEM_IMAGE, image->size);
+	free(image->data);
+	free(image);
+}
+
+void image_pool_flush(void)
+{
+	struct image *image;
+
+	pthread_mutex_lock(&pool.lock);
+
+	while ((image = pool.idle) != NULL) {
+		pool.idle = image->next;
+		image_release(image);
+	}
+
+	pool.count = 0;
+
+	pthread_mutex_unlock(&pool.lock);
+}
+
+static struct image *image_pool_get(unsigned int width, unsigned int height,
+				    uint32_t format, bool *huge_pages)
+{
+	struct image *image, **link;
+
+	pthread_mutex_lock(&pool.lock);
+
+	for (link = &pool.idle; *link; link = &(*link)->next) {
+		image = *link;
+
+		if (image->width == width && image->height == height &&
+		    image->format == format) {
+			*link = image->next;
+			pool.count--;
+			goto unlock;
+		}
+	}
+
+	/*
+	 * Nothing matches, so at least one of the idle images is likely left
+	 * over from a different stream geometry. Drop it so that stale images
+	 * don't keep occupying the pool.
+	 */
+	image = pool.idle;
+	if (image) {
+		pool.idle = image->next;
+		pool.count--;
+		image_release(image);
+	}
+
+	image = NULL;
+
+unlock:
+	*huge_pages = pool.huge_pages;
+	pthread_mutex_unlock(&pool.lock);
+
+	return image;
+}
+
+static void *image_alloc_data(size_t *size, bool huge_pages)
+{
+	size_t align = IMAGE_ALIGN;
+	void *data;
+	int err;
+
+	if (huge_pages && *size >= HUGE_PAGE_SIZE) {
+		*size = ALIGN(*size, HUGE_PAGE_SIZE);
+		align = HUGE_PAGE_SIZE;
+	}
+
+	err = posix_memalign(&data, align, *size);
+	if (err)
+		return NULL;
+
+	/* only advisory, fall back to regular pages silently */
+	if (align == HUGE_PAGE_SIZE)
+		madvise(data, *size, MADV_HUGEPAGE);
+
+	return data;
+}
 
 int image_create(struct image **imagep, unsigned int width,
 		 unsigned int height, uint32_t format)
 {
 	const struct drm_format_info *info;
 	struct image *image;
+	bool huge_pages;
 	unsigned int i;
 	size_t size;
 
@@ -18,6 +131,10 @@ int image_create(struct image **imagep, unsigned int width,
 	if (!info)
 		return -EINVAL;
 
+	image = image_pool_get(width, height, format, &huge_pages);
+	if (image)
+		goto out;
+
 	image = calloc(1, sizeof(*image));
 	if (!image)
 		return -ENOMEM;
@@ -26,43 +143,132 @@ int image_create(struct image **imagep, unsigned int width,
 	image->height = height;
 	image->format = format;
 
-	image->pitch = width * info->cpp[0];
-	size = image->pitch * height;
+	for (i = 0, size = 0; i < info->num_planes; i++) {
+		unsigned int w = width, h = height;
 
-	for (i = 1; i < info->num_planes; i++) {
-		unsigned int pitch = width * info->cpp[i] / info->hsub;
+		if (i > 0) {
+			w /= info->hsub;
+			h /= info->vsub;
+		}
 
+		image->pitches[i] = ALIGN(w * info->cpp[i], IMAGE_ALIGN);
 		image->offsets[i] = size;
 
-		size += pitch * height / info->vsub;
+		size += (size_t)image->pitches[i] * h;
 	}
 
-	image->size = size;
+	image->pitch = image->pitches[0];
 
-	image->data = calloc(1, image->size);
+	image->data = image_alloc_data(&size, huge_pages);
 	if (!image->data) {
 		free(image);
 		return -ENOMEM;
 	}
 
+	for (i = 0; i < info->num_planes; i++)
+		image->planes[i] = image->data + image->offsets[i];
+
+	image->size = size;
+	vde_mem_alloc(VDE_MEM_IMAGE, size);
+
+out:
+	image->refs = 1;
+
 	if (imagep)
 		*imagep = image;
+	else
+		image_free(image);
+
+	return 0;
+}
+
+int image_view_create(struct image **viewp, struct image *image,
+		      unsigned int x, unsigned int y, unsigned int width,
+		      unsigned int height)
+{
+	const struct drm_format_info *info;
+	struct image *view;
+	unsigned int i;
+
+	info = drm_format_get_info(image->format);
+	if (!info)
+		return -EINVAL;
+
+	if (width == 0 || height == 0 || x + width > image->width ||
+	    y + height > image->height)
+		return -EINVAL;
+
+	/* the rectangle must not split chroma samples */
+	if (x % info->hsub || y % info->vsub || width % info->hsub ||
+	    height % info->vsub)
+		return -EINVAL;
+
+	view = calloc(1, sizeof(*view));
+	if (!view)
+		return -ENOMEM;
+
+	*view = *image;
+	view->width = width;
+	view->height = height;
+	view->parent = image->parent ? image->parent : image;
+	view->refs = 1;
+	view->next = NULL;
+
+	for (i = 0; i < info->num_planes; i++) {
+		unsigned int px = x, py = y;
+
+		if (i > 0) {
+			px /= info->hsub;
+			py /= info->vsub;
+		}
+
+		view->planes[i] = image->planes[i] + py * image->pitches[i] +
+				  px * info->cpp[i];
+		view->offsets[i] = view->planes[i] - view->data;
+	}
+
+	__atomic_add_fetch(&view->parent->refs, 1, __ATOMIC_RELAXED);
+	*viewp = view;
 
 	return 0;
 }
 
 void image_free(struct image *image)
 {
-	if (image)
-		free(image->data);
+	struct image *parent;
 
-	free(image);
+	if (!image)
+		return;
+
+	if (__atomic_sub_fetch(&image->refs, 1, __ATOMIC_ACQ_REL) > 0)
+		return;
+
+	if (image->parent) {
+		parent = image->parent;
+		free(image);
+		image_free(parent);
+		return;
+	}
+
+	pthread_mutex_lock(&pool.lock);
+
+	if (pool.count < IMAGE_POOL_MAX) {
+		image->next = pool.idle;
+		pool.idle = image;
+		pool.count++;
+		image = NULL;
+	}
+
+	pthread_mutex_unlock(&pool.lock);
+
+	if (image)
+		image_release(image);
 }
 
 void image_dump(struct image *image, FILE *fp)
 {
 	const struct drm_format_info *info;
-	unsigned int i, j, k;
+	unsigned int j, k;
 
 	info = drm_format_get_info(image->format);
 	if (!info) {
@@ -79,27 +285,113 @@ void image_dump(struct image *image, FILE *fp)
 	for (k = 0; k < info->num_planes; k++) {
 		unsigned int width = image->width;
 		unsigned int height = image->height;
-		unsigned int pitch;
+		unsigned int bytes;
 
 		if (k > 0) {
 			width /= info->hsub;
 			height /= info->vsub;
 		}
 
-		pitch = width * info->cpp[k];
+		bytes = width * info->cpp[k];
 
-		fprintf(fp, "    %u: %ux%u (%u bytes)\n", k, width, height,
-			pitch);
+		fprintf(fp, "    %u: %ux%u (%u bytes, pitch %u)\n", k, width,
+			height, bytes, image->pitches[k]);
 
 		for (j = 0; j < height; j++) {
-			unsigned int offset = image->offsets[k] + j * pitch;
+			const uint8_t *row = image->planes[k] +
+					     j * image->pitches[k];
 
-			fprintf(fp, "     ");
+			hexdump(row, bytes, bytes, "      ", fp);
+		}
+	}
+}
+
+typedef uint8_t image_u8x16 __attribute__((vector_size(16)));
+typedef uint8_t image_u8x32 __attribute__((vector_size(32)));
+
+typedef bool (*image_row_equal_fn)(const uint8_t *a, const uint8_t *b,
+				   size_t size);
 
-			for (i = 0; i < pitch; i++)
-				fprintf(fp, " %02x", image->data[offset + i]);
+static bool image_row_equal_scalar(const uint8_t *a, const uint8_t *b,
+				   size_t size)
+{
+	size_t i;
+
+	for (i = 0; i < size; i++)
+		if (a[i] != b[i])
+			return false;
+
+	return true;
+}
 
-			fprintf(fp, "\n");
+/* ORs together the differences of a vector of bytes at a time */
+#define IMAGE_DEFINE_ROW_EQUAL(name, type, target)			\
+target static bool name(const uint8_t *a, const uint8_t *b, size_t size) \
+{									\
+	uint64_t mask[sizeof(type) / 8], any = 0;			\
+	type va, vb, diff = { 0 };					\
+	unsigned int j;							\
+	size_t i;							\
+									\
+	for (i = 0; i + sizeof(type) <= size; i += sizeof(type)) {	\
+		memcpy(&va, a + i, sizeof(va));				\
+		memcpy(&vb, b + i, sizeof(vb));				\
+		diff |= va ^ vb;					\
+	}								\
+									\
+	memcpy(mask, &diff, sizeof(mask));				\
+									\
+	for (j = 0; j < ARRAY_SIZE(mask); j++)				\
+		any |= mask[j];						\
+									\
+	return !any && image_row_equal_scalar(a + i, b + i, size - i);	\
+}
+
+#if defined(CPU_HAVE_SSE2)
+IMAGE_DEFINE_ROW_EQUAL(image_row_equal_sse2, image_u8x16, CPU_TARGET_SSE2)
+IMAGE_DEFINE_ROW_EQUAL(image_row_equal_avx2, image_u8x32, CPU_TARGET_AVX2)
+#endif
+
+#if defined(CPU_HAVE_NEON)
+IMAGE_DEFINE_ROW_EQUAL(image_row_equal_neon, image_u8x16, CPU_TARGET_NEON)
+#endif
+
+static const image_row_equal_fn image_row_equal_impls[CPU_ISA_COUNT] = {
+	[CPU_ISA_SCALAR] = image_row_equal_scalar,
+	CPU_IMPL_SSE2(image_row_equal_sse2)
+	CPU_IMPL_AVX2(image_row_equal_avx2)
+	CPU_IMPL_NEON(image_row_equal_neon)
+};
+
+int image_compare(const struct image *a, const struct image *b)
+{
+	image_row_equal_fn row_equal = image_row_equal_impls[cpu_isa()];
+	const struct drm_format_info *info;
+	unsigned int j, k;
+
+	if (a->width != b->width || a->height != b->height ||
+	    a->format != b->format)
+		return -EINVAL;
+
+	info = drm_format_get_info(a->format);
+	if (!info)
+		return -EINVAL;
+
+	for (k = 0; k < info->num_planes; k++) {
+		unsigned int width = a->width;
+		unsigned int height = a->height;
+
+		if (k > 0) {
+			width /= info->hsub;
+			height /= info->vsub;
 		}
+
+		for (j = 0; j < height; j++)
+			if (!row_equal(a->planes[k] + a->pitches[k] * j,
+				       b->planes[k] + b->pitches[k] * j,
+				       width * info->cpp[k]))
+				return 1;
 	}
+
+	return 0;
 }
@@ -1,6 +1,20 @@
 #ifndef IMAGE_H
 #define IMAGE_H
 
+#include <stdbool.h>
+
+/*
+ * Images are handed out by a process-wide pool. Each plane starts on a
+ * 64-byte boundary and its pitch is padded to a multiple of 64 bytes, so
+ * rows can be written with full-width vector stores. The contents of a
+ * freshly created image are undefined.
+ *
+ * A view is a rectangle of another image that shares its buffer, so it has
+ * the same pitches but its own plane pointers. The image stays alive until
+ * all of its views have been freed.
+ */
+#define IMAGE_ALIGN 64
+
 struct image {
 	unsigned int width;
 	unsigned int height;
@@ -11,11 +25,33 @@ struct image {
 	size_t size;
 
 	unsigned int offsets[3];
+	unsigned int pitches[3];
+	/* first pixel of each plane, inside the parent's buffer for views */
+	uint8_t *planes[3];
+
+	/* views reference the image that owns the buffer */
+	struct image *parent;
+	unsigned int refs;
+
+	/* free list link while the image is idle in the pool */
+	struct image *next;
 };
 
 int image_create(struct image **imagep, unsigned int width,
 		 unsigned int height, uint32_t format);
+int image_view_create(struct image **viewp, struct image *image,
+		      unsigned int x, unsigned int y, unsigned int width,
+		      unsigned int height);
 void image_free(struct image *image);
 void image_dump(struct image *image, FILE *fp);
 
+/*
+ * Compares the pixels of two images of the same size and format, ignoring
+ * the padding of their pitches. Returns 0 if they match and 1 if they don't.
+ */
+int image_compare(const struct image *a, const struct image *b);
+
+void image_pool_set_huge_pages(bool enable);
+void image_pool_flush(void);
+
 #endif
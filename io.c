@@ -0,0 +1,573 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "io.h"
+#include "utils.h"
+
+/* there is no liburing on the boards, the raw interface is simple enough */
+struct vde_io {
+	int fd;
+	unsigned int entries;
+
+	void *sq_ring;
+	size_t sq_ring_size;
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+
+	void *cq_ring;
+	size_t cq_ring_size;
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	/* queued but not yet submitted, and not yet completed */
+	unsigned int queued;
+	unsigned int inflight;
+};
+
+static int vde_io_enter(struct vde_io *io, unsigned int submit,
+			unsigned int complete)
+{
+	unsigned int flags = complete ? IORING_ENTER_GETEVENTS : 0;
+	long ret;
+
+	do {
+		ret = syscall(__NR_io_uring_enter, io->fd, submit, complete,
+			      flags, NULL, 0);
+	} while (ret < 0 && errno == EINTR);
+
+	return ret < 0 ? -errno : ret;
+}
+
+int vde_io_create(struct vde_io **iop, unsigned int entries)
+{
+	struct io_uring_params params;
+	unsigned int *array, i;
+	struct vde_io *io;
+	uint8_t *ptr;
+	int err;
+
+	io = calloc(1, sizeof(*io));
+	if (!io)
+		return -ENOMEM;
+
+	memset(&params, 0, sizeof(params));
+
+	io->fd = syscall(__NR_io_uring_setup, entries, &params);
+	if (io->fd < 0) {
+		err = -errno;
+		goto free;
+	}
+
+	io->entries = params.sq_entries;
+
+	io->sq_ring_size = params.sq_off.array +
+			   params.sq_entries * sizeof(unsigned int);
+	io->sq_ring = mmap(NULL, io->sq_ring_size, PROT_READ | PROT_WRITE,
+			   MAP_SHARED | MAP_POPULATE, io->fd,
+			   IORING_OFF_SQ_RING);
+	if (io->sq_ring == MAP_FAILED) {
+		err = -errno;
+		goto close;
+	}
+
+	io->cq_ring_size = params.cq_off.cqes +
+			   params.cq_entries * sizeof(struct io_uring_cqe);
+	io->cq_ring = mmap(NULL, io->cq_ring_size, PROT_READ | PROT_WRITE,
+			   MAP_SHARED | MAP_POPULATE, io->fd,
+			   IORING_OFF_CQ_RING);
+	if (io->cq_ring == MAP_FAILED) {
+		err = -errno;
+		goto unmap_sq;
+	}
+
+	io->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	io->sqes = mmap(NULL, io->sqes_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, io->fd, IORING_OFF_SQES);
+	if (io->sqes == MAP_FAILED) {
+		err = -errno;
+		goto unmap_cq;
+	}
+
+	ptr = io->sq_ring;
+	io->sq_head = (unsigned int *)(ptr + params.sq_off.head);
+	io->sq_tail = (unsigned int *)(ptr + params.sq_off.tail);
+	io->sq_mask = (unsigned int *)(ptr + params.sq_off.ring_mask);
+	array = (unsigned int *)(ptr + params.sq_off.array);
+
+	/* submission queue entries are used in ring order */
+	for (i = 0; i < params.sq_entries; i++)
+		array[i] = i;
+
+	ptr = io->cq_ring;
+	io->cq_head = (unsigned int *)(ptr + params.cq_off.head);
+	io->cq_tail = (unsigned int *)(ptr + params.cq_off.tail);
+	io->cq_mask = (unsigned int *)(ptr + params.cq_off.ring_mask);
+	io->cqes = (struct io_uring_cqe *)(ptr + params.cq_off.cqes);
+
+	*iop = io;
+
+	return 0;
+
+unmap_cq:
+	munmap(io->cq_ring, io->cq_ring_size);
+unmap_sq:
+	munmap(io->sq_ring, io->sq_ring_size);
+close:
+	close(io->fd);
+free:
+	free(io);
+	return err;
+}
+
+/* buffers of requests still in flight must outlive the ring */
+void vde_io_free(struct vde_io *io)
+{
+	if (io) {
+		munmap(io->sqes, io->sqes_size);
+		munmap(io->cq_ring, io->cq_ring_size);
+		munmap(io->sq_ring, io->sq_ring_size);
+		close(io->fd);
+	}
+
+	free(io);
+}
+
+int vde_io_register_buffers(struct vde_io *io, const struct iovec *iov,
+			    unsigned int count)
+{
+	if (syscall(__NR_io_uring_register, io->fd, IORING_REGISTER_BUFFERS,
+		    iov, count) < 0)
+		return -errno;
+
+	return 0;
+}
+
+int vde_io_unregister_buffers(struct vde_io *io)
+{
+	if (syscall(__NR_io_uring_register, io->fd, IORING_UNREGISTER_BUFFERS,
+		    NULL, 0) < 0)
+		return -errno;
+
+	return 0;
+}
+
+/*
+ * Registers a single buffer and returns the index to use for requests into
+ * it. Registration counts against the locked memory limit, so it may fail,
+ * in which case the buffer is used unregistered and the index is -1.
+ */
+int vde_io_register_buffer(struct vde_io *io, void *buffer, size_t size)
+{
+	struct iovec iov = {
+		.iov_base = buffer,
+		.iov_len = size,
+	};
+
+	return vde_io_register_buffers(io, &iov, 1) < 0 ? -1 : 0;
+}
+
+static int vde_io_queue(struct vde_io *io, uint8_t opcode, int fd,
+			void *buffer, size_t size, uint64_t offset, int index,
+			uint64_t user)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int tail;
+
+	/* completions can't overflow as long as the queue can't either */
+	if (io->inflight == io->entries)
+		return -EBUSY;
+
+	tail = *io->sq_tail;
+	sqe = &io->sqes[tail & *io->sq_mask];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = opcode;
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t)buffer;
+	sqe->len = size;
+	sqe->off = offset;
+	sqe->user_data = user;
+
+	if (index >= 0)
+		sqe->buf_index = index;
+
+	__atomic_store_n(io->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	io->queued++;
+	io->inflight++;
+
+	return 0;
+}
+
+int vde_io_read(struct vde_io *io, int fd, void *buffer, size_t size,
+		uint64_t offset, int index, uint64_t user)
+{
+	uint8_t opcode = index < 0 ? IORING_OP_READ : IORING_OP_READ_FIXED;
+
+	return vde_io_queue(io, opcode, fd, buffer, size, offset, index, user);
+}
+
+int vde_io_write(struct vde_io *io, int fd, const void *buffer, size_t size,
+		 uint64_t offset, int index, uint64_t user)
+{
+	uint8_t opcode = index < 0 ? IORING_OP_WRITE : IORING_OP_WRITE_FIXED;
+
+	return vde_io_queue(io, opcode, fd, (void *)buffer, size, offset,
+			    index, user);
+}
+
+int vde_io_submit(struct vde_io *io)
+{
+	int ret;
+
+	if (io->queued == 0)
+		return 0;
+
+	ret = vde_io_enter(io, io->queued, 0);
+	if (ret < 0)
+		return ret;
+
+	io->queued -= ret;
+
+	return 0;
+}
+
+int vde_io_complete(struct vde_io *io, uint64_t *user, int *result,
+		    bool wait)
+{
+	struct io_uring_cqe *cqe;
+	unsigned int head;
+	int err;
+
+	err = vde_io_submit(io);
+	if (err < 0)
+		return err;
+
+	if (io->inflight == 0)
+		return -ENODATA;
+
+	head = *io->cq_head;
+
+	while (head == __atomic_load_n(io->cq_tail, __ATOMIC_ACQUIRE)) {
+		if (!wait)
+			return -EAGAIN;
+
+		err = vde_io_enter(io, 0, 1);
+		if (err < 0)
+			return err;
+	}
+
+	cqe = &io->cqes[head & *io->cq_mask];
+	*user = cqe->user_data;
+	*result = cqe->res;
+
+	__atomic_store_n(io->cq_head, head + 1, __ATOMIC_RELEASE);
+	io->inflight--;
+
+	return 0;
+}
+
+unsigned int vde_io_pending(struct vde_io *io)
+{
+	return io->inflight;
+}
+
+enum vde_io_block_state {
+	VDE_IO_BLOCK_IDLE,
+	VDE_IO_BLOCK_BUSY,
+	VDE_IO_BLOCK_DONE,
+};
+
+struct vde_io_block {
+	enum vde_io_block_state state;
+	uint64_t number;
+	/* bytes read so far and the bytes that were asked for */
+	size_t length;
+	size_t size;
+	int err;
+};
+
+struct vde_io_reader {
+	struct vde_io *io;
+	int fd;
+	uint64_t size;
+	uint64_t position;
+
+	uint8_t *data;
+	size_t block_size;
+	unsigned int window;
+	/* -1 if the blocks couldn't be registered */
+	int index;
+
+	/* blocks first to next - 1 are in flight or have been read */
+	struct vde_io_block *blocks;
+	uint64_t first;
+	uint64_t next;
+};
+
+static int vde_io_reader_issue(struct vde_io_reader *reader,
+			       struct vde_io_block *block)
+{
+	size_t slot = block->number % reader->window;
+	uint8_t *ptr = reader->data + slot * reader->block_size;
+	uint64_t offset = block->number * reader->block_size;
+
+	block->state = VDE_IO_BLOCK_BUSY;
+
+	return vde_io_read(reader->io, reader->fd, ptr + block->length,
+			   block->size - block->length,
+			   offset + block->length, reader->index, block->number);
+}
+
+static int vde_io_reader_reap(struct vde_io_reader *reader)
+{
+	struct vde_io_block *block;
+	uint64_t number;
+	int err, result;
+
+	err = vde_io_complete(reader->io, &number, &result, true);
+	if (err < 0)
+		return err;
+
+	block = &reader->blocks[number % reader->window];
+
+	if (result < 0) {
+		block->err = result;
+		block->state = VDE_IO_BLOCK_DONE;
+		return 0;
+	}
+
+	block->length += result;
+
+	/* short reads are continued, unless the file got truncated */
+	if (result > 0 && block->length < block->size)
+		return vde_io_reader_issue(reader, block);
+
+	block->state = VDE_IO_BLOCK_DONE;
+
+	return 0;
+}
+
+/* keeps the window full, without reading past the end of the file */
+static int vde_io_reader_fill(struct vde_io_reader *reader)
+{
+	struct vde_io_block *block;
+	uint64_t offset;
+	int err;
+
+	while (reader->next < reader->first + reader->window) {
+		offset = reader->next * reader->block_size;
+		if (offset >= reader->size)
+			break;
+
+		block = &reader->blocks[reader->next % reader->window];
+
+		/* blocks that were skipped over by a seek may still be busy */
+		while (block->state == VDE_IO_BLOCK_BUSY) {
+			err = vde_io_reader_reap(reader);
+			if (err < 0)
+				return err;
+		}
+
+		block->number = reader->next;
+		block->length = 0;
+		block->size = MIN(reader->block_size, reader->size - offset);
+		block->err = 0;
+
+		err = vde_io_reader_issue(reader, block);
+		if (err < 0)
+			return err;
+
+		reader->next++;
+	}
+
+	return vde_io_submit(reader->io);
+}
+
+/* waits for everything in flight and forgets about the window */
+static int vde_io_reader_drain(struct vde_io_reader *reader)
+{
+	int err;
+
+	while (vde_io_pending(reader->io) > 0) {
+		err = vde_io_reader_reap(reader);
+		if (err < 0)
+			return err;
+	}
+
+	reader->first = reader->next = reader->position / reader->block_size;
+
+	return 0;
+}
+
+int vde_io_reader_create(struct vde_io_reader **readerp, int fd,
+			 unsigned int window, size_t block_size)
+{
+	struct vde_io_reader *reader;
+	struct stat st;
+	int err;
+
+	if (window == 0 || block_size == 0)
+		return -EINVAL;
+
+	if (fstat(fd, &st) < 0)
+		return -errno;
+
+	reader = calloc(1, sizeof(*reader));
+	if (!reader)
+		return -ENOMEM;
+
+	reader->fd = fd;
+	reader->size = st.st_size;
+	reader->window = window;
+	reader->block_size = ALIGN(block_size, 4096);
+
+	reader->blocks = calloc(window, sizeof(*reader->blocks));
+	if (!reader->blocks) {
+		err = -ENOMEM;
+		goto free;
+	}
+
+	err = posix_memalign((void **)&reader->data, 4096,
+			     window * reader->block_size);
+	if (err) {
+		err = -err;
+		goto free_blocks;
+	}
+
+	err = vde_io_create(&reader->io, window);
+	if (err < 0)
+		goto free_data;
+
+	reader->index = vde_io_register_buffer(reader->io, reader->data,
+					       window * reader->block_size);
+
+	*readerp = reader;
+
+	return 0;
+
+free_data:
+	free(reader->data);
+free_blocks:
+	free(reader->blocks);
+free:
+	free(reader);
+	return err;
+}
+
+void vde_io_reader_free(struct vde_io_reader *reader)
+{
+	if (reader) {
+		/* the kernel must be done with the blocks before they go away */
+		vde_io_reader_drain(reader);
+		vde_io_free(reader->io);
+		free(reader->data);
+		free(reader->blocks);
+	}
+
+	free(reader);
+}
+
+ssize_t vde_io_reader_read(struct vde_io_reader *reader, void *buffer,
+			   size_t size)
+{
+	struct vde_io_block *block;
+	uint64_t number, start;
+	uint8_t *dst = buffer;
+	size_t count = 0, n;
+	int err;
+
+	while (count < size && reader->position < reader->size) {
+		number = reader->position / reader->block_size;
+
+		if (number < reader->first || number >= reader->next) {
+			err = vde_io_reader_drain(reader);
+			if (err < 0)
+				return err;
+		}
+
+		err = vde_io_reader_fill(reader);
+		if (err < 0)
+			return err;
+
+		block = &reader->blocks[number % reader->window];
+
+		while (block->state != VDE_IO_BLOCK_DONE) {
+			err = vde_io_reader_reap(reader);
+			if (err < 0)
+				return err;
+		}
+
+		if (block->err < 0)
+			return block->err;
+
+		start = reader->position - number * reader->block_size;
+
+		/* the file shrank after it was opened */
+		if (start >= block->length)
+			break;
+
+		n = MIN(size - count, block->length - start);
+		memcpy(dst + count,
+		       reader->data + (number % reader->window) *
+				      reader->block_size + start, n);
+
+		reader->position += n;
+		count += n;
+
+		/* the block has been consumed, so its slot can be reused */
+		if (start + n == block->length) {
+			block->state = VDE_IO_BLOCK_IDLE;
+			reader->first = number + 1;
+		}
+	}
+
+	return count;
+}
+
+int64_t vde_io_reader_seek(struct vde_io_reader *reader, int64_t offset,
+			   int whence)
+{
+	int64_t position;
+
+	switch (whence) {
+	case SEEK_SET:
+		position = offset;
+		break;
+
+	case SEEK_CUR:
+		position = reader->position + offset;
+		break;
+
+	case SEEK_END:
+		position = reader->size + offset;
+		break;
+
+	default:
+		return -EINVAL;
+	}
+
+	if (position < 0)
+		return -EINVAL;
+
+	/* the window is moved on the next read if needed */
+	reader->position = position;
+
+	return position;
+}
+
+int64_t vde_io_reader_size(struct vde_io_reader *reader)
+{
+	return reader->size;
+}
@@ -0,0 +1,67 @@
+#ifndef IO_H
+#define IO_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/*
+ * Minimal io_uring wrapper for reading input ahead of the demuxer and for
+ * writing output without blocking the decode thread. Requests are queued
+ * with vde_io_read() or vde_io_write() and submitted in one go by the next
+ * vde_io_submit() or vde_io_complete(). Rings are not thread-safe, users
+ * that share one must serialize access to it.
+ *
+ * A buffer index of -1 means the buffer isn't registered, otherwise the
+ * buffer must lie within the registered buffer of that index.
+ */
+struct vde_io;
+
+int vde_io_create(struct vde_io **iop, unsigned int entries);
+void vde_io_free(struct vde_io *io);
+
+int vde_io_register_buffers(struct vde_io *io, const struct iovec *iov,
+			    unsigned int count);
+int vde_io_unregister_buffers(struct vde_io *io);
+int vde_io_register_buffer(struct vde_io *io, void *buffer, size_t size);
+
+int vde_io_read(struct vde_io *io, int fd, void *buffer, size_t size,
+		uint64_t offset, int index, uint64_t user);
+int vde_io_write(struct vde_io *io, int fd, const void *buffer, size_t size,
+		 uint64_t offset, int index, uint64_t user);
+int vde_io_submit(struct vde_io *io);
+
+/*
+ * Reaps one completion, waiting for it if wait is set, and returns the
+ * result of the request along with its user data. Returns -EAGAIN if there
+ * is nothing to reap and -ENODATA if no requests are in flight.
+ */
+int vde_io_complete(struct vde_io *io, uint64_t *user, int *result,
+		    bool wait);
+
+/* requests that have been queued but not completed */
+unsigned int vde_io_pending(struct vde_io *io);
+
+/*
+ * Sequential reader that keeps a window of fixed-size blocks in flight ahead
+ * of the read position. Seeking drops the window and starts over at the new
+ * position, so mostly sequential access patterns, like those of demuxers,
+ * work best.
+ */
+struct vde_io_reader;
+
+int vde_io_reader_create(struct vde_io_reader **readerp, int fd,
+			 unsigned int window, size_t block_size);
+void vde_io_reader_free(struct vde_io_reader *reader);
+
+/* returns the number of bytes read, 0 at the end of the file */
+ssize_t vde_io_reader_read(struct vde_io_reader *reader, void *buffer,
+			   size_t size);
+int64_t vde_io_reader_seek(struct vde_io_reader *reader, int64_t offset,
+			   int whence);
+int64_t vde_io_reader_size(struct vde_io_reader *reader);
+
+#endif
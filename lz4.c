@@ -0,0 +1,232 @@
+#include <errno.h>
+#include <string.h>
+
+#include "lz4.h"
+
+#define LZ4_MIN_MATCH 4
+/* the last match must start at least 12 bytes before the end of the block */
+#define LZ4_MF_LIMIT 12
+/* and the last 5 bytes are always literals */
+#define LZ4_LAST_LITERALS 5
+#define LZ4_MAX_DISTANCE 65535
+
+#define LZ4_HASH_BITS 13
+#define LZ4_HASH_SIZE (1 << LZ4_HASH_BITS)
+
+static inline uint32_t lz4_read32(const uint8_t *ptr)
+{
+	uint32_t value;
+
+	memcpy(&value, ptr, sizeof(value));
+
+	return value;
+}
+
+static inline uint32_t lz4_hash(uint32_t value)
+{
+	return (value * 2654435761u) >> (32 - LZ4_HASH_BITS);
+}
+
+/* lengths of 15 and more continue in bytes of up to 255 */
+static inline uint8_t *lz4_write_length(uint8_t *op, size_t length)
+{
+	while (length >= 255) {
+		*op++ = 255;
+		length -= 255;
+	}
+
+	*op++ = length;
+
+	return op;
+}
+
+static uint8_t *lz4_write_sequence(uint8_t *op, uint8_t *end,
+				   const uint8_t *literals, size_t count,
+				   size_t distance, size_t length)
+{
+	uint8_t *token;
+
+	/* token, literal length, literals, offset and match length */
+	if ((size_t)(end - op) < 1 + count / 255 + 1 + count + 2 +
+				 length / 255 + 1)
+		return NULL;
+
+	token = op++;
+
+	if (count >= 15) {
+		*token = 15 << 4;
+		op = lz4_write_length(op, count - 15);
+	} else {
+		*token = count << 4;
+	}
+
+	memcpy(op, literals, count);
+	op += count;
+
+	/* the last sequence has literals only */
+	if (length == 0)
+		return op;
+
+	*op++ = distance & 0xff;
+	*op++ = distance >> 8;
+
+	length -= LZ4_MIN_MATCH;
+
+	if (length >= 15) {
+		*token |= 15;
+		op = lz4_write_length(op, length - 15);
+	} else {
+		*token |= length;
+	}
+
+	return op;
+}
+
+/*
+ * Greedy single-pass matcher with a hash table of the last position of
+ * every 4-byte sequence. The search accelerates over incompressible data.
+ */
+size_t lz4_compress(uint8_t *dst, size_t capacity, const uint8_t *src,
+		    size_t size)
+{
+	const uint8_t *ip = src, *anchor = src, *end = src + size;
+	uint8_t *op = dst, *oend = dst + capacity;
+	uint32_t table[LZ4_HASH_SIZE];
+	const uint8_t *match_limit;
+	const uint8_t *ref;
+	unsigned int misses;
+	uint32_t value, h;
+	size_t length;
+
+	if (size > LZ4_MF_LIMIT) {
+		const uint8_t *mf_limit = end - LZ4_MF_LIMIT;
+
+		match_limit = end - LZ4_LAST_LITERALS;
+		memset(table, 0, sizeof(table));
+		misses = 1 << 6;
+		ip++;
+
+		while (ip < mf_limit) {
+			value = lz4_read32(ip);
+			h = lz4_hash(value);
+			ref = src + table[h];
+			table[h] = ip - src;
+
+			if (ip - ref > LZ4_MAX_DISTANCE ||
+			    lz4_read32(ref) != value) {
+				ip += misses++ >> 6;
+				continue;
+			}
+
+			while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+				ip--;
+				ref--;
+			}
+
+			length = LZ4_MIN_MATCH;
+
+			while (ip + length < match_limit &&
+			       ip[length] == ref[length])
+				length++;
+
+			op = lz4_write_sequence(op, oend, anchor, ip - anchor,
+						ip - ref, length);
+			if (!op)
+				return 0;
+
+			ip += length;
+			anchor = ip;
+			misses = 1 << 6;
+
+			/* makes runs of repeated data match at the next byte */
+			if (ip < mf_limit)
+				table[lz4_hash(lz4_read32(ip - 2))] = ip - 2 - src;
+		}
+	}
+
+	op = lz4_write_sequence(op, oend, anchor, end - anchor, 0, 0);
+	if (!op)
+		return 0;
+
+	return op - dst;
+}
+
+static inline int lz4_read_length(const uint8_t **ipp, const uint8_t *end,
+				  size_t *length)
+{
+	const uint8_t *ip = *ipp;
+	uint8_t byte;
+
+	do {
+		if (ip == end)
+			return -EINVAL;
+
+		byte = *ip++;
+		*length += byte;
+	} while (byte == 255);
+
+	*ipp = ip;
+
+	return 0;
+}
+
+ssize_t lz4_decompress(uint8_t *dst, size_t capacity, const uint8_t *src,
+		       size_t size)
+{
+	const uint8_t *ip = src, *end = src + size;
+	uint8_t *op = dst, *oend = dst + capacity;
+	size_t count, length, distance;
+	const uint8_t *ref;
+	uint8_t token;
+
+	while (ip < end) {
+		token = *ip++;
+
+		count = token >> 4;
+		if (count == 15 && lz4_read_length(&ip, end, &count) < 0)
+			return -EINVAL;
+
+		if (count > (size_t)(end - ip) || count > (size_t)(oend - op))
+			return -EINVAL;
+
+		memcpy(op, ip, count);
+		op += count;
+		ip += count;
+
+		if (ip == end)
+			break;
+
+		if (end - ip < 2)
+			return -EINVAL;
+
+		distance = ip[0] | ip[1] << 8;
+		ip += 2;
+
+		if (distance == 0 || distance > (size_t)(op - dst))
+			return -EINVAL;
+
+		length = token & 15;
+		if (length == 15 && lz4_read_length(&ip, end, &length) < 0)
+			return -EINVAL;
+
+		length += LZ4_MIN_MATCH;
+
+		if (length > (size_t)(oend - op))
+			return -EINVAL;
+
+		/*
+		 * Overlapping matches repeat the last distance bytes. Every
+		 * copy doubles the repeated part, so runs take few copies.
+		 */
+		for (ref = op - distance; length > 0; length -= count) {
+			count = op - ref;
+			if (count > length)
+				count = length;
+
+			memcpy(op, ref, count);
+			op += count;
+		}
+	}
+
+	return op - dst;
+}
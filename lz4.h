@@ -0,0 +1,33 @@
+#ifndef LZ4_H
+#define LZ4_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Compression in the LZ4 block format, compatible with liblz4's
+ * LZ4_decompress_safe() and LZ4_compress_default(). Only whole blocks are
+ * supported, there is no frame format and no dictionary. Decoded pictures
+ * have large flat areas, which is where LZ4 does well at a fraction of the
+ * cost of deflate.
+ */
+
+/* worst case size of a block that doesn't compress */
+#define LZ4_COMPRESS_BOUND(size) ((size) + (size) / 255 + 16)
+
+/*
+ * Returns the size of the compressed block, or 0 if it doesn't fit into
+ * capacity bytes.
+ */
+size_t lz4_compress(uint8_t *dst, size_t capacity, const uint8_t *src,
+		    size_t size);
+
+/*
+ * Returns the size of the decompressed data, or -EINVAL if the block is
+ * malformed or would overflow capacity bytes.
+ */
+ssize_t lz4_decompress(uint8_t *dst, size_t capacity, const uint8_t *src,
+		       size_t size);
+
+#endif
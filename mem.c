@@ -0,0 +1,142 @@
+#include "mem.h"
+#include "stats.h"
+
+static const char * const vde_mem_names[VDE_MEM_MAX + 1] = {
+	[VDE_MEM_BO] = "bo",
+	[VDE_MEM_DMABUF] = "dmabuf",
+	[VDE_MEM_IMAGE] = "image",
+	[VDE_MEM_PARSER] = "parser",
+	[VDE_MEM_MAX] = "total",
+};
+
+/* the last entry accumulates all categories */
+static struct vde_mem_usage vde_mem_usage[VDE_MEM_MAX + 1];
+static uint64_t vde_mem_start;
+
+static void vde_mem_raise(uint64_t *peak, uint64_t value)
+{
+	uint64_t max = __atomic_load_n(peak, __ATOMIC_RELAXED);
+
+	while (value > max &&
+	       !__atomic_compare_exchange_n(peak, &max, value, true,
+					    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+static void vde_mem_account(struct vde_mem_usage *usage, size_t size)
+{
+	uint64_t count, bytes;
+
+	count = __atomic_add_fetch(&usage->count, 1, __ATOMIC_RELAXED);
+	bytes = __atomic_add_fetch(&usage->bytes, size, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&usage->allocs, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&usage->alloc_bytes, size, __ATOMIC_RELAXED);
+
+	vde_mem_raise(&usage->peak_count, count);
+	vde_mem_raise(&usage->peak_bytes, bytes);
+}
+
+void vde_mem_alloc(enum vde_mem_category category, size_t size)
+{
+	uint64_t start = 0;
+
+	/* rates are relative to the first allocation */
+	if (__builtin_expect(__atomic_load_n(&vde_mem_start,
+					     __ATOMIC_RELAXED) == 0, 0))
+		__atomic_compare_exchange_n(&vde_mem_start, &start,
+					    vde_stats_now(), false,
+					    __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+
+	vde_mem_account(&vde_mem_usage[category], size);
+	vde_mem_account(&vde_mem_usage[VDE_MEM_MAX], size);
+}
+
+void vde_mem_free(enum vde_mem_category category, size_t size)
+{
+	__atomic_fetch_sub(&vde_mem_usage[category].count, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_sub(&vde_mem_usage[category].bytes, size,
+			   __ATOMIC_RELAXED);
+	__atomic_fetch_sub(&vde_mem_usage[VDE_MEM_MAX].count, 1,
+			   __ATOMIC_RELAXED);
+	__atomic_fetch_sub(&vde_mem_usage[VDE_MEM_MAX].bytes, size,
+			   __ATOMIC_RELAXED);
+}
+
+void vde_mem_get(enum vde_mem_category category, struct vde_mem_usage *usage)
+{
+	const struct vde_mem_usage *src = &vde_mem_usage[category];
+
+	usage->count = __atomic_load_n(&src->count, __ATOMIC_RELAXED);
+	usage->bytes = __atomic_load_n(&src->bytes, __ATOMIC_RELAXED);
+	usage->peak_count = __atomic_load_n(&src->peak_count, __ATOMIC_RELAXED);
+	usage->peak_bytes = __atomic_load_n(&src->peak_bytes, __ATOMIC_RELAXED);
+	usage->allocs = __atomic_load_n(&src->allocs, __ATOMIC_RELAXED);
+	usage->alloc_bytes = __atomic_load_n(&src->alloc_bytes,
+					     __ATOMIC_RELAXED);
+}
+
+void vde_mem_reset_peaks(void)
+{
+	unsigned int i;
+
+	for (i = 0; i <= VDE_MEM_MAX; i++) {
+		struct vde_mem_usage *usage = &vde_mem_usage[i];
+
+		__atomic_store_n(&usage->peak_count,
+				 __atomic_load_n(&usage->count,
+						 __ATOMIC_RELAXED),
+				 __ATOMIC_RELAXED);
+		__atomic_store_n(&usage->peak_bytes,
+				 __atomic_load_n(&usage->bytes,
+						 __ATOMIC_RELAXED),
+				 __ATOMIC_RELAXED);
+	}
+}
+
+void vde_mem_report(FILE *fp)
+{
+	uint64_t start = __atomic_load_n(&vde_mem_start, __ATOMIC_RELAXED);
+	double seconds = start ? (vde_stats_now() - start) / 1e9 : 0.0;
+	struct vde_mem_usage usage;
+	unsigned int i;
+
+	fprintf(fp, "memory:\n");
+	fprintf(fp, "  %-8s %8s %10s %8s %10s %10s %10s\n", "category",
+		"live", "KiB", "peak", "peak KiB", "allocs", "allocs/s");
+
+	for (i = 0; i <= VDE_MEM_MAX; i++) {
+		vde_mem_get(i, &usage);
+
+		if (usage.allocs == 0 && i < VDE_MEM_MAX)
+			continue;
+
+		fprintf(fp, "  %-8s %8llu %10.1f %8llu %10.1f %10llu %10.1f\n",
+			vde_mem_names[i], (unsigned long long)usage.count,
+			usage.bytes / 1024.0,
+			(unsigned long long)usage.peak_count,
+			usage.peak_bytes / 1024.0,
+			(unsigned long long)usage.allocs,
+			seconds > 0 ? usage.allocs / seconds : 0.0);
+	}
+}
+
+uint64_t vde_mem_check_leaks(FILE *fp)
+{
+	struct vde_mem_usage usage;
+	uint64_t leaks = 0;
+	unsigned int i;
+
+	for (i = 0; i < VDE_MEM_MAX; i++) {
+		vde_mem_get(i, &usage);
+
+		if (usage.count == 0)
+			continue;
+
+		fprintf(fp, "leaked %llu %s allocations (%llu bytes)\n",
+			(unsigned long long)usage.count, vde_mem_names[i],
+			(unsigned long long)usage.bytes);
+		leaks += usage.count;
+	}
+
+	return leaks;
+}
@@ -0,0 +1,51 @@
+#ifndef MEM_H
+#define MEM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* kinds of allocations that are accounted */
+enum vde_mem_category {
+	/* DRM buffer objects */
+	VDE_MEM_BO,
+	/* exported or imported dmabufs, memfds for the software stand-in */
+	VDE_MEM_DMABUF,
+	/* pixel buffers of images, including those idle in the pool */
+	VDE_MEM_IMAGE,
+	/* parameter sets and scratch buffers of the H.264 parser */
+	VDE_MEM_PARSER,
+	VDE_MEM_MAX,
+};
+
+struct vde_mem_usage {
+	/* live allocations */
+	uint64_t count;
+	uint64_t bytes;
+	/* high-water marks of the above */
+	uint64_t peak_count;
+	uint64_t peak_bytes;
+	/* allocations made since startup */
+	uint64_t allocs;
+	uint64_t alloc_bytes;
+};
+
+/*
+ * Accounting is always on, so whatever is still live after teardown has
+ * leaked. It costs a few atomic operations per allocation, none of which
+ * happen per macroblock or per row. Callers pass the same size to free as
+ * they did to alloc.
+ */
+void vde_mem_alloc(enum vde_mem_category category, size_t size);
+void vde_mem_free(enum vde_mem_category category, size_t size);
+
+/* VDE_MEM_MAX returns the totals over all categories */
+void vde_mem_get(enum vde_mem_category category, struct vde_mem_usage *usage);
+/* restarts the high-water marks from the current usage */
+void vde_mem_reset_peaks(void);
+void vde_mem_report(FILE *fp);
+
+/* reports allocations that are still live, returns how many there are */
+uint64_t vde_mem_check_leaks(FILE *fp);
+
+#endif
@@ -0,0 +1,672 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "io.h"
+#include "mp4.h"
+#include "utils.h"
+
+/*
+ * Minimal MP4/MOV demuxer. The file is mapped into memory and only the boxes
+ * needed to locate the samples of the first H.264 video track are parsed.
+ * Samples are returned as views into the mapping, so no data is copied,
+ * unless they are read ahead.
+ */
+
+/* readahead buffers beyond this are refused, samples are mapped instead */
+#define MP4_READAHEAD_MAX_SIZE (256u << 20)
+
+#define MP4_TYPE(a, b, c, d) \
+	(((uint32_t)(a) << 24) | ((uint32_t)(b) << 16) | ((uint32_t)(c) << 8) | (d))
+
+struct mp4_box {
+	uint32_t type;
+	const uint8_t *data;
+	size_t size;
+};
+
+static inline uint16_t mp4_read_u16(const uint8_t *ptr)
+{
+	return (ptr[0] << 8) | ptr[1];
+}
+
+static inline uint32_t mp4_read_u32(const uint8_t *ptr)
+{
+	return ((uint32_t)ptr[0] << 24) | ((uint32_t)ptr[1] << 16) |
+	       ((uint32_t)ptr[2] <<  8) | ((uint32_t)ptr[3] <<  0);
+}
+
+static inline uint64_t mp4_read_u64(const uint8_t *ptr)
+{
+	return ((uint64_t)mp4_read_u32(ptr) << 32) | mp4_read_u32(ptr + 4);
+}
+
+static int mp4_box_next(struct mp4_box *box, const uint8_t **ptrp,
+			const uint8_t *end)
+{
+	const uint8_t *ptr = *ptrp;
+	size_t available = end - ptr;
+	uint64_t size;
+	size_t header = 8;
+
+	if (available < 8)
+		return -ENOENT;
+
+	size = mp4_read_u32(ptr);
+	box->type = mp4_read_u32(ptr + 4);
+
+	if (size == 1) {
+		if (available < 16)
+			return -EINVAL;
+
+		size = mp4_read_u64(ptr + 8);
+		header = 16;
+	} else if (size == 0) {
+		size = available;
+	}
+
+	if (size < header || size > available)
+		return -EINVAL;
+
+	box->data = ptr + header;
+	box->size = size - header;
+	*ptrp = ptr + size;
+
+	return 0;
+}
+
+static int mp4_box_find(struct mp4_box *box, const uint8_t *ptr, size_t size,
+			uint32_t type)
+{
+	const uint8_t *end = ptr + size;
+	int err;
+
+	while ((err = mp4_box_next(box, &ptr, end)) == 0)
+		if (box->type == type)
+			return 0;
+
+	return err;
+}
+
+/* parses the header of a full box with a table of fixed-size entries */
+static int mp4_table_parse(struct mp4_table *table, const struct mp4_box *box,
+			   size_t offset, size_t entry_size)
+{
+	if (box->size < offset + 4)
+		return -EINVAL;
+
+	table->count = mp4_read_u32(box->data + offset);
+	table->data = box->data + offset + 4;
+
+	if ((box->size - offset - 4) / entry_size < table->count)
+		return -EINVAL;
+
+	return 0;
+}
+
+static int mp4_parse_stsd(struct mp4_file *file, const struct mp4_box *stsd)
+{
+	struct mp4_box entry, avcc;
+	const uint8_t *ptr;
+	int err;
+
+	if (stsd->size < 8)
+		return -EINVAL;
+
+	ptr = stsd->data + 8;
+
+	err = mp4_box_next(&entry, &ptr, stsd->data + stsd->size);
+	if (err < 0)
+		return err;
+
+	if (entry.type != MP4_TYPE('a', 'v', 'c', '1') &&
+	    entry.type != MP4_TYPE('a', 'v', 'c', '3'))
+		return -ENOTSUP;
+
+	/* VisualSampleEntry fields precede the child boxes */
+	if (entry.size < 78)
+		return -EINVAL;
+
+	file->width = mp4_read_u16(entry.data + 24);
+	file->height = mp4_read_u16(entry.data + 26);
+
+	err = mp4_box_find(&avcc, entry.data + 78, entry.size - 78,
+			   MP4_TYPE('a', 'v', 'c', 'C'));
+	if (err < 0)
+		return err;
+
+	file->avcc = avcc.data;
+	file->avcc_size = avcc.size;
+
+	return 0;
+}
+
+static int mp4_parse_stbl(struct mp4_file *file, const struct mp4_box *stbl)
+{
+	const uint8_t *ptr = stbl->data, *end = ptr + stbl->size;
+	bool stsd = false, stsz = false, stco = false, stsc = false;
+	struct mp4_box box;
+	int err;
+
+	while (mp4_box_next(&box, &ptr, end) == 0) {
+		switch (box.type) {
+		case MP4_TYPE('s', 't', 's', 'd'):
+			err = mp4_parse_stsd(file, &box);
+			if (err < 0)
+				return err;
+
+			stsd = true;
+			break;
+
+		case MP4_TYPE('s', 't', 's', 'z'):
+			if (box.size < 12)
+				return -EINVAL;
+
+			file->sample_size = mp4_read_u32(box.data + 4);
+			file->num_samples = mp4_read_u32(box.data + 8);
+
+			/* the table is omitted if all samples have the same size */
+			if (file->sample_size == 0) {
+				err = mp4_table_parse(&file->stsz, &box, 8, 4);
+				if (err < 0)
+					return err;
+			}
+
+			stsz = true;
+			break;
+
+		case MP4_TYPE('s', 't', 'c', 'o'):
+			err = mp4_table_parse(&file->stco, &box, 4, 4);
+			if (err < 0)
+				return err;
+
+			file->co64 = false;
+			stco = true;
+			break;
+
+		case MP4_TYPE('c', 'o', '6', '4'):
+			err = mp4_table_parse(&file->stco, &box, 4, 8);
+			if (err < 0)
+				return err;
+
+			file->co64 = true;
+			stco = true;
+			break;
+
+		case MP4_TYPE('s', 't', 's', 'c'):
+			err = mp4_table_parse(&file->stsc, &box, 4, 12);
+			if (err < 0)
+				return err;
+
+			stsc = true;
+			break;
+
+		case MP4_TYPE('s', 't', 's', 's'):
+			err = mp4_table_parse(&file->stss, &box, 4, 4);
+			if (err < 0)
+				return err;
+
+			break;
+		}
+	}
+
+	if (!stsd || !stsz || !stco || !stsc)
+		return -EINVAL;
+
+	if (file->stsc.count == 0 || mp4_read_u32(file->stsc.data) != 1)
+		return -EINVAL;
+
+	return 0;
+}
+
+static int mp4_parse_trak(struct mp4_file *file, const struct mp4_box *trak)
+{
+	struct mp4_box mdia, hdlr, mdhd, minf, stbl;
+	int err;
+
+	err = mp4_box_find(&mdia, trak->data, trak->size,
+			   MP4_TYPE('m', 'd', 'i', 'a'));
+	if (err < 0)
+		return err;
+
+	err = mp4_box_find(&hdlr, mdia.data, mdia.size,
+			   MP4_TYPE('h', 'd', 'l', 'r'));
+	if (err < 0)
+		return err;
+
+	if (hdlr.size < 12 ||
+	    mp4_read_u32(hdlr.data + 8) != MP4_TYPE('v', 'i', 'd', 'e'))
+		return -ENOENT;
+
+	err = mp4_box_find(&mdhd, mdia.data, mdia.size,
+			   MP4_TYPE('m', 'd', 'h', 'd'));
+	if (err < 0)
+		return err;
+
+	if (mdhd.size >= 24 && mdhd.data[0] == 1)
+		file->timescale = mp4_read_u32(mdhd.data + 20);
+	else if (mdhd.size >= 16)
+		file->timescale = mp4_read_u32(mdhd.data + 12);
+
+	err = mp4_box_find(&minf, mdia.data, mdia.size,
+			   MP4_TYPE('m', 'i', 'n', 'f'));
+	if (err < 0)
+		return err;
+
+	err = mp4_box_find(&stbl, minf.data, minf.size,
+			   MP4_TYPE('s', 't', 'b', 'l'));
+	if (err < 0)
+		return err;
+
+	return mp4_parse_stbl(file, &stbl);
+}
+
+static int mp4_parse(struct mp4_file *file)
+{
+	struct mp4_box ftyp, moov, trak;
+	const uint8_t *ptr, *end;
+	int err;
+
+	ptr = file->data;
+
+	/* require ftyp (MP4) or moov/mdat/wide (QuickTime) up front */
+	err = mp4_box_next(&ftyp, &ptr, file->data + file->size);
+	if (err < 0)
+		return -EINVAL;
+
+	switch (ftyp.type) {
+	case MP4_TYPE('f', 't', 'y', 'p'):
+	case MP4_TYPE('m', 'o', 'o', 'v'):
+	case MP4_TYPE('m', 'd', 'a', 't'):
+	case MP4_TYPE('w', 'i', 'd', 'e'):
+	case MP4_TYPE('f', 'r', 'e', 'e'):
+		break;
+
+	default:
+		return -EINVAL;
+	}
+
+	err = mp4_box_find(&moov, file->data, file->size,
+			   MP4_TYPE('m', 'o', 'o', 'v'));
+	if (err < 0)
+		return -EINVAL;
+
+	ptr = moov.data;
+	end = moov.data + moov.size;
+
+	while (mp4_box_next(&trak, &ptr, end) == 0) {
+		if (trak.type != MP4_TYPE('t', 'r', 'a', 'k'))
+			continue;
+
+		err = mp4_parse_trak(file, &trak);
+		if (err == 0)
+			return 0;
+
+		/* skip non-video and non-H.264 tracks */
+		if (err != -ENOENT && err != -ENOTSUP)
+			return err;
+	}
+
+	return -ENOTSUP;
+}
+
+int mp4_open(struct mp4_file **filep, const char *filename)
+{
+	struct mp4_file *file;
+	struct stat st;
+	void *ptr;
+	int err;
+
+	file = calloc(1, sizeof(*file));
+	if (!file)
+		return -ENOMEM;
+
+	file->fd = open(filename, O_RDONLY);
+	if (file->fd < 0) {
+		err = -errno;
+		goto free;
+	}
+
+	if (fstat(file->fd, &st) < 0) {
+		err = -errno;
+		goto close;
+	}
+
+	if (!S_ISREG(st.st_mode) || st.st_size == 0) {
+		err = -EINVAL;
+		goto close;
+	}
+
+	ptr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, file->fd, 0);
+	if (ptr == MAP_FAILED) {
+		err = -errno;
+		goto close;
+	}
+
+	file->data = ptr;
+	file->size = st.st_size;
+
+	err = mp4_parse(file);
+	if (err < 0)
+		goto unmap;
+
+	/* samples are read in order, mostly sequentially */
+	madvise(ptr, file->size, MADV_SEQUENTIAL);
+
+	*filep = file;
+
+	return 0;
+
+unmap:
+	munmap(ptr, st.st_size);
+close:
+	close(file->fd);
+free:
+	free(file);
+	return err;
+}
+
+struct mp4_slot {
+	uint32_t sample;
+	bool done;
+	/* bytes read so far and the size of the sample */
+	size_t length;
+	size_t size;
+	uint64_t offset;
+	int err;
+};
+
+static int mp4_slot_issue(struct mp4_file *file, unsigned int index)
+{
+	struct mp4_slot *slot = &file->slots[index];
+	uint8_t *ptr = file->buffers + index * file->buffer_size;
+
+	slot->done = false;
+
+	return vde_io_read(file->io, file->fd, ptr + slot->length,
+			   slot->size - slot->length,
+			   slot->offset + slot->length, file->index, index);
+}
+
+static int mp4_readahead_reap(struct mp4_file *file)
+{
+	struct mp4_slot *slot;
+	int err, result;
+	uint64_t index;
+
+	err = vde_io_complete(file->io, &index, &result, true);
+	if (err < 0)
+		return err;
+
+	slot = &file->slots[index];
+
+	if (result < 0) {
+		slot->err = result;
+		slot->done = true;
+		return 0;
+	}
+
+	if (result == 0 && slot->length < slot->size) {
+		slot->err = -EIO;
+		slot->done = true;
+		return 0;
+	}
+
+	slot->length += result;
+
+	if (slot->length < slot->size)
+		return mp4_slot_issue(file, index);
+
+	slot->done = true;
+
+	return 0;
+}
+
+/*
+ * Advances the cursor by one sample and returns where the sample is. Every
+ * sample is checked against the size of the file.
+ */
+static int mp4_locate(struct mp4_file *file, struct mp4_cursor *cursor,
+		      uint64_t *offsetp, uint32_t *sizep)
+{
+	const uint8_t *stsc = file->stsc.data;
+	uint32_t size;
+
+	/* move on to the next chunk once all of its samples are consumed */
+	while (cursor->chunk_samples == 0) {
+		if (cursor->chunk >= file->stco.count)
+			return -EINVAL;
+
+		while (cursor->stsc_index + 1 < file->stsc.count &&
+		       cursor->chunk + 1 >= mp4_read_u32(stsc + (cursor->stsc_index + 1) * 12))
+			cursor->stsc_index++;
+
+		cursor->chunk_samples = mp4_read_u32(stsc + cursor->stsc_index * 12 + 4);
+
+		if (file->co64)
+			cursor->offset = mp4_read_u64(file->stco.data + cursor->chunk * 8);
+		else
+			cursor->offset = mp4_read_u32(file->stco.data + cursor->chunk * 4);
+
+		cursor->chunk++;
+	}
+
+	if (file->sample_size)
+		size = file->sample_size;
+	else
+		size = mp4_read_u32(file->stsz.data + cursor->sample * 4);
+
+	if (cursor->offset > file->size || size > file->size - cursor->offset)
+		return -EINVAL;
+
+	*offsetp = cursor->offset;
+	*sizep = size;
+
+	cursor->offset += size;
+	cursor->chunk_samples--;
+	cursor->sample++;
+
+	return 0;
+}
+
+/* keeps reads in flight for the window of samples following the cursor */
+static int mp4_readahead_fill(struct mp4_file *file, uint32_t sample)
+{
+	struct mp4_slot *slot;
+	unsigned int index;
+	uint64_t offset;
+	uint32_t size;
+	int err;
+
+	while (file->ahead.sample < file->num_samples &&
+	       file->ahead.sample < sample + file->window) {
+		index = file->ahead.sample % file->window;
+		slot = &file->slots[index];
+
+		/* broken tables are reported when the cursor gets there */
+		err = mp4_locate(file, &file->ahead, &offset, &size);
+		if (err < 0) {
+			file->ahead.sample = file->num_samples;
+			break;
+		}
+
+		slot->sample = file->ahead.sample - 1;
+		slot->offset = offset;
+		slot->size = size;
+		slot->length = 0;
+		slot->err = 0;
+
+		if (size > file->buffer_size) {
+			slot->err = -E2BIG;
+			slot->done = true;
+			continue;
+		}
+
+		err = mp4_slot_issue(file, index);
+		if (err < 0)
+			return err;
+	}
+
+	return vde_io_submit(file->io);
+}
+
+int mp4_start_readahead(struct mp4_file *file, unsigned int window)
+{
+	uint64_t max = file->sample_size, size;
+	uint32_t i, count;
+	int err;
+
+	if (window == 0 || file->io)
+		return -EINVAL;
+
+	/*
+	 * Only samples that fit into the file can be read, mp4_locate() fails
+	 * for the others, so they don't count towards the buffer size.
+	 */
+	if (max > file->size)
+		return -EINVAL;
+
+	if (!max) {
+		count = MIN(file->num_samples, file->stsz.count);
+
+		for (i = 0; i < count; i++) {
+			size = mp4_read_u32(file->stsz.data + i * 4);
+			if (size <= file->size)
+				max = MAX(max, size);
+		}
+	}
+
+	size = ALIGN(MAX(max, 1), 4096);
+	if (size > MP4_READAHEAD_MAX_SIZE / window)
+		return -E2BIG;
+
+	file->buffer_size = size;
+	file->window = window;
+
+	file->slots = calloc(window, sizeof(*file->slots));
+	if (!file->slots)
+		return -ENOMEM;
+
+	err = posix_memalign((void **)&file->buffers, 4096,
+			     window * file->buffer_size);
+	if (err) {
+		err = -err;
+		goto free;
+	}
+
+	err = vde_io_create(&file->io, window);
+	if (err < 0)
+		goto free;
+
+	file->index = vde_io_register_buffer(file->io, file->buffers,
+					     window * file->buffer_size);
+
+	file->ahead = file->cursor;
+
+	return 0;
+
+free:
+	free(file->buffers);
+	free(file->slots);
+	file->buffers = NULL;
+	file->slots = NULL;
+	return err;
+}
+
+void mp4_close(struct mp4_file *file)
+{
+	if (file) {
+		if (file->io) {
+			/* the kernel must be done with the buffers first */
+			while (vde_io_pending(file->io) > 0)
+				if (mp4_readahead_reap(file) < 0)
+					break;
+
+			vde_io_free(file->io);
+			free(file->buffers);
+			free(file->slots);
+		}
+
+		munmap((void *)file->data, file->size);
+		close(file->fd);
+	}
+
+	free(file);
+}
+
+/* waits for the read of a sample that was issued by mp4_readahead_fill() */
+static int mp4_readahead_wait(struct mp4_file *file, uint32_t sample,
+			      const uint8_t **datap)
+{
+	unsigned int index = sample % file->window;
+	struct mp4_slot *slot = &file->slots[index];
+	int err;
+
+	err = mp4_readahead_fill(file, sample);
+	if (err < 0)
+		return err;
+
+	if (slot->sample != sample)
+		return -EINVAL;
+
+	while (!slot->done) {
+		err = mp4_readahead_reap(file);
+		if (err < 0)
+			return err;
+	}
+
+	if (slot->err < 0)
+		return slot->err;
+
+	*datap = file->buffers + index * file->buffer_size;
+
+	return 0;
+}
+
+int mp4_next_sample(struct mp4_file *file, struct mp4_sample *sample)
+{
+	uint32_t index = file->cursor.sample;
+	const uint8_t *data;
+	uint64_t offset;
+	uint32_t size;
+	int err;
+
+	if (index >= file->num_samples)
+		return -ENOENT;
+
+	err = mp4_locate(file, &file->cursor, &offset, &size);
+	if (err < 0)
+		return err;
+
+	if (file->io) {
+		err = mp4_readahead_wait(file, index, &data);
+		if (err < 0)
+			return err;
+	} else {
+		data = file->data + offset;
+	}
+
+	sample->data = data;
+	sample->size = size;
+	sample->index = index;
+
+	/* stss is sorted and 1-based, no stss means every sample is a sync sample */
+	if (file->stss.data) {
+		while (file->stss_index < file->stss.count &&
+		       mp4_read_u32(file->stss.data + file->stss_index * 4) < index + 1)
+			file->stss_index++;
+
+		sample->sync = file->stss_index < file->stss.count &&
+			       mp4_read_u32(file->stss.data + file->stss_index * 4) == index + 1;
+	} else {
+		sample->sync = true;
+	}
+
+	return 0;
+}
@@ -0,0 +1,83 @@
+#ifndef MP4_H
+#define MP4_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* view into one of the sample tables of the mapped file */
+struct mp4_table {
+	const uint8_t *data;
+	uint32_t count;
+};
+
+/* position in the sample tables, chunk is the next chunk to read from */
+struct mp4_cursor {
+	uint32_t sample;
+	uint32_t chunk;
+	uint32_t chunk_samples;
+	uint32_t stsc_index;
+	uint64_t offset;
+};
+
+struct mp4_slot;
+struct vde_io;
+
+struct mp4_sample {
+	const uint8_t *data;
+	size_t size;
+
+	uint32_t index;
+	bool sync;
+};
+
+struct mp4_file {
+	const uint8_t *data;
+	size_t size;
+	int fd;
+
+	/* avcC record of the H.264 track */
+	const uint8_t *avcc;
+	size_t avcc_size;
+
+	unsigned int width;
+	unsigned int height;
+	uint32_t timescale;
+
+	uint32_t num_samples;
+	uint32_t sample_size;
+
+	struct mp4_table stsz;
+	struct mp4_table stco;
+	struct mp4_table stsc;
+	struct mp4_table stss;
+	bool co64;
+
+	/* sample iterator */
+	struct mp4_cursor cursor;
+	uint32_t stss_index;
+
+	/* samples read ahead of the cursor, into one buffer each */
+	struct vde_io *io;
+	struct mp4_cursor ahead;
+	struct mp4_slot *slots;
+	unsigned int window;
+	uint8_t *buffers;
+	size_t buffer_size;
+	int index;
+};
+
+int mp4_open(struct mp4_file **filep, const char *filename);
+void mp4_close(struct mp4_file *file);
+
+/*
+ * Reads the next window samples with io_uring instead of faulting them in
+ * from the mapping, so that cold storage doesn't stall the caller. Samples
+ * then live in a ring of buffers and each one is only valid until the next
+ * call to mp4_next_sample(). Fails with -E2BIG if the largest sample would
+ * need too much memory for the window, samples are then still mapped.
+ */
+int mp4_start_readahead(struct mp4_file *file, unsigned int window);
+int mp4_next_sample(struct mp4_file *file, struct mp4_sample *sample);
+
+#endif
@@ -0,0 +1,254 @@
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "h264-parser.h"
+#include "mem.h"
+#include "mp4.h"
+#include "utils.h"
+#include "vde-decode.h"
+
+/* pic_width_in_mbs and pic_height_in_mbs of the decode ioctl are 8 bits */
+#define VDE_PROBE_MAX_MBS 255
+
+static const char *const vde_probe_reason_names[] = {
+	"malformed",
+	"profile",
+	"chroma-format",
+	"bit-depth",
+	"scaling-matrix",
+	"poc-type",
+	"interlaced",
+	"size",
+	"cabac",
+	"slice-groups",
+	"weighted-prediction",
+	"transform-8x8",
+};
+
+const char *vde_probe_reason_name(enum vde_probe_reason reason)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(vde_probe_reason_names); i++)
+		if (reason == 1u << i)
+			return vde_probe_reason_names[i];
+
+	return "unknown";
+}
+
+static unsigned int vde_probe_sps(const struct h264_sps *sps)
+{
+	/* 64 bits, so that a hostile SPS can't wrap around to a valid size */
+	uint64_t width = (uint64_t)sps->pic_width_in_mbs_minus1 + 1;
+	uint64_t height = (uint64_t)sps->pic_height_in_map_units_minus1 + 1;
+	unsigned int reasons = 0;
+
+	if (sps->profile_idc != 66)
+		reasons |= VDE_PROBE_PROFILE;
+
+	if (sps->chroma_format_idc != 1)
+		reasons |= VDE_PROBE_CHROMA_FORMAT;
+
+	if (sps->bit_depth_luma_minus8 || sps->bit_depth_chroma_minus8)
+		reasons |= VDE_PROBE_BIT_DEPTH;
+
+	if (sps->seq_scaling_matrix_present_flag)
+		reasons |= VDE_PROBE_SCALING_MATRIX;
+
+	if (sps->pic_order_cnt_type != 2)
+		reasons |= VDE_PROBE_POC_TYPE;
+
+	if (!sps->frame_mbs_only_flag) {
+		reasons |= VDE_PROBE_INTERLACED;
+		height *= 2;
+	}
+
+	if (width > VDE_PROBE_MAX_MBS || height > VDE_PROBE_MAX_MBS)
+		reasons |= VDE_PROBE_SIZE;
+
+	return reasons;
+}
+
+static unsigned int vde_probe_pps(const struct h264_pps *pps)
+{
+	unsigned int reasons = 0;
+
+	if (pps->entropy_coding_mode_flag)
+		reasons |= VDE_PROBE_CABAC;
+
+	if (pps->num_slice_groups_minus1 > 0)
+		reasons |= VDE_PROBE_SLICE_GROUPS;
+
+	if (pps->weighted_pred_flag || pps->weighted_bipred_idc)
+		reasons |= VDE_PROBE_WEIGHTED_PRED;
+
+	if (pps->transform_8x8_mode_flag)
+		reasons |= VDE_PROBE_TRANSFORM_8X8;
+
+	if (pps->pic_scaling_matrix_present_flag)
+		reasons |= VDE_PROBE_SCALING_MATRIX;
+
+	return reasons;
+}
+
+/*
+ * Returns the next parameter set of the avcC record, without its NAL unit
+ * header, or -ENOSPC if the record is truncated.
+ */
+static int vde_probe_next(const uint8_t **ptrp, const uint8_t *end,
+			  unsigned int type, const uint8_t **datap,
+			  size_t *sizep)
+{
+	const uint8_t *ptr = *ptrp;
+	size_t length;
+
+	if (end - ptr < 2)
+		return -ENOSPC;
+
+	length = (ptr[0] << 8) | ptr[1];
+	ptr += 2;
+
+	if (length < 1 || length > (size_t)(end - ptr))
+		return -ENOSPC;
+
+	if ((ptr[0] & 0x1f) != type)
+		return -EINVAL;
+
+	*datap = ptr + 1;
+	*sizep = length - 1;
+	*ptrp = ptr + length;
+
+	return 0;
+}
+
+static void vde_probe_describe(struct vde_probe *probe,
+			       const struct h264_sps *sps)
+{
+	unsigned int units = 2 - sps->frame_mbs_only_flag;
+	uint64_t width, height;
+
+	width = ((uint64_t)sps->pic_width_in_mbs_minus1 + 1) * 16;
+	height = ((uint64_t)sps->pic_height_in_map_units_minus1 + 1) * units * 16;
+
+	probe->profile_idc = sps->profile_idc;
+	probe->level_idc = sps->level_idc;
+	probe->width = MIN(width, UINT_MAX);
+	probe->height = MIN(height, UINT_MAX);
+	probe->chroma_format_idc = sps->chroma_format_idc;
+	probe->bit_depth = sps->bit_depth_luma_minus8 + 8;
+	probe->pic_order_cnt_type = sps->pic_order_cnt_type;
+}
+
+int vde_probe_parameter_sets(struct vde_probe *probe, const void *avcc,
+			     size_t size)
+{
+	const uint8_t *ptr = avcc, *end = ptr + size, *data;
+	struct h264_sps *sps;
+	struct h264_pps pps;
+	unsigned int i;
+	size_t length;
+	uint8_t *rbsp;
+	int err = 0;
+
+	memset(probe, 0, sizeof(*probe));
+
+	if (size < 7 || ptr[0] != 1) {
+		probe->reasons = VDE_PROBE_MALFORMED;
+		probe->error = -EINVAL;
+		return 0;
+	}
+
+	probe->num_sps = ptr[5] & 0x1f;
+	ptr += 6;
+
+	if (probe->num_sps == 0) {
+		probe->reasons = VDE_PROBE_MALFORMED;
+		probe->error = -ENODATA;
+		return 0;
+	}
+
+	/* parameter sets are parsed from a copy without emulation prevention */
+	rbsp = malloc(size);
+	sps = calloc(probe->num_sps, sizeof(*sps));
+	if (!rbsp || !sps) {
+		free(rbsp);
+		free(sps);
+		return -ENOMEM;
+	}
+
+	vde_mem_alloc(VDE_MEM_PARSER, size);
+	vde_mem_alloc(VDE_MEM_PARSER, probe->num_sps * sizeof(*sps));
+
+	for (i = 0; i < probe->num_sps; i++) {
+		err = vde_probe_next(&ptr, end, H264_NAL_SPS, &data, &length);
+		if (err < 0)
+			goto out;
+
+		length = h264_nal_unescape(rbsp, data, length);
+
+		err = h264_sps_parse_syntax(&sps[i], rbsp, length, NULL);
+		if (err < 0)
+			goto out;
+
+		probe->reasons |= vde_probe_sps(&sps[i]);
+	}
+
+	vde_probe_describe(probe, &sps[0]);
+
+	if (ptr >= end) {
+		err = -ENODATA;
+		goto out;
+	}
+
+	probe->num_pps = *ptr++;
+
+	if (probe->num_pps == 0) {
+		err = -ENODATA;
+		goto out;
+	}
+
+	for (i = 0; i < probe->num_pps; i++) {
+		err = vde_probe_next(&ptr, end, H264_NAL_PPS, &data, &length);
+		if (err < 0)
+			goto out;
+
+		length = h264_nal_unescape(rbsp, data, length);
+		memset(&pps, 0, sizeof(pps));
+
+		err = h264_pps_parse_syntax(&pps, rbsp, length, sps,
+					    probe->num_sps, NULL);
+		if (err < 0)
+			goto out;
+
+		probe->reasons |= vde_probe_pps(&pps);
+	}
+
+out:
+	if (err < 0) {
+		probe->reasons |= VDE_PROBE_MALFORMED;
+		probe->error = err;
+	}
+
+	vde_mem_free(VDE_MEM_PARSER, probe->num_sps * sizeof(*sps));
+	vde_mem_free(VDE_MEM_PARSER, size);
+	free(sps);
+	free(rbsp);
+	return 0;
+}
+
+int vde_probe_file(struct vde_probe *probe, const char *filename)
+{
+	struct mp4_file *mp4;
+	int err;
+
+	err = mp4_open(&mp4, filename);
+	if (err < 0)
+		return err;
+
+	err = vde_probe_parameter_sets(probe, mp4->avcc, mp4->avcc_size);
+	mp4_close(mp4);
+
+	return err;
+}
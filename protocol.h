@@ -0,0 +1,98 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stdint.h>
+
+/*
+ * Wire format used between the decode daemon and its clients. Messages are
+ * exchanged over a SOCK_SEQPACKET Unix socket, so every message is received
+ * in one piece. Each starts with a header, followed by a type-specific body.
+ * Each connection carries a single stream.
+ *
+ * Decoded frames are not copied: the daemon passes the dmabuf of the frame
+ * along with the VDE_MESSAGE_FRAME message (SCM_RIGHTS) and the client sends
+ * VDE_MESSAGE_RELEASE once it is done with the frame, after which the buffer
+ * is recycled for another picture. Every access unit is answered by exactly
+ * one frame message, which carries a negative error code in the status field
+ * if the access unit could not be decoded (or if the parameter sets that it
+ * refers to were rejected, or if the stream could not be admitted).
+ *
+ * Access units that don't fit into a message, such as the I-frames of high
+ * level streams, are written to a memfd by the client, which is passed along
+ * with VDE_MESSAGE_DECODE_FD instead, so that the socket buffers can stay
+ * small.
+ */
+
+enum vde_message_type {
+	/* client: avcC record for all subsequent access units */
+	VDE_MESSAGE_PARAMETER_SETS = 1,
+	/* client: struct vde_message_decode followed by an access unit */
+	VDE_MESSAGE_DECODE,
+	/* client: struct vde_message_release */
+	VDE_MESSAGE_RELEASE,
+	/* daemon: struct vde_message_frame, dmabuf attached if status is 0 */
+	VDE_MESSAGE_FRAME,
+	/* client: struct vde_message_stream */
+	VDE_MESSAGE_STREAM,
+	/* client: struct vde_message_decode, access unit in an attached memfd */
+	VDE_MESSAGE_DECODE_FD,
+};
+
+struct vde_message_header {
+	uint32_t type;
+	uint32_t size;
+};
+
+struct vde_message_decode {
+	uint64_t user;
+	uint32_t flags;
+	uint32_t reserved;
+};
+
+struct vde_message_stream {
+	uint32_t priority;
+	uint32_t weight;
+	uint32_t frame_rate;
+	uint32_t reserved;
+};
+
+struct vde_message_release {
+	uint64_t id;
+};
+
+struct vde_message_frame {
+	uint64_t id;
+	uint64_t sequence;
+	uint64_t user;
+	int32_t status;
+
+	uint32_t width;
+	uint32_t height;
+	uint32_t format;
+	uint64_t modifier;
+
+	uint32_t pitch;
+	uint32_t reserved;
+	uint64_t offsets[3];
+	uint64_t size;
+
+	/* visible rectangle */
+	uint32_t crop_x;
+	uint32_t crop_y;
+	uint32_t crop_width;
+	uint32_t crop_height;
+};
+
+/* largest access unit that is sent inline, larger ones go through a memfd */
+#define VDE_MESSAGE_MAX_DATA (256 * 1024)
+/*
+ * largest access unit that can be passed in a memfd, at least the largest
+ * bitstream buffer that tegra_vde_get_limits() sizes (A.3.1, for a picture
+ * of H264_MAX_FRAME_MBS macroblocks)
+ */
+#define VDE_MESSAGE_MAX_FD_DATA (64 << 20)
+#define VDE_MESSAGE_MAX_SIZE (sizeof(struct vde_message_header) + \
+			      sizeof(struct vde_message_decode) + \
+			      VDE_MESSAGE_MAX_DATA)
+
+#endif
@@ -0,0 +1,285 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "h264-parser.h"
+#include "scheduler.h"
+#include "vde-decode.h"
+
+/*
+ * Shares one decoder between any number of sessions. Decoding an access unit
+ * can't be interrupted, so all the scheduler can do is pick which session gets
+ * to decode next, one access unit at a time:
+ *
+ *   - live streams always go first, oldest access unit first
+ *   - batch streams share what is left in proportion to their weights, using
+ *     start-time fair queueing with the number of macroblocks as the cost
+ *
+ * To keep live latency predictable, live streams must be admitted: the sum of
+ * their macroblock rates can't exceed the capacity of the decoder, given as a
+ * level.
+ */
+
+/* fixed-point scale of the virtual time */
+#define VDE_SCHEDULER_VTIME_SCALE 1024
+
+struct vde_scheduler {
+	const struct h264_level *level;
+
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	pthread_cond_t idle;
+	bool stop;
+
+	struct vde_scheduler_stream *streams;
+	/* stream that is currently decoding */
+	struct vde_scheduler_stream *current;
+
+	/* start time of the batch unit that was picked last */
+	uint64_t vtime;
+	/* macroblocks per second reserved by live streams */
+	uint64_t reserved;
+};
+
+/* called with the scheduler lock held */
+static struct vde_scheduler_stream *
+vde_scheduler_pick(struct vde_scheduler *scheduler)
+{
+	struct vde_scheduler_stream *stream, *live = NULL, *batch = NULL;
+	uint64_t time, oldest = 0;
+
+	for (stream = scheduler->streams; stream; stream = stream->next) {
+		if (!vde_session_peek(stream->session, &time))
+			continue;
+
+		if (stream->params.priority == VDE_PRIORITY_LIVE) {
+			if (!live || time < oldest) {
+				oldest = time;
+				live = stream;
+			}
+
+			continue;
+		}
+
+		/* idle streams don't accumulate credit */
+		if (stream->vtime < scheduler->vtime)
+			stream->vtime = scheduler->vtime;
+
+		if (!batch || stream->vtime < batch->vtime)
+			batch = stream;
+	}
+
+	if (live)
+		return live;
+
+	if (batch)
+		scheduler->vtime = batch->vtime;
+
+	return batch;
+}
+
+static void *vde_scheduler_run(void *arg)
+{
+	struct vde_scheduler *scheduler = arg;
+	struct vde_scheduler_stream *stream;
+	unsigned int cost;
+
+	pthread_mutex_lock(&scheduler->lock);
+
+	while (true) {
+		while (!scheduler->stop &&
+		       (stream = vde_scheduler_pick(scheduler)) == NULL)
+			pthread_cond_wait(&scheduler->work, &scheduler->lock);
+
+		if (scheduler->stop)
+			break;
+
+		scheduler->current = stream;
+		pthread_mutex_unlock(&scheduler->lock);
+
+		cost = vde_session_process(stream->session);
+
+		pthread_mutex_lock(&scheduler->lock);
+
+		if (stream->params.priority != VDE_PRIORITY_LIVE)
+			stream->vtime += (uint64_t)cost * VDE_SCHEDULER_VTIME_SCALE /
+					 stream->params.weight;
+
+		scheduler->current = NULL;
+		pthread_cond_broadcast(&scheduler->idle);
+	}
+
+	pthread_mutex_unlock(&scheduler->lock);
+
+	return NULL;
+}
+
+int vde_scheduler_create(struct vde_scheduler **schedulerp,
+			 const struct vde_scheduler_config *config)
+{
+	struct vde_scheduler *scheduler;
+	unsigned int level = 41;
+	int err;
+
+	if (config && config->level)
+		level = config->level;
+
+	scheduler = calloc(1, sizeof(*scheduler));
+	if (!scheduler)
+		return -ENOMEM;
+
+	scheduler->level = h264_level_find(level);
+	if (!scheduler->level) {
+		err = -EINVAL;
+		goto free;
+	}
+
+	pthread_mutex_init(&scheduler->lock, NULL);
+	pthread_cond_init(&scheduler->work, NULL);
+	pthread_cond_init(&scheduler->idle, NULL);
+
+	err = pthread_create(&scheduler->thread, NULL, vde_scheduler_run,
+			     scheduler);
+	if (err != 0) {
+		err = -err;
+		goto destroy;
+	}
+
+	*schedulerp = scheduler;
+
+	return 0;
+
+destroy:
+	pthread_cond_destroy(&scheduler->idle);
+	pthread_cond_destroy(&scheduler->work);
+	pthread_mutex_destroy(&scheduler->lock);
+free:
+	free(scheduler);
+	return err;
+}
+
+/* all sessions using the scheduler must have been closed */
+void vde_scheduler_free(struct vde_scheduler *scheduler)
+{
+	if (!scheduler)
+		return;
+
+	pthread_mutex_lock(&scheduler->lock);
+	scheduler->stop = true;
+	pthread_cond_broadcast(&scheduler->work);
+	pthread_mutex_unlock(&scheduler->lock);
+
+	pthread_join(scheduler->thread, NULL);
+
+	pthread_cond_destroy(&scheduler->idle);
+	pthread_cond_destroy(&scheduler->work);
+	pthread_mutex_destroy(&scheduler->lock);
+	free(scheduler);
+}
+
+void vde_scheduler_attach(struct vde_scheduler *scheduler,
+			  struct vde_scheduler_stream *stream)
+{
+	pthread_mutex_lock(&scheduler->lock);
+
+	stream->vtime = scheduler->vtime;
+	stream->reserved = 0;
+	stream->next = scheduler->streams;
+	scheduler->streams = stream;
+
+	pthread_mutex_unlock(&scheduler->lock);
+}
+
+/* returns once the stream is no longer decoding and won't be picked again */
+void vde_scheduler_detach(struct vde_scheduler *scheduler,
+			  struct vde_scheduler_stream *stream)
+{
+	struct vde_scheduler_stream **streamp = &scheduler->streams;
+
+	pthread_mutex_lock(&scheduler->lock);
+
+	while (scheduler->current == stream)
+		pthread_cond_wait(&scheduler->idle, &scheduler->lock);
+
+	while (*streamp && *streamp != stream)
+		streamp = &(*streamp)->next;
+
+	if (*streamp)
+		*streamp = stream->next;
+
+	scheduler->reserved -= stream->reserved;
+	stream->reserved = 0;
+
+	pthread_mutex_unlock(&scheduler->lock);
+}
+
+/*
+ * Checks that a stream with the given parameters and parameter sets can be
+ * served and reserves capacity for it if it is live. The macroblock rate of
+ * a stream is derived from its frame rate, or assumed to be the maximum for
+ * its level if the frame rate is unknown. Returns -ERANGE if the stream
+ * exceeds the limits of its own level or of the decoder and -EBUSY if there
+ * is not enough capacity left. The stream keeps its previous parameters and
+ * reservation on failure.
+ */
+int vde_scheduler_admit(struct vde_scheduler *scheduler,
+			struct vde_scheduler_stream *stream,
+			const struct vde_stream_params *params,
+			const struct h264_context *h264)
+{
+	const struct h264_level *level;
+	const struct h264_sps *sps;
+	uint64_t mbs, rate = 0;
+	int err = 0;
+
+	/* nothing to reserve until the parameter sets are known */
+	if (h264 && h264->num_sps > 0) {
+		sps = &h264->sps[0];
+		level = h264_level_find(h264_sps_level_idc(sps));
+
+		mbs = (uint64_t)(sps->pic_width_in_mbs_minus1 + 1) *
+		      (sps->pic_height_in_map_units_minus1 + 1) *
+		      (2 - sps->frame_mbs_only_flag);
+
+		if (params->frame_rate)
+			rate = mbs * params->frame_rate;
+		else if (level)
+			rate = level->max_mbps;
+		else
+			rate = scheduler->level->max_mbps;
+
+		if (level && (rate > level->max_mbps || mbs > level->max_fs))
+			return -ERANGE;
+
+		if (mbs > scheduler->level->max_fs)
+			return -ERANGE;
+	}
+
+	if (params->priority != VDE_PRIORITY_LIVE)
+		rate = 0;
+
+	pthread_mutex_lock(&scheduler->lock);
+
+	if (scheduler->reserved - stream->reserved + rate >
+	    scheduler->level->max_mbps) {
+		err = -EBUSY;
+	} else {
+		scheduler->reserved -= stream->reserved;
+		scheduler->reserved += rate;
+		stream->reserved = rate;
+		stream->params = *params;
+	}
+
+	pthread_mutex_unlock(&scheduler->lock);
+
+	return err;
+}
+
+/* tells the scheduler that a stream has new work */
+void vde_scheduler_kick(struct vde_scheduler *scheduler)
+{
+	pthread_mutex_lock(&scheduler->lock);
+	pthread_cond_signal(&scheduler->work);
+	pthread_mutex_unlock(&scheduler->lock);
+}
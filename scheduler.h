@@ -0,0 +1,38 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "vde-decode.h"
+
+struct h264_context;
+
+/* per-session state of the scheduler, embedded in the session */
+struct vde_scheduler_stream {
+	struct vde_session *session;
+	struct vde_stream_params params;
+
+	/* virtual time, advanced by the cost of each unit over its weight */
+	uint64_t vtime;
+	/* macroblocks per second reserved for a live stream */
+	uint64_t reserved;
+
+	struct vde_scheduler_stream *next;
+};
+
+void vde_scheduler_attach(struct vde_scheduler *scheduler,
+			  struct vde_scheduler_stream *stream);
+void vde_scheduler_detach(struct vde_scheduler *scheduler,
+			  struct vde_scheduler_stream *stream);
+int vde_scheduler_admit(struct vde_scheduler *scheduler,
+			struct vde_scheduler_stream *stream,
+			const struct vde_stream_params *params,
+			const struct h264_context *h264);
+void vde_scheduler_kick(struct vde_scheduler *scheduler);
+
+/* implemented by the session for the scheduler */
+bool vde_session_peek(struct vde_session *session, uint64_t *time);
+unsigned int vde_session_process(struct vde_session *session);
+
+#endif
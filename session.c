@@ -0,0 +1,806 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/eventfd.h>
+
+#include <libdrm/tegra.h>
+
+#include "frame.h"
+#include "h264-parser.h"
+#include "scheduler.h"
+#include "trace.h"
+#include "utils.h"
+#include "vde.h"
+#include "vde-decode.h"
+
+/* number of released frames kept around for reuse until the SPS is known */
+#define VDE_SESSION_POOL_SIZE 4
+
+struct vde_session_unit {
+	uint8_t *data;
+	size_t size;
+	unsigned long flags;
+	uint64_t sequence;
+	uint64_t user;
+	/* submission time, in nanoseconds */
+	uint64_t time;
+
+	struct vde_session_unit *next;
+};
+
+struct vde_session_frame {
+	struct vde_frame_object object;
+	struct vde_session *session;
+	int status;
+
+	struct vde_session_frame *next;
+};
+
+struct vde_session {
+	struct vde_session_config config;
+
+	struct drm_tegra *drm;
+	int drm_fd;
+
+	struct tegra_vde *vde;
+	struct h264_context h264;
+	uint8_t *extradata;
+
+	/* either decodes on a thread of its own or on a shared scheduler */
+	struct vde_scheduler_stream stream;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t input;
+	pthread_cond_t output;
+	bool stop;
+	int event;
+
+	struct vde_session_unit *head;
+	struct vde_session_unit *tail;
+	unsigned int queued;
+	unsigned int queue_depth;
+
+	struct vde_session_frame *done;
+	struct vde_session_frame *last;
+
+	struct vde_session_frame *pool;
+	unsigned int pool_size;
+	unsigned int pool_max;
+
+	/* submitted access units that have not been received yet */
+	unsigned int pending;
+	/* access unit currently being decoded */
+	bool busy;
+	uint64_t sequence;
+};
+
+static uint64_t vde_session_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static inline struct vde_session_frame *
+to_session_frame(struct vde_frame_object *object)
+{
+	return container_of(object, struct vde_session_frame, object);
+}
+
+static void vde_session_frame_free(struct vde_session_frame *frame)
+{
+	if (frame)
+		tegra_vde_frame_free(frame->object.frame);
+
+	free(frame);
+}
+
+static void vde_session_frame_put(struct vde_session *session,
+				  struct vde_session_frame *frame);
+
+static void vde_session_frame_release(struct vde_frame_object *object)
+{
+	struct vde_session_frame *frame = to_session_frame(object);
+
+	vde_session_frame_put(frame->session, frame);
+}
+
+static enum tegra_vde_consumer vde_session_consumer(struct vde_session *session)
+{
+	switch (session->config.consumer) {
+	case VDE_CONSUMER_DISPLAY:
+		return TEGRA_VDE_CONSUMER_DISPLAY;
+
+	case VDE_CONSUMER_ENCODER:
+		return TEGRA_VDE_CONSUMER_ENCODER;
+
+	default:
+		return TEGRA_VDE_CONSUMER_CPU;
+	}
+}
+
+/*
+ * Returns a frame of the current geometry, recycling one if possible. The
+ * layout only depends on the geometry and the session's consumer, so frames
+ * of the same size can be reused as they are.
+ */
+static int vde_session_frame_get(struct vde_session *session,
+				 struct vde_session_frame **framep)
+{
+	struct vde_session_frame *frame;
+	unsigned int width, height;
+	int err;
+
+	tegra_vde_picture_size(&session->h264, &width, &height);
+
+	pthread_mutex_lock(&session->lock);
+
+	while ((frame = session->pool) != NULL) {
+		session->pool = frame->next;
+		session->pool_size--;
+
+		if (frame->object.frame->width == width &&
+		    frame->object.frame->height == height)
+			break;
+
+		vde_session_frame_free(frame);
+	}
+
+	pthread_mutex_unlock(&session->lock);
+
+	if (!frame) {
+		frame = calloc(1, sizeof(*frame));
+		if (!frame)
+			return -ENOMEM;
+
+		err = tegra_vde_frame_create_for(&frame->object.frame,
+						 session->vde, &session->h264,
+						 vde_session_consumer(session));
+		if (err < 0) {
+			free(frame);
+			return err;
+		}
+
+		vde_frame_object_init(&frame->object, frame->object.frame,
+				      vde_session_frame_release);
+		frame->session = session;
+	}
+
+	frame->status = 0;
+	frame->next = NULL;
+	*framep = frame;
+
+	return 0;
+}
+
+static void vde_session_frame_put(struct vde_session *session,
+				  struct vde_session_frame *frame)
+{
+	pthread_mutex_lock(&session->lock);
+
+	if (session->pool_size < session->pool_max) {
+		frame->next = session->pool;
+		session->pool = frame;
+		session->pool_size++;
+		frame = NULL;
+	}
+
+	pthread_mutex_unlock(&session->lock);
+
+	vde_session_frame_free(frame);
+}
+
+static int vde_session_decode(struct vde_session *session,
+			      struct vde_session_unit *unit,
+			      struct vde_session_frame *frame)
+{
+	ssize_t length;
+
+	session->vde->frame = unit->sequence;
+
+	if (unit->flags & VDE_SUBMIT_AVCC)
+		length = tegra_vde_stage_sample(session->vde, &session->h264,
+						unit->data, unit->size);
+	else
+		length = tegra_vde_stage(session->vde, unit->data, unit->size);
+
+	if (length < 0)
+		return length;
+
+	return tegra_vde_decode_frame(session->vde, frame->object.frame,
+				      &session->h264, length);
+}
+
+/* decodes a unit taken off the queue and hands out the result */
+static void vde_session_process_unit(struct vde_session *session,
+				     struct vde_session_unit *unit)
+{
+	struct vde_session_frame *frame;
+	int err;
+
+	err = vde_session_frame_get(session, &frame);
+	if (err == 0) {
+		frame->status = vde_session_decode(session, unit, frame);
+	} else {
+		frame = calloc(1, sizeof(*frame));
+		if (frame)
+			frame->status = err;
+	}
+
+	pthread_mutex_lock(&session->lock);
+
+	if (frame) {
+		frame->object.base.sequence = unit->sequence;
+		frame->object.base.user = unit->user;
+
+		if (session->last)
+			session->last->next = frame;
+		else
+			session->done = frame;
+
+		session->last = frame;
+
+		eventfd_write(session->event, 1);
+	} else {
+		/* nothing to hand out for this unit */
+		session->pending--;
+	}
+
+	session->busy = false;
+	pthread_cond_broadcast(&session->output);
+	pthread_mutex_unlock(&session->lock);
+
+	free(unit->data);
+	free(unit);
+}
+
+/* called with the session lock held */
+static struct vde_session_unit *vde_session_dequeue(struct vde_session *session)
+{
+	struct vde_session_unit *unit = session->head;
+
+	session->head = unit->next;
+	if (!session->head)
+		session->tail = NULL;
+
+	session->queued--;
+	session->busy = true;
+
+	return unit;
+}
+
+static void *vde_session_run(void *arg)
+{
+	struct vde_session *session = arg;
+	struct vde_session_unit *unit;
+
+	pthread_mutex_lock(&session->lock);
+
+	while (true) {
+		while (!session->stop && !session->head)
+			pthread_cond_wait(&session->input, &session->lock);
+
+		if (session->stop)
+			break;
+
+		unit = vde_session_dequeue(session);
+		pthread_mutex_unlock(&session->lock);
+
+		vde_session_process_unit(session, unit);
+
+		pthread_mutex_lock(&session->lock);
+	}
+
+	pthread_mutex_unlock(&session->lock);
+
+	return NULL;
+}
+
+/* returns the submission time of the next queued unit, if any */
+bool vde_session_peek(struct vde_session *session, uint64_t *time)
+{
+	bool queued = false;
+
+	pthread_mutex_lock(&session->lock);
+
+	if (session->head) {
+		*time = session->head->time;
+		queued = true;
+	}
+
+	pthread_mutex_unlock(&session->lock);
+
+	return queued;
+}
+
+/* decodes the next queued unit and returns its cost in macroblocks */
+unsigned int vde_session_process(struct vde_session *session)
+{
+	struct vde_session_unit *unit;
+	unsigned int width, height;
+
+	pthread_mutex_lock(&session->lock);
+
+	if (!session->head) {
+		pthread_mutex_unlock(&session->lock);
+		return 0;
+	}
+
+	unit = vde_session_dequeue(session);
+	pthread_mutex_unlock(&session->lock);
+
+	/* parameter sets can't change while a unit is being decoded */
+	tegra_vde_picture_size(&session->h264, &width, &height);
+
+	vde_session_process_unit(session, unit);
+
+	return (width / 16) * (height / 16);
+}
+
+int vde_session_open(struct vde_session **sessionp,
+		     const struct vde_session_config *config)
+{
+	const struct tegra_vde_ops *ops = &tegra_vde_hw_ops;
+	struct vde_session *session;
+	pthread_condattr_t attr;
+	int err;
+
+	session = calloc(1, sizeof(*session));
+	if (!session)
+		return -ENOMEM;
+
+	if (config)
+		session->config = *config;
+
+	if (!session->config.device)
+		session->config.device = "/dev/dri/card0";
+
+	session->queue_depth = session->config.queue_depth ?:
+			       TEGRA_VDE_QUEUE_DEPTH;
+	session->pool_max = VDE_SESSION_POOL_SIZE;
+
+	if (session->config.stream.weight == 0)
+		session->config.stream.weight = 1;
+
+	session->stream.session = session;
+	session->stream.params = session->config.stream;
+
+	session->drm_fd = -1;
+
+	if (session->config.backend == VDE_BACKEND_SOFTWARE) {
+		/* the software stand-in uses memfd-backed buffers */
+		ops = &tegra_vde_soft_ops;
+	} else {
+		session->drm_fd = open(session->config.device, O_RDWR);
+		if (session->drm_fd < 0) {
+			err = -errno;
+			goto free;
+		}
+
+		err = drm_tegra_new(&session->drm, session->drm_fd);
+		if (err < 0)
+			goto close;
+	}
+
+	err = tegra_vde_open(&session->vde, session->drm, ops);
+	if (err < 0)
+		goto close_drm;
+
+	session->vde->verbose = session->config.verbose;
+
+	session->event = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK | EFD_SEMAPHORE);
+	if (session->event < 0) {
+		err = -errno;
+		goto close_vde;
+	}
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_mutex_init(&session->lock, NULL);
+	pthread_cond_init(&session->input, NULL);
+	pthread_cond_init(&session->output, &attr);
+	pthread_condattr_destroy(&attr);
+
+	if (session->config.scheduler) {
+		vde_scheduler_attach(session->config.scheduler, &session->stream);
+	} else {
+		err = pthread_create(&session->thread, NULL, vde_session_run,
+				     session);
+		if (err != 0) {
+			err = -err;
+			goto destroy;
+		}
+	}
+
+	*sessionp = session;
+
+	return 0;
+
+destroy:
+	pthread_cond_destroy(&session->output);
+	pthread_cond_destroy(&session->input);
+	pthread_mutex_destroy(&session->lock);
+	close(session->event);
+close_vde:
+	tegra_vde_close(session->vde);
+close_drm:
+	if (session->drm)
+		drm_tegra_close(session->drm);
+close:
+	if (session->drm_fd >= 0)
+		close(session->drm_fd);
+free:
+	free(session);
+	return err;
+}
+
+/* all frames must have been released before the session is closed */
+void vde_session_close(struct vde_session *session)
+{
+	struct vde_session_frame *frame;
+	struct vde_session_unit *unit;
+
+	if (!session)
+		return;
+
+	if (session->config.scheduler) {
+		vde_scheduler_detach(session->config.scheduler, &session->stream);
+	} else {
+		pthread_mutex_lock(&session->lock);
+		session->stop = true;
+		pthread_cond_broadcast(&session->input);
+		pthread_mutex_unlock(&session->lock);
+
+		pthread_join(session->thread, NULL);
+	}
+
+	while ((unit = session->head) != NULL) {
+		session->head = unit->next;
+		free(unit->data);
+		free(unit);
+	}
+
+	while ((frame = session->done) != NULL) {
+		session->done = frame->next;
+		vde_session_frame_free(frame);
+	}
+
+	while ((frame = session->pool) != NULL) {
+		session->pool = frame->next;
+		vde_session_frame_free(frame);
+	}
+
+	pthread_cond_destroy(&session->output);
+	pthread_cond_destroy(&session->input);
+	pthread_mutex_destroy(&session->lock);
+	close(session->event);
+
+	tegra_vde_close(session->vde);
+	h264_context_free(&session->h264);
+	free(session->extradata);
+
+	if (session->drm) {
+		drm_tegra_close(session->drm);
+		close(session->drm_fd);
+	}
+
+	free(session);
+}
+
+/* file descriptor that becomes readable when decoded frames are available */
+int vde_session_get_fd(struct vde_session *session)
+{
+	return session->event;
+}
+
+/*
+ * Sizes the bitstream buffer, frame pool and queue for the stream. Called
+ * with the lock held while the decoder is idle. Frames that no longer fit
+ * into the pool are returned via unused.
+ */
+static int vde_session_apply_limits(struct vde_session *session,
+				    const struct h264_context *h264,
+				    struct vde_session_frame **unused)
+{
+	struct tegra_vde_limits limits;
+	struct vde_session_frame *frame;
+	int err;
+
+	err = tegra_vde_get_limits(h264, session->stream.params.frame_rate,
+				   &limits);
+	if (err < 0)
+		return err;
+
+	err = tegra_vde_resize_bitstream(session->vde, limits.bitstream_size);
+	if (err < 0)
+		return err;
+
+	session->pool_max = limits.num_frames;
+
+	while (session->pool_size > session->pool_max) {
+		frame = session->pool;
+		session->pool = frame->next;
+		session->pool_size--;
+
+		frame->next = *unused;
+		*unused = frame;
+	}
+
+	if (session->config.queue_depth == 0)
+		session->queue_depth = limits.queue_depth;
+
+	if (session->config.verbose)
+		printf("stream limits: bitstream %zu bytes, %u frames, queue depth %u\n",
+		       limits.bitstream_size, limits.num_frames,
+		       session->queue_depth);
+
+	return 0;
+}
+
+/*
+ * Sets the SPS and PPS from an avcC record. Access units that are still
+ * queued are decoded with the previous parameter sets before they change.
+ */
+int vde_session_set_parameter_sets(struct vde_session *session,
+				   const void *avcc, size_t size)
+{
+	struct vde_session_frame *frame, *unused = NULL;
+	struct h264_context h264;
+	uint8_t *extradata;
+	int err;
+
+	extradata = malloc(size);
+	if (!extradata)
+		return -ENOMEM;
+
+	memcpy(extradata, avcc, size);
+	memset(&h264, 0, sizeof(h264));
+
+	vde_trace_begin(VDE_TRACE_PARSE, session->vde->id, session->sequence);
+	err = h264_context_parse(&h264, extradata, size,
+				 session->config.verbose ? stdout : NULL);
+	vde_trace_end(VDE_TRACE_PARSE, session->vde->id, session->sequence);
+	if (err < 0) {
+		h264_context_free(&h264);
+		free(extradata);
+		return err;
+	}
+
+	if (h264.num_sps == 0 || h264.num_pps == 0) {
+		err = -EINVAL;
+		goto free;
+	}
+
+	if (session->config.scheduler) {
+		err = vde_scheduler_admit(session->config.scheduler,
+					  &session->stream,
+					  &session->stream.params, &h264);
+		if (err < 0)
+			goto free;
+	}
+
+	pthread_mutex_lock(&session->lock);
+
+	while (session->head || session->busy)
+		pthread_cond_wait(&session->output, &session->lock);
+
+	err = vde_session_apply_limits(session, &h264, &unused);
+	if (err < 0) {
+		pthread_mutex_unlock(&session->lock);
+		goto free;
+	}
+
+	h264_context_free(&session->h264);
+	free(session->extradata);
+
+	session->h264 = h264;
+	session->extradata = extradata;
+
+	pthread_mutex_unlock(&session->lock);
+
+	while ((frame = unused) != NULL) {
+		unused = frame->next;
+		vde_session_frame_free(frame);
+	}
+
+	return 0;
+
+free:
+	h264_context_free(&h264);
+	free(extradata);
+	return err;
+}
+
+/*
+ * Changes how the session is scheduled. For sessions on a scheduler, this
+ * fails with -EBUSY if a live stream can't be admitted, in which case the
+ * previous parameters remain in effect.
+ */
+int vde_session_set_stream(struct vde_session *session,
+			   const struct vde_stream_params *params)
+{
+	struct vde_stream_params stream = *params;
+	struct tegra_vde_limits limits;
+	int err = 0;
+
+	if (stream.weight == 0)
+		stream.weight = 1;
+
+	if (!session->config.scheduler) {
+		session->stream.params = stream;
+	} else {
+		err = vde_scheduler_admit(session->config.scheduler,
+					  &session->stream, &stream,
+					  session->extradata ? &session->h264 : NULL);
+		if (err < 0)
+			return err;
+	}
+
+	/* the queue depth follows the frame rate */
+	pthread_mutex_lock(&session->lock);
+
+	if (session->extradata && session->config.queue_depth == 0) {
+		err = tegra_vde_get_limits(&session->h264, stream.frame_rate,
+					   &limits);
+		if (err == 0)
+			session->queue_depth = limits.queue_depth;
+	}
+
+	pthread_mutex_unlock(&session->lock);
+
+	return err;
+}
+
+/*
+ * Queues an access unit for decoding. The data is copied, so the buffer can
+ * be reused as soon as this returns. Returns -EAGAIN if the queue is full.
+ */
+int vde_session_submit(struct vde_session *session, const void *data,
+		       size_t size, unsigned long flags, uint64_t user)
+{
+	struct vde_session_unit *unit;
+
+	if (!session->extradata)
+		return -EINVAL;
+
+	unit = calloc(1, sizeof(*unit));
+	if (!unit)
+		return -ENOMEM;
+
+	unit->data = malloc(size);
+	if (!unit->data) {
+		free(unit);
+		return -ENOMEM;
+	}
+
+	memcpy(unit->data, data, size);
+	unit->size = size;
+	unit->flags = flags;
+	unit->user = user;
+	unit->time = vde_session_time();
+
+	/*
+	 * Copy first and check the depth when queueing, so that concurrent
+	 * submitters can't both pass the check and overfill the queue.
+	 */
+	pthread_mutex_lock(&session->lock);
+
+	if (session->queued >= session->queue_depth) {
+		pthread_mutex_unlock(&session->lock);
+		free(unit->data);
+		free(unit);
+		return -EAGAIN;
+	}
+
+	unit->sequence = session->sequence++;
+
+	if (session->tail)
+		session->tail->next = unit;
+	else
+		session->head = unit;
+
+	session->tail = unit;
+	session->queued++;
+	session->pending++;
+
+	pthread_cond_signal(&session->input);
+	pthread_mutex_unlock(&session->lock);
+
+	if (session->config.scheduler)
+		vde_scheduler_kick(session->config.scheduler);
+
+	return 0;
+}
+
+/*
+ * Returns the next decoded frame, in submission order. A timeout of 0 never
+ * blocks and a negative timeout waits indefinitely. Returns -EAGAIN if no
+ * frame became available in time, -ENODATA if there is nothing left to
+ * receive, or the error that occurred while decoding the access unit.
+ */
+int vde_session_receive(struct vde_session *session,
+			struct vde_frame **framep, int timeout)
+{
+	struct vde_session_frame *frame;
+	struct timespec deadline;
+	eventfd_t value;
+	int err = 0;
+
+	if (timeout > 0) {
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_sec += timeout / 1000;
+		deadline.tv_nsec += (timeout % 1000) * 1000000;
+
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_nsec -= 1000000000;
+			deadline.tv_sec++;
+		}
+	}
+
+	pthread_mutex_lock(&session->lock);
+
+	while (!session->done) {
+		if (session->pending == 0) {
+			err = -ENODATA;
+			break;
+		}
+
+		if (timeout == 0) {
+			err = -EAGAIN;
+			break;
+		}
+
+		if (timeout < 0) {
+			pthread_cond_wait(&session->output, &session->lock);
+		} else {
+			err = pthread_cond_timedwait(&session->output,
+						     &session->lock, &deadline);
+			if (err == ETIMEDOUT && !session->done) {
+				err = -EAGAIN;
+				break;
+			}
+
+			err = 0;
+		}
+	}
+
+	frame = session->done;
+
+	if (err == 0) {
+		session->done = frame->next;
+		if (!session->done)
+			session->last = NULL;
+
+		session->pending--;
+
+		eventfd_read(session->event, &value);
+	}
+
+	pthread_mutex_unlock(&session->lock);
+
+	if (err < 0)
+		return err;
+
+	if (frame->status < 0) {
+		err = frame->status;
+
+		if (frame->object.frame)
+			vde_session_frame_put(session, frame);
+		else
+			free(frame);
+
+		return err;
+	}
+
+	frame->next = NULL;
+	*framep = &frame->object.base;
+
+	return 0;
+}
@@ -0,0 +1,517 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include <drm_fourcc.h>
+
+#include "h264-parser.h"
+#include "image.h"
+#include "snapshot.h"
+
+/* conversion coefficients, fixed point with SNAPSHOT_SHIFT fractional bits */
+#define SNAPSHOT_SHIFT 14
+
+struct snapshot_coefficients {
+	int32_t y_offset;
+	int32_t y;
+	int32_t rv;
+	int32_t gu;
+	int32_t gv;
+	int32_t bu;
+};
+
+void snapshot_colorspace_from_sps(struct snapshot_colorspace *cs,
+				  const struct h264_sps *sps)
+{
+	const struct h264_vui_parameters *vui = &sps->vui_parameters;
+	unsigned int height = (sps->pic_height_in_map_units_minus1 + 1) * 16;
+
+	cs->matrix = height > 576 ? SNAPSHOT_MATRIX_BT709 :
+				    SNAPSHOT_MATRIX_BT601;
+	cs->full_range = false;
+
+	if (!sps->vui_parameters_present_flag ||
+	    !vui->video_signal_type_present_flag)
+		return;
+
+	cs->full_range = vui->video_full_range_flag;
+
+	if (!vui->colour_description_present_flag)
+		return;
+
+	/* table E-5, 2 means unspecified and everything else is BT.601-like */
+	switch (vui->matrix_coefficients) {
+	case 1:
+		cs->matrix = SNAPSHOT_MATRIX_BT709;
+		break;
+
+	case 4:
+	case 5:
+	case 6:
+	case 7:
+		cs->matrix = SNAPSHOT_MATRIX_BT601;
+		break;
+	}
+}
+
+static void snapshot_coefficients_init(struct snapshot_coefficients *k,
+				       const struct snapshot_colorspace *cs)
+{
+	double kr = 0.299, kb = 0.114, kg, y = 1.0, c = 1.0;
+	double scale = 1 << SNAPSHOT_SHIFT;
+
+	if (cs->matrix == SNAPSHOT_MATRIX_BT709) {
+		kr = 0.2126;
+		kb = 0.0722;
+	}
+
+	kg = 1.0 - kr - kb;
+
+	/* limited range is 16-235 for luma and 16-240 for chroma */
+	if (!cs->full_range) {
+		y = 255.0 / 219.0;
+		c = 255.0 / 224.0;
+	}
+
+	k->y_offset = cs->full_range ? 0 : 16;
+	k->y = y * scale + 0.5;
+	k->rv = 2.0 * (1.0 - kr) * c * scale + 0.5;
+	k->gu = 2.0 * kb * (1.0 - kb) / kg * c * scale + 0.5;
+	k->gv = 2.0 * kr * (1.0 - kr) / kg * c * scale + 0.5;
+	k->bu = 2.0 * (1.0 - kb) * c * scale + 0.5;
+}
+
+static inline uint8_t snapshot_clamp(int32_t value)
+{
+	value >>= SNAPSHOT_SHIFT;
+
+	if (value < 0)
+		return 0;
+
+	if (value > 255)
+		return 255;
+
+	return value;
+}
+
+typedef int32_t snapshot_i32x4 __attribute__((vector_size(16)));
+typedef uint8_t snapshot_u8x4 __attribute__((vector_size(4)));
+
+static inline snapshot_i32x4 snapshot_clamp4(snapshot_i32x4 value)
+{
+	value >>= SNAPSHOT_SHIFT;
+	/* clear negative lanes, saturate lanes above 255 */
+	value &= ~(value >> 31);
+	value |= (255 - value) >> 31;
+
+	return value & 255;
+}
+
+static inline snapshot_i32x4 snapshot_load4(const uint8_t *src)
+{
+	snapshot_u8x4 bytes;
+
+	memcpy(&bytes, src, sizeof(bytes));
+
+	return __builtin_convertvector(bytes, snapshot_i32x4);
+}
+
+/* converts four pixels, sharing chroma terms between horizontal pairs */
+static inline void snapshot_convert4(uint8_t *dst, snapshot_i32x4 y,
+				     snapshot_i32x4 ruv, snapshot_i32x4 guv,
+				     snapshot_i32x4 buv)
+{
+	snapshot_i32x4 rgb;
+	uint32_t out[4];
+
+	rgb = snapshot_clamp4(y + ruv);
+	rgb |= snapshot_clamp4(y - guv) << 8;
+	rgb |= snapshot_clamp4(y + buv) << 16;
+
+	/* overlapping stores, the last one must not write past the pixel */
+	memcpy(out, &rgb, sizeof(out));
+	memcpy(dst + 0, &out[0], 4);
+	memcpy(dst + 3, &out[1], 4);
+	memcpy(dst + 6, &out[2], 4);
+	memcpy(dst + 9, &out[3], 3);
+}
+
+/*
+ * Converts one row, eight pixels at a time using GCC vector extensions so
+ * that it maps to SSE or NEON. The chroma terms are computed once for each
+ * pair of pixels. Semi-planar rows keep both chroma samples in pu.
+ */
+static void snapshot_convert_row(uint8_t *dst, const uint8_t *py,
+				 const uint8_t *pu, const uint8_t *pv,
+				 bool interleaved, bool swap,
+				 unsigned int width,
+				 const struct snapshot_coefficients *k)
+{
+	const snapshot_i32x4 lo = { 0, 0, 1, 1 }, hi = { 2, 2, 3, 3 };
+	const snapshot_i32x4 even = { 0, 2, 4, 6 }, odd = { 1, 3, 5, 7 };
+	const int32_t round = 1 << (SNAPSHOT_SHIFT - 1);
+	unsigned int i;
+
+	for (i = 0; i + 8 <= width; i += 8) {
+		snapshot_i32x4 y0, y1, u, v, ruv, guv, buv;
+
+		if (interleaved) {
+			snapshot_i32x4 c0 = snapshot_load4(pu + i);
+			snapshot_i32x4 c1 = snapshot_load4(pu + i + 4);
+
+			u = __builtin_shuffle(c0, c1, even);
+			v = __builtin_shuffle(c0, c1, odd);
+
+			if (swap) {
+				snapshot_i32x4 tmp = u;
+
+				u = v;
+				v = tmp;
+			}
+		} else {
+			u = snapshot_load4(pu + i / 2);
+			v = snapshot_load4(pv + i / 2);
+		}
+
+		y0 = (snapshot_load4(py + i) - k->y_offset) * k->y + round;
+		y1 = (snapshot_load4(py + i + 4) - k->y_offset) * k->y + round;
+		u -= 128;
+		v -= 128;
+
+		ruv = v * k->rv;
+		guv = u * k->gu + v * k->gv;
+		buv = u * k->bu;
+
+		snapshot_convert4(dst + i * 3, y0, __builtin_shuffle(ruv, lo),
+				  __builtin_shuffle(guv, lo),
+				  __builtin_shuffle(buv, lo));
+		snapshot_convert4(dst + i * 3 + 12, y1,
+				  __builtin_shuffle(ruv, hi),
+				  __builtin_shuffle(guv, hi),
+				  __builtin_shuffle(buv, hi));
+	}
+
+	for (; i < width; i++) {
+		int32_t y = (py[i] - k->y_offset) * k->y + round;
+		int32_t u, v;
+
+		if (interleaved) {
+			u = pu[i / 2 * 2 + swap] - 128;
+			v = pu[i / 2 * 2 + !swap] - 128;
+		} else {
+			u = pu[i / 2] - 128;
+			v = pv[i / 2] - 128;
+		}
+
+		dst[i * 3 + 0] = snapshot_clamp(y + v * k->rv);
+		dst[i * 3 + 1] = snapshot_clamp(y - u * k->gu - v * k->gv);
+		dst[i * 3 + 2] = snapshot_clamp(y + u * k->bu);
+	}
+}
+
+int snapshot_convert_rgb(const struct image *image,
+			 const struct snapshot_colorspace *cs, uint8_t *rgb,
+			 size_t pitch)
+{
+	struct snapshot_coefficients k;
+	bool interleaved = false, swap;
+	const uint8_t *u, *v;
+	unsigned int j;
+
+	switch (image->format) {
+	case DRM_FORMAT_YUV420:
+	case DRM_FORMAT_YVU420:
+		swap = image->format == DRM_FORMAT_YVU420;
+		u = image->planes[swap ? 2 : 1];
+		v = image->planes[swap ? 1 : 2];
+		break;
+
+	case DRM_FORMAT_NV12:
+	case DRM_FORMAT_NV21:
+		swap = image->format == DRM_FORMAT_NV21;
+		interleaved = true;
+		u = v = image->planes[1];
+		break;
+
+	default:
+		return -EINVAL;
+	}
+
+	snapshot_coefficients_init(&k, cs);
+
+	for (j = 0; j < image->height; j++) {
+		/* both chroma planes of planar images have the same pitch */
+		size_t offset = (j / 2) * image->pitches[1];
+
+		snapshot_convert_row(rgb + pitch * j,
+				     image->planes[0] + image->pitches[0] * j,
+				     u + offset, v + offset, interleaved, swap,
+				     image->width, &k);
+	}
+
+	return 0;
+}
+
+/* CRC-32 as used by PNG, eight bytes per step (slicing-by-8) */
+static uint32_t crc_table[8][256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void crc_init(void)
+{
+	unsigned int i, j;
+	uint32_t crc;
+
+	for (i = 0; i < 256; i++) {
+		crc = i;
+
+		for (j = 0; j < 8; j++)
+			crc = (crc & 1) ? (crc >> 1) ^ 0xedb88320 : crc >> 1;
+
+		crc_table[0][i] = crc;
+	}
+
+	for (i = 0; i < 256; i++)
+		for (j = 1; j < 8; j++)
+			crc_table[j][i] = (crc_table[j - 1][i] >> 8) ^
+					  crc_table[0][crc_table[j - 1][i] & 0xff];
+}
+
+static uint32_t crc_update(uint32_t crc, const uint8_t *data, size_t size)
+{
+	uint32_t a, b;
+
+	crc = ~crc;
+
+	while (size >= 8) {
+		a = crc ^ (data[0] | data[1] << 8 | data[2] << 16 |
+			   (uint32_t)data[3] << 24);
+		b = data[4] | data[5] << 8 | data[6] << 16 |
+		    (uint32_t)data[7] << 24;
+
+		crc = crc_table[7][a & 0xff] ^ crc_table[6][(a >> 8) & 0xff] ^
+		      crc_table[5][(a >> 16) & 0xff] ^ crc_table[4][a >> 24] ^
+		      crc_table[3][b & 0xff] ^ crc_table[2][(b >> 8) & 0xff] ^
+		      crc_table[1][(b >> 16) & 0xff] ^ crc_table[0][b >> 24];
+
+		data += 8;
+		size -= 8;
+	}
+
+	while (size--)
+		crc = (crc >> 8) ^ crc_table[0][(crc ^ *data++) & 0xff];
+
+	return ~crc;
+}
+
+typedef uint32_t snapshot_u32x4 __attribute__((vector_size(16)));
+
+static inline uint32_t snapshot_sum4(snapshot_u32x4 value)
+{
+	return value[0] + value[1] + value[2] + value[3];
+}
+
+static uint32_t adler32_update(uint32_t adler, const uint8_t *data,
+			       size_t size)
+{
+	const snapshot_u32x4 w[4] = {
+		{ 16, 15, 14, 13 }, { 12, 11, 10, 9 }, { 8, 7, 6, 5 },
+		{ 4, 3, 2, 1 },
+	};
+	uint64_t a = adler & 0xffff, b = adler >> 16;
+	size_t n, groups;
+
+	while (size > 0) {
+		/* largest n such that b cannot overflow before the modulo */
+		n = size < 5552 ? size : 5552;
+		size -= n;
+
+		/*
+		 * 16 bytes at a time, in vector lanes: every group adds the
+		 * running sum of the groups before it 16 times to b, and each
+		 * byte position is added 16 - position times within its group.
+		 */
+		groups = n / 16;
+
+		if (groups) {
+			snapshot_u32x4 sums[4] = { { 0 } }, prefix = { 0 };
+			size_t i, j;
+
+			for (i = 0; i < groups; i++, data += 16) {
+				prefix += sums[0] + sums[1] + sums[2] + sums[3];
+
+				for (j = 0; j < 4; j++)
+					sums[j] += (snapshot_u32x4)
+						snapshot_load4(data + j * 4);
+			}
+
+			b += groups * 16 * a + 16 * (uint64_t)snapshot_sum4(prefix);
+
+			for (j = 0; j < 4; j++) {
+				b += snapshot_sum4(sums[j] * w[j]);
+				a += snapshot_sum4(sums[j]);
+			}
+
+			n -= groups * 16;
+		}
+
+		while (n--) {
+			a += *data++;
+			b += a;
+		}
+
+		a %= 65521;
+		b %= 65521;
+	}
+
+	return b << 16 | a;
+}
+
+static void put_be32(uint8_t *ptr, uint32_t value)
+{
+	ptr[0] = value >> 24;
+	ptr[1] = value >> 16;
+	ptr[2] = value >> 8;
+	ptr[3] = value;
+}
+
+struct png_writer {
+	FILE *fp;
+	uint32_t crc;
+};
+
+static void png_chunk_begin(struct png_writer *png, const char *type,
+			    uint32_t length)
+{
+	uint8_t header[8];
+
+	put_be32(header, length);
+	memcpy(header + 4, type, 4);
+
+	fwrite(header, 1, sizeof(header), png->fp);
+	png->crc = crc_update(0, header + 4, 4);
+}
+
+static void png_chunk_data(struct png_writer *png, const void *data,
+			   size_t size)
+{
+	fwrite(data, 1, size, png->fp);
+	png->crc = crc_update(png->crc, data, size);
+}
+
+static void png_chunk_end(struct png_writer *png)
+{
+	uint8_t crc[4];
+
+	put_be32(crc, png->crc);
+	fwrite(crc, 1, sizeof(crc), png->fp);
+}
+
+/*
+ * rows holds one filter type byte (0, none) followed by the RGB samples for
+ * each row. It is wrapped in a zlib stream of stored deflate blocks, which
+ * costs nothing but a CRC and an Adler-32 over the data.
+ */
+static void png_write(FILE *fp, unsigned int width, unsigned int height,
+		      const uint8_t *rows, size_t size)
+{
+	static const uint8_t signature[8] = {
+		0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n',
+	};
+	static const uint8_t zlib[2] = { 0x78, 0x01 };
+	size_t blocks = (size + 65534) / 65535, offset, n;
+	struct png_writer png = { .fp = fp };
+	uint8_t ihdr[13], block[5], adler[4];
+
+	pthread_once(&crc_once, crc_init);
+
+	fwrite(signature, 1, sizeof(signature), fp);
+
+	put_be32(ihdr + 0, width);
+	put_be32(ihdr + 4, height);
+	/* 8 bits per sample, RGB, deflate, no filter, no interlacing */
+	ihdr[8] = 8;
+	ihdr[9] = 2;
+	ihdr[10] = 0;
+	ihdr[11] = 0;
+	ihdr[12] = 0;
+
+	png_chunk_begin(&png, "IHDR", sizeof(ihdr));
+	png_chunk_data(&png, ihdr, sizeof(ihdr));
+	png_chunk_end(&png);
+
+	png_chunk_begin(&png, "IDAT", sizeof(zlib) + blocks * sizeof(block) +
+			size + sizeof(adler));
+	png_chunk_data(&png, zlib, sizeof(zlib));
+
+	for (offset = 0; offset < size; offset += n) {
+		n = size - offset < 65535 ? size - offset : 65535;
+
+		block[0] = (offset + n == size) ? 1 : 0;
+		block[1] = n & 0xff;
+		block[2] = n >> 8;
+		block[3] = ~n & 0xff;
+		block[4] = (~n >> 8) & 0xff;
+
+		png_chunk_data(&png, block, sizeof(block));
+		png_chunk_data(&png, rows + offset, n);
+	}
+
+	put_be32(adler, adler32_update(1, rows, size));
+	png_chunk_data(&png, adler, sizeof(adler));
+	png_chunk_end(&png);
+
+	png_chunk_begin(&png, "IEND", 0);
+	png_chunk_end(&png);
+}
+
+int snapshot_write(const struct image *image,
+		   const struct snapshot_colorspace *cs, const char *filename)
+{
+	const char *extension = strrchr(filename, '.');
+	bool png = extension && strcasecmp(extension, ".png") == 0;
+	size_t pitch = image->width * 3 + (png ? 1 : 0), size;
+	uint8_t *buffer;
+	unsigned int j;
+	FILE *fp;
+	int err;
+
+	size = pitch * image->height;
+
+	buffer = malloc(size);
+	if (!buffer)
+		return -ENOMEM;
+
+	err = snapshot_convert_rgb(image, cs, png ? buffer + 1 : buffer, pitch);
+	if (err < 0)
+		goto free;
+
+	fp = fopen(filename, "wb");
+	if (!fp) {
+		err = -errno;
+		goto free;
+	}
+
+	if (png) {
+		for (j = 0; j < image->height; j++)
+			buffer[pitch * j] = 0;
+
+		png_write(fp, image->width, image->height, buffer, size);
+	} else {
+		fprintf(fp, "P6\n%u %u\n255\n", image->width, image->height);
+		fwrite(buffer, 1, size, fp);
+	}
+
+	if (ferror(fp))
+		err = -EIO;
+
+	if (fclose(fp) != 0 && err == 0)
+		err = -errno;
+
+free:
+	free(buffer);
+	return err;
+}
@@ -0,0 +1,42 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct h264_sps;
+struct image;
+
+/*
+ * Viewable snapshots of decoded images. The image (or a view or thumbnail of
+ * it) is converted to 8-bit RGB and written as binary PPM or as PNG with
+ * stored (uncompressed) deflate blocks, whichever the file name ends in.
+ */
+
+enum snapshot_matrix {
+	SNAPSHOT_MATRIX_BT601,
+	SNAPSHOT_MATRIX_BT709,
+};
+
+struct snapshot_colorspace {
+	enum snapshot_matrix matrix;
+	bool full_range;
+};
+
+/*
+ * Takes the matrix and range from the VUI of the SPS. Without a colour
+ * description, HD pictures are assumed to be BT.709 and SD ones BT.601.
+ */
+void snapshot_colorspace_from_sps(struct snapshot_colorspace *cs,
+				  const struct h264_sps *sps);
+
+/* converts a YUV 4:2:0 image to packed RGB rows, pitch bytes apart */
+int snapshot_convert_rgb(const struct image *image,
+			 const struct snapshot_colorspace *cs, uint8_t *rgb,
+			 size_t pitch);
+
+int snapshot_write(const struct image *image,
+		   const struct snapshot_colorspace *cs, const char *filename);
+
+#endif
@@ -0,0 +1,177 @@
+#include <time.h>
+
+#include "stats.h"
+#include "utils.h"
+
+/*
+ * Latencies are collected in log-linear histograms, in the spirit of
+ * HdrHistogram: values below 2^P nanoseconds are counted exactly, above that
+ * each power of two is split into 2^P buckets, which bounds the error of any
+ * reported percentile to about 3%.
+ */
+#define VDE_HISTOGRAM_PRECISION 5
+#define VDE_HISTOGRAM_SUB_BUCKETS (1 << VDE_HISTOGRAM_PRECISION)
+/* values of 2^40 ns (about 18 minutes) and up end up in the last bucket */
+#define VDE_HISTOGRAM_MAX_SHIFT 40
+#define VDE_HISTOGRAM_BUCKETS \
+	((VDE_HISTOGRAM_MAX_SHIFT - VDE_HISTOGRAM_PRECISION + 1) * \
+	 VDE_HISTOGRAM_SUB_BUCKETS)
+
+struct vde_histogram {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+	uint64_t buckets[VDE_HISTOGRAM_BUCKETS];
+};
+
+static const char * const vde_stage_names[VDE_STAGE_MAX] = {
+	[VDE_STAGE_DEMUX] = "demux",
+	[VDE_STAGE_BSF] = "bsf",
+	[VDE_STAGE_COPY] = "copy",
+	[VDE_STAGE_DECODE] = "decode",
+	[VDE_STAGE_DETILE] = "detile",
+	[VDE_STAGE_OUTPUT] = "output",
+};
+
+bool vde_stats_enabled;
+
+static struct vde_histogram vde_histograms[VDE_STAGE_MAX];
+static uint64_t vde_counters[VDE_COUNTER_MAX];
+static uint64_t vde_stats_start;
+
+uint64_t vde_stats_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static unsigned int vde_histogram_index(uint64_t value)
+{
+	unsigned int shift;
+
+	if (value < VDE_HISTOGRAM_SUB_BUCKETS)
+		return value;
+
+	shift = 63 - __builtin_clzll(value);
+	if (shift >= VDE_HISTOGRAM_MAX_SHIFT)
+		return VDE_HISTOGRAM_BUCKETS - 1;
+
+	return (shift - VDE_HISTOGRAM_PRECISION + 1) * VDE_HISTOGRAM_SUB_BUCKETS +
+	       ((value >> (shift - VDE_HISTOGRAM_PRECISION)) &
+		(VDE_HISTOGRAM_SUB_BUCKETS - 1));
+}
+
+/* highest value that is counted in a bucket */
+static uint64_t vde_histogram_value(unsigned int index)
+{
+	unsigned int octave = index / VDE_HISTOGRAM_SUB_BUCKETS;
+	uint64_t sub = index % VDE_HISTOGRAM_SUB_BUCKETS;
+
+	if (octave == 0)
+		return index;
+
+	return ((VDE_HISTOGRAM_SUB_BUCKETS + sub + 1) << (octave - 1)) - 1;
+}
+
+static void vde_histogram_record(struct vde_histogram *histogram,
+				 uint64_t value)
+{
+	uint64_t max = __atomic_load_n(&histogram->max, __ATOMIC_RELAXED);
+
+	__atomic_fetch_add(&histogram->buckets[vde_histogram_index(value)], 1,
+			   __ATOMIC_RELAXED);
+	__atomic_fetch_add(&histogram->count, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&histogram->sum, value, __ATOMIC_RELAXED);
+
+	while (value > max &&
+	       !__atomic_compare_exchange_n(&histogram->max, &max, value, true,
+					    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+static uint64_t vde_histogram_percentile(const struct vde_histogram *histogram,
+					 unsigned int percentile)
+{
+	uint64_t count = 0, target, value;
+	unsigned int i;
+
+	if (histogram->count == 0)
+		return 0;
+
+	target = DIV_ROUND_UP(histogram->count * percentile, 100);
+
+	for (i = 0; i < VDE_HISTOGRAM_BUCKETS; i++) {
+		count += histogram->buckets[i];
+
+		if (count >= target)
+			break;
+	}
+
+	value = vde_histogram_value(i);
+
+	return value < histogram->max ? value : histogram->max;
+}
+
+void vde_stats_enable(void)
+{
+	vde_stats_start = vde_stats_now();
+	vde_stats_enabled = true;
+}
+
+void vde_stats_end(enum vde_stage stage, uint64_t start)
+{
+	if (vde_stats_enabled && start)
+		vde_histogram_record(&vde_histograms[stage],
+				     vde_stats_now() - start);
+}
+
+void vde_stats_add(enum vde_counter counter, uint64_t value)
+{
+	if (vde_stats_enabled)
+		__atomic_fetch_add(&vde_counters[counter], value,
+				   __ATOMIC_RELAXED);
+}
+
+void vde_stats_report(FILE *fp)
+{
+	uint64_t elapsed = vde_stats_now() - vde_stats_start;
+	double seconds = elapsed / 1e9;
+	unsigned int i;
+
+	if (!vde_stats_enabled)
+		return;
+
+	fprintf(fp, "%llu frames in %.3f s\n",
+		(unsigned long long)vde_counters[VDE_COUNTER_FRAMES], seconds);
+	fprintf(fp, "  frames/s: %.1f\n",
+		vde_counters[VDE_COUNTER_FRAMES] / seconds);
+	fprintf(fp, "  MB/s: %.3f (bitstream)\n",
+		vde_counters[VDE_COUNTER_BYTES] / seconds / 1e6);
+	fprintf(fp, "  macroblocks/s: %.0f\n",
+		vde_counters[VDE_COUNTER_MACROBLOCKS] / seconds);
+	fprintf(fp, "  ioctl retries: %llu EINTR, %llu EAGAIN\n",
+		(unsigned long long)vde_counters[VDE_COUNTER_EINTR],
+		(unsigned long long)vde_counters[VDE_COUNTER_EAGAIN]);
+
+	fprintf(fp, "  %-8s %8s %10s %10s %10s %10s %10s (us)\n", "stage",
+		"count", "mean", "p50", "p90", "p99", "max");
+
+	for (i = 0; i < VDE_STAGE_MAX; i++) {
+		const struct vde_histogram *histogram = &vde_histograms[i];
+
+		if (histogram->count == 0)
+			continue;
+
+		fprintf(fp, "  %-8s %8llu %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+			vde_stage_names[i],
+			(unsigned long long)histogram->count,
+			histogram->sum / 1e3 / histogram->count,
+			vde_histogram_percentile(histogram, 50) / 1e3,
+			vde_histogram_percentile(histogram, 90) / 1e3,
+			vde_histogram_percentile(histogram, 99) / 1e3,
+			histogram->max / 1e3);
+	}
+}
@@ -0,0 +1,47 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* stages of the decode pipeline that are timed */
+enum vde_stage {
+	VDE_STAGE_DEMUX,
+	VDE_STAGE_BSF,
+	VDE_STAGE_COPY,
+	VDE_STAGE_DECODE,
+	VDE_STAGE_DETILE,
+	VDE_STAGE_OUTPUT,
+	VDE_STAGE_MAX,
+};
+
+enum vde_counter {
+	VDE_COUNTER_FRAMES,
+	VDE_COUNTER_BYTES,
+	VDE_COUNTER_MACROBLOCKS,
+	/* retries of the decode ioctl */
+	VDE_COUNTER_EINTR,
+	VDE_COUNTER_EAGAIN,
+	VDE_COUNTER_MAX,
+};
+
+/*
+ * Statistics are global and can be updated from any thread. They cost one
+ * branch per call site unless they have been enabled.
+ */
+extern bool vde_stats_enabled;
+
+uint64_t vde_stats_now(void);
+
+static inline uint64_t vde_stats_begin(void)
+{
+	return vde_stats_enabled ? vde_stats_now() : 0;
+}
+
+void vde_stats_enable(void);
+void vde_stats_end(enum vde_stage stage, uint64_t start);
+void vde_stats_add(enum vde_counter counter, uint64_t value);
+void vde_stats_report(FILE *fp);
+
+#endif
@@ -0,0 +1,207 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/syscall.h>
+
+#include "trace.h"
+
+/* events per thread, older events are overwritten once the ring is full */
+#define VDE_TRACE_RING_SIZE (1 << 16)
+
+struct vde_trace_event {
+	uint64_t time;
+	const char *name;
+	uint64_t frame;
+	unsigned int stream;
+	char phase;
+};
+
+struct vde_trace_ring {
+	struct vde_trace_event events[VDE_TRACE_RING_SIZE];
+	/* number of events ever recorded, only written by the owning thread */
+	uint64_t head;
+
+	pid_t tid;
+	char name[16];
+
+	struct vde_trace_ring *next;
+};
+
+bool vde_trace_enabled;
+
+static struct vde_trace_ring *vde_trace_rings;
+static __thread struct vde_trace_ring *vde_trace_ring;
+
+/*
+ * Bumped by vde_trace_disable(), which frees all rings. A thread whose ring
+ * belongs to an older generation must not touch it and creates a new one.
+ */
+static unsigned int vde_trace_generation;
+static __thread unsigned int vde_trace_ring_generation;
+
+static uint64_t vde_trace_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static struct vde_trace_ring *vde_trace_ring_create(void)
+{
+	struct vde_trace_ring *ring;
+
+	ring = calloc(1, sizeof(*ring));
+	if (!ring)
+		return NULL;
+
+	ring->tid = syscall(SYS_gettid);
+	pthread_getname_np(pthread_self(), ring->name, sizeof(ring->name));
+
+	/* rings are only ever added, so a plain compare-and-swap will do */
+	ring->next = __atomic_load_n(&vde_trace_rings, __ATOMIC_RELAXED);
+
+	while (!__atomic_compare_exchange_n(&vde_trace_rings, &ring->next, ring,
+					    true, __ATOMIC_RELEASE,
+					    __ATOMIC_RELAXED))
+		;
+
+	return ring;
+}
+
+void vde_trace_record(const char *name, char phase, unsigned int stream,
+		      uint64_t frame)
+{
+	unsigned int generation = __atomic_load_n(&vde_trace_generation,
+						  __ATOMIC_ACQUIRE);
+	struct vde_trace_ring *ring = vde_trace_ring;
+	struct vde_trace_event *event;
+
+	if (!ring || vde_trace_ring_generation != generation) {
+		ring = vde_trace_ring = vde_trace_ring_create();
+		if (!ring)
+			return;
+
+		vde_trace_ring_generation = generation;
+	}
+
+	event = &ring->events[ring->head % VDE_TRACE_RING_SIZE];
+	event->time = vde_trace_now();
+	event->name = name;
+	event->frame = frame;
+	event->stream = stream;
+	event->phase = phase;
+
+	/* publish the event to vde_trace_flush() */
+	__atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+void vde_trace_enable(void)
+{
+	vde_trace_enabled = true;
+}
+
+static void vde_trace_flush_ring(struct vde_trace_ring *ring, FILE *fp,
+				 struct vde_trace_event *events, bool *first)
+{
+	uint64_t head, start, end, i;
+
+	fprintf(fp, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,"
+		"\"tid\":%d,\"args\":{\"name\":\"%s\"}}", *first ? "" : ",",
+		getpid(), ring->tid, ring->name);
+	*first = false;
+
+	end = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	start = end > VDE_TRACE_RING_SIZE ? end - VDE_TRACE_RING_SIZE : 0;
+
+	for (i = start; i < end; i++)
+		events[i % VDE_TRACE_RING_SIZE] = ring->events[i % VDE_TRACE_RING_SIZE];
+
+	/*
+	 * The thread keeps recording while its events are copied, skip those
+	 * that may have been overwritten in the meantime.
+	 */
+	head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	if (head >= VDE_TRACE_RING_SIZE && head - VDE_TRACE_RING_SIZE + 1 > start)
+		start = head - VDE_TRACE_RING_SIZE + 1;
+
+	for (i = start; i < end; i++) {
+		const struct vde_trace_event *event = &events[i % VDE_TRACE_RING_SIZE];
+
+		fprintf(fp, ",\n{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%llu.%03llu,"
+			"\"pid\":%d,\"tid\":%d,\"args\":{\"stream\":%u,\"frame\":%llu}}",
+			event->name, event->phase,
+			(unsigned long long)(event->time / 1000),
+			(unsigned long long)(event->time % 1000),
+			getpid(), ring->tid, event->stream,
+			(unsigned long long)event->frame);
+	}
+}
+
+/*
+ * Writes a snapshot of all events recorded so far to a file. This can be
+ * called at any time, threads keep recording while their buffer is copied.
+ */
+int vde_trace_flush(const char *filename)
+{
+	struct vde_trace_event *events;
+	struct vde_trace_ring *ring;
+	bool first = true;
+	FILE *fp;
+	int err = 0;
+
+	events = malloc(sizeof(*events) * VDE_TRACE_RING_SIZE);
+	if (!events)
+		return -ENOMEM;
+
+	fp = fopen(filename, "w");
+	if (!fp) {
+		err = -errno;
+		goto free;
+	}
+
+	fprintf(fp, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+
+	ring = __atomic_load_n(&vde_trace_rings, __ATOMIC_ACQUIRE);
+
+	for (; ring; ring = ring->next)
+		vde_trace_flush_ring(ring, fp, events, &first);
+
+	fprintf(fp, "\n]}\n");
+
+	if (fclose(fp) != 0)
+		err = -errno;
+
+free:
+	free(events);
+	return err;
+}
+
+/*
+ * Frees all events. No thread may be recording while this runs, but threads
+ * don't need to exit: those that record again after tracing is re-enabled
+ * notice the new generation and start a fresh ring.
+ */
+void vde_trace_disable(void)
+{
+	struct vde_trace_ring *ring, *next;
+
+	vde_trace_enabled = false;
+
+	__atomic_add_fetch(&vde_trace_generation, 1, __ATOMIC_RELEASE);
+	ring = __atomic_exchange_n(&vde_trace_rings, NULL, __ATOMIC_ACQUIRE);
+
+	for (; ring; ring = next) {
+		next = ring->next;
+		free(ring);
+	}
+
+	vde_trace_ring = NULL;
+}
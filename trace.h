@@ -0,0 +1,44 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Timeline of decode activity in Chrome trace format, for chrome://tracing
+ * or ui.perfetto.dev. Each thread records begin and end events into a ring
+ * buffer of its own, without any locking, and the buffers are written out
+ * by vde_trace_flush(). Recording costs one branch unless enabled.
+ */
+
+#define VDE_TRACE_READ "read"
+#define VDE_TRACE_PARSE "parse"
+#define VDE_TRACE_STAGE "stage"
+#define VDE_TRACE_DECODE "decode"
+#define VDE_TRACE_DETILE "detile"
+#define VDE_TRACE_OUTPUT "output"
+
+extern bool vde_trace_enabled;
+
+void vde_trace_record(const char *name, char phase, unsigned int stream,
+		      uint64_t frame);
+
+static inline void vde_trace_begin(const char *name, unsigned int stream,
+				   uint64_t frame)
+{
+	if (vde_trace_enabled)
+		vde_trace_record(name, 'B', stream, frame);
+}
+
+static inline void vde_trace_end(const char *name, unsigned int stream,
+				 uint64_t frame)
+{
+	if (vde_trace_enabled)
+		vde_trace_record(name, 'E', stream, frame);
+}
+
+void vde_trace_enable(void);
+int vde_trace_flush(const char *filename);
+void vde_trace_disable(void);
+
+#endif
@@ -1,21 +1,102 @@
 #include <stdint.h>
+#include <string.h>
 
+#include "cpu.h"
 #include "utils.h"
 
+typedef uint8_t hex_u8x16 __attribute__((vector_size(16)));
+typedef uint8_t hex_u8x32 __attribute__((vector_size(32)));
+
+typedef void (*hex_format_fn)(char *dst, const uint8_t *src, size_t size);
+
+/* writes " xx" for each byte, 3 * size characters in total */
+static void hex_format_scalar(char *dst, const uint8_t *src, size_t size)
+{
+	static const char digits[16] = "0123456789abcdef";
+	size_t i;
+
+	for (i = 0; i < size; i++) {
+		dst[i * 3 + 0] = ' ';
+		dst[i * 3 + 1] = digits[src[i] >> 4];
+		dst[i * 3 + 2] = digits[src[i] & 0xf];
+	}
+}
+
+/* converts a vector of bytes to digits at a time, then spreads them out */
+#define HEX_DEFINE_FORMAT(name, type, target)				\
+target static void name(char *dst, const uint8_t *src, size_t size)	\
+{									\
+	uint8_t hi[sizeof(type)], lo[sizeof(type)];			\
+	size_t i, j;							\
+	type v, h, l;							\
+									\
+	for (i = 0; i + sizeof(type) <= size; i += sizeof(type)) {	\
+		memcpy(&v, src + i, sizeof(v));				\
+		h = v >> 4;						\
+		l = v & 0xf;						\
+		h += '0' + ((type)(h > 9) & ('a' - '0' - 10));		\
+		l += '0' + ((type)(l > 9) & ('a' - '0' - 10));		\
+		memcpy(hi, &h, sizeof(hi));				\
+		memcpy(lo, &l, sizeof(lo));				\
+									\
+		for (j = 0; j < sizeof(type); j++) {			\
+			dst[(i + j) * 3 + 0] = ' ';			\
+			dst[(i + j) * 3 + 1] = hi[j];			\
+			dst[(i + j) * 3 + 2] = lo[j];			\
+		}							\
+	}								\
+									\
+	hex_format_scalar(dst + i * 3, src + i, size - i);		\
+}
+
+#if defined(CPU_HAVE_SSE2)
+HEX_DEFINE_FORMAT(hex_format_sse2, hex_u8x16, CPU_TARGET_SSE2)
+HEX_DEFINE_FORMAT(hex_format_avx2, hex_u8x32, CPU_TARGET_AVX2)
+#endif
+
+#if defined(CPU_HAVE_NEON)
+HEX_DEFINE_FORMAT(hex_format_neon, hex_u8x16, CPU_TARGET_NEON)
+#endif
+
+static const hex_format_fn hex_format_impls[CPU_ISA_COUNT] = {
+	[CPU_ISA_SCALAR] = hex_format_scalar,
+	CPU_IMPL_SSE2(hex_format_sse2)
+	CPU_IMPL_AVX2(hex_format_avx2)
+	CPU_IMPL_NEON(hex_format_neon)
+};
+
+/* bytes formatted per write */
+#define HEXDUMP_CHUNK 64
+
 void hexdump(const void *data, size_t size, size_t block_size,
 	     const char *indent, FILE *fp)
 {
+	hex_format_fn format = hex_format_impls[cpu_isa()];
+	char line[HEXDUMP_CHUNK * 3 + 1];
 	const uint8_t *ptr = data;
-	size_t i, j;
+	size_t i, j, n, count;
+
+	/* keeps lines whole when several threads dump at once */
+	flockfile(fp);
 
 	for (j = 0; j < size; j += block_size) {
-		const char *prefix = indent ?: "";
+		count = size - j < block_size ? size - j : block_size;
+
+		fputs(indent ?: "", fp);
 
-		for (i = 0; (i < block_size) && ((i + j) < size); i++) {
-			printf("%s%02x", prefix, ptr[j + i]);
-			prefix = " ";
+		/* the first byte is preceded by the indentation only */
+		for (i = 0; i < count; i += n) {
+			n = count - i < HEXDUMP_CHUNK ? count - i : HEXDUMP_CHUNK;
+			format(line, ptr + j + i, n);
+
+			if (i == 0)
+				fwrite(line + 1, 1, n * 3 - 1, fp);
+			else
+				fwrite(line, 1, n * 3, fp);
 		}
 
-		printf("\n");
+		fputc('\n', fp);
 	}
+
+	funlockfile(fp);
 }
@@ -0,0 +1,378 @@
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "archive.h"
+#include "drm-utils.h"
+#include "image.h"
+#include "snapshot.h"
+
+/*
+ * Inspects frame archives written by vde-decode --archive. Single frames are
+ * extracted without touching the rest of the archive and archives are
+ * compared by the hashes in their indices, so nothing is decompressed.
+ */
+
+static const struct option options[] = {
+	{ "full-range", no_argument, NULL, 'f' },
+	{ "matrix", required_argument, NULL, 'm' },
+	{ "help", no_argument, NULL, 'h' },
+	{ NULL, 0, NULL, 0 },
+};
+
+static void usage(const char *program, FILE *fp)
+{
+	fprintf(fp, "usage: %s [options] list ARCHIVE\n", program);
+	fprintf(fp, "       %s [options] extract ARCHIVE FRAME OUTPUT\n", program);
+	fprintf(fp, "       %s [options] diff ARCHIVE ARCHIVE\n", program);
+	fprintf(fp, "\n");
+	fprintf(fp, "Frames are extracted as PNG or PPM if OUTPUT ends in .png or .ppm\n");
+	fprintf(fp, "and as raw planes otherwise.\n");
+	fprintf(fp, "\n");
+	fprintf(fp, "options:\n");
+	fprintf(fp, "  -f, --full-range      extract to RGB from full-range YUV\n");
+	fprintf(fp, "  -m, --matrix NAME     extract to RGB using the bt601 or bt709 matrix\n");
+	fprintf(fp, "  -h, --help            display this help screen and exit\n");
+}
+
+struct inspector {
+	struct snapshot_colorspace colorspace;
+	bool matrix;
+};
+
+static void format_name(uint32_t format, char name[5])
+{
+	unsigned int i;
+
+	for (i = 0; i < 4; i++)
+		name[i] = format >> (i * 8);
+
+	name[4] = '\0';
+}
+
+static int archive_list(const char *filename)
+{
+	const struct vde_archive_entry *entry;
+	struct vde_archive_file *file;
+	uint64_t stored = 0, raw = 0;
+	unsigned int i, j;
+	char format[5];
+	int err;
+
+	err = vde_archive_open(&file, filename);
+	if (err < 0) {
+		fprintf(stderr, "failed to open archive '%s': %d\n", filename,
+			err);
+		return err;
+	}
+
+	printf("%s: %u frames\n", filename, file->header->num_frames);
+	printf("  %8s %8s %6s %11s %10s %10s  %s\n", "frame", "poc", "format",
+	       "size", "stored", "raw", "hash");
+
+	for (i = 0; i < file->header->num_frames; i++) {
+		uint64_t frame_stored = 0, frame_raw = 0;
+		char poc[12] = "-";
+
+		err = vde_archive_get(file, i, &entry);
+		if (err < 0) {
+			fprintf(stderr, "invalid entry %u: %d\n", i, err);
+			break;
+		}
+
+		for (j = 0; j < entry->num_planes; j++) {
+			frame_stored += entry->sizes[j];
+			frame_raw += entry->raw_sizes[j];
+		}
+
+		if (entry->poc != VDE_ARCHIVE_POC_UNKNOWN)
+			snprintf(poc, sizeof(poc), "%d", entry->poc);
+
+		format_name(entry->format, format);
+
+		printf("  %8" PRIu64 " %8s %6s %5ux%-5u %10" PRIu64 " %10" PRIu64
+		       "  %016" PRIx64 "\n", entry->frame, poc, format,
+		       entry->width, entry->height, frame_stored, frame_raw,
+		       entry->hash);
+
+		stored += frame_stored;
+		raw += frame_raw;
+	}
+
+	if (raw > 0)
+		printf("  %" PRIu64 " of %" PRIu64 " bytes stored (%.1f%%)\n",
+		       stored, raw, stored * 100.0 / raw);
+
+	vde_archive_close(file);
+
+	return err;
+}
+
+static int write_raw(const struct image *image, const char *filename)
+{
+	const struct drm_format_info *info;
+	unsigned int i, j, width, height;
+	FILE *fp;
+	int err = 0;
+
+	info = drm_format_get_info(image->format);
+	if (!info)
+		return -EINVAL;
+
+	fp = fopen(filename, "wb");
+	if (!fp)
+		return -errno;
+
+	for (i = 0; i < info->num_planes && err == 0; i++) {
+		width = image->width;
+		height = image->height;
+
+		if (i > 0) {
+			width /= info->hsub;
+			height /= info->vsub;
+		}
+
+		width *= info->cpp[i];
+
+		for (j = 0; j < height; j++) {
+			if (fwrite(image->planes[i] + j * image->pitches[i], 1,
+				   width, fp) != width) {
+				err = -EIO;
+				break;
+			}
+		}
+	}
+
+	if (fclose(fp) != 0 && err == 0)
+		err = -errno;
+
+	return err;
+}
+
+static bool has_suffix(const char *filename, const char *suffix)
+{
+	size_t length = strlen(filename), size = strlen(suffix);
+
+	return length >= size && strcasecmp(filename + length - size,
+					    suffix) == 0;
+}
+
+static int archive_extract(struct inspector *inspector, const char *filename,
+			   const char *frame, const char *output)
+{
+	struct vde_archive_file *file;
+	struct image *image;
+	int index, err;
+	char *end;
+	uint64_t n;
+
+	n = strtoull(frame, &end, 0);
+	if (*frame == '\0' || *end != '\0') {
+		fprintf(stderr, "invalid frame number: %s\n", frame);
+		return -EINVAL;
+	}
+
+	err = vde_archive_open(&file, filename);
+	if (err < 0) {
+		fprintf(stderr, "failed to open archive '%s': %d\n", filename,
+			err);
+		return err;
+	}
+
+	index = vde_archive_find(file, n);
+	if (index < 0) {
+		fprintf(stderr, "frame %" PRIu64 " not found in '%s'\n", n,
+			filename);
+		err = index;
+		goto close;
+	}
+
+	err = vde_archive_extract(file, index, &image);
+	if (err < 0) {
+		fprintf(stderr, "failed to extract frame %" PRIu64 ": %d\n", n,
+			err);
+		goto close;
+	}
+
+	if (has_suffix(output, ".png") || has_suffix(output, ".ppm")) {
+		/* same guess as for streams without a colour description */
+		if (!inspector->matrix)
+			inspector->colorspace.matrix = image->height > 576 ?
+						       SNAPSHOT_MATRIX_BT709 :
+						       SNAPSHOT_MATRIX_BT601;
+
+		err = snapshot_write(image, &inspector->colorspace, output);
+	} else {
+		err = write_raw(image, output);
+	}
+
+	if (err < 0)
+		fprintf(stderr, "failed to write '%s': %d\n", output, err);
+
+	image_free(image);
+close:
+	vde_archive_close(file);
+	return err;
+}
+
+static const char *entry_mismatch(const struct vde_archive_entry *a,
+				  const struct vde_archive_entry *b)
+{
+	if (a->format != b->format)
+		return "format";
+
+	if (a->width != b->width || a->height != b->height)
+		return "size";
+
+	if (a->hash != b->hash)
+		return "hash";
+
+	return NULL;
+}
+
+/* frames of a that are missing from b, or differ if compare is set */
+static int archive_diff_one(struct vde_archive_file *a,
+			    struct vde_archive_file *b, const char *name,
+			    bool compare, unsigned int *differences)
+{
+	const struct vde_archive_entry *entry, *other;
+	const char *mismatch;
+	unsigned int i;
+	int index, err;
+
+	for (i = 0; i < a->header->num_frames; i++) {
+		err = vde_archive_get(a, i, &entry);
+		if (err < 0) {
+			fprintf(stderr, "invalid entry %u: %d\n", i, err);
+			return err;
+		}
+
+		index = vde_archive_find(b, entry->frame);
+		if (index < 0) {
+			printf("frame %" PRIu64 ": only in %s\n", entry->frame,
+			       name);
+			(*differences)++;
+			continue;
+		}
+
+		if (!compare)
+			continue;
+
+		err = vde_archive_get(b, index, &other);
+		if (err < 0) {
+			fprintf(stderr, "invalid entry %d: %d\n", index, err);
+			return err;
+		}
+
+		mismatch = entry_mismatch(entry, other);
+		if (mismatch) {
+			printf("frame %" PRIu64 ": %s differs\n", entry->frame,
+			       mismatch);
+			(*differences)++;
+		}
+	}
+
+	return 0;
+}
+
+static int archive_diff(const char *first, const char *second,
+			unsigned int *differences)
+{
+	struct vde_archive_file *a, *b;
+	int err;
+
+	err = vde_archive_open(&a, first);
+	if (err < 0) {
+		fprintf(stderr, "failed to open archive '%s': %d\n", first, err);
+		return err;
+	}
+
+	err = vde_archive_open(&b, second);
+	if (err < 0) {
+		fprintf(stderr, "failed to open archive '%s': %d\n", second,
+			err);
+		goto close;
+	}
+
+	err = archive_diff_one(a, b, first, true, differences);
+	if (err == 0)
+		err = archive_diff_one(b, a, second, false, differences);
+
+	if (err == 0)
+		printf("%u and %u frames, %u differences\n",
+		       a->header->num_frames, b->header->num_frames,
+		       *differences);
+
+	vde_archive_close(b);
+close:
+	vde_archive_close(a);
+	return err;
+}
+
+int main(int argc, char *argv[])
+{
+	struct inspector inspector;
+	const char *program = argv[0], *command;
+	unsigned int differences = 0;
+	int opt, err;
+
+	memset(&inspector, 0, sizeof(inspector));
+
+	while ((opt = getopt_long(argc, argv, "fhm:", options, NULL)) != -1) {
+		switch (opt) {
+		case 'f':
+			inspector.colorspace.full_range = true;
+			break;
+
+		case 'h':
+			usage(argv[0], stdout);
+			return 0;
+
+		case 'm':
+			if (strcmp(optarg, "bt601") == 0) {
+				inspector.colorspace.matrix = SNAPSHOT_MATRIX_BT601;
+			} else if (strcmp(optarg, "bt709") == 0) {
+				inspector.colorspace.matrix = SNAPSHOT_MATRIX_BT709;
+			} else {
+				fprintf(stderr, "unknown matrix: %s\n", optarg);
+				return 1;
+			}
+
+			inspector.matrix = true;
+			break;
+
+		default:
+			usage(argv[0], stderr);
+			return 1;
+		}
+	}
+
+	if (optind >= argc) {
+		usage(argv[0], stderr);
+		return 1;
+	}
+
+	command = argv[optind++];
+	argc -= optind;
+	argv += optind;
+
+	if (strcmp(command, "list") == 0 && argc == 1) {
+		err = archive_list(argv[0]);
+	} else if (strcmp(command, "extract") == 0 && argc == 3) {
+		err = archive_extract(&inspector, argv[0], argv[1], argv[2]);
+	} else if (strcmp(command, "diff") == 0 && argc == 2) {
+		err = archive_diff(argv[0], argv[1], &differences);
+		if (err == 0 && differences > 0)
+			return 1;
+	} else {
+		usage(program, stderr);
+		return 1;
+	}
+
+	return err < 0 ? 1 : 0;
+}
@@ -0,0 +1,762 @@
+#include <errno.h>
+#include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "archive.h"
+#include "image.h"
+#include "mp4.h"
+#include "stats.h"
+#include "utils.h"
+#include "vde-decode.h"
+
+/*
+ * Decodes a batch of clips listed in a manifest, one per line:
+ *
+ *   INPUT [ARCHIVE]
+ *
+ * Empty lines and lines starting with # are ignored. Sessions are opened once
+ * and kept warm for the whole batch, and clips are demuxed ahead of time by
+ * worker threads, so switching to the next clip costs little more than setting
+ * its parameter sets. Per-clip results are summarized as JSON.
+ */
+
+static const struct option options[] = {
+	{ "interleave", required_argument, NULL, 'i' },
+	{ "jobs", required_argument, NULL, 'j' },
+	{ "output", required_argument, NULL, 'o' },
+	{ "io-depth", required_argument, NULL, 'Q' },
+	{ "soft", no_argument, NULL, 's' },
+	{ "verbose", no_argument, NULL, 'v' },
+	{ "lz4", no_argument, NULL, 'z' },
+	{ "help", no_argument, NULL, 'h' },
+	{ NULL, 0, NULL, 0 },
+};
+
+static void usage(const char *program, FILE *fp)
+{
+	fprintf(fp, "usage: %s [options] MANIFEST\n", program);
+	fprintf(fp, "\n");
+	fprintf(fp, "options:\n");
+	fprintf(fp, "  -i, --interleave N  decode N clips at a time on sessions sharing the\n");
+	fprintf(fp, "                      decoder (default: 1, back to back)\n");
+	fprintf(fp, "  -j, --jobs N        demux clips on N worker threads (default: 2)\n");
+	fprintf(fp, "  -o, --output FILE   write the JSON summary to FILE (default: stdout)\n");
+	fprintf(fp, "  -Q, --io-depth N    read N samples ahead and keep N archived frames in\n");
+	fprintf(fp, "                      flight using io_uring\n");
+	fprintf(fp, "  -s, --soft          use the software stand-in instead of the VDE\n");
+	fprintf(fp, "  -v, --verbose       print the decoder's debugging output, use -o to keep\n");
+	fprintf(fp, "                      the summary apart from it\n");
+	fprintf(fp, "  -z, --lz4           compress archived frames with LZ4\n");
+	fprintf(fp, "  -h, --help          display this help screen and exit\n");
+}
+
+struct batch_sample {
+	size_t offset;
+	size_t size;
+};
+
+struct batch_clip {
+	char *input;
+	char *output;
+
+	/* filled in by a demux worker */
+	uint8_t *avcc;
+	size_t avcc_size;
+	uint8_t *data;
+	struct batch_sample *samples;
+	unsigned int num_samples;
+	unsigned int width;
+	unsigned int height;
+	uint64_t demux_time;
+	bool ready;
+
+	/* decoding */
+	struct vde_archive *archive;
+	unsigned int submitted;
+	unsigned int received;
+	unsigned int failed;
+	uint64_t start;
+	uint64_t switch_time;
+	uint64_t decode_time;
+	uint64_t bytes;
+	int err;
+};
+
+struct batch_slot {
+	struct vde_session *session;
+	struct batch_clip *clip;
+};
+
+struct batch {
+	struct batch_clip *clips;
+	unsigned int num_clips;
+	unsigned int max_clips;
+
+	/* demux workers stay up to window clips ahead of the decoder */
+	pthread_t *workers;
+	unsigned int num_workers;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	unsigned int next;
+	unsigned int started;
+	unsigned int window;
+	bool stop;
+
+	struct vde_scheduler *scheduler;
+	struct batch_slot *slots;
+	unsigned int num_slots;
+	unsigned int finished;
+
+	struct vde_session_config config;
+	unsigned int archive_flags;
+	unsigned int io_depth;
+	uint64_t setup_time;
+};
+
+/* how long to wait for frames when none of the slots made progress */
+#define BATCH_POLL_MS 1
+
+static int batch_add_clip(struct batch *batch, const char *input,
+			  const char *output)
+{
+	struct batch_clip *clip;
+
+	if (batch->num_clips == batch->max_clips) {
+		unsigned int max = batch->max_clips * 2 ?: 64;
+
+		clip = realloc(batch->clips, max * sizeof(*clip));
+		if (!clip)
+			return -ENOMEM;
+
+		batch->clips = clip;
+		batch->max_clips = max;
+	}
+
+	clip = &batch->clips[batch->num_clips];
+	memset(clip, 0, sizeof(*clip));
+
+	clip->input = strdup(input);
+	clip->output = output ? strdup(output) : NULL;
+
+	if (!clip->input || (output && !clip->output)) {
+		free(clip->output);
+		free(clip->input);
+		return -ENOMEM;
+	}
+
+	batch->num_clips++;
+
+	return 0;
+}
+
+static int batch_parse_manifest(struct batch *batch, const char *filename)
+{
+	char *line = NULL, *input, *output, *save;
+	unsigned int number = 0;
+	size_t size = 0;
+	int err = 0;
+	FILE *fp;
+
+	fp = fopen(filename, "r");
+	if (!fp)
+		return -errno;
+
+	while (getline(&line, &size, fp) >= 0) {
+		number++;
+
+		input = strtok_r(line, " \t\r\n", &save);
+		if (!input || input[0] == '#')
+			continue;
+
+		output = strtok_r(NULL, " \t\r\n", &save);
+
+		if (strtok_r(NULL, " \t\r\n", &save)) {
+			fprintf(stderr, "%s:%u: too many fields\n", filename,
+				number);
+			err = -EINVAL;
+			break;
+		}
+
+		err = batch_add_clip(batch, input, output);
+		if (err < 0)
+			break;
+	}
+
+	free(line);
+	fclose(fp);
+
+	return err;
+}
+
+/* copies the samples out of the file, so the decoder never waits for I/O */
+static int batch_demux(struct batch *batch, struct batch_clip *clip)
+{
+	struct mp4_sample sample;
+	struct mp4_file *mp4;
+	size_t size = 0, max;
+	uint8_t *data;
+	int err;
+
+	err = mp4_open(&mp4, clip->input);
+	if (err < 0)
+		return err;
+
+	clip->width = mp4->width;
+	clip->height = mp4->height;
+
+	clip->avcc = malloc(mp4->avcc_size);
+	clip->samples = calloc(mp4->num_samples, sizeof(*clip->samples));
+	if (!clip->avcc || !clip->samples) {
+		err = -ENOMEM;
+		goto close;
+	}
+
+	memcpy(clip->avcc, mp4->avcc, mp4->avcc_size);
+	clip->avcc_size = mp4->avcc_size;
+
+	if (batch->io_depth > 0) {
+		err = mp4_start_readahead(mp4, batch->io_depth);
+		if (err < 0)
+			fprintf(stderr, "%s: failed to set up readahead: %d\n",
+				clip->input, err);
+	}
+
+	max = 0;
+
+	while ((err = mp4_next_sample(mp4, &sample)) == 0) {
+		if (size + sample.size > max) {
+			max = MAX(max * 2, size + sample.size);
+
+			data = realloc(clip->data, max);
+			if (!data) {
+				err = -ENOMEM;
+				goto close;
+			}
+
+			clip->data = data;
+		}
+
+		memcpy(clip->data + size, sample.data, sample.size);
+		clip->samples[clip->num_samples].offset = size;
+		clip->samples[clip->num_samples].size = sample.size;
+		clip->num_samples++;
+		size += sample.size;
+	}
+
+	if (err == -ENOENT)
+		err = 0;
+
+close:
+	mp4_close(mp4);
+	return err;
+}
+
+static void batch_clip_release(struct batch_clip *clip)
+{
+	free(clip->samples);
+	free(clip->data);
+	free(clip->avcc);
+
+	clip->samples = NULL;
+	clip->data = NULL;
+	clip->avcc = NULL;
+}
+
+static void *batch_worker(void *data)
+{
+	struct batch *batch = data;
+	struct batch_clip *clip;
+	uint64_t start;
+	int err;
+
+	pthread_mutex_lock(&batch->lock);
+
+	while (!batch->stop && batch->next < batch->num_clips) {
+		if (batch->next >= batch->started + batch->window) {
+			pthread_cond_wait(&batch->cond, &batch->lock);
+			continue;
+		}
+
+		clip = &batch->clips[batch->next++];
+		pthread_mutex_unlock(&batch->lock);
+
+		start = vde_stats_now();
+		err = batch_demux(batch, clip);
+		clip->demux_time = vde_stats_now() - start;
+
+		if (err < 0) {
+			batch_clip_release(clip);
+			clip->err = err;
+		}
+
+		pthread_mutex_lock(&batch->lock);
+		clip->ready = true;
+		pthread_cond_broadcast(&batch->cond);
+	}
+
+	pthread_mutex_unlock(&batch->lock);
+
+	return NULL;
+}
+
+static void batch_finish(struct batch *batch, struct batch_slot *slot)
+{
+	struct batch_clip *clip = slot->clip;
+	int err;
+
+	err = vde_archive_finish(clip->archive);
+	if (err < 0 && clip->err == 0)
+		clip->err = err;
+
+	clip->archive = NULL;
+
+	if (clip->start)
+		clip->decode_time = vde_stats_now() - clip->start;
+
+	fprintf(stderr, "%s: %u frames, %u failed, %d\n", clip->input,
+		clip->received - clip->failed, clip->failed, clip->err);
+
+	batch_clip_release(clip);
+	slot->clip = NULL;
+	batch->finished++;
+}
+
+/* takes on the next clip in manifest order, if it has been demuxed */
+static bool batch_start(struct batch *batch, struct batch_slot *slot)
+{
+	struct batch_clip *clip = NULL;
+	uint64_t start;
+	int err;
+
+	pthread_mutex_lock(&batch->lock);
+
+	if (batch->started < batch->num_clips &&
+	    batch->clips[batch->started].ready) {
+		clip = &batch->clips[batch->started++];
+		pthread_cond_broadcast(&batch->cond);
+	}
+
+	pthread_mutex_unlock(&batch->lock);
+
+	if (!clip)
+		return false;
+
+	slot->clip = clip;
+
+	if (clip->err < 0) {
+		batch_finish(batch, slot);
+		return true;
+	}
+
+	start = vde_stats_now();
+
+	err = vde_session_set_parameter_sets(slot->session, clip->avcc,
+					     clip->avcc_size);
+	if (err == 0 && clip->output) {
+		err = vde_archive_create(&clip->archive, clip->output,
+					 batch->archive_flags);
+		if (err == 0 && batch->io_depth > 0)
+			vde_archive_set_async(clip->archive, batch->io_depth);
+	}
+
+	clip->start = vde_stats_now();
+	clip->switch_time = clip->start - start;
+
+	if (err < 0) {
+		clip->err = err;
+		batch_finish(batch, slot);
+	}
+
+	return true;
+}
+
+static void batch_output(struct batch_clip *clip, struct vde_frame *frame)
+{
+	struct image *image;
+	int err;
+
+	if (!clip->archive)
+		return;
+
+	err = vde_frame_detile(frame, &image);
+	if (err == 0) {
+		/* sessions number frames across clips, samples count per clip */
+		err = vde_archive_add(clip->archive, image, frame->user,
+				      VDE_ARCHIVE_POC_UNKNOWN);
+		image_free(image);
+	}
+
+	if (err < 0 && clip->err == 0)
+		clip->err = err;
+}
+
+/* submits and receives whatever doesn't block, returns whether it did any */
+static bool batch_step(struct batch *batch, struct batch_slot *slot)
+{
+	struct batch_clip *clip = slot->clip;
+	const struct batch_sample *sample;
+	struct vde_frame *frame;
+	bool progress = false;
+	int err;
+
+	while (clip->submitted < clip->num_samples) {
+		sample = &clip->samples[clip->submitted];
+
+		err = vde_session_submit(slot->session,
+					 clip->data + sample->offset,
+					 sample->size, VDE_SUBMIT_AVCC,
+					 clip->submitted);
+		if (err == -EAGAIN)
+			break;
+
+		/* frames already in flight are still picked up */
+		if (err < 0) {
+			clip->err = err;
+			clip->num_samples = clip->submitted;
+			break;
+		}
+
+		clip->bytes += sample->size;
+		clip->submitted++;
+		progress = true;
+	}
+
+	while (true) {
+		err = vde_session_receive(slot->session, &frame, 0);
+		if (err == -EAGAIN)
+			break;
+
+		if (err == -ENODATA) {
+			if (clip->submitted == clip->num_samples) {
+				batch_finish(batch, slot);
+				progress = true;
+			}
+
+			break;
+		}
+
+		clip->received++;
+		progress = true;
+
+		if (err < 0) {
+			clip->failed++;
+			continue;
+		}
+
+		batch_output(clip, frame);
+		vde_frame_release(frame);
+	}
+
+	return progress;
+}
+
+static void batch_wait(struct batch *batch)
+{
+	struct pollfd fds[batch->num_slots];
+	unsigned int i, count = 0;
+
+	for (i = 0; i < batch->num_slots; i++) {
+		if (!batch->slots[i].clip)
+			continue;
+
+		fds[count].fd = vde_session_get_fd(batch->slots[i].session);
+		fds[count].events = POLLIN;
+		count++;
+	}
+
+	/* nothing is being decoded, so wait for the next clip to be demuxed */
+	if (count == 0) {
+		pthread_mutex_lock(&batch->lock);
+
+		while (batch->started < batch->num_clips &&
+		       !batch->clips[batch->started].ready)
+			pthread_cond_wait(&batch->cond, &batch->lock);
+
+		pthread_mutex_unlock(&batch->lock);
+		return;
+	}
+
+	poll(fds, count, BATCH_POLL_MS);
+}
+
+static int batch_run(struct batch *batch)
+{
+	struct batch_slot *slot;
+	unsigned int i;
+	bool progress;
+	int err;
+
+	err = pthread_mutex_init(&batch->lock, NULL);
+	if (err)
+		return -err;
+
+	pthread_cond_init(&batch->cond, NULL);
+
+	for (i = 0; i < batch->num_workers; i++) {
+		err = pthread_create(&batch->workers[i], NULL, batch_worker,
+				     batch);
+		if (err) {
+			batch->num_workers = i;
+			err = -err;
+			goto stop;
+		}
+	}
+
+	while (batch->finished < batch->num_clips) {
+		progress = false;
+
+		for (i = 0; i < batch->num_slots; i++) {
+			slot = &batch->slots[i];
+
+			if (!slot->clip)
+				progress |= batch_start(batch, slot);
+
+			if (slot->clip)
+				progress |= batch_step(batch, slot);
+		}
+
+		if (!progress)
+			batch_wait(batch);
+	}
+
+	err = 0;
+
+stop:
+	pthread_mutex_lock(&batch->lock);
+	batch->stop = true;
+	pthread_cond_broadcast(&batch->cond);
+	pthread_mutex_unlock(&batch->lock);
+
+	for (i = 0; i < batch->num_workers; i++)
+		pthread_join(batch->workers[i], NULL);
+
+	pthread_cond_destroy(&batch->cond);
+	pthread_mutex_destroy(&batch->lock);
+
+	return err;
+}
+
+static int batch_open(struct batch *batch)
+{
+	struct vde_session_config config = batch->config;
+	uint64_t start = vde_stats_now();
+	unsigned int i;
+	int err;
+
+	batch->slots = calloc(batch->num_slots, sizeof(*batch->slots));
+	batch->workers = calloc(batch->num_workers, sizeof(*batch->workers));
+	if (!batch->slots || !batch->workers)
+		return -ENOMEM;
+
+	/* interleaved clips share the decoder through a scheduler */
+	if (batch->num_slots > 1) {
+		err = vde_scheduler_create(&batch->scheduler, NULL);
+		if (err < 0)
+			return err;
+
+		config.scheduler = batch->scheduler;
+	}
+
+	for (i = 0; i < batch->num_slots; i++) {
+		err = vde_session_open(&batch->slots[i].session, &config);
+		if (err < 0)
+			return err;
+	}
+
+	batch->setup_time = vde_stats_now() - start;
+
+	return 0;
+}
+
+static void batch_close(struct batch *batch)
+{
+	unsigned int i;
+
+	if (batch->slots)
+		for (i = 0; i < batch->num_slots; i++)
+			vde_session_close(batch->slots[i].session);
+
+	vde_scheduler_free(batch->scheduler);
+
+	for (i = 0; i < batch->num_clips; i++) {
+		free(batch->clips[i].output);
+		free(batch->clips[i].input);
+	}
+
+	free(batch->workers);
+	free(batch->slots);
+	free(batch->clips);
+}
+
+static void json_string(FILE *fp, const char *s)
+{
+	fputc('"', fp);
+
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\')
+			fprintf(fp, "\\%c", *s);
+		else if ((unsigned char)*s < 0x20)
+			fprintf(fp, "\\u%04x", *s);
+		else
+			fputc(*s, fp);
+	}
+
+	fputc('"', fp);
+}
+
+static void batch_write_json(struct batch *batch, FILE *fp, uint64_t time)
+{
+	unsigned int i, failed = 0;
+	uint64_t frames = 0;
+
+	fprintf(fp, "{\n");
+	fprintf(fp, "  \"clips\": [");
+
+	for (i = 0; i < batch->num_clips; i++) {
+		struct batch_clip *clip = &batch->clips[i];
+
+		fprintf(fp, "%s\n    { \"input\": ", i ? "," : "");
+		json_string(fp, clip->input);
+
+		if (clip->output) {
+			fprintf(fp, ", \"output\": ");
+			json_string(fp, clip->output);
+		}
+
+		fprintf(fp, ", \"status\": %d, \"width\": %u, \"height\": %u, "
+			"\"frames\": %u, \"failed\": %u, \"bytes\": %llu, "
+			"\"demux_ms\": %.3f, \"switch_ms\": %.3f, "
+			"\"decode_ms\": %.3f }", clip->err, clip->width,
+			clip->height, clip->received - clip->failed,
+			clip->failed, (unsigned long long)clip->bytes,
+			clip->demux_time / 1e6, clip->switch_time / 1e6,
+			clip->decode_time / 1e6);
+
+		frames += clip->received - clip->failed;
+
+		if (clip->err < 0 || clip->failed > 0)
+			failed++;
+	}
+
+	fprintf(fp, "\n  ],\n");
+	fprintf(fp, "  \"total\": %u,\n", batch->num_clips);
+	fprintf(fp, "  \"failed\": %u,\n", failed);
+	fprintf(fp, "  \"frames\": %llu,\n", (unsigned long long)frames);
+	fprintf(fp, "  \"setup_ms\": %.3f,\n", batch->setup_time / 1e6);
+	fprintf(fp, "  \"total_ms\": %.3f,\n", time / 1e6);
+	fprintf(fp, "  \"frames_per_second\": %.1f\n",
+		time ? frames * 1e9 / time : 0.0);
+	fprintf(fp, "}\n");
+}
+
+int main(int argc, char *argv[])
+{
+	const char *output = NULL;
+	struct batch batch;
+	int opt, err;
+	uint64_t start, time = 0;
+	unsigned int i;
+	FILE *fp;
+
+	memset(&batch, 0, sizeof(batch));
+	batch.num_slots = 1;
+	batch.num_workers = 2;
+
+	while ((opt = getopt_long(argc, argv, "hi:j:o:Q:svz", options, NULL)) != -1) {
+		switch (opt) {
+		case 'h':
+			usage(argv[0], stdout);
+			return 0;
+
+		case 'i':
+			batch.num_slots = strtoul(optarg, NULL, 0);
+			break;
+
+		case 'j':
+			batch.num_workers = strtoul(optarg, NULL, 0);
+			break;
+
+		case 'o':
+			output = optarg;
+			break;
+
+		case 'Q':
+			batch.io_depth = strtoul(optarg, NULL, 0);
+			break;
+
+		case 's':
+			batch.config.backend = VDE_BACKEND_SOFTWARE;
+			break;
+
+		case 'v':
+			batch.config.verbose = true;
+			break;
+
+		case 'z':
+			batch.archive_flags |= VDE_ARCHIVE_LZ4;
+			break;
+
+		default:
+			usage(argv[0], stderr);
+			return 1;
+		}
+	}
+
+	if (optind >= argc || batch.num_slots == 0 || batch.num_workers == 0) {
+		usage(argv[0], stderr);
+		return 1;
+	}
+
+	err = batch_parse_manifest(&batch, argv[optind]);
+	if (err < 0) {
+		fprintf(stderr, "failed to read manifest '%s': %d\n",
+			argv[optind], err);
+		goto close;
+	}
+
+	/* enough demuxed clips to keep every slot busy */
+	batch.window = batch.num_workers + batch.num_slots;
+
+	start = vde_stats_now();
+
+	err = batch_open(&batch);
+	if (err < 0) {
+		fprintf(stderr, "failed to open session: %d\n", err);
+		goto close;
+	}
+
+	err = batch_run(&batch);
+	if (err < 0)
+		fprintf(stderr, "failed to run batch: %d\n", err);
+
+	time = vde_stats_now() - start;
+
+	if (err == 0) {
+		fp = output ? fopen(output, "w") : stdout;
+		if (!fp) {
+			err = -errno;
+			fprintf(stderr, "failed to create '%s': %d\n", output,
+				err);
+			goto close;
+		}
+
+		batch_write_json(&batch, fp, time);
+
+		if (fp != stdout)
+			fclose(fp);
+
+		for (i = 0; i < batch.num_clips; i++)
+			if (batch.clips[i].err < 0 || batch.clips[i].failed)
+				err = -EIO;
+	}
+
+close:
+	batch_close(&batch);
+
+	return err < 0 ? 1 : 0;
+}
@@ -0,0 +1,1102 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <drm_fourcc.h>
+
+#include "bitstream.h"
+#include "cpu.h"
+#include "h264-generator.h"
+#include "h264-parser.h"
+#include "hash.h"
+#include "image.h"
+#include "mem.h"
+#include "snapshot.h"
+#include "stats.h"
+#include "utils.h"
+#include "vde.h"
+
+/*
+ * Microbenchmarks of the CPU-side hot paths. Inputs are generated from a
+ * fixed seed and frames are backed by memfd, so the results are reproducible
+ * on any Linux machine, with or without a VDE. Each benchmark is calibrated
+ * to run for at least BENCH_ROUND_NS per round and the median of all rounds
+ * is reported.
+ */
+
+static const struct option options[] = {
+	{ "cpu", required_argument, NULL, 'c' },
+	{ "filter", required_argument, NULL, 'f' },
+	{ "isa", required_argument, NULL, 'I' },
+	{ "layouts", no_argument, NULL, 'l' },
+	{ "output", required_argument, NULL, 'o' },
+	{ "rounds", required_argument, NULL, 'r' },
+	{ "seed", required_argument, NULL, 'S' },
+	{ "help", no_argument, NULL, 'h' },
+	{ NULL, 0, NULL, 0 },
+};
+
+static void usage(const char *program, FILE *fp)
+{
+	fprintf(fp, "usage: %s [options]\n", program);
+	fprintf(fp, "\n");
+	fprintf(fp, "options:\n");
+	fprintf(fp, "  -c, --cpu N          pin to CPU N, -1 to not pin (default: 0)\n");
+	fprintf(fp, "  -f, --filter STRING  only run benchmarks whose name contains STRING\n");
+	fprintf(fp, "  -I, --isa NAME       use the scalar, sse2, avx2 or neon kernels (default: auto)\n");
+	fprintf(fp, "  -l, --layouts        show the padding of each block height and the ones\n");
+	fprintf(fp, "                       chosen for common picture sizes, then exit\n");
+	fprintf(fp, "  -o, --output FILE    write results as JSON to FILE\n");
+	fprintf(fp, "  -r, --rounds N       number of timed rounds (default: 9)\n");
+	fprintf(fp, "  -S, --seed N         seed of the generated inputs (default: 1)\n");
+	fprintf(fp, "  -h, --help           display this help screen and exit\n");
+}
+
+#define BENCH_ROUND_NS 20000000ull
+#define BENCH_MAX_ROUNDS 64
+
+/* sizes of the generated inputs */
+#define BENCH_BITSTREAM_SIZE 4096
+#define BENCH_NUM_CODES 4096
+#define BENCH_NUM_HEADERS 256
+#define BENCH_HEADER_SIZE 256
+#define BENCH_STREAM_SIZE (1024 * 1024)
+#define BENCH_FRAME_WIDTH 1920
+#define BENCH_FRAME_HEIGHT 1088
+#define BENCH_PREVIEW_WIDTH 320
+#define BENCH_PREVIEW_HEIGHT 180
+
+struct bench;
+
+struct bench_case {
+	const char *name;
+	int (*setup)(struct bench *bench, struct bench_case *bc);
+	void (*run)(struct bench_case *bc);
+	void (*teardown)(struct bench_case *bc);
+	/* parameter of the benchmark, such as the block height */
+	unsigned int param;
+	/* the benchmark writes debug output to stdout */
+	bool quiet;
+
+	/* filled in by setup, bytes processed by each run */
+	size_t bytes;
+	void *priv;
+};
+
+struct bench_result {
+	uint64_t iterations;
+	double median;
+	double min;
+	double max;
+	/* high-water mark of accounted memory from setup to teardown */
+	uint64_t peak_bytes;
+};
+
+struct bench {
+	struct h264_generator gen;
+	unsigned long long seed;
+	unsigned int rounds;
+	int cpu;
+};
+
+/* keeps the compiler from optimizing away benchmarked work */
+static volatile uint64_t bench_sink;
+
+struct bench_buffer {
+	uint8_t *data;
+	size_t size;
+	/* widths of the fields to read or sizes of the headers */
+	uint8_t *widths;
+	uint16_t *sizes;
+	unsigned int count;
+};
+
+static int bench_buffer_alloc(struct bench_case *bc, size_t size)
+{
+	struct bench_buffer *buffer;
+
+	buffer = calloc(1, sizeof(*buffer));
+	if (!buffer)
+		return -ENOMEM;
+
+	buffer->data = malloc(size);
+	if (!buffer->data) {
+		free(buffer);
+		return -ENOMEM;
+	}
+
+	buffer->size = size;
+	bc->priv = buffer;
+
+	return 0;
+}
+
+static void bench_buffer_free(struct bench_case *bc)
+{
+	struct bench_buffer *buffer = bc->priv;
+
+	free(buffer->sizes);
+	free(buffer->widths);
+	free(buffer->data);
+	free(buffer);
+}
+
+static int bench_read_setup(struct bench *bench, struct bench_case *bc)
+{
+	struct bench_buffer *buffer;
+	size_t bits = 0, i;
+	int err;
+
+	err = bench_buffer_alloc(bc, BENCH_BITSTREAM_SIZE);
+	if (err < 0)
+		return err;
+
+	buffer = bc->priv;
+
+	for (i = 0; i < buffer->size; i++)
+		buffer->data[i] = h264_generator_random(&bench->gen, 256);
+
+	/* upper bound, every field is at least one bit wide */
+	buffer->widths = malloc(buffer->size * 8);
+	if (!buffer->widths)
+		return -ENOMEM;
+
+	while (true) {
+		unsigned int width = 1 + h264_generator_random(&bench->gen, 32);
+
+		if (bits + width > buffer->size * 8)
+			break;
+
+		buffer->widths[buffer->count++] = width;
+		bits += width;
+	}
+
+	bc->bytes = buffer->size;
+
+	return 0;
+}
+
+static void bench_read_run(struct bench_case *bc)
+{
+	struct bench_buffer *buffer = bc->priv;
+	struct bitstream bs;
+	uint64_t sum = 0;
+	uint32_t value;
+	unsigned int i;
+
+	bitstream_init(&bs, buffer->data, buffer->size);
+
+	for (i = 0; i < buffer->count; i++) {
+		bitstream_read_u32(&bs, &value, buffer->widths[i]);
+		sum += value;
+	}
+
+	bench_sink = sum;
+}
+
+static int bench_golomb_setup(struct bench *bench, struct bench_case *bc)
+{
+	struct bench_buffer *buffer;
+	struct bitstream_writer bw;
+	ssize_t length;
+	unsigned int i;
+	int err;
+
+	/* ue(v) of up to 16 bits takes at most 33 bits */
+	err = bench_buffer_alloc(bc, BENCH_NUM_CODES * 5);
+	if (err < 0)
+		return err;
+
+	buffer = bc->priv;
+
+	bitstream_writer_init(&bw, buffer->data, buffer->size, false);
+
+	/* mostly small values, like those found in headers */
+	for (i = 0; i < BENCH_NUM_CODES; i++) {
+		uint32_t max = 1 << h264_generator_random(&bench->gen, 17);
+		uint32_t value = h264_generator_random(&bench->gen, max);
+
+		if (bc->param)
+			bitstream_write_se(&bw, h264_generator_random(&bench->gen, 2) ?
+					   (int32_t)value : -(int32_t)value);
+		else
+			bitstream_write_ue(&bw, value);
+	}
+
+	bitstream_write_trailing_bits(&bw);
+
+	length = bitstream_writer_finish(&bw);
+	if (length < 0)
+		return length;
+
+	buffer->size = length;
+	buffer->count = BENCH_NUM_CODES;
+	bc->bytes = length;
+
+	return 0;
+}
+
+static void bench_golomb_run(struct bench_case *bc)
+{
+	struct bench_buffer *buffer = bc->priv;
+	struct bitstream bs;
+	uint64_t sum = 0;
+	unsigned int i;
+
+	bitstream_init(&bs, buffer->data, buffer->size);
+
+	for (i = 0; i < buffer->count; i++) {
+		if (bc->param) {
+			int32_t value;
+
+			bitstream_read_se(&bs, &value, NULL);
+			sum += value;
+		} else {
+			uint32_t value;
+
+			bitstream_read_ue(&bs, &value, NULL);
+			sum += value;
+		}
+	}
+
+	bench_sink = sum;
+}
+
+/* RBSPs of generated SPS (param 0) or PPS (param 1), without NAL header */
+static int bench_header_setup(struct bench *bench, struct bench_case *bc)
+{
+	struct bench_buffer *buffer;
+	struct h264_sps sps;
+	struct h264_pps pps;
+	uint8_t *unit;
+	ssize_t length;
+	unsigned int i;
+	int err;
+
+	err = bench_buffer_alloc(bc, BENCH_NUM_HEADERS * BENCH_HEADER_SIZE);
+	if (err < 0)
+		return err;
+
+	buffer = bc->priv;
+
+	buffer->sizes = calloc(BENCH_NUM_HEADERS, sizeof(*buffer->sizes));
+	if (!buffer->sizes)
+		return -ENOMEM;
+
+	for (i = 0; i < BENCH_NUM_HEADERS; i++) {
+		unit = buffer->data + i * BENCH_HEADER_SIZE;
+
+		h264_generate_sps(&bench->gen, &sps);
+		h264_generate_pps(&bench->gen, &pps, &sps);
+
+		if (bc->param)
+			length = h264_write_pps(&pps, unit, BENCH_HEADER_SIZE);
+		else
+			length = h264_write_sps(&sps, unit, BENCH_HEADER_SIZE);
+
+		if (length < 0)
+			return length;
+
+		length = h264_nal_unescape(unit, unit + 1, length - 1);
+
+		buffer->sizes[i] = length;
+		bc->bytes += length;
+	}
+
+	buffer->count = BENCH_NUM_HEADERS;
+
+	return 0;
+}
+
+static void bench_header_run(struct bench_case *bc)
+{
+	struct bench_buffer *buffer = bc->priv;
+	struct h264_sps sps;
+	struct h264_pps pps;
+	unsigned int i;
+	uint64_t sum = 0;
+
+	for (i = 0; i < buffer->count; i++) {
+		const uint8_t *unit = buffer->data + i * BENCH_HEADER_SIZE;
+		size_t size = buffer->sizes[i];
+
+		if (bc->param) {
+			h264_pps_parse(&pps, unit, size);
+			sum += pps.pic_parameter_set_id;
+		} else {
+			h264_sps_parse(&sps, unit, size, NULL);
+			sum += sps.pic_width_in_mbs_minus1;
+		}
+	}
+
+	bench_sink = sum;
+}
+
+/* random data with a start code every 1 to 4096 bytes */
+static int bench_scan_setup(struct bench *bench, struct bench_case *bc)
+{
+	struct bench_buffer *buffer;
+	size_t i, next = 0;
+	int err;
+
+	err = bench_buffer_alloc(bc, BENCH_STREAM_SIZE);
+	if (err < 0)
+		return err;
+
+	buffer = bc->priv;
+
+	for (i = 0; i < buffer->size; i++)
+		buffer->data[i] = h264_generator_random(&bench->gen, 256);
+
+	while (next + 3 <= buffer->size) {
+		memcpy(buffer->data + next, "\x00\x00\x01", 3);
+		next += 3 + h264_generator_random(&bench->gen, 4096);
+	}
+
+	bc->bytes = buffer->size;
+
+	return 0;
+}
+
+static void bench_scan_run(struct bench_case *bc)
+{
+	struct bench_buffer *buffer = bc->priv;
+	const uint8_t *ptr = buffer->data, *end = ptr + buffer->size;
+	uint64_t count = 0;
+
+	while ((ptr = h264_find_start_code(ptr, end)) != end) {
+		ptr += 3;
+		count++;
+	}
+
+	bench_sink = count;
+}
+
+/* random data with an emulation prevention byte every 1 to 4096 bytes */
+static int bench_unescape_setup(struct bench *bench, struct bench_case *bc)
+{
+	struct bench_buffer *buffer;
+	size_t i, next = 0;
+	int err;
+
+	/* the second half receives the RBSP */
+	err = bench_buffer_alloc(bc, BENCH_STREAM_SIZE * 2);
+	if (err < 0)
+		return err;
+
+	buffer = bc->priv;
+
+	for (i = 0; i < BENCH_STREAM_SIZE; i++)
+		buffer->data[i] = h264_generator_random(&bench->gen, 256);
+
+	while (next + 3 <= BENCH_STREAM_SIZE) {
+		memcpy(buffer->data + next, "\x00\x00\x03", 3);
+		next += 3 + h264_generator_random(&bench->gen, 4096);
+	}
+
+	bc->bytes = BENCH_STREAM_SIZE;
+
+	return 0;
+}
+
+static void bench_unescape_run(struct bench_case *bc)
+{
+	struct bench_buffer *buffer = bc->priv;
+
+	bench_sink = h264_nal_unescape(buffer->data + BENCH_STREAM_SIZE,
+				       buffer->data, BENCH_STREAM_SIZE);
+}
+
+/* param is the log2 of the block height */
+static int bench_detile_setup(struct bench *bench, struct bench_case *bc)
+{
+	uint64_t modifier = DRM_FORMAT_MOD_NVIDIA_16BX2_BLOCK(bc->param);
+	struct tegra_vde_frame *frame;
+	struct tegra_vde vde;
+	uint8_t *ptr;
+	size_t i;
+	int err;
+
+	/* without a DRM device, frames are backed by memfd */
+	memset(&vde, 0, sizeof(vde));
+
+	err = tegra_vde_frame_create(&frame, &vde, BENCH_FRAME_WIDTH,
+				     BENCH_FRAME_HEIGHT, DRM_FORMAT_YUV420,
+				     modifier);
+	if (err < 0)
+		return err;
+
+	err = tegra_vde_buffer_map(frame->buffer, (void **)&ptr);
+	if (err < 0) {
+		tegra_vde_frame_free(frame);
+		return err;
+	}
+
+	for (i = 0; i < frame->size; i++)
+		ptr[i] = h264_generator_random(&bench->gen, 256);
+
+	tegra_vde_buffer_unmap(frame->buffer);
+
+	bc->bytes = BENCH_FRAME_WIDTH * BENCH_FRAME_HEIGHT * 3 / 2;
+	bc->priv = frame;
+
+	return 0;
+}
+
+static void bench_detile_run(struct bench_case *bc)
+{
+	bench_sink = tegra_vde_frame_detile(bc->priv, NULL);
+}
+
+static void bench_detile_nv12_run(struct bench_case *bc)
+{
+	bench_sink = tegra_vde_frame_detile_to(bc->priv, NULL, DRM_FORMAT_NV12,
+					       NULL);
+}
+
+static void bench_framehash_md5_run(struct bench_case *bc)
+{
+	struct vde_hash hash;
+	char digest[2 * VDE_HASH_MAX_SIZE + 1];
+
+	vde_hash_init(&hash, VDE_HASH_MD5);
+	tegra_vde_frame_hash(bc->priv, &hash);
+	vde_hash_final(&hash, digest);
+	bench_sink = digest[0];
+}
+
+static void bench_framehash_xxh64_run(struct bench_case *bc)
+{
+	struct vde_hash hash;
+	char digest[2 * VDE_HASH_MAX_SIZE + 1];
+
+	vde_hash_init(&hash, VDE_HASH_XXH64);
+	tegra_vde_frame_hash(bc->priv, &hash);
+	vde_hash_final(&hash, digest);
+	bench_sink = digest[0];
+}
+
+static void bench_detile_teardown(struct bench_case *bc)
+{
+	tegra_vde_frame_free(bc->priv);
+}
+
+struct bench_tile {
+	struct tegra_vde_frame *frame;
+	struct image *image;
+};
+
+/* param is the log2 of the block height, as for detiling */
+static int bench_tile_setup(struct bench *bench, struct bench_case *bc)
+{
+	struct bench_tile *tile;
+	unsigned int i, j;
+	int err;
+
+	tile = calloc(1, sizeof(*tile));
+	if (!tile)
+		return -ENOMEM;
+
+	err = bench_detile_setup(bench, bc);
+	if (err < 0) {
+		free(tile);
+		return err;
+	}
+
+	tile->frame = bc->priv;
+
+	err = image_create(&tile->image, BENCH_FRAME_WIDTH, BENCH_FRAME_HEIGHT,
+			   DRM_FORMAT_YUV420);
+	if (err < 0) {
+		tegra_vde_frame_free(tile->frame);
+		free(tile);
+		return err;
+	}
+
+	for (i = 0; i < 3; i++) {
+		size_t size = tile->image->pitches[i] * (i ? BENCH_FRAME_HEIGHT / 2 :
+							      BENCH_FRAME_HEIGHT);
+
+		for (j = 0; j < size; j++)
+			tile->image->planes[i][j] = h264_generator_random(&bench->gen,
+									  256);
+	}
+
+	bc->priv = tile;
+
+	return 0;
+}
+
+/* what the software stand-in does with each decoded picture */
+static void bench_tile_run(struct bench_case *bc)
+{
+	struct bench_tile *tile = bc->priv;
+	struct tegra_vde_frame *frame = tile->frame;
+	unsigned int i, block_height, gobs;
+	uint8_t *ptr;
+
+	block_height = tegra_get_block_height(frame->modifier);
+	gobs = DIV_ROUND_UP(frame->pitch, 64);
+
+	if (tegra_vde_buffer_map(frame->buffer, (void **)&ptr) < 0)
+		return;
+
+	for (i = 0; i < 3; i++) {
+		unsigned int width = BENCH_FRAME_WIDTH, height = BENCH_FRAME_HEIGHT;
+		unsigned int g = gobs;
+
+		if (i > 0) {
+			width /= 2;
+			height /= 2;
+			g = DIV_ROUND_UP(g, 2);
+		}
+
+		tegra_vde_tile_plane(ptr + frame->offsets[i],
+				     frame->size - frame->offsets[i],
+				     tile->image->planes[i],
+				     tile->image->pitches[i], width, height, g,
+				     block_height);
+	}
+
+	tegra_vde_buffer_unmap(frame->buffer);
+
+	bench_sink = ptr[0];
+}
+
+static void bench_tile_teardown(struct bench_case *bc)
+{
+	struct bench_tile *tile = bc->priv;
+
+	image_free(tile->image);
+	tegra_vde_frame_free(tile->frame);
+	free(tile);
+}
+
+/* param selects a crop (0) or a thumbnail (1) of the frame */
+static int bench_preview_setup(struct bench *bench, struct bench_case *bc)
+{
+	struct bench_case detile = { .param = 4 };
+	int err;
+
+	err = bench_detile_setup(bench, &detile);
+	if (err < 0)
+		return err;
+
+	bc->bytes = BENCH_PREVIEW_WIDTH * BENCH_PREVIEW_HEIGHT * 3 / 2;
+	bc->priv = detile.priv;
+
+	return 0;
+}
+
+static void bench_preview_run(struct bench_case *bc)
+{
+	struct tegra_vde_rect rect = {
+		.x = (BENCH_FRAME_WIDTH - BENCH_PREVIEW_WIDTH) / 2,
+		.y = (BENCH_FRAME_HEIGHT - BENCH_PREVIEW_HEIGHT) / 2,
+		.width = BENCH_PREVIEW_WIDTH,
+		.height = BENCH_PREVIEW_HEIGHT,
+	};
+
+	if (bc->param)
+		bench_sink = tegra_vde_frame_thumbnail(bc->priv,
+						       BENCH_PREVIEW_WIDTH,
+						       BENCH_PREVIEW_HEIGHT,
+						       NULL);
+	else
+		bench_sink = tegra_vde_frame_detile_rect(bc->priv, &rect, NULL);
+}
+
+static void bench_image_run(struct bench_case *bc)
+{
+	struct image *image;
+
+	if (image_create(&image, BENCH_FRAME_WIDTH, BENCH_FRAME_HEIGHT,
+			 DRM_FORMAT_YUV420) == 0) {
+		bench_sink = image->size;
+		image_free(image);
+	}
+}
+
+struct bench_snapshot {
+	struct image *image;
+	uint8_t *rgb;
+};
+
+/* param is the format of the image to convert */
+static int bench_rgb_setup(struct bench *bench, struct bench_case *bc)
+{
+	struct bench_snapshot *snapshot;
+	unsigned int i;
+	int err;
+
+	snapshot = calloc(1, sizeof(*snapshot));
+	if (!snapshot)
+		return -ENOMEM;
+
+	err = image_create(&snapshot->image, BENCH_FRAME_WIDTH,
+			   BENCH_FRAME_HEIGHT, bc->param);
+	if (err < 0) {
+		free(snapshot);
+		return err;
+	}
+
+	snapshot->rgb = malloc(BENCH_FRAME_WIDTH * BENCH_FRAME_HEIGHT * 3);
+	if (!snapshot->rgb) {
+		image_free(snapshot->image);
+		free(snapshot);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < snapshot->image->size; i++)
+		snapshot->image->data[i] = h264_generator_random(&bench->gen, 256);
+
+	bc->bytes = BENCH_FRAME_WIDTH * BENCH_FRAME_HEIGHT * 3 / 2;
+	bc->priv = snapshot;
+
+	return 0;
+}
+
+static void bench_rgb_run(struct bench_case *bc)
+{
+	static const struct snapshot_colorspace cs = {
+		.matrix = SNAPSHOT_MATRIX_BT709,
+	};
+	struct bench_snapshot *snapshot = bc->priv;
+
+	bench_sink = snapshot_convert_rgb(snapshot->image, &cs, snapshot->rgb,
+					  BENCH_FRAME_WIDTH * 3);
+}
+
+static void bench_rgb_teardown(struct bench_case *bc)
+{
+	struct bench_snapshot *snapshot = bc->priv;
+
+	image_free(snapshot->image);
+	free(snapshot->rgb);
+	free(snapshot);
+}
+
+/* two identical images, so that every byte gets compared */
+static int bench_compare_setup(struct bench *bench, struct bench_case *bc)
+{
+	struct image **images;
+	unsigned int i;
+	int err;
+
+	images = calloc(2, sizeof(*images));
+	if (!images)
+		return -ENOMEM;
+
+	for (i = 0; i < 2; i++) {
+		err = image_create(&images[i], BENCH_FRAME_WIDTH,
+				   BENCH_FRAME_HEIGHT, DRM_FORMAT_YUV420);
+		if (err < 0)
+			goto free;
+	}
+
+	for (i = 0; i < images[0]->size; i++)
+		images[0]->data[i] = h264_generator_random(&bench->gen, 256);
+
+	memcpy(images[1]->data, images[0]->data, images[0]->size);
+
+	bc->bytes = BENCH_FRAME_WIDTH * BENCH_FRAME_HEIGHT * 3 / 2;
+	bc->priv = images;
+
+	return 0;
+
+free:
+	while (i--)
+		image_free(images[i]);
+
+	free(images);
+	return err;
+}
+
+static void bench_compare_run(struct bench_case *bc)
+{
+	struct image **images = bc->priv;
+
+	bench_sink = image_compare(images[0], images[1]);
+}
+
+static void bench_compare_teardown(struct bench_case *bc)
+{
+	struct image **images = bc->priv;
+
+	image_free(images[0]);
+	image_free(images[1]);
+	free(images);
+}
+
+static int bench_hexdump_setup(struct bench *bench, struct bench_case *bc)
+{
+	struct bench_buffer *buffer;
+	size_t i;
+	int err;
+
+	err = bench_buffer_alloc(bc, 4096);
+	if (err < 0)
+		return err;
+
+	buffer = bc->priv;
+
+	for (i = 0; i < buffer->size; i++)
+		buffer->data[i] = h264_generator_random(&bench->gen, 256);
+
+	bc->bytes = buffer->size;
+
+	return 0;
+}
+
+static void bench_hexdump_run(struct bench_case *bc)
+{
+	struct bench_buffer *buffer = bc->priv;
+
+	hexdump(buffer->data, buffer->size, 16, NULL, stdout);
+}
+
+#define BENCH_DETILE(bh, log2) \
+	{ "detile-bh" #bh, bench_detile_setup, bench_detile_run, \
+	  bench_detile_teardown, log2 }
+
+#define BENCH_TILE(bh, log2) \
+	{ "tile-bh" #bh, bench_tile_setup, bench_tile_run, \
+	  bench_tile_teardown, log2 }
+
+static struct bench_case bench_cases[] = {
+	{ "bitstream-read", bench_read_setup, bench_read_run, bench_buffer_free },
+	{ "golomb-ue", bench_golomb_setup, bench_golomb_run, bench_buffer_free, 0 },
+	{ "golomb-se", bench_golomb_setup, bench_golomb_run, bench_buffer_free, 1 },
+	{ "sps-parse", bench_header_setup, bench_header_run, bench_buffer_free, 0 },
+	{ "pps-parse", bench_header_setup, bench_header_run, bench_buffer_free, 1 },
+	{ "start-code-scan", bench_scan_setup, bench_scan_run, bench_buffer_free },
+	{ "nal-unescape", bench_unescape_setup, bench_unescape_run, bench_buffer_free },
+	BENCH_DETILE(1, 0),
+	BENCH_DETILE(2, 1),
+	BENCH_DETILE(4, 2),
+	BENCH_DETILE(8, 3),
+	BENCH_DETILE(16, 4),
+	BENCH_DETILE(32, 5),
+	BENCH_TILE(1, 0),
+	BENCH_TILE(2, 1),
+	BENCH_TILE(4, 2),
+	BENCH_TILE(8, 3),
+	BENCH_TILE(16, 4),
+	BENCH_TILE(32, 5),
+	{ "detile-nv12", bench_detile_setup, bench_detile_nv12_run, bench_detile_teardown, 4 },
+	{ "framehash-md5", bench_detile_setup, bench_framehash_md5_run, bench_detile_teardown, 4 },
+	{ "framehash-xxh64", bench_detile_setup, bench_framehash_xxh64_run, bench_detile_teardown, 4 },
+	{ "detile-roi", bench_preview_setup, bench_preview_run, bench_detile_teardown, 0 },
+	{ "thumbnail", bench_preview_setup, bench_preview_run, bench_detile_teardown, 1 },
+	{ "image-create", NULL, bench_image_run, NULL },
+	{ "image-compare", bench_compare_setup, bench_compare_run, bench_compare_teardown },
+	{ "yuv-to-rgb", bench_rgb_setup, bench_rgb_run, bench_rgb_teardown, DRM_FORMAT_YUV420 },
+	{ "nv12-to-rgb", bench_rgb_setup, bench_rgb_run, bench_rgb_teardown, DRM_FORMAT_NV12 },
+	{ "hexdump", bench_hexdump_setup, bench_hexdump_run, bench_buffer_free, 0, true },
+};
+
+static int bench_stdout = -1;
+
+/* sends stdout to /dev/null while benchmarks that print are running */
+static void bench_quiet(bool quiet)
+{
+	int fd;
+
+	fflush(stdout);
+
+	if (quiet) {
+		fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+		if (fd < 0)
+			return;
+
+		bench_stdout = dup(STDOUT_FILENO);
+		dup2(fd, STDOUT_FILENO);
+		close(fd);
+	} else if (bench_stdout >= 0) {
+		dup2(bench_stdout, STDOUT_FILENO);
+		close(bench_stdout);
+		bench_stdout = -1;
+	}
+}
+
+static uint64_t bench_time(struct bench_case *bc, uint64_t iterations)
+{
+	uint64_t i, start = vde_stats_now();
+
+	for (i = 0; i < iterations; i++)
+		bc->run(bc);
+
+	return vde_stats_now() - start;
+}
+
+static int bench_compare(const void *a, const void *b)
+{
+	const double *x = a, *y = b;
+
+	return (*x > *y) - (*x < *y);
+}
+
+static void bench_measure(struct bench *bench, struct bench_case *bc,
+			  struct bench_result *result)
+{
+	double samples[BENCH_MAX_ROUNDS];
+	uint64_t iterations = 1;
+	unsigned int i;
+
+	if (bc->quiet)
+		bench_quiet(true);
+
+	/* warms up caches while finding the number of iterations per round */
+	while (bench_time(bc, iterations) < BENCH_ROUND_NS / 4)
+		iterations *= 2;
+
+	iterations *= 4;
+
+	for (i = 0; i < bench->rounds; i++)
+		samples[i] = (double)bench_time(bc, iterations) / iterations;
+
+	if (bc->quiet)
+		bench_quiet(false);
+
+	qsort(samples, bench->rounds, sizeof(samples[0]), bench_compare);
+
+	result->iterations = iterations;
+	result->median = samples[bench->rounds / 2];
+	result->min = samples[0];
+	result->max = samples[bench->rounds - 1];
+}
+
+/* decoded sizes of common streams, heights are whole macroblocks */
+static const struct {
+	unsigned int width;
+	unsigned int height;
+} bench_layouts[] = {
+	{ 64, 64 },
+	{ 176, 144 },
+	{ 320, 240 },
+	{ 640, 368 },
+	{ 720, 480 },
+	{ 720, 576 },
+	{ 1280, 720 },
+	{ 1920, 1088 },
+	{ 3840, 2160 },
+};
+
+/* padding of each block height and what the policy picks for each consumer */
+static void bench_show_layouts(void)
+{
+	static const enum tegra_vde_consumer consumers[] = {
+		TEGRA_VDE_CONSUMER_CPU,
+		TEGRA_VDE_CONSUMER_DISPLAY,
+		TEGRA_VDE_CONSUMER_ENCODER,
+	};
+	unsigned int i, j;
+
+	printf("%-10s", "picture");
+
+	for (j = 0; j <= 5; j++)
+		printf(" %6s%-2u", "bh", 1 << j);
+
+	printf(" %8s %8s %8s\n", "cpu", "display", "encoder");
+
+	for (i = 0; i < ARRAY_SIZE(bench_layouts); i++) {
+		unsigned int width = bench_layouts[i].width;
+		unsigned int height = bench_layouts[i].height;
+		size_t size = (size_t)ALIGN(width, 64) * height +
+			      2 * ALIGN(width / 2, 64) * (height / 2);
+		char name[32];
+
+		snprintf(name, sizeof(name), "%ux%u", width, height);
+		printf("%-10s", name);
+
+		for (j = 0; j <= 5; j++)
+			printf(" %7.1f%%", 100.0 *
+			       tegra_vde_frame_padding(width, height, 1 << j) /
+			       size);
+
+		for (j = 0; j < ARRAY_SIZE(consumers); j++) {
+			uint64_t modifier;
+
+			modifier = tegra_vde_choose_modifier(width, height,
+							     consumers[j]);
+			printf(" %8d", tegra_get_block_height(modifier));
+		}
+
+		printf("\n");
+	}
+}
+
+static void bench_write_json(struct bench *bench, FILE *fp,
+			     struct bench_result *results, const char *filter)
+{
+	const char *separator = "";
+	unsigned int i;
+
+	fprintf(fp, "{\n");
+	fprintf(fp, "  \"seed\": %llu,\n", bench->seed);
+	fprintf(fp, "  \"cpu\": %d,\n", bench->cpu);
+	fprintf(fp, "  \"isa\": \"%s\",\n", cpu_isa_name(cpu_isa()));
+	fprintf(fp, "  \"rounds\": %u,\n", bench->rounds);
+	fprintf(fp, "  \"benchmarks\": [");
+
+	for (i = 0; i < ARRAY_SIZE(bench_cases); i++) {
+		struct bench_result *result = &results[i];
+		struct bench_case *bc = &bench_cases[i];
+
+		if (filter && !strstr(bc->name, filter))
+			continue;
+
+		fprintf(fp, "%s\n    { \"name\": \"%s\", \"iterations\": %llu, "
+			"\"bytes\": %zu, \"median_ns\": %.1f, \"min_ns\": %.1f, "
+			"\"max_ns\": %.1f, \"peak_bytes\": %llu }", separator,
+			bc->name, (unsigned long long)result->iterations,
+			bc->bytes, result->median, result->min, result->max,
+			(unsigned long long)result->peak_bytes);
+		separator = ",";
+	}
+
+	fprintf(fp, "\n  ]\n}\n");
+}
+
+int main(int argc, char *argv[])
+{
+	struct bench_result results[ARRAY_SIZE(bench_cases)];
+	const char *output = NULL, *filter = NULL;
+	struct vde_mem_usage memory;
+	struct bench bench;
+	unsigned int i;
+	int opt, err;
+	FILE *fp;
+
+	memset(&bench, 0, sizeof(bench));
+	memset(results, 0, sizeof(results));
+	bench.seed = 1;
+	bench.rounds = 9;
+	bench.cpu = 0;
+
+	while ((opt = getopt_long(argc, argv, "c:f:hI:lo:r:S:", options, NULL)) != -1) {
+		switch (opt) {
+		case 'c':
+			bench.cpu = strtol(optarg, NULL, 0);
+			break;
+
+		case 'f':
+			filter = optarg;
+			break;
+
+		case 'h':
+			usage(argv[0], stdout);
+			return 0;
+
+		case 'I':
+			err = cpu_isa_force(optarg);
+			if (err < 0) {
+				fprintf(stderr, "unsupported ISA: %s\n", optarg);
+				return 1;
+			}
+			break;
+
+		case 'l':
+			bench_show_layouts();
+			return 0;
+
+		case 'o':
+			output = optarg;
+			break;
+
+		case 'r':
+			bench.rounds = strtoul(optarg, NULL, 0);
+			if (bench.rounds == 0 || bench.rounds > BENCH_MAX_ROUNDS) {
+				fprintf(stderr, "invalid number of rounds: %s\n", optarg);
+				return 1;
+			}
+			break;
+
+		case 'S':
+			bench.seed = strtoull(optarg, NULL, 0);
+			break;
+
+		default:
+			usage(argv[0], stderr);
+			return 1;
+		}
+	}
+
+	if (bench.cpu >= 0) {
+		cpu_set_t set;
+
+		CPU_ZERO(&set);
+		CPU_SET(bench.cpu, &set);
+
+		if (sched_setaffinity(0, sizeof(set), &set) < 0)
+			fprintf(stderr, "failed to pin to CPU %d: %d\n",
+				bench.cpu, -errno);
+	}
+
+	printf("kernels: %s\n", cpu_isa_name(cpu_isa()));
+	printf("%-16s %12s %12s %12s %12s %10s\n", "benchmark", "median (ns)",
+	       "min (ns)", "max (ns)", "MiB/s", "peak KiB");
+
+	for (i = 0; i < ARRAY_SIZE(bench_cases); i++) {
+		struct bench_case *bc = &bench_cases[i];
+		struct bench_result *result = &results[i];
+
+		if (filter && !strstr(bc->name, filter))
+			continue;
+
+		/* every benchmark sees the same inputs, whatever runs before */
+		h264_generator_init(&bench.gen, bench.seed);
+		vde_mem_reset_peaks();
+
+		if (bc->setup) {
+			err = bc->setup(&bench, bc);
+			if (err < 0) {
+				fprintf(stderr, "failed to set up %s: %d\n",
+					bc->name, err);
+				return 1;
+			}
+		}
+
+		bench_measure(&bench, bc, result);
+
+		if (bc->teardown)
+			bc->teardown(bc);
+
+		vde_mem_get(VDE_MEM_MAX, &memory);
+		result->peak_bytes = memory.peak_bytes;
+
+		printf("%-16s %12.1f %12.1f %12.1f %12.1f %10.1f\n", bc->name,
+		       result->median, result->min, result->max,
+		       bc->bytes ? bc->bytes * 1e9 / result->median /
+				   (1024 * 1024) : 0.0,
+		       result->peak_bytes / 1024.0);
+
+		/* idle images would otherwise look like leaks */
+		image_pool_flush();
+
+		if (vde_mem_check_leaks(stderr) > 0) {
+			fprintf(stderr, "%s leaked memory\n", bc->name);
+			return 1;
+		}
+	}
+
+	if (output) {
+		fp = fopen(output, "w");
+		if (!fp) {
+			fprintf(stderr, "failed to create '%s': %d\n", output,
+				-errno);
+			return 1;
+		}
+
+		bench_write_json(&bench, fp, results, filter);
+		fclose(fp);
+	}
+
+	return 0;
+}
@@ -1,559 +1,992 @@
 #include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
-#include <sys/ioctl.h>
-#include <sys/mman.h>
-
 #include <libavformat/avformat.h>
 #include <libavcodec/avcodec.h>
 #include <libavutil/pixdesc.h>
 
-#include <libdrm/tegra.h>
 #include <drm_fourcc.h>
+#include <libdrm/tegra.h>
 
+#include "archive.h"
+#include "capture.h"
+#include "cpu.h"
 #include "drm-utils.h"
+#include "gop.h"
+#include "hash.h"
 #include "h264-parser.h"
 #include "image.h"
+#include "io.h"
+#include "mem.h"
+#include "mp4.h"
+#include "snapshot.h"
+#include "stats.h"
+#include "trace.h"
 #include "utils.h"
-
-#include "tegra-vde.h"
+#include "vde.h"
+#include "vde-decode.h"
+
+static const struct option options[] = {
+	{ "archive", required_argument, NULL, 'A' },
+	{ "bench", no_argument, NULL, 'b' },
+	{ "capture", required_argument, NULL, 'C' },
+	{ "connect", required_argument, NULL, 'c' },
+	{ "consumer", required_argument, NULL, 'u' },
+	{ "daemon", required_argument, NULL, 'd' },
+	{ "framehash", required_argument, NULL, 'F' },
+	{ "huge-pages", no_argument, NULL, 'H' },
+	{ "isa", required_argument, NULL, 'I' },
+	{ "snapshot-interval", required_argument, NULL, 'i' },
+	{ "jobs", required_argument, NULL, 'j' },
+	{ "libav", no_argument, NULL, 'l' },
+	{ "live", required_argument, NULL, 'L' },
+	{ "memory", no_argument, NULL, 'M' },
+	{ "probe", no_argument, NULL, 'P' },
+	{ "io-depth", required_argument, NULL, 'Q' },
+	{ "reference-archive", required_argument, NULL, 'R' },
+	{ "snapshot", required_argument, NULL, 'S' },
+	{ "soft", no_argument, NULL, 's' },
+	{ "trace", required_argument, NULL, 't' },
+	{ "weight", required_argument, NULL, 'w' },
+	{ "hash", required_argument, NULL, 'X' },
+	{ "lz4", no_argument, NULL, 'z' },
+	{ "help", no_argument, NULL, 'h' },
+	{ NULL, 0, NULL, 0 },
+};
 
 static void usage(const char *program, FILE *fp)
 {
-	fprintf(fp, "usage: %s FILENAME\n", program);
+	fprintf(fp, "usage: %s [options] FILENAME\n", program);
+	fprintf(fp, "       %s [options] --daemon SOCKET\n", program);
+	fprintf(fp, "       %s --probe FILENAME...\n", program);
+	fprintf(fp, "\n");
+	fprintf(fp, "options:\n");
+	fprintf(fp, "  -A, --archive FILE    write frames to a binary archive instead of dumping\n");
+	fprintf(fp, "                        them, see vde-archive\n");
+	fprintf(fp, "  -b, --bench           don't dump frames, report throughput and latencies\n");
+	fprintf(fp, "  -C, --capture FILE    record all decoder submissions to FILE for vde-replay\n");
+	fprintf(fp, "  -c, --connect SOCKET  decode using the daemon listening on SOCKET\n");
+	fprintf(fp, "  -d, --daemon SOCKET   serve decode clients on SOCKET\n");
+	fprintf(fp, "  -F, --framehash FILE  write a hash of each frame to FILE in the format of\n");
+	fprintf(fp, "                        ffmpeg -f framemd5, instead of dumping frames\n");
+	fprintf(fp, "  -H, --huge-pages      back decoded images with transparent huge pages\n");
+	fprintf(fp, "  -I, --isa NAME        use the scalar, sse2, avx2 or neon kernels\n");
+	fprintf(fp, "  -i, --snapshot-interval N\n");
+	fprintf(fp, "                        write a snapshot of every Nth frame (default: 1)\n");
+	fprintf(fp, "  -j, --jobs N          decode closed GOPs in parallel on N decoder contexts\n");
+	fprintf(fp, "  -l, --libav           demux MP4 files using libavformat\n");
+	fprintf(fp, "  -L, --live FPS        ask the daemon to treat the stream as live\n");
+	fprintf(fp, "  -M, --memory          report memory usage at exit and on SIGUSR2, fail if\n");
+	fprintf(fp, "                        anything leaked\n");
+	fprintf(fp, "  -P, --probe           report whether the VDE can decode each MP4 file,\n");
+	fprintf(fp, "                        without opening any device\n");
+	fprintf(fp, "  -Q, --io-depth N      read N samples or blocks ahead and keep N archived\n");
+	fprintf(fp, "                        frames in flight using io_uring\n");
+	fprintf(fp, "  -R, --reference-archive FILE\n");
+	fprintf(fp, "                        write the frames decoded by libavcodec to FILE\n");
+	fprintf(fp, "  -S, --snapshot FILE   write frames as PNG or PPM to FILE, %%u is replaced\n");
+	fprintf(fp, "                        by the frame number\n");
+	fprintf(fp, "  -s, --soft            use the software stand-in instead of the VDE\n");
+	fprintf(fp, "  -t, --trace FILE      write a Chrome trace to FILE at exit and on SIGUSR1\n");
+	fprintf(fp, "  -u, --consumer NAME   lay frames out for the cpu (default), display or\n");
+	fprintf(fp, "                        encoder\n");
+	fprintf(fp, "  -w, --weight N        share of the daemon's batch capacity\n");
+	fprintf(fp, "  -X, --hash NAME       hash frames with md5 (default) or xxh64\n");
+	fprintf(fp, "  -z, --lz4             compress archived frames with LZ4\n");
+	fprintf(fp, "  -h, --help            display this help screen and exit\n");
 }
 
-struct tegra_vde {
+struct context {
+	const struct tegra_vde_ops *ops;
+	bool bench;
+	bool memory;
+	const char *trace;
 	struct drm_tegra *drm;
-	int fd;
 
-	struct drm_tegra_bo *bitstream;
-	int bitstream_fd;
+	/* snapshots of every Nth frame */
+	const char *snapshot;
+	unsigned int snapshot_interval;
+	struct snapshot_colorspace colorspace;
 
-	struct drm_tegra_bo *secure;
-	int secure_fd;
-};
+	/* per-frame hashes in framemd5 format */
+	FILE *framehash;
+	enum vde_hash_type hash_type;
+	uint64_t hashed;
+
+	/* binary frame archives of our frames and the libavcodec ones */
+	struct vde_archive *archive;
+	struct vde_archive *reference;
+	unsigned int references;
 
-struct tegra_vde_frame {
-	struct drm_tegra_bo *buffer;
 	int fd;
 
-	unsigned int width;
-	unsigned int height;
-	uint32_t format;
-	uint64_t modifier;
+	/* reads and writes in flight with io_uring, 0 for blocking I/O */
+	unsigned int io_depth;
 
-	unsigned int pitch;
-	size_t offsets[3];
+	/* GOP-parallel decoding */
+	struct h264_context h264;
+	struct gop_decoder *gop;
+	unsigned int jobs;
+	uint8_t *buffer;
 	size_t size;
+
+	struct vde_session *session;
+	enum vde_consumer consumer;
+
+	/* decoding via a daemon */
+	const char *socket;
+	struct vde_stream_params stream;
+	struct vde_client *client;
+	unsigned int pending;
 };
 
-int tegra_get_block_height(uint64_t modifier)
+/* number of access units kept in flight when decoding via a daemon */
+#define CLIENT_QUEUE_DEPTH 4
+
+static volatile sig_atomic_t trace_requested;
+
+static void trace_signal(int signum)
 {
-	switch (modifier) {
-	case DRM_FORMAT_MOD_NVIDIA_16BX2_BLOCK(0):
-		return 1;
+	trace_requested = 1;
+}
 
-	case DRM_FORMAT_MOD_NVIDIA_16BX2_BLOCK(1):
-		return 2;
+static void trace_poll(struct context *context)
+{
+	int err;
 
-	case DRM_FORMAT_MOD_NVIDIA_16BX2_BLOCK(2):
-		return 4;
+	if (!context->trace || !trace_requested)
+		return;
 
-	case DRM_FORMAT_MOD_NVIDIA_16BX2_BLOCK(3):
-		return 8;
+	trace_requested = 0;
 
-	case DRM_FORMAT_MOD_NVIDIA_16BX2_BLOCK(4):
-		return 16;
+	err = vde_trace_flush(context->trace);
+	if (err < 0)
+		fprintf(stderr, "failed to write trace to '%s': %d\n",
+			context->trace, err);
+}
 
-	case DRM_FORMAT_MOD_NVIDIA_16BX2_BLOCK(5):
-		return 32;
-	}
+static volatile sig_atomic_t memory_requested;
 
-	return -EINVAL;
+static void memory_signal(int signum)
+{
+	memory_requested = 1;
 }
 
-int tegra_vde_frame_create(struct tegra_vde_frame **framep,
-			   struct tegra_vde *vde, unsigned int width,
-			   unsigned int height, uint32_t format,
-			   uint64_t modifier)
+static void memory_poll(struct context *context)
 {
-	const struct drm_format_info *info;
-	struct tegra_vde_frame *frame;
-	unsigned int block_height;
-	unsigned int i;
-	size_t size;
-	void *ptr;
-	int err;
+	if (!context->memory || !memory_requested)
+		return;
 
-	info = drm_format_get_info(format);
-	if (!info)
-		return -EINVAL;
+	memory_requested = 0;
+	vde_mem_report(stdout);
+}
 
-	frame = calloc(1, sizeof(*frame));
-	if (!frame)
-		return -ENOMEM;
+static struct vde_daemon *daemon_instance;
 
-	err = tegra_get_block_height(modifier);
-	if (err < 0)
-		return err;
+static void daemon_signal(int signum)
+{
+	vde_daemon_stop(daemon_instance);
+}
 
-	block_height = err;
+static int parse_consumer(const char *name, enum vde_consumer *consumer)
+{
+	if (strcmp(name, "cpu") == 0)
+		*consumer = VDE_CONSUMER_CPU;
+	else if (strcmp(name, "display") == 0)
+		*consumer = VDE_CONSUMER_DISPLAY;
+	else if (strcmp(name, "encoder") == 0)
+		*consumer = VDE_CONSUMER_ENCODER;
+	else
+		return -EINVAL;
 
-	frame->width = width;
-	frame->height = height;
-	frame->format = format;
-	frame->modifier = modifier;
+	return 0;
+}
 
-	/* blocks are 64 bytes wide, assuming block-linear */
-	frame->pitch = ALIGN(width * info->cpp[0], 64);
+static int run_daemon(const char *path, bool soft, enum vde_consumer consumer)
+{
+	struct vde_session_config config;
+	struct sigaction sa;
+	int err;
 
-	frame->offsets[0] = 0;
+	memset(&config, 0, sizeof(config));
+	config.consumer = consumer;
 
-	size = frame->pitch * ALIGN(height, 8 * block_height);
+	if (soft)
+		config.backend = VDE_BACKEND_SOFTWARE;
 
-	for (i = 1; i < info->num_planes; i++) {
-		unsigned int pitch = width * info->cpp[i] / info->hsub;
+	err = vde_daemon_create(&daemon_instance, path, &config);
+	if (err < 0) {
+		fprintf(stderr, "failed to listen on '%s': %d\n", path, err);
+		return err;
+	}
 
-		frame->offsets[i] = size;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = daemon_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
 
-		size += pitch * ALIGN(height / info->vsub, 8 * block_height);
-	}
+	printf("listening on %s\n", path);
 
-	err = drm_tegra_bo_new(&frame->buffer, vde->drm, 0, size);
+	err = vde_daemon_run(daemon_instance);
 	if (err < 0)
-		goto free;
+		fprintf(stderr, "daemon failed: %d\n", err);
 
-	frame->size = size;
+	vde_daemon_free(daemon_instance);
 
-	err = drm_tegra_bo_map(frame->buffer, &ptr);
-	if (err < 0)
-		goto free;
+	return err;
+}
 
-	memset(ptr, 0xaa, size);
+static void context_snapshot(struct context *context,
+			     const struct image *image, unsigned int frame)
+{
+	const char *marker = strstr(context->snapshot, "%u");
+	char filename[PATH_MAX];
+	int err;
 
-	drm_tegra_bo_unmap(frame->buffer);
+	if (marker)
+		snprintf(filename, sizeof(filename), "%.*s%u%s",
+			 (int)(marker - context->snapshot), context->snapshot,
+			 frame, marker + 2);
+	else
+		snprintf(filename, sizeof(filename), "%s", context->snapshot);
 
-	err = drm_tegra_bo_export(frame->buffer, 0);
+	err = snapshot_write(image, &context->colorspace, filename);
 	if (err < 0)
-		goto free;
+		fprintf(stderr, "failed to write snapshot '%s': %d\n",
+			filename, err);
+}
 
-	frame->fd = err;
+/*
+ * Writes a line in the format of ffmpeg's framemd5 muxer, preceded by its
+ * header for the first frame. The decoder doesn't know timestamps, so frames
+ * are numbered in output order, in the time base ffmpeg uses for raw H.264.
+ */
+static void context_framehash(struct context *context, struct vde_hash *hash,
+			      unsigned int width, unsigned int height)
+{
+	char digest[2 * VDE_HASH_MAX_SIZE + 1];
+	FILE *fp = context->framehash;
+
+	if (context->hashed == 0) {
+		fprintf(fp, "#format: frame checksums\n");
+		fprintf(fp, "#version: 2\n");
+		fprintf(fp, "#hash: %s\n", vde_hash_name(context->hash_type));
+		fprintf(fp, "#tb 0: 1/25\n");
+		fprintf(fp, "#media_type 0: video\n");
+		fprintf(fp, "#codec_id 0: rawvideo\n");
+		fprintf(fp, "#dimensions 0: %ux%u\n", width, height);
+		fprintf(fp, "#sar 0: 1/1\n");
+		fprintf(fp, "#stream#, dts,        pts, duration,     size, hash\n");
+	}
 
-	*framep = frame;
+	vde_hash_final(hash, digest);
 
-	return 0;
+	fprintf(fp, "0, %10" PRIu64 ", %10" PRIu64 ", %8d, %8u, %s\n",
+		context->hashed, context->hashed, 1, width * height * 3 / 2,
+		digest);
 
-free:
-	free(frame);
-	return err;
+	context->hashed++;
 }
 
-int tegra_vde_frame_detile(struct tegra_vde_frame *frame,
-			   struct image **imagep)
+static void context_hash_frame(struct context *context,
+			       struct vde_frame *frame)
 {
-	unsigned int stride, i, j, k, block_height, gobs;
-	const struct drm_format_info *info;
-	struct image *image;
-	void *ptr;
+	struct vde_hash hash;
 	int err;
 
-	info = drm_format_get_info(frame->format);
-	if (!info)
-		return -EINVAL;
+	vde_hash_init(&hash, context->hash_type);
 
-	err = tegra_get_block_height(frame->modifier);
-	if (err < 0)
-		return err;
+	err = vde_frame_hash(frame, &hash);
+	if (err < 0) {
+		fprintf(stderr, "failed to hash frame: %d\n", err);
+		return;
+	}
 
-	block_height = err;
+	context_framehash(context, &hash, frame->crop.width,
+			  frame->crop.height);
+}
 
-	err = drm_tegra_bo_map(frame->buffer, &ptr);
-	if (err < 0)
-		return err;
+/* GOP-parallel decoding produces images, which are hashed the same way */
+static void context_hash_image(struct context *context,
+			       const struct image *image)
+{
+	const struct drm_format_info *info;
+	unsigned int i, j, width, height;
+	struct vde_hash hash;
 
-	err = image_create(&image, frame->width, frame->height, frame->format);
-	if (err < 0) {
-		drm_tegra_bo_unmap(frame->buffer);
-		return err;
-	}
+	info = drm_format_get_info(image->format);
+	if (!info)
+		return;
 
-	for (k = 0; k < info->num_planes; k++) {
-		unsigned int width = image->width;
-		unsigned int height = image->height;
-		unsigned int pitch;
+	vde_hash_init(&hash, context->hash_type);
 
-		gobs = DIV_ROUND_UP(frame->pitch, 64);
+	for (i = 0; i < info->num_planes; i++) {
+		width = image->width * info->cpp[i];
+		height = image->height;
 
-		if (k > 0) {
+		if (i > 0) {
 			width /= info->hsub;
 			height /= info->vsub;
-			gobs /= info->hsub;
 		}
 
-		pitch = width * info->cpp[k];
-		stride = 16 / info->cpp[k];
-
-		for (j = 0; j < height; j++) {
-			void *dst = image->data + image->offsets[k] + pitch * j;
-			unsigned int y = j;
-
-			for (i = 0; i < width; i += stride) {
-				unsigned int x = i * info->cpp[k];
-				unsigned int base = (y / (8 * block_height)) * 512 * block_height * gobs +
-						    (x / 64) * 512 * block_height +
-						    (y % (8 * block_height) / 8) * 512;
-				unsigned int offset = ((x % 64) / 32) * 256 +
-						      ((y %  8) /  2) *  64 +
-						      ((x % 32) / 16) *  32 +
-						      ((y %  2) * 16) + (x % 16);
-				void *src = ptr + frame->offsets[k] + base + offset;
-
-				memcpy(dst + x, src, 16);
-			}
-		}
+		for (j = 0; j < height; j++)
+			vde_hash_update(&hash, image->planes[i] +
+					image->pitches[i] * j, width);
 	}
 
-	if (imagep)
-		*imagep = image;
+	context_framehash(context, &hash, image->width, image->height);
+}
 
-	drm_tegra_bo_unmap(frame->buffer);
+/* the decoder doesn't parse slice headers, so the POC isn't known */
+static void context_archive(struct vde_archive *archive,
+			    const struct image *image, uint64_t frame)
+{
+	int err;
 
-	return 0;
+	err = vde_archive_add(archive, image, frame, VDE_ARCHIVE_POC_UNKNOWN);
+	if (err < 0)
+		fprintf(stderr, "failed to archive frame %" PRIu64 ": %d\n",
+			frame, err);
 }
 
-void tegra_vde_frame_dump(struct tegra_vde_frame *frame, FILE *fp)
+/* archiving falls back to blocking writes if io_uring isn't available */
+static void context_archive_async(struct context *context,
+				  struct vde_archive *archive)
 {
-	const struct drm_format_info *info;
-	struct image *image;
-	unsigned int i, j;
-	uint32_t handle;
-	void *ptr;
 	int err;
 
-	info = drm_format_get_info(frame->format);
-	if (!info) {
-		fprintf(stderr, "invalid format %08x\n", frame->format);
+	if (context->io_depth == 0)
 		return;
-	}
 
-	err = drm_tegra_bo_get_handle(frame->buffer, &handle);
-	if (err < 0) {
-		fprintf(stderr, "failed to get buffer object handle: %d\n", err);
-		return;
+	err = vde_archive_set_async(archive, context->io_depth);
+	if (err < 0)
+		fprintf(stderr, "failed to set up asynchronous writes: %d\n",
+			err);
+}
+
+static void gop_output(struct image *image, unsigned int frame, void *data)
+{
+	uint64_t start = vde_stats_begin();
+	struct context *context = data;
+
+	vde_trace_begin(VDE_TRACE_OUTPUT, 0, frame);
+
+	if (context->framehash)
+		context_hash_image(context, image);
+
+	if (context->archive) {
+		context_archive(context->archive, image, frame);
+	} else if (!context->bench && !context->framehash) {
+		printf("frame %u decoded\n", frame);
+		image_dump(image, stdout);
 	}
 
-	err = drm_tegra_bo_map(frame->buffer, &ptr);
-	if (err < 0) {
-		fprintf(stderr, "failed to map frame buffer: %d\n", err);
+	if (context->snapshot && frame % context->snapshot_interval == 0)
+		context_snapshot(context, image, frame);
+
+	vde_stats_add(VDE_COUNTER_FRAMES, 1);
+	vde_stats_add(VDE_COUNTER_MACROBLOCKS,
+		      DIV_ROUND_UP(image->width, 16) *
+		      DIV_ROUND_UP(image->height, 16));
+	vde_trace_end(VDE_TRACE_OUTPUT, 0, frame);
+	vde_stats_end(VDE_STAGE_OUTPUT, start);
+}
+
+void av_frame_dump(AVFrame *frame, FILE *fp)
+{
+	const AVPixFmtDescriptor *desc;
+	unsigned int i, j;
+
+	desc = av_pix_fmt_desc_get(frame->format);
+	if (!desc) {
+		fprintf(stderr, "invalid pixel format\n");
 		return;
 	}
 
-	fprintf(fp, "frame: %ux%u\n", frame->width, frame->height);
-	fprintf(fp, "  buffer: %p\n", frame->buffer);
-	fprintf(fp, "    handle: %u\n", handle);
-	fprintf(fp, "    size: %zu\n", frame->size);
-	fprintf(fp, "    ptr: %p\n", ptr);
-	fprintf(fp, "    fd: %d\n", frame->fd);
+	fprintf(fp, "frame decoded:\n");
+	fprintf(fp, "  resolution: %dx%d\n", frame->width, frame->height);
+	fprintf(fp, "  samples: %d\n", frame->nb_samples);
+	fprintf(fp, "  format: %d\n", frame->format);
+	fprintf(fp, "  key frame: %s\n", frame->key_frame ? "yes" : "no");
+	fprintf(fp, "  channels: %d\n", frame->channels);
+	fprintf(fp, "  crop: top %zu bottom %zu left %zu right %zu\n",
+	        frame->crop_top, frame->crop_bottom,
+	        frame->crop_left, frame->crop_right);
+	fprintf(fp, "  components: %d\n", desc->nb_components);
+	fprintf(fp, "  data:\n");
 
-	for (i = 0; i < info->num_planes; i++) {
-		unsigned int width = frame->width;
-		unsigned int height = frame->height;
-		unsigned int stride, pitch;
+	for (i = 0; i < av_pix_fmt_count_planes(frame->format); i++) {
+		int width = frame->width;
+		int height = frame->width;
+		unsigned int pitch;
 
 		if (i > 0) {
-			width /= info->hsub;
-			height /= info->vsub;
+			width = AV_CEIL_RSHIFT(width, desc->log2_chroma_w);
+			height = AV_CEIL_RSHIFT(height, desc->log2_chroma_h);
 		}
 
-		stride = width * info->cpp[i];
-		pitch = ALIGN(stride, 64);
+		pitch = width * desc->comp[i].depth / 8;
 
-		fprintf(fp, "  %u: %zx\n", i, frame->offsets[i]);
+		fprintf(fp, "    %u: %ux%u (%u bytes)\n", i, width, height,
+			pitch);
 
 		for (j = 0; j < height; j++) {
 			unsigned int offset = j * pitch;
 
-			hexdump(ptr + frame->offsets[i] + offset,
-				stride, stride, "    ", fp);
+			hexdump(frame->data[i] + offset, pitch, pitch,
+				"      ", stdout);
+		}
+	}
+}
+
+/* copies a frame decoded by libavcodec, for archiving */
+static int av_frame_to_image(AVFrame *frame, struct image **imagep)
+{
+	const struct drm_format_info *info;
+	struct image *image;
+	unsigned int i, j;
+	uint32_t format;
+	int err;
+
+	switch (frame->format) {
+	case AV_PIX_FMT_YUV420P:
+	case AV_PIX_FMT_YUVJ420P:
+		format = DRM_FORMAT_YUV420;
+		break;
+
+	case AV_PIX_FMT_NV12:
+		format = DRM_FORMAT_NV12;
+		break;
+
+	default:
+		return -ENOTSUP;
+	}
+
+	info = drm_format_get_info(format);
+
+	err = image_create(&image, frame->width, frame->height, format);
+	if (err < 0)
+		return err;
+
+	for (i = 0; i < info->num_planes; i++) {
+		unsigned int width = frame->width, height = frame->height;
+
+		if (i > 0) {
+			width /= info->hsub;
+			height /= info->vsub;
 		}
+
+		for (j = 0; j < height; j++)
+			memcpy(image->planes[i] + j * image->pitches[i],
+			       frame->data[i] + j * frame->linesize[i],
+			       width * info->cpp[i]);
 	}
 
-	drm_tegra_bo_unmap(frame->buffer);
+	*imagep = image;
+
+	return 0;
+}
+
+static int context_parse(struct context *context, const void *avcc,
+			 size_t size)
+{
+	int err;
 
-	err = tegra_vde_frame_detile(frame, &image);
+	vde_trace_begin(VDE_TRACE_PARSE, 0, 0);
+	err = h264_context_parse(&context->h264, avcc, size,
+				 context->bench ? NULL : stdout);
+	vde_trace_end(VDE_TRACE_PARSE, 0, 0);
 	if (err < 0) {
-		fprintf(stderr, "failed to detile frame: %d\n", err);
-		return;
+		fprintf(stderr, "failed to parse H264 context: %d\n", err);
+		return err;
 	}
 
-	image_dump(image, fp);
-	image_free(image);
+	if (context->h264.num_sps > 0)
+		snapshot_colorspace_from_sps(&context->colorspace,
+					     &context->h264.sps[0]);
+
+	return 0;
 }
 
-void tegra_vde_frame_free(struct tegra_vde_frame *frame)
+static void print_probe_reasons(FILE *fp, unsigned int reasons)
 {
-	if (frame)
-		drm_tegra_bo_unref(frame->buffer);
+	const char *separator = "";
+	unsigned int i;
 
-	free(frame);
+	for (i = 0; i < 32; i++) {
+		if (reasons & (1u << i)) {
+			fprintf(fp, "%s%s", separator,
+				vde_probe_reason_name(1u << i));
+			separator = ", ";
+		}
+	}
 }
 
-static int tegra_vde_open(struct tegra_vde **vdep, struct drm_tegra *drm)
+static int context_open(struct context *context, const void *avcc,
+			size_t size)
 {
-	struct tegra_vde *vde;
+	struct vde_session_config config;
+	struct vde_probe probe;
 	int err;
 
-	vde = calloc(1, sizeof(*vde));
-	if (!vde)
-		return -ENOMEM;
+	/* fail before connecting to the daemon or opening any device */
+	err = vde_probe_parameter_sets(&probe, avcc, size);
+	if (err < 0)
+		return err;
 
-	vde->drm = drm;
+	if (probe.reasons) {
+		fprintf(stderr, "stream can't be decoded by the VDE: ");
+		print_probe_reasons(stderr, probe.reasons);
+		fprintf(stderr, "\n");
+		return -ENOTSUP;
+	}
 
-	vde->fd = open("/dev/tegra_vde", O_RDWR);
-	if (vde->fd < 0) {
-		err = -errno;
-		goto free;
+	/* sessions and the daemon parse on their own, snapshots need the VUI */
+	if (context->snapshot || context->jobs > 0) {
+		err = context_parse(context, avcc, size);
+		if (err < 0)
+			return err;
 	}
 
-	err = drm_tegra_bo_new(&vde->bitstream, vde->drm, 0, 256 * 1024);
-	if (err < 0) {
-		fprintf(stderr, "failed to create bitstream buffer: %d\n", err);
-		goto close;
+	if (context->socket) {
+		err = vde_client_connect(&context->client, context->socket);
+		if (err < 0) {
+			fprintf(stderr, "failed to connect to '%s': %d\n",
+				context->socket, err);
+			return err;
+		}
+
+		err = vde_client_set_stream(context->client, &context->stream);
+		if (err < 0) {
+			fprintf(stderr, "failed to set stream parameters: %d\n", err);
+			return err;
+		}
+
+		err = vde_client_set_parameter_sets(context->client, avcc, size);
+		if (err < 0) {
+			fprintf(stderr, "failed to send parameter sets: %d\n", err);
+			return err;
+		}
+
+		return 0;
 	}
 
-	err = drm_tegra_bo_export(vde->bitstream, 0);
-	if (err < 0) {
-		fprintf(stderr, "failed to export bitstream buffer: %d\n", err);
-		goto unref_bitstream;
+	if (context->jobs == 0) {
+		memset(&config, 0, sizeof(config));
+		config.verbose = !context->bench;
+		config.consumer = context->consumer;
+
+		if (context->ops == &tegra_vde_soft_ops)
+			config.backend = VDE_BACKEND_SOFTWARE;
+
+		err = vde_session_open(&context->session, &config);
+		if (err < 0) {
+			fprintf(stderr, "failed to open session: %d\n", err);
+			return err;
+		}
+
+		err = vde_session_set_parameter_sets(context->session, avcc, size);
+		if (err < 0) {
+			fprintf(stderr, "failed to parse H264 context: %d\n", err);
+			return err;
+		}
+
+		return 0;
 	}
 
-	vde->bitstream_fd = err;
+	/* the software stand-in uses memfd-backed buffers */
+	if (context->ops == &tegra_vde_hw_ops) {
+		context->fd = open("/dev/dri/card0", O_RDWR);
+		if (context->fd < 0) {
+			fprintf(stderr, "failed to open Tegra DRM: %d\n", -errno);
+			return -errno;
+		}
+
+		err = drm_tegra_new(&context->drm, context->fd);
+		if (err < 0) {
+			fprintf(stderr, "failed to open Tegra DRM: %d\n", err);
+			close(context->fd);
+			return err;
+		}
+	}
 
-	err = drm_tegra_bo_new(&vde->secure, vde->drm, 0, 4 * 1024);
+	err = gop_decoder_create(&context->gop, &context->h264, context->drm,
+				 context->ops, context->jobs, gop_output,
+				 context);
 	if (err < 0) {
-		fprintf(stderr, "failed to create secure buffer: %d\n", err);
-		goto close_bitstream;
+		fprintf(stderr, "failed to create GOP decoder: %d\n", err);
+		return err;
+	}
+
+	return 0;
+}
+
+static int context_receive(struct context *context, int timeout)
+{
+	struct vde_frame *frame;
+	struct image *image;
+	uint64_t start;
+	bool snapshot;
+	int err;
+
+	if (context->client) {
+		if (context->pending == 0)
+			return -ENODATA;
+
+		err = vde_client_receive(context->client, &frame, timeout);
+		if (err != -EAGAIN)
+			context->pending--;
+	} else {
+		err = vde_session_receive(context->session, &frame, timeout);
 	}
 
-	err = drm_tegra_bo_export(vde->secure, 0);
 	if (err < 0) {
-		fprintf(stderr, "failed to export secure buffer: %d\n", err);
-		goto unref_secure;
+		if (err != -ENODATA && err != -EAGAIN)
+			fprintf(stderr, "failed to decode frame: %d\n", err);
+
+		return err;
+	}
+
+	start = vde_stats_begin();
+	vde_trace_begin(VDE_TRACE_OUTPUT, 0, frame->sequence);
+
+	/* a real consumer needs the frame in linear layout as well */
+	if (context->framehash) {
+		context_hash_frame(context, frame);
+	} else if (context->bench) {
+		err = vde_frame_detile(frame, NULL);
+		if (err < 0)
+			fprintf(stderr, "failed to detile frame: %d\n", err);
+	} else if (!context->archive) {
+		printf("frame decoded\n");
+		vde_frame_dump(frame, stdout);
 	}
 
-	vde->secure_fd = err;
+	snapshot = context->snapshot &&
+		   frame->sequence % context->snapshot_interval == 0;
+
+	if (context->archive || snapshot) {
+		err = vde_frame_detile(frame, &image);
+		if (err < 0) {
+			fprintf(stderr, "failed to detile frame: %d\n", err);
+		} else {
+			if (context->archive)
+				context_archive(context->archive, image,
+						frame->sequence);
 
-	*vdep = vde;
+			if (snapshot)
+				context_snapshot(context, image,
+						 frame->sequence);
+
+			image_free(image);
+		}
+	}
+
+	vde_stats_add(VDE_COUNTER_FRAMES, 1);
+	vde_stats_add(VDE_COUNTER_MACROBLOCKS,
+		      DIV_ROUND_UP(frame->width, 16) *
+		      DIV_ROUND_UP(frame->height, 16));
+
+	vde_trace_end(VDE_TRACE_OUTPUT, 0, frame->sequence);
+	vde_frame_release(frame);
+	vde_stats_end(VDE_STAGE_OUTPUT, start);
 
 	return 0;
+}
+
+static int context_submit(struct context *context, const void *data,
+			  size_t size, unsigned long flags)
+{
+	ssize_t length;
+	uint64_t start;
+	int err;
+
+	trace_poll(context);
+	memory_poll(context);
+
+	vde_stats_add(VDE_COUNTER_BYTES, size);
+
+	if (context->gop) {
+		/* GOP segments keep a copy of each access unit anyway */
+		if (flags & VDE_SUBMIT_AVCC) {
+			size_t needed = size + context->h264.extradata_size + 64;
+
+			if (context->size < needed) {
+				free(context->buffer);
+				context->size = needed * 2;
+
+				context->buffer = malloc(context->size);
+				if (!context->buffer)
+					return -ENOMEM;
+			}
+
+			start = vde_stats_begin();
+			length = h264_sample_to_annexb(&context->h264,
+						       context->buffer,
+						       context->size, data,
+						       size);
+			vde_stats_end(VDE_STAGE_BSF, start);
+			if (length < 0)
+				return length;
+
+			data = context->buffer;
+			size = length;
+		}
+
+		err = gop_decoder_push(context->gop, data, size);
+		if (err < 0)
+			fprintf(stderr, "failed to queue frame: %d\n", err);
+
+		return err;
+	}
+
+	if (context->client) {
+		/* the daemon stops reading if it falls behind, so don't overrun it */
+		while (context->pending >= CLIENT_QUEUE_DEPTH) {
+			err = context_receive(context, -1);
+			if (err < 0)
+				return err;
+		}
+
+		err = vde_client_submit(context->client, data, size, flags, 0);
+		if (err < 0) {
+			fprintf(stderr, "failed to queue frame: %d\n", err);
+			return err;
+		}
+
+		context->pending++;
+		return 0;
+	}
+
+	/* make room by picking up decoded frames while the queue is full */
+	while ((err = vde_session_submit(context->session, data, size, flags,
+					 0)) == -EAGAIN) {
+		err = context_receive(context, -1);
+		if (err < 0)
+			return err;
+	}
+
+	if (err < 0)
+		fprintf(stderr, "failed to queue frame: %d\n", err);
 
-unref_secure:
-	drm_tegra_bo_unref(vde->secure);
-close_bitstream:
-	close(vde->bitstream_fd);
-unref_bitstream:
-	drm_tegra_bo_unref(vde->bitstream);
-close:
-	close(vde->fd);
-free:
-	free(vde);
 	return err;
 }
 
-static void tegra_vde_close(struct tegra_vde *vde)
+static int context_flush(struct context *context)
 {
-	if (vde) {
-		drm_tegra_bo_unref(vde->secure);
-		close(vde->secure_fd);
+	int ret, err = 0;
 
-		drm_tegra_bo_unref(vde->bitstream);
-		close(vde->bitstream_fd);
+	if (context->gop) {
+		err = gop_decoder_flush(context->gop);
+		if (err < 0) {
+			fprintf(stderr, "failed to decode GOPs: %d\n", err);
+			return err;
+		}
 
-		close(vde->fd);
+		return 0;
 	}
 
-	free(vde);
+	/* pick up the frames after a failed one, but report the failure */
+	while ((ret = context_receive(context, -1)) != -ENODATA)
+		if (ret < 0 && err == 0)
+			err = ret;
+
+	return err;
+}
+
+static void context_close(struct context *context)
+{
+	vde_client_close(context->client);
+	vde_session_close(context->session);
+	gop_decoder_free(context->gop);
+	h264_context_free(&context->h264);
+	free(context->buffer);
+
+	if (context->drm) {
+		drm_tegra_close(context->drm);
+		close(context->fd);
+	}
 }
 
-static int tegra_vde_decode(struct tegra_vde *vde,
-			    struct tegra_vde_frame **framep,
-			    struct h264_context *ctx,
-			    const void *data, size_t size)
+static int decode_mp4(struct context *context, struct mp4_file *mp4)
 {
-	uint64_t modifier = DRM_FORMAT_MOD_NVIDIA_16BX2_BLOCK(4);
-	struct tegra_vde_h264_decoder_ctx args;
-	struct h264_sps *sps = &ctx->sps[0];
-	struct h264_pps *pps = &ctx->pps[0];
-	struct tegra_vde_h264_frame f;
-	struct tegra_vde_frame *frame;
-	unsigned int width, height;
-	void *ptr;
+	struct mp4_sample sample;
+	uint32_t index;
+	uint64_t start;
 	int err;
 
-	width = (sps->pic_width_in_mbs_minus1 + 1) * 16;
-	height = (sps->pic_height_in_map_units_minus1 + 1) * 16;
+	printf("MP4: %ux%u, %u samples, timescale %u\n", mp4->width,
+	       mp4->height, mp4->num_samples, mp4->timescale);
 
-	printf("picture: %ux%u\n", width, height);
+	if (!context->bench)
+		hexdump(mp4->avcc, mp4->avcc_size, 16, NULL, stdout);
 
-	err = drm_tegra_bo_map(vde->bitstream, &ptr);
+	err = context_open(context, mp4->avcc, mp4->avcc_size);
 	if (err < 0)
 		return err;
 
-	memcpy(ptr, data, size);
+	if (context->io_depth > 0) {
+		err = mp4_start_readahead(mp4, context->io_depth);
+		if (err < 0)
+			fprintf(stderr, "failed to set up readahead: %d, reading from the mapping\n",
+				err);
+	}
 
-	hexdump(ptr, (size < 256) ? size : 256, 16, NULL, stdout);
+	while (true) {
+		start = vde_stats_begin();
+		index = mp4->cursor.sample;
+		vde_trace_begin(VDE_TRACE_READ, 0, index);
+		err = mp4_next_sample(mp4, &sample);
+		vde_trace_end(VDE_TRACE_READ, 0, index);
+		vde_stats_end(VDE_STAGE_DEMUX, start);
+		if (err < 0)
+			break;
+
+		err = context_submit(context, sample.data, sample.size,
+				     VDE_SUBMIT_AVCC);
+		if (err < 0)
+			break;
+	}
 
-	drm_tegra_bo_unmap(vde->bitstream);
+	if (err == -ENOENT)
+		err = context_flush(context);
+	else if (err < 0)
+		fprintf(stderr, "failed to decode sample %u: %d\n",
+			sample.index, err);
 
-	err = tegra_vde_frame_create(&frame, vde, width, height,
-				     DRM_FORMAT_YUV420, modifier);
-	if (err < 0)
-		return err;
+	context_close(context);
 
-	printf("buffer: %d\n", frame->fd);
-
-	memset(&f, 0, sizeof(f));
-	f.y_fd = frame->fd;
-	f.cb_fd = frame->fd;
-	f.cr_fd = frame->fd;
-	f.aux_fd = -1;
-	f.y_offset = frame->offsets[0];
-	f.cb_offset = frame->offsets[1];
-	f.cr_offset = frame->offsets[2];
-	f.aux_offset = 0;
-	f.frame_num = 0;
-	f.flags = FLAG_REFERENCE;
-	f.modifier = modifier;
-
-	memset(&args, 0, sizeof(args));
-	args.bitstream_data_fd = vde->bitstream_fd;
-	args.bitstream_data_offset = 0;
-	args.secure_fd = vde->secure_fd;
-	args.secure_offset = 0;
-	args.dpb_frames_ptr = (uintptr_t)&f;
-	args.dpb_frames_nb = 1;
-	args.dpb_ref_frames_with_earlier_poc_nb = 0;
-
-	/* SPS */
-	args.baseline_profile = 1;
-	args.level_idc = 11; //sps->level_idc;
-	args.log2_max_pic_order_cnt_lsb = sps->log2_max_pic_order_cnt_lsb_minus4 + 4;
-	args.log2_max_frame_num = sps->log2_max_frame_num_minus4 + 4;
-	args.pic_order_cnt_type = sps->pic_order_cnt_type;
-	args.direct_8x8_inference_flag = sps->direct_8x8_inference_flag;
-	args.pic_width_in_mbs = width / 16;
-	args.pic_height_in_mbs = height / 16;
-
-	/* PPS */
-	args.pic_init_qp = pps->pic_init_qp_minus26 + 26;
-	args.deblocking_filter_control_present_flag = pps->deblocking_filter_control_present_flag;
-	args.constrained_intra_pred_flag = pps->constrained_intra_pred_flag;
-	args.chroma_qp_index_offset = pps->chroma_qp_index_offset & 0x1f;
-	args.pic_order_present_flag = 0; //pps->pic_order_present_flag;
-
-	/* slice header */
-	args.num_ref_idx_l0_active_minus1 = pps->num_ref_idx_l0_default_active_minus1;
-	args.num_ref_idx_l1_active_minus1 = pps->num_ref_idx_l1_default_active_minus1;
-
-repeat:
-	err = ioctl(vde->fd, TEGRA_VDE_IOCTL_DECODE_H264, &args);
-	if (err < 0) {
-		if (errno == EINTR || errno == EAGAIN)
-			goto repeat;
+	return err;
+}
 
-		return -errno;
-	}
+/* input of libavformat, read ahead through io_uring */
+struct libav_input {
+	int fd;
+	struct vde_io_reader *reader;
+	AVIOContext *avio;
+};
 
-	*framep = frame;
+/* libavformat reads are small, so blocks are read ahead in bigger units */
+#define LIBAV_BLOCK_SIZE (256 * 1024)
+#define LIBAV_BUFFER_SIZE (32 * 1024)
 
-	return 0;
+static int libav_read(void *opaque, uint8_t *buffer, int size)
+{
+	ssize_t count = vde_io_reader_read(opaque, buffer, size);
+
+	if (count < 0)
+		return count;
+
+	return count ?: AVERROR_EOF;
 }
 
-void av_frame_dump(AVFrame *frame, FILE *fp)
+static int64_t libav_seek(void *opaque, int64_t offset, int whence)
 {
-	const AVPixFmtDescriptor *desc;
-	unsigned int i, j;
+	if (whence & AVSEEK_SIZE)
+		return vde_io_reader_size(opaque);
 
-	desc = av_pix_fmt_desc_get(frame->format);
-	if (!desc) {
-		fprintf(stderr, "invalid pixel format\n");
-		return;
+	return vde_io_reader_seek(opaque, offset, whence & ~AVSEEK_FORCE);
+}
+
+static void libav_close_input(struct libav_input *input)
+{
+	if (input->avio) {
+		av_freep(&input->avio->buffer);
+		avio_context_free(&input->avio);
 	}
 
-	fprintf(fp, "frame decoded:\n");
-	fprintf(fp, "  resolution: %dx%d\n", frame->width, frame->height);
-	fprintf(fp, "  samples: %d\n", frame->nb_samples);
-	fprintf(fp, "  format: %d\n", frame->format);
-	fprintf(fp, "  key frame: %s\n", frame->key_frame ? "yes" : "no");
-	fprintf(fp, "  channels: %d\n", frame->channels);
-	fprintf(fp, "  crop: top %zu bottom %zu left %zu right %zu\n",
-	        frame->crop_top, frame->crop_bottom,
-	        frame->crop_left, frame->crop_right);
-	fprintf(fp, "  components: %d\n", desc->nb_components);
-	fprintf(fp, "  data:\n");
+	vde_io_reader_free(input->reader);
 
-	for (i = 0; i < av_pix_fmt_count_planes(frame->format); i++) {
-		int width = frame->width;
-		int height = frame->width;
-		unsigned int pitch;
+	if (input->fd >= 0)
+		close(input->fd);
+}
 
-		if (i > 0) {
-			width = AV_CEIL_RSHIFT(width, desc->log2_chroma_w);
-			height = AV_CEIL_RSHIFT(height, desc->log2_chroma_h);
-		}
+static int libav_open_input(struct context *context, struct libav_input *input,
+			    AVFormatContext **fmtp, const char *filename)
+{
+	uint8_t *buffer;
+	int err;
 
-		pitch = width * desc->comp[i].depth / 8;
+	input->fd = -1;
 
-		fprintf(fp, "    %u: %ux%u (%u bytes)\n", i, width, height,
-			pitch);
+	if (context->io_depth == 0)
+		goto open;
 
-		for (j = 0; j < height; j++) {
-			unsigned int offset = j * pitch;
+	input->fd = open(filename, O_RDONLY | O_CLOEXEC);
+	if (input->fd < 0)
+		goto open;
 
-			hexdump(frame->data[i] + offset, pitch, pitch,
-				"      ", stdout);
-		}
+	err = vde_io_reader_create(&input->reader, input->fd,
+				   context->io_depth, LIBAV_BLOCK_SIZE);
+	if (err < 0) {
+		fprintf(stderr, "failed to set up readahead: %d, reading synchronously\n",
+			err);
+		goto close;
+	}
+
+	buffer = av_malloc(LIBAV_BUFFER_SIZE);
+	if (!buffer)
+		goto close;
+
+	input->avio = avio_alloc_context(buffer, LIBAV_BUFFER_SIZE, 0,
+					 input->reader, libav_read, NULL,
+					 libav_seek);
+	if (!input->avio) {
+		av_free(buffer);
+		goto close;
 	}
+
+	*fmtp = avformat_alloc_context();
+	if (!*fmtp)
+		goto close;
+
+	(*fmtp)->pb = input->avio;
+	(*fmtp)->flags |= AVFMT_FLAG_CUSTOM_IO;
+
+	goto open;
+
+close:
+	libav_close_input(input);
+	memset(input, 0, sizeof(*input));
+	input->fd = -1;
+open:
+	return avformat_open_input(fmtp, filename, NULL, NULL);
 }
 
-int main(int argc, char *argv[])
+static int decode_libav(struct context *context, const char *filename)
 {
-	struct tegra_vde_frame *vf = NULL;
+	struct libav_input input;
 	const AVBitStreamFilter *bsf;
-	struct tegra_vde *vde = NULL;
 	AVFormatContext *fmt = NULL;
-	struct h264_context ctx;
-	struct drm_tegra *drm;
 	AVCodecContext *codec;
-	const char *filename;
 	AVBSFContext *bsfc;
 	AVCodec *decoder;
 	AVStream *video;
+	unsigned int index = 0;
 	AVFrame *frame;
+	uint64_t start;
 	AVPacket pkt;
-	int err, fd;
-
-	if (argc < 2) {
-		usage(argv[0], stderr);
-		return 1;
-	}
-
-	filename = argv[1];
+	int err;
 
-	err = avformat_open_input(&fmt, filename, NULL, NULL);
+	err = libav_open_input(context, &input, &fmt, filename);
 	if (err < 0) {
 		fprintf(stderr, "failed to open '%s': %d\n", filename, err);
-		return 1;
+		libav_close_input(&input);
+		return err;
 	}
 
 	err = avformat_find_stream_info(fmt, NULL);
 	if (err < 0) {
 		fprintf(stderr, "failed to find stream info: %d\n", err);
-		return 1;
+		return err;
 	}
 
 	av_dump_format(fmt, 0, filename, 0);
@@ -561,7 +994,7 @@ int main(int argc, char *argv[])
 	err = av_find_best_stream(fmt, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
 	if (err < 0) {
 		fprintf(stderr, "failed to find video stream: %d\n", err);
-		return 1;
+		return err;
 	}
 
 	video = fmt->streams[err];
@@ -569,93 +1002,81 @@ int main(int argc, char *argv[])
 	bsf = av_bsf_get_by_name("h264_mp4toannexb");
 	if (!bsf) {
 		fprintf(stderr, "failed to find mp4toannexb filter\n");
-		return 1;
+		return -ENOENT;
 	}
 
 	err = av_bsf_alloc(bsf, &bsfc);
 	if (err < 0) {
 		fprintf(stderr, "failed to allocate bitstream filter\n");
-		return 1;
+		return err;
 	}
 
 	err = avcodec_parameters_copy(bsfc->par_in, video->codecpar);
 	if (err < 0) {
 		fprintf(stderr, "failed to copy codec paremeters\n");
-		return 1;
+		return err;
 	}
 
 	err = av_bsf_init(bsfc);
 	if (err < 0) {
 		fprintf(stderr, "failed to initialize bitstream filter\n");
-		return 1;
+		return err;
 	}
 
 	decoder = avcodec_find_decoder(video->codecpar->codec_id);
 	if (!decoder) {
 		fprintf(stderr, "failed to find decoder\n");
-		return 1;
+		return -ENOENT;
 	}
 
 	codec = avcodec_alloc_context3(decoder);
 	if (!codec) {
 		fprintf(stderr, "failed to allocate codec\n");
-		return 1;
+		return -ENOMEM;
 	}
 
 	printf("extra data: %d bytes\n", video->codecpar->extradata_size);
 
-	hexdump(video->codecpar->extradata, video->codecpar->extradata_size,
-		16, NULL, stdout);
-
-	memset(&ctx, 0, sizeof(ctx));
+	if (!context->bench)
+		hexdump(video->codecpar->extradata,
+			video->codecpar->extradata_size, 16, NULL, stdout);
 
-	err = h264_context_parse(&ctx, video->codecpar->extradata, video->codecpar->extradata_size);
-	if (err < 0) {
-		fprintf(stderr, "failed to parse H264 context: %d\n", err);
-		return 1;
-	}
-
-	fd = open("/dev/dri/card0", O_RDWR);
-	if (fd < 0) {
-		fprintf(stderr, "failed to open Tegra DRM: %d\n", -errno);
-		return 1;
-	}
-
-	err = drm_tegra_new(&drm, fd);
-	if (err < 0) {
-		fprintf(stderr, "failed to open Tegra DRM: %d\n", err);
-		return 1;
-	}
-
-	err = tegra_vde_open(&vde, drm);
-	if (err < 0) {
-		fprintf(stderr, "failed to open VDE: %d\n", err);
-		return 1;
-	}
+	err = context_open(context, video->codecpar->extradata,
+			   video->codecpar->extradata_size);
+	if (err < 0)
+		return err;
 
 	err = avcodec_parameters_to_context(codec, video->codecpar);
 	if (err < 0) {
 		fprintf(stderr, "failed to copy codec parameters: %d\n", err);
-		return 1;
+		return err;
 	}
 
 	err = avcodec_open2(codec, decoder, NULL);
 	if (err < 0) {
 		fprintf(stderr, "failed to open codec: %d\n", err);
-		return 1;
+		return err;
 	}
 
 	frame = av_frame_alloc();
 	if (!frame) {
 		fprintf(stderr, "failed to allocate frame\n");
-		return 1;
+		return -ENOMEM;
 	}
 
 	av_init_packet(&pkt);
 	pkt.data = NULL;
 	pkt.size = 0;
 
-	while (av_read_frame(fmt, &pkt) >= 0) {
+	while (true) {
+		start = vde_stats_begin();
+		vde_trace_begin(VDE_TRACE_READ, 0, index);
+		err = av_read_frame(fmt, &pkt);
+		vde_trace_end(VDE_TRACE_READ, 0, index++);
+		vde_stats_end(VDE_STAGE_DEMUX, start);
+		if (err < 0)
+			break;
+
 		if (pkt.stream_index == video->index) {
 			AVPacket raw;
 
@@ -664,12 +1085,13 @@ int main(int argc, char *argv[])
 				hexdump(pkt.data, pkt.size, 16, NULL, stdout);
 			}
 
+			start = vde_stats_begin();
 			av_packet_ref(&raw, &pkt);
 
 			err = av_bsf_send_packet(bsfc, &raw);
 			if (err < 0) {
 				fprintf(stderr, "failed to send packet to bitstream filter\n");
-				return 1;
+				return err;
 			}
 
 			av_packet_unref(&raw);
@@ -677,46 +1099,66 @@ int main(int argc, char *argv[])
 			err = av_bsf_receive_packet(bsfc, &raw);
 			if (err < 0) {
 				fprintf(stderr, "failed to receive packet from bitstream filter\n");
-				return 1;
+				return err;
 			}
 
+			vde_stats_end(VDE_STAGE_BSF, start);
+
 			if (0) {
 				fprintf(stdout, "raw H.264 data:\n");
 				hexdump(raw.data, raw.size, 16, NULL, stdout);
 			}
 
-			err = tegra_vde_decode(vde, &vf, &ctx, raw.data, raw.size);
-			if (err < 0) {
-				fprintf(stderr, "failed to decode frame: %d\n",
-					err);
-				return 1;
-			}
-
-			printf("frame decoded\n");
+			err = context_submit(context, raw.data, raw.size, 0);
+			if (err < 0)
+				return err;
 
-			tegra_vde_frame_dump(vf, stdout);
-			tegra_vde_frame_free(vf);
 			av_packet_unref(&raw);
 
+			/* no reference decode when benchmarking */
+			if (context->gop || context->bench) {
+				av_packet_unref(&pkt);
+				continue;
+			}
+
+			err = context_receive(context, -1);
+			if (err < 0)
+				return err;
+
 			err = avcodec_send_packet(codec, &pkt);
 			if (err < 0) {
 				fprintf(stderr, "failed to decode frame: %d\n",
 					err);
-				return 1;
+				return err;
 			}
 
 			err = avcodec_receive_frame(codec, frame);
 			if (err < 0) {
 				fprintf(stderr, "failed to receive frame: %d\n", err);
-				return 1;
+				return err;
 			}
 
-			av_frame_dump(frame, stdout);
+			if (context->reference) {
+				struct image *image;
+
+				err = av_frame_to_image(frame, &image);
+				if (err < 0) {
+					fprintf(stderr, "failed to convert frame: %d\n",
+						err);
+					return err;
+				}
+
+				context_archive(context->reference, image,
+						context->references++);
+				image_free(image);
+			} else {
+				av_frame_dump(frame, stdout);
+			}
 
 			if (0) {
 				FILE *fp = fopen("packet.h264", "wb");
 				if (!fp)
-					return 1;
+					return -errno;
 
 				fwrite(pkt.data, 1, pkt.size, fp);
 
@@ -727,13 +1169,353 @@ int main(int argc, char *argv[])
 		av_packet_unref(&pkt);
 	}
 
-	tegra_vde_close(vde);
-	drm_tegra_close(drm);
-	close(fd);
+	err = context_flush(context);
+	if (err < 0)
+		return err;
+
+	context_close(context);
 
+	av_frame_free(&frame);
 	av_bsf_free(&bsfc);
 	avcodec_close(codec);
 	avformat_close_input(&fmt);
+	libav_close_input(&input);
 
 	return 0;
 }
+
+/* returns 0 if all files can be decoded, 2 if any can't and 1 on errors */
+static int run_probe(int argc, char *argv[])
+{
+	struct vde_probe probe;
+	int i, err, ret = 0;
+
+	for (i = 0; i < argc; i++) {
+		err = vde_probe_file(&probe, argv[i]);
+		if (err < 0) {
+			fprintf(stderr, "failed to probe '%s': %d\n", argv[i], err);
+			ret = 1;
+			continue;
+		}
+
+		if (probe.reasons) {
+			printf("%s: unsupported: ", argv[i]);
+			print_probe_reasons(stdout, probe.reasons);
+			printf("\n");
+
+			if (ret == 0)
+				ret = 2;
+
+			continue;
+		}
+
+		printf("%s: supported (profile %u level %u, %ux%u)\n", argv[i],
+		       probe.profile_idc, probe.level_idc, probe.width,
+		       probe.height);
+	}
+
+	return ret;
+}
+
+int main(int argc, char *argv[])
+{
+	struct context context;
+	struct mp4_file *mp4 = NULL;
+	const char *filename, *daemon = NULL, *capture = NULL;
+	const char *archive = NULL, *reference = NULL, *framehash = NULL;
+	unsigned int archive_flags = 0;
+	bool libav = false, probe = false;
+	int opt, err;
+
+	memset(&context, 0, sizeof(context));
+	context.ops = &tegra_vde_hw_ops;
+	context.fd = -1;
+	context.snapshot_interval = 1;
+
+	while ((opt = getopt_long(argc, argv, "A:bC:c:d:F:HhI:i:j:lL:MPQ:R:S:st:u:w:X:z", options, NULL)) != -1) {
+		switch (opt) {
+		case 'A':
+			archive = optarg;
+			break;
+
+		case 'b':
+			context.bench = true;
+			break;
+
+		case 'C':
+			capture = optarg;
+			break;
+
+		case 'c':
+			context.socket = optarg;
+			break;
+
+		case 'd':
+			daemon = optarg;
+			break;
+
+		case 'F':
+			framehash = optarg;
+			break;
+
+		case 'H':
+			image_pool_set_huge_pages(true);
+			break;
+
+		case 'h':
+			usage(argv[0], stdout);
+			return 0;
+
+		case 'I':
+			err = cpu_isa_force(optarg);
+			if (err < 0) {
+				fprintf(stderr, "unsupported ISA: %s\n", optarg);
+				return 1;
+			}
+			break;
+
+		case 'i':
+			context.snapshot_interval = strtoul(optarg, NULL, 0);
+			if (context.snapshot_interval == 0) {
+				fprintf(stderr, "invalid snapshot interval: %s\n", optarg);
+				return 1;
+			}
+			break;
+
+		case 'j':
+			context.jobs = strtoul(optarg, NULL, 0);
+			if (context.jobs == 0) {
+				fprintf(stderr, "invalid number of jobs: %s\n", optarg);
+				return 1;
+			}
+			break;
+
+		case 'l':
+			libav = true;
+			break;
+
+		case 'L':
+			context.stream.priority = VDE_PRIORITY_LIVE;
+			context.stream.frame_rate = strtoul(optarg, NULL, 0);
+			break;
+
+		case 'M':
+			context.memory = true;
+			break;
+
+		case 'P':
+			probe = true;
+			break;
+
+		case 'Q':
+			context.io_depth = strtoul(optarg, NULL, 0);
+			break;
+
+		case 'R':
+			reference = optarg;
+			break;
+
+		case 'S':
+			context.snapshot = optarg;
+			break;
+
+		case 's':
+			context.ops = &tegra_vde_soft_ops;
+			break;
+
+		case 't':
+			context.trace = optarg;
+			break;
+
+		case 'u':
+			err = parse_consumer(optarg, &context.consumer);
+			if (err < 0) {
+				fprintf(stderr, "unknown consumer: %s\n", optarg);
+				return 1;
+			}
+			break;
+
+		case 'w':
+			context.stream.weight = strtoul(optarg, NULL, 0);
+			break;
+
+		case 'X':
+			err = vde_hash_parse(optarg, &context.hash_type);
+			if (err < 0) {
+				fprintf(stderr, "unsupported hash: %s\n", optarg);
+				return 1;
+			}
+			break;
+
+		case 'z':
+			archive_flags |= VDE_ARCHIVE_LZ4;
+			break;
+
+		default:
+			usage(argv[0], stderr);
+			return 1;
+		}
+	}
+
+	if (probe) {
+		if (optind >= argc) {
+			usage(argv[0], stderr);
+			return 1;
+		}
+
+		return run_probe(argc - optind, argv + optind);
+	}
+
+	if (capture) {
+		err = vde_capture_start(capture);
+		if (err < 0) {
+			fprintf(stderr, "failed to create capture '%s': %d\n",
+				capture, err);
+			return 1;
+		}
+	}
+
+	if (daemon) {
+		err = run_daemon(daemon, context.ops == &tegra_vde_soft_ops,
+				 context.consumer);
+		goto stop;
+	}
+
+	if (optind >= argc) {
+		usage(argv[0], stderr);
+		err = -EINVAL;
+		goto stop;
+	}
+
+	filename = argv[optind];
+
+	if (archive) {
+		err = vde_archive_create(&context.archive, archive,
+					 archive_flags);
+		if (err < 0) {
+			fprintf(stderr, "failed to create archive '%s': %d\n",
+				archive, err);
+			goto stop;
+		}
+
+		context_archive_async(&context, context.archive);
+	}
+
+	if (framehash) {
+		context.framehash = fopen(framehash, "w");
+		if (!context.framehash) {
+			err = -errno;
+			fprintf(stderr, "failed to create '%s': %d\n",
+				framehash, err);
+			goto stop;
+		}
+	}
+
+	if (reference) {
+		err = vde_archive_create(&context.reference, reference,
+					 archive_flags);
+		if (err < 0) {
+			fprintf(stderr, "failed to create archive '%s': %d\n",
+				reference, err);
+			goto stop;
+		}
+
+		context_archive_async(&context, context.reference);
+	}
+
+	if (context.bench)
+		vde_stats_enable();
+
+	if (context.trace) {
+		struct sigaction sa;
+
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_handler = trace_signal;
+		sigaction(SIGUSR1, &sa, NULL);
+
+		vde_trace_enable();
+	}
+
+	if (context.memory) {
+		struct sigaction sa;
+
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_handler = memory_signal;
+		sigaction(SIGUSR2, &sa, NULL);
+	}
+
+	/* MP4/MOV files are demuxed natively, everything else via libavformat */
+	if (!libav) {
+		err = mp4_open(&mp4, filename);
+		if (err < 0 && err != -EINVAL)
+			fprintf(stderr, "failed to open '%s' as MP4: %d, falling back to libavformat\n",
+				filename, err);
+	}
+
+	if (mp4) {
+		err = decode_mp4(&context, mp4);
+		mp4_close(mp4);
+	} else {
+		err = decode_libav(&context, filename);
+	}
+
+	if (context.bench && err == 0) {
+		vde_stats_report(stdout);
+		vde_mem_report(stdout);
+	}
+
+	if (context.trace) {
+		trace_requested = 1;
+		trace_poll(&context);
+		vde_trace_disable();
+	}
+
+stop:
+	if (context.archive) {
+		int ret = vde_archive_finish(context.archive);
+
+		if (ret < 0) {
+			fprintf(stderr, "failed to write archive '%s': %d\n",
+				archive, ret);
+			err = ret;
+		}
+	}
+
+	if (context.reference) {
+		int ret = vde_archive_finish(context.reference);
+
+		if (ret < 0) {
+			fprintf(stderr, "failed to write archive '%s': %d\n",
+				reference, ret);
+			err = ret;
+		}
+	}
+
+	if (context.framehash && fclose(context.framehash) != 0) {
+		int ret = -errno;
+
+		fprintf(stderr, "failed to write '%s': %d\n", framehash, ret);
+		err = ret;
+	}
+
+	if (capture) {
+		int ret = vde_capture_stop();
+
+		if (ret < 0) {
+			fprintf(stderr, "failed to write capture '%s': %d\n",
+				capture, ret);
+			err = ret;
+		}
+	}
+
+	/* everything has been torn down, so whatever is left has leaked */
+	if (context.memory) {
+		image_pool_flush();
+		vde_mem_report(stdout);
+
+		if (vde_mem_check_leaks(stderr) > 0)
+			err = -EBUSY;
+	}
+
+	return err < 0 ? 1 : 0;
+}
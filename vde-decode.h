@@ -0,0 +1,249 @@
+#ifndef VDE_DECODE_H
+#define VDE_DECODE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * libvde-decode session API
+ *
+ * A session owns a decoder context, its buffers and a pool of frames. Access
+ * units are queued with vde_session_submit(), which never blocks, and decoded
+ * on a separate thread. Decoded frames are picked up with vde_session_receive()
+ * and must be handed back with vde_frame_release(), after which their buffers
+ * are recycled for subsequent pictures. Sessions can be kept open across any
+ * number of streams by setting new parameter sets between them.
+ */
+
+struct image;
+struct vde_client;
+struct vde_daemon;
+struct vde_hash;
+struct vde_scheduler;
+struct vde_session;
+
+enum vde_backend {
+	VDE_BACKEND_HARDWARE,
+	VDE_BACKEND_SOFTWARE,
+};
+
+enum vde_priority {
+	/* shares the capacity left over by live streams with other batch work */
+	VDE_PRIORITY_BATCH,
+	/* decoded ahead of batch work, requires capacity to be reserved */
+	VDE_PRIORITY_LIVE,
+};
+
+/* what frames are used for, which decides their memory layout */
+enum vde_consumer {
+	/* detiled or otherwise read by the CPU */
+	VDE_CONSUMER_CPU,
+	/* scanned out by the display controller */
+	VDE_CONSUMER_DISPLAY,
+	/* read by a hardware encoder */
+	VDE_CONSUMER_ENCODER,
+};
+
+struct vde_stream_params {
+	enum vde_priority priority;
+	/* share of batch streams relative to each other, defaults to 1 */
+	unsigned int weight;
+	/* frames per second, 0 reserves the maximum rate of the stream's level */
+	unsigned int frame_rate;
+};
+
+struct vde_session_config {
+	enum vde_backend backend;
+	/* DRM device, defaults to /dev/dri/card0 */
+	const char *device;
+	/*
+	 * maximum number of queued access units, defaults to 100 ms worth of
+	 * the stream's frame rate or 4 if that isn't known
+	 */
+	unsigned int queue_depth;
+	/* print debugging output while decoding */
+	bool verbose;
+	/* block height of frames is chosen for this and the picture height */
+	enum vde_consumer consumer;
+
+	/* decode on a shared scheduler rather than a thread of its own */
+	struct vde_scheduler *scheduler;
+	struct vde_stream_params stream;
+};
+
+/*
+ * A scheduler shares one decoder between many sessions. Live sessions are
+ * decoded first and admitted based on their macroblock rate, batch sessions
+ * fill the remaining capacity in proportion to their weights.
+ */
+struct vde_scheduler_config {
+	/* level_idc of the decoder's capacity, defaults to 41 (level 4.1) */
+	unsigned int level;
+};
+
+int vde_scheduler_create(struct vde_scheduler **schedulerp,
+			 const struct vde_scheduler_config *config);
+void vde_scheduler_free(struct vde_scheduler *scheduler);
+
+/* access unit is a sample of length-prefixed NAL units rather than Annex B */
+#define VDE_SUBMIT_AVCC (1 << 0)
+
+struct vde_rect {
+	unsigned int x;
+	unsigned int y;
+	unsigned int width;
+	unsigned int height;
+};
+
+struct vde_frame {
+	/*
+	 * dmabuf containing all planes, valid until the frame is released
+	 * (for frames received from a daemon, this is a local copy of the
+	 * file descriptor)
+	 */
+	int fd;
+
+	unsigned int width;
+	unsigned int height;
+	uint32_t format;
+	uint64_t modifier;
+
+	unsigned int pitch;
+	size_t offsets[3];
+	size_t size;
+
+	/* visible part of the picture, as given by the SPS frame cropping */
+	struct vde_rect crop;
+
+	/* submission order and the value passed to vde_session_submit() */
+	uint64_t sequence;
+	uint64_t user;
+};
+
+int vde_session_open(struct vde_session **sessionp,
+		     const struct vde_session_config *config);
+void vde_session_close(struct vde_session *session);
+int vde_session_get_fd(struct vde_session *session);
+int vde_session_set_parameter_sets(struct vde_session *session,
+				   const void *avcc, size_t size);
+int vde_session_set_stream(struct vde_session *session,
+			   const struct vde_stream_params *params);
+int vde_session_submit(struct vde_session *session, const void *data,
+		       size_t size, unsigned long flags, uint64_t user);
+int vde_session_receive(struct vde_session *session,
+			struct vde_frame **framep, int timeout);
+
+/*
+ * Decode daemon and its clients
+ *
+ * The daemon accepts clients on a Unix socket and decodes each of their
+ * streams in a session of its own. Frames are handed to clients as dmabuf
+ * file descriptors without copying, and are recycled once the client has
+ * released them. Frames received by clients are used and released in the
+ * same way as those of a local session.
+ */
+
+int vde_daemon_create(struct vde_daemon **daemonp, const char *path,
+		      const struct vde_session_config *config);
+void vde_daemon_free(struct vde_daemon *daemon);
+int vde_daemon_run(struct vde_daemon *daemon);
+void vde_daemon_stop(struct vde_daemon *daemon);
+
+int vde_client_connect(struct vde_client **clientp, const char *path);
+void vde_client_close(struct vde_client *client);
+int vde_client_get_fd(struct vde_client *client);
+int vde_client_set_parameter_sets(struct vde_client *client, const void *avcc,
+				  size_t size);
+int vde_client_set_stream(struct vde_client *client,
+			  const struct vde_stream_params *params);
+int vde_client_submit(struct vde_client *client, const void *data, size_t size,
+		      unsigned long flags, uint64_t user);
+int vde_client_receive(struct vde_client *client, struct vde_frame **framep,
+		       int timeout);
+
+int vde_frame_detile(struct vde_frame *frame, struct image **imagep);
+/*
+ * Detile only part of the frame, or a scaled-down copy of it. Rectangles and
+ * sizes refer to the visible (cropped) picture and must be multiples of the
+ * chroma subsampling. Only the GOBs that contribute to the result are read.
+ */
+int vde_frame_detile_rect(struct vde_frame *frame, const struct vde_rect *rect,
+			  struct image **imagep);
+/* like vde_frame_detile_rect(), converting to YVU420, NV12 or NV21 */
+int vde_frame_detile_to(struct vde_frame *frame, const struct vde_rect *rect,
+			uint32_t format, struct image **imagep);
+/*
+ * Feeds the visible picture to the hash, plane by plane, without detiling it
+ * into an image first. See hash.h.
+ */
+int vde_frame_hash(struct vde_frame *frame, struct vde_hash *hash);
+int vde_frame_thumbnail(struct vde_frame *frame, unsigned int width,
+			unsigned int height, struct image **imagep);
+void vde_frame_dump(struct vde_frame *frame, FILE *fp);
+void vde_frame_release(struct vde_frame *frame);
+
+/*
+ * Stream classification
+ *
+ * Tells from the parameter sets alone whether the VDE can decode a stream,
+ * without opening any device, so that streams it can't decode can be routed
+ * elsewhere before anything is set up for them. The parameter sets of every
+ * profile are parsed completely, and all reasons against the VDE reported.
+ */
+
+enum vde_probe_reason {
+	/* parameter sets are missing or can't be parsed */
+	VDE_PROBE_MALFORMED = 1 << 0,
+	/* profile_idc other than baseline */
+	VDE_PROBE_PROFILE = 1 << 1,
+	/* anything but 4:2:0 */
+	VDE_PROBE_CHROMA_FORMAT = 1 << 2,
+	/* more than 8 bits per sample */
+	VDE_PROBE_BIT_DEPTH = 1 << 3,
+	VDE_PROBE_SCALING_MATRIX = 1 << 4,
+	/* pic_order_cnt_type other than 2 */
+	VDE_PROBE_POC_TYPE = 1 << 5,
+	/* field or MBAFF coding */
+	VDE_PROBE_INTERLACED = 1 << 6,
+	/* more than 255 macroblocks in either direction */
+	VDE_PROBE_SIZE = 1 << 7,
+	VDE_PROBE_CABAC = 1 << 8,
+	/* flexible macroblock ordering */
+	VDE_PROBE_SLICE_GROUPS = 1 << 9,
+	VDE_PROBE_WEIGHTED_PRED = 1 << 10,
+	VDE_PROBE_TRANSFORM_8X8 = 1 << 11,
+};
+
+struct vde_probe {
+	/* mask of enum vde_probe_reason, 0 if the VDE can decode the stream */
+	unsigned int reasons;
+	/* why the parameter sets are malformed */
+	int error;
+
+	unsigned int num_sps;
+	unsigned int num_pps;
+
+	/* taken from the first SPS */
+	unsigned int profile_idc;
+	unsigned int level_idc;
+	unsigned int width;
+	unsigned int height;
+	unsigned int chroma_format_idc;
+	unsigned int bit_depth;
+	unsigned int pic_order_cnt_type;
+};
+
+/*
+ * Both return 0 once the stream has been classified, malformed parameter
+ * sets included, and a negative error code if that wasn't possible.
+ */
+int vde_probe_parameter_sets(struct vde_probe *probe, const void *avcc,
+			     size_t size);
+/* probes the H.264 track of an MP4 file */
+int vde_probe_file(struct vde_probe *probe, const char *filename);
+/* short name of a single reason, such as "cabac" */
+const char *vde_probe_reason_name(enum vde_probe_reason reason);
+
+#endif
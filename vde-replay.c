@@ -0,0 +1,343 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <libdrm/tegra.h>
+
+#include "capture.h"
+#include "mem.h"
+#include "stats.h"
+#include "vde.h"
+
+/*
+ * Feeds a capture recorded by vde-decode --capture straight into a decoder
+ * backend. Nothing is demuxed or parsed, so this measures the submission path
+ * on its own and reproduces the exact sequence of decoder calls that led to
+ * a failure.
+ */
+
+static const struct option options[] = {
+	{ "paced", no_argument, NULL, 'p' },
+	{ "soft", no_argument, NULL, 's' },
+	{ "verbose", no_argument, NULL, 'v' },
+	{ "help", no_argument, NULL, 'h' },
+	{ NULL, 0, NULL, 0 },
+};
+
+static void usage(const char *program, FILE *fp)
+{
+	fprintf(fp, "usage: %s [options] CAPTURE\n", program);
+	fprintf(fp, "\n");
+	fprintf(fp, "options:\n");
+	fprintf(fp, "  -p, --paced    submit at the original pace rather than at full speed\n");
+	fprintf(fp, "  -s, --soft     use the software stand-in instead of the VDE\n");
+	fprintf(fp, "  -v, --verbose  print debugging output while decoding\n");
+	fprintf(fp, "  -h, --help     display this help screen and exit\n");
+}
+
+/* decoder context and frames of one of the captured streams */
+struct replay_stream {
+	unsigned int id;
+	struct tegra_vde *vde;
+	struct tegra_vde_frame *frames[VDE_CAPTURE_MAX_FRAMES];
+	struct replay_stream *next;
+};
+
+struct replay {
+	const struct tegra_vde_ops *ops;
+	struct drm_tegra *drm;
+	bool verbose;
+	bool paced;
+	int fd;
+
+	struct replay_stream *streams;
+	unsigned int mismatches;
+};
+
+static int replay_stream_get(struct replay *replay, unsigned int id,
+			     struct replay_stream **streamp)
+{
+	struct replay_stream *stream;
+	int err;
+
+	for (stream = replay->streams; stream; stream = stream->next) {
+		if (stream->id == id) {
+			*streamp = stream;
+			return 0;
+		}
+	}
+
+	stream = calloc(1, sizeof(*stream));
+	if (!stream)
+		return -ENOMEM;
+
+	err = tegra_vde_open(&stream->vde, replay->drm, replay->ops);
+	if (err < 0) {
+		free(stream);
+		return err;
+	}
+
+	stream->vde->verbose = replay->verbose;
+	stream->id = id;
+	stream->next = replay->streams;
+	replay->streams = stream;
+
+	*streamp = stream;
+
+	return 0;
+}
+
+static void replay_stream_free(struct replay_stream *stream)
+{
+	unsigned int i;
+
+	for (i = 0; i < VDE_CAPTURE_MAX_FRAMES; i++)
+		tegra_vde_frame_free(stream->frames[i]);
+
+	tegra_vde_close(stream->vde);
+	free(stream);
+}
+
+/* frames are reused for as long as the captured layout doesn't change */
+static int replay_stream_frame(struct replay_stream *stream, unsigned int index,
+			       const struct vde_capture_frame *capture,
+			       struct tegra_vde_frame **framep)
+{
+	struct tegra_vde_frame *frame = stream->frames[index];
+	int err;
+
+	if (frame && frame->width == capture->width &&
+	    frame->height == capture->height &&
+	    frame->format == capture->format &&
+	    frame->modifier == capture->frame.modifier) {
+		*framep = frame;
+		return 0;
+	}
+
+	tegra_vde_frame_free(frame);
+	stream->frames[index] = NULL;
+
+	err = tegra_vde_frame_create(&frame, stream->vde, capture->width,
+				     capture->height, capture->format,
+				     capture->frame.modifier);
+	if (err < 0)
+		return err;
+
+	stream->frames[index] = frame;
+
+	if (frame->pitch != capture->pitch || frame->size != capture->size)
+		return -EINVAL;
+
+	*framep = frame;
+
+	return 0;
+}
+
+static int replay_entry(struct replay *replay, unsigned int index,
+			const struct vde_capture_entry *entry)
+{
+	const struct vde_capture_record *record = entry->record;
+	struct tegra_vde_h264_frame dpb[VDE_CAPTURE_MAX_FRAMES];
+	struct tegra_vde_h264_decoder_ctx args;
+	struct tegra_vde_frame *frame;
+	struct replay_stream *stream;
+	struct tegra_vde *vde;
+	unsigned int i;
+	uint64_t start;
+	ssize_t length;
+	int err;
+
+	err = replay_stream_get(replay, record->stream, &stream);
+	if (err < 0)
+		return err;
+
+	vde = stream->vde;
+
+	for (i = 0; i < record->ctx.dpb_frames_nb; i++) {
+		err = replay_stream_frame(stream, i, &entry->frames[i], &frame);
+		if (err < 0)
+			return err;
+
+		dpb[i] = entry->frames[i].frame;
+		dpb[i].y_fd = frame->buffer->fd;
+		dpb[i].cb_fd = frame->buffer->fd;
+		dpb[i].cr_fd = frame->buffer->fd;
+		dpb[i].aux_fd = -1;
+	}
+
+	vde->frame = record->frame;
+
+	length = tegra_vde_stage(vde, entry->data, record->size);
+	if (length < 0)
+		return length;
+
+	args = record->ctx;
+	args.bitstream_data_fd = vde->bitstream->fd;
+	args.bitstream_data_offset = 0;
+	args.secure_fd = vde->secure->fd;
+	args.secure_offset = 0;
+	args.dpb_frames_ptr = (uintptr_t)dpb;
+
+	start = vde_stats_begin();
+	err = vde->ops->decode(vde, &args, length);
+	vde_stats_end(VDE_STAGE_DECODE, start);
+
+	if (err != record->status) {
+		fprintf(stderr, "decode %u (stream %u, frame %llu): %d, captured %d\n",
+			index, record->stream,
+			(unsigned long long)record->frame, err,
+			record->status);
+		replay->mismatches++;
+	}
+
+	vde_stats_add(VDE_COUNTER_FRAMES, 1);
+	vde_stats_add(VDE_COUNTER_BYTES, length);
+	vde_stats_add(VDE_COUNTER_MACROBLOCKS, args.pic_width_in_mbs *
+					       args.pic_height_in_mbs);
+
+	return 0;
+}
+
+static int replay_run(struct replay *replay, struct vde_capture_file *capture)
+{
+	unsigned int i, count = capture->header->num_records;
+	struct vde_capture_entry entry;
+	struct timespec ts;
+	uint64_t start, time;
+	int err;
+
+	start = vde_stats_now();
+
+	for (i = 0; i < count; i++) {
+		err = vde_capture_get(capture, i, &entry);
+		if (err < 0) {
+			fprintf(stderr, "invalid record %u: %d\n", i, err);
+			return err;
+		}
+
+		if (replay->paced) {
+			time = start + entry.record->time;
+			ts.tv_sec = time / 1000000000;
+			ts.tv_nsec = time % 1000000000;
+
+			while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+					       &ts, NULL) == EINTR)
+				;
+		}
+
+		err = replay_entry(replay, i, &entry);
+		if (err < 0) {
+			fprintf(stderr, "failed to replay record %u: %d\n", i,
+				err);
+			return err;
+		}
+	}
+
+	time = vde_stats_now() - start;
+
+	printf("replayed %u decodes in %.3f s, %.1f decodes/s, %u mismatches\n",
+	       count, time / 1e9, time ? count * 1e9 / time : 0.0,
+	       replay->mismatches);
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	struct vde_capture_file *capture;
+	struct replay_stream *stream;
+	struct replay replay;
+	int opt, err;
+
+	memset(&replay, 0, sizeof(replay));
+	replay.ops = &tegra_vde_hw_ops;
+	replay.fd = -1;
+
+	while ((opt = getopt_long(argc, argv, "hpsv", options, NULL)) != -1) {
+		switch (opt) {
+		case 'h':
+			usage(argv[0], stdout);
+			return 0;
+
+		case 'p':
+			replay.paced = true;
+			break;
+
+		case 's':
+			replay.ops = &tegra_vde_soft_ops;
+			break;
+
+		case 'v':
+			replay.verbose = true;
+			break;
+
+		default:
+			usage(argv[0], stderr);
+			return 1;
+		}
+	}
+
+	if (optind >= argc) {
+		usage(argv[0], stderr);
+		return 1;
+	}
+
+	err = vde_capture_open(&capture, argv[optind]);
+	if (err < 0) {
+		fprintf(stderr, "failed to open capture '%s': %d\n",
+			argv[optind], err);
+		return 1;
+	}
+
+	/* the software stand-in uses memfd-backed buffers */
+	if (replay.ops == &tegra_vde_hw_ops) {
+		replay.fd = open("/dev/dri/card0", O_RDWR);
+		if (replay.fd < 0) {
+			err = -errno;
+			fprintf(stderr, "failed to open Tegra DRM: %d\n", err);
+			goto close;
+		}
+
+		err = drm_tegra_new(&replay.drm, replay.fd);
+		if (err < 0) {
+			fprintf(stderr, "failed to open Tegra DRM: %d\n", err);
+			close(replay.fd);
+			goto close;
+		}
+	}
+
+	vde_stats_enable();
+
+	err = replay_run(&replay, capture);
+	if (err == 0)
+		vde_stats_report(stdout);
+
+	while ((stream = replay.streams) != NULL) {
+		replay.streams = stream->next;
+		replay_stream_free(stream);
+	}
+
+	if (replay.drm) {
+		drm_tegra_close(replay.drm);
+		close(replay.fd);
+	}
+
+	vde_mem_report(stdout);
+
+	if (vde_mem_check_leaks(stderr) > 0 && err == 0)
+		err = -EBUSY;
+
+close:
+	vde_capture_close(capture);
+
+	if (err == 0 && replay.mismatches)
+		err = -EIO;
+
+	return err < 0 ? 1 : 0;
+}
@@ -0,0 +1,233 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+
+#include <libavcodec/avcodec.h>
+
+#include "utils.h"
+#include "vde.h"
+
+/*
+ * Software stand-in for the VDE. It consumes the same decoder context as the
+ * TEGRA_VDE_IOCTL_DECODE_H264 IOCTL, decodes the bitstream using libavcodec
+ * and writes the result in block-linear layout to the first DPB frame, much
+ * like the hardware would. This allows the decoding pipeline to be exercised
+ * on machines without a VDE.
+ */
+struct tegra_vde_soft {
+	AVCodecContext *codec;
+	AVFrame *frame;
+
+	uint8_t *data;
+	size_t size;
+};
+
+struct tegra_vde_soft_mapping {
+	void *ptr;
+	size_t size;
+};
+
+static int tegra_vde_soft_map(struct tegra_vde_soft_mapping *map, int fd,
+			      int prot)
+{
+	off_t size;
+
+	size = lseek(fd, 0, SEEK_END);
+	if (size < 0)
+		return -errno;
+
+	map->ptr = mmap(NULL, size, prot, MAP_SHARED, fd, 0);
+	if (map->ptr == MAP_FAILED)
+		return -errno;
+
+	map->size = size;
+
+	return 0;
+}
+
+static void tegra_vde_soft_unmap(struct tegra_vde_soft_mapping *map)
+{
+	munmap(map->ptr, map->size);
+}
+
+static int tegra_vde_soft_open(struct tegra_vde *vde)
+{
+	struct tegra_vde_soft *soft;
+	AVCodec *decoder;
+	int err;
+
+	decoder = avcodec_find_decoder(AV_CODEC_ID_H264);
+	if (!decoder)
+		return -ENOENT;
+
+	soft = calloc(1, sizeof(*soft));
+	if (!soft)
+		return -ENOMEM;
+
+	soft->codec = avcodec_alloc_context3(decoder);
+	if (!soft->codec) {
+		err = -ENOMEM;
+		goto free;
+	}
+
+	/* parallelism comes from running multiple decoder contexts */
+	soft->codec->thread_count = 1;
+	soft->codec->flags |= AV_CODEC_FLAG_LOW_DELAY;
+	soft->codec->apply_cropping = 0;
+
+	err = avcodec_open2(soft->codec, decoder, NULL);
+	if (err < 0)
+		goto free_codec;
+
+	soft->frame = av_frame_alloc();
+	if (!soft->frame) {
+		err = -ENOMEM;
+		goto close;
+	}
+
+	vde->priv = soft;
+
+	return 0;
+
+close:
+	avcodec_close(soft->codec);
+free_codec:
+	avcodec_free_context(&soft->codec);
+free:
+	free(soft);
+	return err;
+}
+
+static void tegra_vde_soft_close(struct tegra_vde *vde)
+{
+	struct tegra_vde_soft *soft = vde->priv;
+
+	av_frame_free(&soft->frame);
+	avcodec_close(soft->codec);
+	avcodec_free_context(&soft->codec);
+	free(soft->data);
+	free(soft);
+}
+
+static int tegra_vde_soft_decode(struct tegra_vde *vde,
+				 const struct tegra_vde_h264_decoder_ctx *args,
+				 size_t size)
+{
+	const struct tegra_vde_h264_frame *frames = (const void *)(uintptr_t)args->dpb_frames_ptr;
+	const struct tegra_vde_h264_frame *f = &frames[0];
+	unsigned int width = args->pic_width_in_mbs * 16;
+	unsigned int height = args->pic_height_in_mbs * 16;
+	const int fds[3] = { f->y_fd, f->cb_fd, f->cr_fd };
+	const size_t offsets[3] = { f->y_offset, f->cb_offset, f->cr_offset };
+	struct tegra_vde_soft *soft = vde->priv;
+	struct tegra_vde_soft_mapping map;
+	unsigned int block_height, gobs;
+	AVFrame *frame = soft->frame;
+	unsigned int i;
+	AVPacket pkt;
+	int err;
+
+	err = tegra_get_block_height(f->modifier);
+	if (err < 0)
+		return err;
+
+	block_height = err;
+
+	/* libavcodec may read past the end of the input */
+	if (soft->size < size + AV_INPUT_BUFFER_PADDING_SIZE) {
+		uint8_t *data = realloc(soft->data, size + AV_INPUT_BUFFER_PADDING_SIZE);
+		if (!data)
+			return -ENOMEM;
+
+		soft->size = size + AV_INPUT_BUFFER_PADDING_SIZE;
+		soft->data = data;
+	}
+
+	err = tegra_vde_soft_map(&map, args->bitstream_data_fd, PROT_READ);
+	if (err < 0)
+		return err;
+
+	if (args->bitstream_data_offset + size > map.size) {
+		tegra_vde_soft_unmap(&map);
+		return -EINVAL;
+	}
+
+	memcpy(soft->data, map.ptr + args->bitstream_data_offset, size);
+	memset(soft->data + size, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+	tegra_vde_soft_unmap(&map);
+
+	av_init_packet(&pkt);
+	pkt.data = soft->data;
+	pkt.size = size;
+
+	err = avcodec_send_packet(soft->codec, &pkt);
+	if (err < 0)
+		return err;
+
+	/*
+	 * No picture came out of the access unit. Fail the way the VDE does,
+	 * -ENODATA would be mistaken for the end of the session's queue.
+	 */
+	err = avcodec_receive_frame(soft->codec, frame);
+	if (err == AVERROR(EAGAIN))
+		return -EIO;
+
+	if (err < 0)
+		return err;
+
+	if (frame->format != AV_PIX_FMT_YUV420P &&
+	    frame->format != AV_PIX_FMT_YUVJ420P) {
+		err = -ENOTSUP;
+		goto unref;
+	}
+
+	if (frame->width < width)
+		width = frame->width;
+
+	if (frame->height < height)
+		height = frame->height;
+
+	gobs = DIV_ROUND_UP(args->pic_width_in_mbs * 16, 64);
+
+	for (i = 0; i < 3; i++) {
+		unsigned int w = width, h = height, g = gobs;
+
+		if (i > 0) {
+			w /= 2;
+			h /= 2;
+			g = DIV_ROUND_UP(g, 2);
+		}
+
+		err = tegra_vde_soft_map(&map, fds[i], PROT_READ | PROT_WRITE);
+		if (err < 0)
+			goto unref;
+
+		if (offsets[i] >= map.size) {
+			tegra_vde_soft_unmap(&map);
+			err = -EINVAL;
+			goto unref;
+		}
+
+		tegra_vde_tile_plane(map.ptr + offsets[i], map.size - offsets[i],
+				     frame->data[i], frame->linesize[i], w, h, g,
+				     block_height);
+
+		tegra_vde_soft_unmap(&map);
+	}
+
+	err = 0;
+
+unref:
+	av_frame_unref(frame);
+	return err;
+}
+
+const struct tegra_vde_ops tegra_vde_soft_ops = {
+	.name = "software",
+	.open = tegra_vde_soft_open,
+	.close = tegra_vde_soft_close,
+	.decode = tegra_vde_soft_decode,
+};
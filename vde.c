@@ -0,0 +1,1514 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#include <libdrm/tegra.h>
+#include <drm_fourcc.h>
+
+#include "capture.h"
+#include "cpu.h"
+#include "drm-utils.h"
+#include "hash.h"
+#include "h264-parser.h"
+#include "image.h"
+#include "mem.h"
+#include "stats.h"
+#include "trace.h"
+#include "utils.h"
+#include "vde.h"
+
+int tegra_vde_buffer_create(struct tegra_vde_buffer **bufferp,
+			    struct drm_tegra *drm, size_t size)
+{
+	struct tegra_vde_buffer *buffer;
+	int err;
+
+	buffer = calloc(1, sizeof(*buffer));
+	if (!buffer)
+		return -ENOMEM;
+
+	buffer->size = size;
+
+	if (drm) {
+		err = drm_tegra_bo_new(&buffer->bo, drm, 0, size);
+		if (err < 0)
+			goto free;
+
+		err = drm_tegra_bo_export(buffer->bo, 0);
+		if (err < 0)
+			goto unref;
+
+		buffer->fd = err;
+	} else {
+		buffer->fd = memfd_create("vde-buffer", MFD_CLOEXEC);
+		if (buffer->fd < 0) {
+			err = -errno;
+			goto free;
+		}
+
+		if (ftruncate(buffer->fd, size) < 0) {
+			err = -errno;
+			goto close;
+		}
+
+		buffer->ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+				   MAP_SHARED, buffer->fd, 0);
+		if (buffer->ptr == MAP_FAILED) {
+			err = -errno;
+			goto close;
+		}
+	}
+
+	if (buffer->bo)
+		vde_mem_alloc(VDE_MEM_BO, size);
+
+	vde_mem_alloc(VDE_MEM_DMABUF, size);
+	*bufferp = buffer;
+
+	return 0;
+
+close:
+	close(buffer->fd);
+unref:
+	drm_tegra_bo_unref(buffer->bo);
+free:
+	free(buffer);
+	return err;
+}
+
+/*
+ * Wraps a buffer that was exported elsewhere, typically a frame passed in by
+ * a decode daemon. The buffer takes ownership of the file descriptor and is
+ * only mapped for reading.
+ */
+int tegra_vde_buffer_import(struct tegra_vde_buffer **bufferp, int fd,
+			    size_t size)
+{
+	struct tegra_vde_buffer *buffer;
+
+	buffer = calloc(1, sizeof(*buffer));
+	if (!buffer)
+		return -ENOMEM;
+
+	buffer->ptr = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	if (buffer->ptr == MAP_FAILED) {
+		free(buffer);
+		return -errno;
+	}
+
+	buffer->size = size;
+	buffer->fd = fd;
+	vde_mem_alloc(VDE_MEM_DMABUF, size);
+	*bufferp = buffer;
+
+	return 0;
+}
+
+void tegra_vde_buffer_free(struct tegra_vde_buffer *buffer)
+{
+	if (buffer) {
+		if (buffer->bo) {
+			drm_tegra_bo_unref(buffer->bo);
+			vde_mem_free(VDE_MEM_BO, buffer->size);
+		} else {
+			munmap(buffer->ptr, buffer->size);
+		}
+
+		close(buffer->fd);
+		vde_mem_free(VDE_MEM_DMABUF, buffer->size);
+	}
+
+	free(buffer);
+}
+
+int tegra_vde_buffer_map(struct tegra_vde_buffer *buffer, void **ptrp)
+{
+	if (buffer->bo)
+		return drm_tegra_bo_map(buffer->bo, ptrp);
+
+	*ptrp = buffer->ptr;
+
+	return 0;
+}
+
+void tegra_vde_buffer_unmap(struct tegra_vde_buffer *buffer)
+{
+	if (buffer->bo)
+		drm_tegra_bo_unmap(buffer->bo);
+}
+
+int tegra_get_block_height(uint64_t modifier)
+{
+	switch (modifier) {
+	case DRM_FORMAT_MOD_NVIDIA_16BX2_BLOCK(0):
+		return 1;
+
+	case DRM_FORMAT_MOD_NVIDIA_16BX2_BLOCK(1):
+		return 2;
+
+	case DRM_FORMAT_MOD_NVIDIA_16BX2_BLOCK(2):
+		return 4;
+
+	case DRM_FORMAT_MOD_NVIDIA_16BX2_BLOCK(3):
+		return 8;
+
+	case DRM_FORMAT_MOD_NVIDIA_16BX2_BLOCK(4):
+		return 16;
+
+	case DRM_FORMAT_MOD_NVIDIA_16BX2_BLOCK(5):
+		return 32;
+	}
+
+	return -EINVAL;
+}
+
+/*
+ * Copies a linear plane into block-linear layout. This is what the software
+ * stand-in does for every decoded picture, and the inverse of detiling.
+ */
+void tegra_vde_tile_plane(void *dst, size_t size, const uint8_t *src,
+			  unsigned int pitch, unsigned int width,
+			  unsigned int height, unsigned int gobs,
+			  unsigned int block_height)
+{
+	unsigned int i, j;
+
+	for (j = 0; j < height; j++) {
+		const uint8_t *row = src + pitch * j;
+
+		for (i = 0; i < width; i += 16) {
+			size_t offset = tegra_block_linear_offset(i, j, gobs,
+								  block_height);
+
+			/* never write past the end of the buffer */
+			if (offset + 16 > size)
+				continue;
+
+			memcpy(dst + offset, row + i, 16);
+		}
+	}
+}
+
+/* bytes spent on rows that pad the planes of a YUV420 frame to whole blocks */
+size_t tegra_vde_frame_padding(unsigned int width, unsigned int height,
+			       unsigned int block_height)
+{
+	unsigned int rows = 8 * block_height;
+	size_t padding;
+
+	padding = (size_t)ALIGN(width, 64) * (ALIGN(height, rows) - height);
+	padding += (size_t)2 * ALIGN(width / 2, 64) *
+		   (ALIGN(height / 2, rows) - height / 2);
+
+	return padding;
+}
+
+/*
+ * Cost of detiling a frame with each block height, relative to 16 GOBs, from
+ * the medians of six runs of vde-bench -f detile-bh -r 25 with the AVX2
+ * kernels on an Intel Xeon. Differences below 1% were noise between runs, so
+ * the costs are rounded to that. Rerun those and update the table when the
+ * detile kernels change.
+ */
+static const unsigned int tegra_vde_detile_cost[] = {
+	1120, 1180, 1100, 1000, 1000, 1020,
+};
+
+/* padding above 1/TEGRA_VDE_MAX_PADDING of the frame rules a layout out */
+#define TEGRA_VDE_MAX_PADDING 16
+
+/*
+ * Picks the block height of frames decoded for the given consumer. Layouts
+ * that would pad the frame by more than the budget are skipped, which keeps
+ * small streams from paying for 128-row alignment. Of the others, the CPU
+ * gets the one that detiles fastest, while display and encoder engines get
+ * the tallest one up to 16 GOBs, the layout they have always been fed, since
+ * they fetch whole GOB columns and taller blocks mean fewer page switches.
+ */
+uint64_t tegra_vde_choose_modifier(unsigned int width, unsigned int height,
+				   enum tegra_vde_consumer consumer)
+{
+	const unsigned int *cost = tegra_vde_detile_cost;
+	size_t size = (size_t)ALIGN(width, 64) * height +
+		      2 * ALIGN(width / 2, 64) * (height / 2);
+	unsigned int i, best = 0;
+
+	for (i = 0; i < ARRAY_SIZE(tegra_vde_detile_cost); i++) {
+		size_t padding = tegra_vde_frame_padding(width, height, 1 << i);
+
+		if (padding * TEGRA_VDE_MAX_PADDING > size)
+			continue;
+
+		switch (consumer) {
+		case TEGRA_VDE_CONSUMER_CPU:
+			/*
+			 * Ties go to 16 GOBs, the layout frames have always
+			 * had, and otherwise to the one with less padding.
+			 */
+			if (cost[i] < cost[best] ||
+			    (cost[i] == cost[best] && i == 4))
+				best = i;
+			break;
+
+		case TEGRA_VDE_CONSUMER_DISPLAY:
+		case TEGRA_VDE_CONSUMER_ENCODER:
+			if (i <= 4)
+				best = i;
+			break;
+		}
+	}
+
+	return DRM_FORMAT_MOD_NVIDIA_16BX2_BLOCK(best);
+}
+
+int tegra_vde_frame_create(struct tegra_vde_frame **framep,
+			   struct tegra_vde *vde, unsigned int width,
+			   unsigned int height, uint32_t format,
+			   uint64_t modifier)
+{
+	const struct drm_format_info *info;
+	struct tegra_vde_frame *frame;
+	unsigned int block_height;
+	unsigned int i;
+	size_t size;
+	void *ptr;
+	int err;
+
+	info = drm_format_get_info(format);
+	if (!info)
+		return -EINVAL;
+
+	err = tegra_get_block_height(modifier);
+	if (err < 0)
+		return err;
+
+	block_height = err;
+
+	frame = calloc(1, sizeof(*frame));
+	if (!frame)
+		return -ENOMEM;
+
+	frame->width = width;
+	frame->height = height;
+	frame->format = format;
+	frame->modifier = modifier;
+
+	frame->crop.width = width;
+	frame->crop.height = height;
+
+	/* blocks are 64 bytes wide, assuming block-linear */
+	frame->pitch = ALIGN(width * info->cpp[0], 64);
+
+	frame->offsets[0] = 0;
+
+	size = frame->pitch * ALIGN(height, 8 * block_height);
+
+	for (i = 1; i < info->num_planes; i++) {
+		/* chroma rows are whole GOBs as well */
+		unsigned int pitch = ALIGN(width * info->cpp[i] / info->hsub,
+					   64);
+
+		frame->offsets[i] = size;
+
+		size += pitch * ALIGN(height / info->vsub, 8 * block_height);
+	}
+
+	err = tegra_vde_buffer_create(&frame->buffer, vde->drm, size);
+	if (err < 0)
+		goto free;
+
+	frame->size = size;
+
+	err = tegra_vde_buffer_map(frame->buffer, &ptr);
+	if (err < 0)
+		goto free_buffer;
+
+	memset(ptr, 0xaa, size);
+
+	tegra_vde_buffer_unmap(frame->buffer);
+
+	*framep = frame;
+
+	return 0;
+
+free_buffer:
+	tegra_vde_buffer_free(frame->buffer);
+free:
+	free(frame);
+	return err;
+}
+
+/*
+ * Copies one row of a block-linear plane, starting at byte x. Chunks are 16
+ * bytes, so a row that starts on a chunk boundary is copied in whole chunks,
+ * which may write up to 15 bytes past the end of the row (into the padding
+ * of the image pitch). Built for each ISA, so that chunk copies become
+ * vector loads and stores where the baseline has none (ARMv7).
+ */
+CPU_INLINE void tegra_vde_detile_row_with(uint8_t *dst, const uint8_t *src,
+					  unsigned int x, unsigned int y,
+					  unsigned int bytes, unsigned int gobs,
+					  unsigned int block_height)
+{
+	unsigned int i, n;
+	size_t offset;
+
+	if (x % 16 == 0) {
+		for (i = 0; i < bytes; i += 16) {
+			offset = tegra_block_linear_offset(x + i, y, gobs,
+							   block_height);
+			memcpy(dst + i, src + offset, 16);
+		}
+
+		return;
+	}
+
+	for (i = 0; i < bytes; i += n) {
+		n = 16 - (x + i) % 16;
+		if (n > bytes - i)
+			n = bytes - i;
+
+		offset = tegra_block_linear_offset(x + i, y, gobs, block_height);
+		memcpy(dst + i, src + offset, n);
+	}
+}
+
+/*
+ * Checks that the rectangle, which is relative to the visible part of the
+ * frame, lies within it and doesn't split chroma samples, and converts it to
+ * frame coordinates.
+ */
+static int tegra_vde_frame_check_rect(struct tegra_vde_frame *frame,
+				      const struct drm_format_info *info,
+				      const struct tegra_vde_rect *rect,
+				      struct tegra_vde_rect *out)
+{
+	const struct tegra_vde_rect *crop = &frame->crop;
+
+	if (crop->width == 0 || crop->height == 0 ||
+	    crop->x + crop->width > frame->width ||
+	    crop->y + crop->height > frame->height)
+		return -EINVAL;
+
+	if (!rect) {
+		*out = *crop;
+		return 0;
+	}
+
+	if (rect->width == 0 || rect->height == 0 ||
+	    (uint64_t)rect->x + rect->width > crop->width ||
+	    (uint64_t)rect->y + rect->height > crop->height)
+		return -EINVAL;
+
+	if (rect->x % info->hsub || rect->width % info->hsub ||
+	    rect->y % info->vsub || rect->height % info->vsub)
+		return -EINVAL;
+
+	out->x = crop->x + rect->x;
+	out->y = crop->y + rect->y;
+	out->width = rect->width;
+	out->height = rect->height;
+
+	return 0;
+}
+
+typedef uint8_t tegra_vde_u8x16 __attribute__((vector_size(16)));
+
+/* interleaves 16 bytes from each of a and b into 32 bytes at dst */
+static inline void tegra_vde_interleave16(uint8_t *dst, const uint8_t *a,
+					  const uint8_t *b)
+{
+	static const tegra_vde_u8x16 lo = {
+		0, 16, 1, 17, 2, 18, 3, 19, 4, 20, 5, 21, 6, 22, 7, 23,
+	};
+	static const tegra_vde_u8x16 hi = {
+		8, 24, 9, 25, 10, 26, 11, 27, 12, 28, 13, 29, 14, 30, 15, 31,
+	};
+	tegra_vde_u8x16 va, vb, v;
+
+	memcpy(&va, a, sizeof(va));
+	memcpy(&vb, b, sizeof(vb));
+
+	v = __builtin_shuffle(va, vb, lo);
+	memcpy(dst, &v, sizeof(v));
+
+	v = __builtin_shuffle(va, vb, hi);
+	memcpy(dst + 16, &v, sizeof(v));
+}
+
+/*
+ * Like tegra_vde_detile_row_with(), but interleaves the bytes of two planes
+ * with the same layout, such as the Cb and Cr planes, into one row. Scalar
+ * code interleaves one byte at a time.
+ */
+CPU_INLINE void tegra_vde_detile_row_interleaved_with(uint8_t *dst,
+						      const uint8_t *a,
+						      const uint8_t *b,
+						      unsigned int x,
+						      unsigned int y,
+						      unsigned int bytes,
+						      unsigned int gobs,
+						      unsigned int block_height,
+						      bool vector)
+{
+	unsigned int i;
+	size_t offset;
+
+	if (x % 16 == 0 && vector) {
+		for (i = 0; i < bytes; i += 16) {
+			offset = tegra_block_linear_offset(x + i, y, gobs,
+							   block_height);
+			tegra_vde_interleave16(dst + i * 2, a + offset,
+					       b + offset);
+		}
+
+		return;
+	}
+
+	for (i = 0; i < bytes; i++) {
+		offset = tegra_block_linear_offset(x + i, y, gobs, block_height);
+		dst[i * 2 + 0] = a[offset];
+		dst[i * 2 + 1] = b[offset];
+	}
+}
+
+typedef void (*tegra_vde_detile_row_fn)(uint8_t *dst, const uint8_t *src,
+					unsigned int x, unsigned int y,
+					unsigned int bytes, unsigned int gobs,
+					unsigned int block_height);
+typedef void (*tegra_vde_detile_row_interleaved_fn)(uint8_t *dst,
+						    const uint8_t *a,
+						    const uint8_t *b,
+						    unsigned int x,
+						    unsigned int y,
+						    unsigned int bytes,
+						    unsigned int gobs,
+						    unsigned int block_height);
+
+#define TEGRA_VDE_DEFINE_DETILE(isa, target, vector)			\
+target static void tegra_vde_detile_row_##isa(uint8_t *dst,		\
+					      const uint8_t *src,	\
+					      unsigned int x,		\
+					      unsigned int y,		\
+					      unsigned int bytes,	\
+					      unsigned int gobs,	\
+					      unsigned int block_height) \
+{									\
+	tegra_vde_detile_row_with(dst, src, x, y, bytes, gobs,		\
+				  block_height);			\
+}									\
+									\
+target static void							\
+tegra_vde_detile_row_interleaved_##isa(uint8_t *dst, const uint8_t *a,	\
+				       const uint8_t *b, unsigned int x, \
+				       unsigned int y, unsigned int bytes, \
+				       unsigned int gobs,		\
+				       unsigned int block_height)	\
+{									\
+	tegra_vde_detile_row_interleaved_with(dst, a, b, x, y, bytes,	\
+					      gobs, block_height,	\
+					      vector);			\
+}
+
+TEGRA_VDE_DEFINE_DETILE(scalar, , false)
+
+#if defined(CPU_HAVE_SSE2)
+TEGRA_VDE_DEFINE_DETILE(sse2, CPU_TARGET_SSE2, true)
+#endif
+
+#if defined(CPU_HAVE_NEON)
+TEGRA_VDE_DEFINE_DETILE(neon, CPU_TARGET_NEON, true)
+#endif
+
+/* chunks are 16 bytes apart at best, so AVX2 has nothing over SSE2 here */
+static const tegra_vde_detile_row_fn tegra_vde_detile_row_impls[CPU_ISA_COUNT] = {
+	[CPU_ISA_SCALAR] = tegra_vde_detile_row_scalar,
+	CPU_IMPL_SSE2(tegra_vde_detile_row_sse2)
+	CPU_IMPL_AVX2(tegra_vde_detile_row_sse2)
+	CPU_IMPL_NEON(tegra_vde_detile_row_neon)
+};
+
+static const tegra_vde_detile_row_interleaved_fn
+tegra_vde_detile_row_interleaved_impls[CPU_ISA_COUNT] = {
+	[CPU_ISA_SCALAR] = tegra_vde_detile_row_interleaved_scalar,
+	CPU_IMPL_SSE2(tegra_vde_detile_row_interleaved_sse2)
+	CPU_IMPL_AVX2(tegra_vde_detile_row_interleaved_sse2)
+	CPU_IMPL_NEON(tegra_vde_detile_row_interleaved_neon)
+};
+
+/*
+ * The VDE writes three-plane YUV 4:2:0. Detiling can reorder the chroma
+ * planes or interleave them at the same time, which is cheaper than a
+ * separate conversion pass over the linear image.
+ */
+static int tegra_vde_detile_layout(uint32_t src, uint32_t dst, bool *swap,
+				   bool *interleave)
+{
+	*swap = false;
+	*interleave = false;
+
+	if (src == dst)
+		return 0;
+
+	if (src != DRM_FORMAT_YUV420)
+		return -EINVAL;
+
+	switch (dst) {
+	case DRM_FORMAT_YVU420:
+		*swap = true;
+		return 0;
+
+	case DRM_FORMAT_NV12:
+		*interleave = true;
+		return 0;
+
+	case DRM_FORMAT_NV21:
+		*swap = true;
+		*interleave = true;
+		return 0;
+	}
+
+	return -EINVAL;
+}
+
+int tegra_vde_frame_detile_to(struct tegra_vde_frame *frame,
+			      const struct tegra_vde_rect *rect,
+			      uint32_t format, struct image **imagep)
+{
+	tegra_vde_detile_row_interleaved_fn detile_row_interleaved;
+	unsigned int j, k, block_height, gobs;
+	uint64_t start = vde_stats_begin();
+	const struct drm_format_info *info;
+	tegra_vde_detile_row_fn detile_row;
+	struct tegra_vde_rect area;
+	enum cpu_isa isa;
+	bool swap, interleave;
+	struct image *image;
+	void *ptr;
+	int err;
+
+	info = drm_format_get_info(frame->format);
+	if (!info)
+		return -EINVAL;
+
+	err = tegra_vde_detile_layout(frame->format, format, &swap,
+				      &interleave);
+	if (err < 0)
+		return err;
+
+	err = tegra_get_block_height(frame->modifier);
+	if (err < 0)
+		return err;
+
+	block_height = err;
+
+	err = tegra_vde_frame_check_rect(frame, info, rect, &area);
+	if (err < 0)
+		return err;
+
+	isa = cpu_isa();
+	detile_row = tegra_vde_detile_row_impls[isa];
+	detile_row_interleaved = tegra_vde_detile_row_interleaved_impls[isa];
+
+	err = tegra_vde_buffer_map(frame->buffer, &ptr);
+	if (err < 0)
+		return err;
+
+	vde_trace_begin(VDE_TRACE_DETILE, frame->stream, frame->sequence);
+
+	/* only the requested rectangle is detiled, the rest is skipped */
+	err = image_create(&image, area.width, area.height, format);
+	if (err < 0) {
+		tegra_vde_buffer_unmap(frame->buffer);
+		vde_trace_end(VDE_TRACE_DETILE, frame->stream, frame->sequence);
+		return err;
+	}
+
+	for (k = 0; k < info->num_planes; k++) {
+		unsigned int width = image->width;
+		unsigned int height = image->height;
+		unsigned int x = area.x, y = area.y;
+		unsigned int plane = k;
+
+		gobs = DIV_ROUND_UP(frame->pitch, 64);
+
+		if (k > 0) {
+			width /= info->hsub;
+			height /= info->vsub;
+			x /= info->hsub;
+			y /= info->vsub;
+			gobs = DIV_ROUND_UP(gobs, info->hsub);
+
+			if (swap)
+				plane = 3 - k;
+		}
+
+		/* both chroma planes are written in one go */
+		if (k > 0 && interleave) {
+			const uint8_t *first = ptr + frame->offsets[swap ? 2 : 1];
+			const uint8_t *second = ptr + frame->offsets[swap ? 1 : 2];
+
+			for (j = 0; j < height; j++) {
+				uint8_t *dst = image->planes[1] +
+					       image->pitches[1] * j;
+
+				detile_row_interleaved(dst, first, second, x,
+						       y + j, width, gobs,
+						       block_height);
+			}
+
+			break;
+		}
+
+		for (j = 0; j < height; j++)
+			detile_row(image->planes[plane] +
+				   image->pitches[plane] * j,
+				   ptr + frame->offsets[k], x * info->cpp[k],
+				   y + j, width * info->cpp[k], gobs,
+				   block_height);
+	}
+
+	if (imagep)
+		*imagep = image;
+	else
+		image_free(image);
+
+	tegra_vde_buffer_unmap(frame->buffer);
+
+	vde_trace_end(VDE_TRACE_DETILE, frame->stream, frame->sequence);
+	vde_stats_end(VDE_STAGE_DETILE, start);
+
+	return 0;
+}
+
+int tegra_vde_frame_detile_rect(struct tegra_vde_frame *frame,
+				const struct tegra_vde_rect *rect,
+				struct image **imagep)
+{
+	return tegra_vde_frame_detile_to(frame, rect, frame->format, imagep);
+}
+
+/* detiles the visible part of the frame */
+int tegra_vde_frame_detile(struct tegra_vde_frame *frame,
+			   struct image **imagep)
+{
+	return tegra_vde_frame_detile_rect(frame, NULL, imagep);
+}
+
+/* bytes of a row that are detiled and hashed at a time */
+#define TEGRA_VDE_HASH_CHUNK 1024
+
+/*
+ * Hashes the visible part of the frame plane by plane and row by row, which
+ * is what ffmpeg's framemd5 hashes for planar formats. Rows are detiled into
+ * a small buffer that stays in cache and hashed right away, so no image is
+ * created and the frame is read only once.
+ */
+int tegra_vde_frame_hash(struct tegra_vde_frame *frame, struct vde_hash *hash)
+{
+	/* whole chunks are copied, up to 15 bytes past the end of a row */
+	uint8_t row[TEGRA_VDE_HASH_CHUNK + 16];
+	unsigned int i, j, k, block_height, gobs;
+	uint64_t start = vde_stats_begin();
+	const struct drm_format_info *info;
+	tegra_vde_detile_row_fn detile_row;
+	struct tegra_vde_rect area;
+	void *ptr;
+	int err;
+
+	info = drm_format_get_info(frame->format);
+	if (!info)
+		return -EINVAL;
+
+	err = tegra_get_block_height(frame->modifier);
+	if (err < 0)
+		return err;
+
+	block_height = err;
+
+	err = tegra_vde_frame_check_rect(frame, info, NULL, &area);
+	if (err < 0)
+		return err;
+
+	detile_row = tegra_vde_detile_row_impls[cpu_isa()];
+
+	err = tegra_vde_buffer_map(frame->buffer, &ptr);
+	if (err < 0)
+		return err;
+
+	vde_trace_begin(VDE_TRACE_DETILE, frame->stream, frame->sequence);
+
+	for (k = 0; k < info->num_planes; k++) {
+		unsigned int width = area.width, height = area.height;
+		unsigned int x = area.x, y = area.y, bytes, count;
+
+		gobs = DIV_ROUND_UP(frame->pitch, 64);
+
+		if (k > 0) {
+			width /= info->hsub;
+			height /= info->vsub;
+			x /= info->hsub;
+			y /= info->vsub;
+			gobs = DIV_ROUND_UP(gobs, info->hsub);
+		}
+
+		bytes = width * info->cpp[k];
+		x *= info->cpp[k];
+
+		for (j = 0; j < height; j++) {
+			for (i = 0; i < bytes; i += count) {
+				count = MIN(bytes - i, TEGRA_VDE_HASH_CHUNK);
+				detile_row(row, ptr + frame->offsets[k], x + i,
+					   y + j, count, gobs, block_height);
+				vde_hash_update(hash, row, count);
+			}
+		}
+	}
+
+	tegra_vde_buffer_unmap(frame->buffer);
+
+	vde_trace_end(VDE_TRACE_DETILE, frame->stream, frame->sequence);
+	vde_stats_end(VDE_STAGE_DETILE, start);
+
+	return 0;
+}
+
+/*
+ * Picks the two adjacent source positions in the middle of the cell that
+ * output position i out of count is scaled down from. Both are the same if
+ * the cell is a single sample wide. The pair starts at an even position if
+ * the cell allows it, because the 16Bx2 layout stores pairs of rows (and
+ * pairs of samples) next to each other, so that the samples of the pair
+ * share a cache line.
+ */
+static void tegra_vde_thumbnail_cell(unsigned int i, unsigned int count,
+				     unsigned int start, unsigned int size,
+				     unsigned int *first, unsigned int *second)
+{
+	unsigned int begin = start + i * size / count;
+	unsigned int end = start + (i + 1) * size / count;
+	unsigned int middle = begin + (end - begin) / 2;
+
+	if (end - begin > 1) {
+		*first = middle - 1;
+
+		if ((*first & 1) && *first + 2 < end)
+			*first += 1;
+
+		*second = *first + 1;
+	} else {
+		*first = middle;
+		*second = middle;
+	}
+}
+
+/*
+ * Gathers the samples of one source row into two linear rows, the first and
+ * second sample of each cell. columns holds the precomputed offsets of the
+ * samples within a row of GOBs.
+ */
+static void tegra_vde_thumbnail_gather(uint8_t *first, uint8_t *second,
+				       const uint8_t *src,
+				       const size_t *columns,
+				       unsigned int count, unsigned int cpp)
+{
+	unsigned int i, c;
+
+	if (cpp == 1) {
+		for (i = 0; i < count; i++) {
+			first[i] = src[columns[i * 2]];
+			second[i] = src[columns[i * 2 + 1]];
+		}
+
+		return;
+	}
+
+	for (i = 0; i < count; i++) {
+		for (c = 0; c < cpp; c++) {
+			first[i * cpp + c] = src[columns[i * 2] + c];
+			second[i * cpp + c] = src[columns[i * 2 + 1] + c];
+		}
+	}
+}
+
+/* kept as a plain loop over bytes so that the compiler can vectorize it */
+static void tegra_vde_box_filter(uint8_t *dst, const uint8_t *a0,
+				 const uint8_t *a1, const uint8_t *b0,
+				 const uint8_t *b1, unsigned int count)
+{
+	unsigned int i;
+
+	for (i = 0; i < count; i++)
+		dst[i] = (a0[i] + a1[i] + b0[i] + b1[i] + 2) >> 2;
+}
+
+/*
+ * Scales the visible part of the frame down to the given size. Each output
+ * sample is the average of the 2x2 source samples in the middle of the cell
+ * that it covers, so only a sparse subset of the GOBs is read and the amount
+ * of memory traffic depends on the size of the thumbnail rather than on the
+ * size of the frame.
+ */
+int tegra_vde_frame_thumbnail(struct tegra_vde_frame *frame,
+			      unsigned int width, unsigned int height,
+			      struct image **imagep)
+{
+	unsigned int i, j, k, block_height, gobs, max = 0;
+	uint64_t start = vde_stats_begin();
+	const struct drm_format_info *info;
+	struct tegra_vde_rect area;
+	uint8_t *scratch, *rows[4];
+	size_t *columns;
+	struct image *image;
+	void *ptr;
+	int err;
+
+	info = drm_format_get_info(frame->format);
+	if (!info)
+		return -EINVAL;
+
+	err = tegra_get_block_height(frame->modifier);
+	if (err < 0)
+		return err;
+
+	block_height = err;
+
+	err = tegra_vde_frame_check_rect(frame, info, NULL, &area);
+	if (err < 0)
+		return err;
+
+	if (width == 0 || height == 0 || width > area.width ||
+	    height > area.height || width % info->hsub || height % info->vsub)
+		return -EINVAL;
+
+	for (k = 0; k < info->num_planes; k++)
+		if (width * info->cpp[k] > max)
+			max = width * info->cpp[k];
+
+	scratch = malloc(ALIGN(max * 4, sizeof(*columns)) +
+			 width * 2 * sizeof(*columns));
+	if (!scratch)
+		return -ENOMEM;
+
+	for (k = 0; k < 4; k++)
+		rows[k] = scratch + max * k;
+
+	columns = (size_t *)(scratch + ALIGN(max * 4, sizeof(*columns)));
+
+	vde_trace_begin(VDE_TRACE_DETILE, frame->stream, frame->sequence);
+
+	err = tegra_vde_buffer_map(frame->buffer, &ptr);
+	if (err < 0)
+		goto free;
+
+	err = image_create(&image, width, height, frame->format);
+	if (err < 0)
+		goto unmap;
+
+	for (k = 0; k < info->num_planes; k++) {
+		unsigned int x = area.x, y = area.y, cpp = info->cpp[k];
+		unsigned int sw = area.width, sh = area.height;
+		unsigned int w = width, h = height;
+
+		gobs = DIV_ROUND_UP(frame->pitch, 64);
+
+		if (k > 0) {
+			x /= info->hsub;
+			y /= info->vsub;
+			sw /= info->hsub;
+			sh /= info->vsub;
+			w /= info->hsub;
+			h /= info->vsub;
+			gobs = DIV_ROUND_UP(gobs, info->hsub);
+		}
+
+		for (i = 0; i < w; i++) {
+			unsigned int x0, x1;
+
+			tegra_vde_thumbnail_cell(i, w, x, sw, &x0, &x1);
+
+			columns[i * 2 + 0] =
+				tegra_block_linear_x_offset(x0 * cpp,
+							    block_height);
+			columns[i * 2 + 1] =
+				tegra_block_linear_x_offset(x1 * cpp,
+							    block_height);
+		}
+
+		for (j = 0; j < h; j++) {
+			const uint8_t *src = ptr + frame->offsets[k];
+			unsigned int y0, y1;
+			size_t offset;
+
+			tegra_vde_thumbnail_cell(j, h, y, sh, &y0, &y1);
+
+			offset = tegra_block_linear_y_offset(y0, gobs,
+							     block_height);
+			tegra_vde_thumbnail_gather(rows[0], rows[1],
+						   src + offset, columns, w,
+						   cpp);
+
+			offset = tegra_block_linear_y_offset(y1, gobs,
+							     block_height);
+			tegra_vde_thumbnail_gather(rows[2], rows[3],
+						   src + offset, columns, w,
+						   cpp);
+
+			tegra_vde_box_filter(image->planes[k] +
+					     image->pitches[k] * j,
+					     rows[0], rows[1], rows[2], rows[3],
+					     w * cpp);
+		}
+	}
+
+	if (imagep)
+		*imagep = image;
+	else
+		image_free(image);
+
+unmap:
+	tegra_vde_buffer_unmap(frame->buffer);
+free:
+	vde_trace_end(VDE_TRACE_DETILE, frame->stream, frame->sequence);
+	free(scratch);
+
+	if (err == 0)
+		vde_stats_end(VDE_STAGE_DETILE, start);
+
+	return err;
+}
+
+void tegra_vde_frame_dump(struct tegra_vde_frame *frame, FILE *fp)
+{
+	const struct drm_format_info *info;
+	struct image *image;
+	uint32_t handle = 0;
+	unsigned int i, j;
+	void *ptr;
+	int err;
+
+	info = drm_format_get_info(frame->format);
+	if (!info) {
+		fprintf(stderr, "invalid format %08x\n", frame->format);
+		return;
+	}
+
+	if (frame->buffer->bo) {
+		err = drm_tegra_bo_get_handle(frame->buffer->bo, &handle);
+		if (err < 0) {
+			fprintf(stderr, "failed to get buffer object handle: %d\n", err);
+			return;
+		}
+	}
+
+	err = tegra_vde_buffer_map(frame->buffer, &ptr);
+	if (err < 0) {
+		fprintf(stderr, "failed to map frame buffer: %d\n", err);
+		return;
+	}
+
+	fprintf(fp, "frame: %ux%u\n", frame->width, frame->height);
+	fprintf(fp, "  crop: %ux%u at %u,%u\n", frame->crop.width,
+		frame->crop.height, frame->crop.x, frame->crop.y);
+	fprintf(fp, "  buffer: %p\n", frame->buffer);
+	fprintf(fp, "    handle: %u\n", handle);
+	fprintf(fp, "    size: %zu\n", frame->size);
+	fprintf(fp, "    ptr: %p\n", ptr);
+	fprintf(fp, "    fd: %d\n", frame->buffer->fd);
+
+	for (i = 0; i < info->num_planes; i++) {
+		unsigned int width = frame->width;
+		unsigned int height = frame->height;
+		unsigned int stride, pitch;
+
+		if (i > 0) {
+			width /= info->hsub;
+			height /= info->vsub;
+		}
+
+		stride = width * info->cpp[i];
+		pitch = ALIGN(stride, 64);
+
+		fprintf(fp, "  %u: %zx\n", i, frame->offsets[i]);
+
+		for (j = 0; j < height; j++) {
+			unsigned int offset = j * pitch;
+
+			hexdump(ptr + frame->offsets[i] + offset,
+				stride, stride, "    ", fp);
+		}
+	}
+
+	tegra_vde_buffer_unmap(frame->buffer);
+
+	err = tegra_vde_frame_detile(frame, &image);
+	if (err < 0) {
+		fprintf(stderr, "failed to detile frame: %d\n", err);
+		return;
+	}
+
+	image_dump(image, fp);
+	image_free(image);
+}
+
+void tegra_vde_frame_free(struct tegra_vde_frame *frame)
+{
+	if (frame)
+		tegra_vde_buffer_free(frame->buffer);
+
+	free(frame);
+}
+
+static int tegra_vde_hw_open(struct tegra_vde *vde)
+{
+	vde->fd = open("/dev/tegra_vde", O_RDWR);
+	if (vde->fd < 0)
+		return -errno;
+
+	return 0;
+}
+
+static void tegra_vde_hw_close(struct tegra_vde *vde)
+{
+	close(vde->fd);
+}
+
+static int tegra_vde_hw_decode(struct tegra_vde *vde,
+			       const struct tegra_vde_h264_decoder_ctx *args,
+			       size_t size)
+{
+	int err;
+
+repeat:
+	err = ioctl(vde->fd, TEGRA_VDE_IOCTL_DECODE_H264, args);
+	if (err < 0) {
+		if (errno == EINTR) {
+			vde_stats_add(VDE_COUNTER_EINTR, 1);
+			goto repeat;
+		}
+
+		if (errno == EAGAIN) {
+			vde_stats_add(VDE_COUNTER_EAGAIN, 1);
+			goto repeat;
+		}
+
+		return -errno;
+	}
+
+	return 0;
+}
+
+const struct tegra_vde_ops tegra_vde_hw_ops = {
+	.name = "hardware",
+	.open = tegra_vde_hw_open,
+	.close = tegra_vde_hw_close,
+	.decode = tegra_vde_hw_decode,
+};
+
+static unsigned int tegra_vde_next_id(void)
+{
+	static unsigned int id;
+
+	return __atomic_fetch_add(&id, 1, __ATOMIC_RELAXED);
+}
+
+int tegra_vde_open(struct tegra_vde **vdep, struct drm_tegra *drm,
+		   const struct tegra_vde_ops *ops)
+{
+	struct tegra_vde *vde;
+	int err;
+
+	vde = calloc(1, sizeof(*vde));
+	if (!vde)
+		return -ENOMEM;
+
+	vde->ops = ops;
+	vde->drm = drm;
+	vde->fd = -1;
+	vde->id = tegra_vde_next_id();
+
+	err = vde->ops->open(vde);
+	if (err < 0)
+		goto free;
+
+	/* until tegra_vde_resize_bitstream() sizes it for the stream */
+	err = tegra_vde_buffer_create(&vde->bitstream, vde->drm,
+				      TEGRA_VDE_BITSTREAM_SIZE);
+	if (err < 0) {
+		fprintf(stderr, "failed to create bitstream buffer: %d\n", err);
+		goto close;
+	}
+
+	err = tegra_vde_buffer_create(&vde->secure, vde->drm, 4 * 1024);
+	if (err < 0) {
+		fprintf(stderr, "failed to create secure buffer: %d\n", err);
+		goto free_bitstream;
+	}
+
+	*vdep = vde;
+
+	return 0;
+
+free_bitstream:
+	tegra_vde_buffer_free(vde->bitstream);
+close:
+	vde->ops->close(vde);
+free:
+	free(vde);
+	return err;
+}
+
+void tegra_vde_close(struct tegra_vde *vde)
+{
+	if (vde) {
+		tegra_vde_buffer_free(vde->secure);
+		tegra_vde_buffer_free(vde->bitstream);
+
+		vde->ops->close(vde);
+	}
+
+	free(vde);
+}
+
+/* replaces the bitstream buffer, the old one stays in place on failure */
+int tegra_vde_resize_bitstream(struct tegra_vde *vde, size_t size)
+{
+	struct tegra_vde_buffer *bitstream;
+	int err;
+
+	if (size == vde->bitstream->size)
+		return 0;
+
+	err = tegra_vde_buffer_create(&bitstream, vde->drm, size);
+	if (err < 0)
+		return err;
+
+	tegra_vde_buffer_free(vde->bitstream);
+	vde->bitstream = bitstream;
+
+	return 0;
+}
+
+/* headroom for parameter sets, SEI and start codes in an access unit */
+#define TEGRA_VDE_BITSTREAM_SLACK 4096
+/* input queued ahead of the decoder, in milliseconds */
+#define TEGRA_VDE_QUEUE_TIME 100
+
+/*
+ * Sizes buffers for the largest pictures that streams of the given context
+ * may contain. frame_rate overrides the one in the VUI if non-zero.
+ */
+int tegra_vde_get_limits(const struct h264_context *ctx,
+			 unsigned int frame_rate,
+			 struct tegra_vde_limits *limits)
+{
+	const struct h264_sps *sps = &ctx->sps[0];
+	const struct h264_vui_parameters *vui = &sps->vui_parameters;
+	uint64_t mbs, size, cpb;
+	int frames;
+
+	frames = h264_sps_max_dpb_frames(sps);
+	if (frames < 0)
+		return frames;
+
+	mbs = (uint64_t)(sps->pic_width_in_mbs_minus1 + 1) *
+	      (sps->pic_height_in_map_units_minus1 + 1) *
+	      (2 - sps->frame_mbs_only_flag);
+
+	/* no macroblock takes more than RawMbBits + 128 bits (A.3.1) */
+	size = mbs * (3072 + 128) / 8;
+
+	if (sps->vui_parameters_present_flag &&
+	    vui->bitstream_restriction_flag && vui->max_bytes_per_pic_denom)
+		size = MIN(size, mbs * 3072 / 8 / vui->max_bytes_per_pic_denom);
+
+	/* and no access unit is larger than the CPB */
+	cpb = h264_sps_max_cpb_size(sps) / 8;
+	if (cpb > 0)
+		size = MIN(size, cpb);
+
+	limits->bitstream_size = ALIGN(size + TEGRA_VDE_BITSTREAM_SLACK,
+				       4096);
+	limits->num_frames = frames + 1;
+
+	if (frame_rate == 0)
+		frame_rate = h264_sps_frame_rate(sps);
+
+	if (frame_rate > 0) {
+		limits->queue_depth = DIV_ROUND_UP(frame_rate *
+						   TEGRA_VDE_QUEUE_TIME, 1000);
+		limits->queue_depth = MAX(limits->queue_depth, 2u);
+		limits->queue_depth = MIN(limits->queue_depth, 16u);
+	} else {
+		limits->queue_depth = TEGRA_VDE_QUEUE_DEPTH;
+	}
+
+	return 0;
+}
+
+void tegra_vde_picture_size(const struct h264_context *ctx,
+			    unsigned int *widthp, unsigned int *heightp)
+{
+	const struct h264_sps *sps = &ctx->sps[0];
+
+	*widthp = (sps->pic_width_in_mbs_minus1 + 1) * 16;
+	*heightp = (sps->pic_height_in_map_units_minus1 + 1) * 16;
+}
+
+/*
+ * Returns the visible rectangle of pictures of the given context. The crop
+ * offsets are in units of chroma samples (4:2:0) and of field rows if the
+ * stream isn't frame-only. Bogus offsets are ignored.
+ */
+void tegra_vde_picture_crop(const struct h264_context *ctx,
+			    struct tegra_vde_rect *crop)
+{
+	const struct h264_sps *sps = &ctx->sps[0];
+	unsigned int width, height, unit_x = 2, unit_y;
+	uint64_t left, right, top, bottom;
+
+	tegra_vde_picture_size(ctx, &width, &height);
+
+	crop->x = 0;
+	crop->y = 0;
+	crop->width = width;
+	crop->height = height;
+
+	if (!sps->frame_cropping_flag)
+		return;
+
+	unit_y = 2 * (2 - sps->frame_mbs_only_flag);
+
+	left = (uint64_t)sps->frame_crop_left_offset * unit_x;
+	right = (uint64_t)sps->frame_crop_right_offset * unit_x;
+	top = (uint64_t)sps->frame_crop_top_offset * unit_y;
+	bottom = (uint64_t)sps->frame_crop_bottom_offset * unit_y;
+
+	if (left + right >= width || top + bottom >= height)
+		return;
+
+	crop->x = left;
+	crop->y = top;
+	crop->width = width - left - right;
+	crop->height = height - top - bottom;
+}
+
+/* creates a frame suitable to decode pictures of the given context into */
+int tegra_vde_frame_create_for(struct tegra_vde_frame **framep,
+			       struct tegra_vde *vde,
+			       const struct h264_context *ctx,
+			       enum tegra_vde_consumer consumer)
+{
+	unsigned int width, height;
+	uint64_t modifier;
+
+	tegra_vde_picture_size(ctx, &width, &height);
+	modifier = tegra_vde_choose_modifier(width, height, consumer);
+
+	return tegra_vde_frame_create(framep, vde, width, height,
+				      DRM_FORMAT_YUV420, modifier);
+}
+
+/* copies an Annex B access unit to the bitstream buffer */
+ssize_t tegra_vde_stage(struct tegra_vde *vde, const void *data, size_t size)
+{
+	uint64_t start = vde_stats_begin();
+	void *ptr;
+	int err;
+
+	if (size > vde->bitstream->size)
+		return -ENOSPC;
+
+	err = tegra_vde_buffer_map(vde->bitstream, &ptr);
+	if (err < 0)
+		return err;
+
+	vde_trace_begin(VDE_TRACE_STAGE, vde->id, vde->frame);
+	memcpy(ptr, data, size);
+	vde_trace_end(VDE_TRACE_STAGE, vde->id, vde->frame);
+
+	if (vde->verbose)
+		hexdump(ptr, (size < 256) ? size : 256, 16, NULL, stdout);
+
+	tegra_vde_buffer_unmap(vde->bitstream);
+
+	vde_stats_end(VDE_STAGE_COPY, start);
+
+	return size;
+}
+
+/*
+ * Like tegra_vde_stage(), but takes a sample of length-prefixed NAL units as
+ * stored in MP4 files. The sample is converted to Annex B format while it is
+ * copied to the bitstream buffer, so no intermediate copy is needed.
+ */
+ssize_t tegra_vde_stage_sample(struct tegra_vde *vde,
+			       const struct h264_context *ctx,
+			       const void *data, size_t size)
+{
+	uint64_t start = vde_stats_begin();
+	ssize_t length;
+	void *ptr;
+	int err;
+
+	/* conversion to Annex B happens while copying into the bitstream */
+	err = tegra_vde_buffer_map(vde->bitstream, &ptr);
+	if (err < 0)
+		return err;
+
+	vde_trace_begin(VDE_TRACE_STAGE, vde->id, vde->frame);
+	length = h264_sample_to_annexb(ctx, ptr, vde->bitstream->size, data,
+				       size);
+	vde_trace_end(VDE_TRACE_STAGE, vde->id, vde->frame);
+	if (length >= 0 && vde->verbose)
+		hexdump(ptr, (length < 256) ? length : 256, 16, NULL, stdout);
+
+	tegra_vde_buffer_unmap(vde->bitstream);
+
+	vde_stats_end(VDE_STAGE_COPY, start);
+
+	return length;
+}
+
+/* decodes the staged bitstream into the given frame */
+int tegra_vde_decode_frame(struct tegra_vde *vde,
+			   struct tegra_vde_frame *frame,
+			   struct h264_context *ctx, size_t size)
+{
+	struct tegra_vde_h264_decoder_ctx args;
+	struct h264_sps *sps = &ctx->sps[0];
+	struct h264_pps *pps = &ctx->pps[0];
+	struct tegra_vde_h264_frame f;
+	unsigned int width, height;
+	uint64_t start, submitted;
+	int err;
+
+	tegra_vde_picture_size(ctx, &width, &height);
+
+	if (vde->verbose)
+		printf("picture: %ux%u\n", width, height);
+
+	if (frame->width != width || frame->height != height)
+		return -EINVAL;
+
+	if (vde->verbose)
+		printf("buffer: %d\n", frame->buffer->fd);
+
+	memset(&f, 0, sizeof(f));
+	f.y_fd = frame->buffer->fd;
+	f.cb_fd = frame->buffer->fd;
+	f.cr_fd = frame->buffer->fd;
+	f.aux_fd = -1;
+	f.y_offset = frame->offsets[0];
+	f.cb_offset = frame->offsets[1];
+	f.cr_offset = frame->offsets[2];
+	f.aux_offset = 0;
+	f.frame_num = 0;
+	f.flags = FLAG_REFERENCE;
+	f.modifier = frame->modifier;
+
+	memset(&args, 0, sizeof(args));
+	args.bitstream_data_fd = vde->bitstream->fd;
+	args.bitstream_data_offset = 0;
+	args.secure_fd = vde->secure->fd;
+	args.secure_offset = 0;
+	args.dpb_frames_ptr = (uintptr_t)&f;
+	args.dpb_frames_nb = 1;
+	args.dpb_ref_frames_with_earlier_poc_nb = 0;
+
+	/* SPS */
+	args.baseline_profile = 1;
+	args.level_idc = 11; //sps->level_idc;
+	args.log2_max_pic_order_cnt_lsb = sps->log2_max_pic_order_cnt_lsb_minus4 + 4;
+	args.log2_max_frame_num = sps->log2_max_frame_num_minus4 + 4;
+	args.pic_order_cnt_type = sps->pic_order_cnt_type;
+	args.direct_8x8_inference_flag = sps->direct_8x8_inference_flag;
+	args.pic_width_in_mbs = width / 16;
+	args.pic_height_in_mbs = height / 16;
+
+	/* PPS */
+	args.pic_init_qp = pps->pic_init_qp_minus26 + 26;
+	args.deblocking_filter_control_present_flag = pps->deblocking_filter_control_present_flag;
+	args.constrained_intra_pred_flag = pps->constrained_intra_pred_flag;
+	args.chroma_qp_index_offset = pps->chroma_qp_index_offset & 0x1f;
+	args.pic_order_present_flag = 0; //pps->pic_order_present_flag;
+
+	/* slice header */
+	args.num_ref_idx_l0_active_minus1 = pps->num_ref_idx_l0_default_active_minus1;
+	args.num_ref_idx_l1_active_minus1 = pps->num_ref_idx_l1_default_active_minus1;
+
+	frame->stream = vde->id;
+	frame->sequence = vde->frame;
+	tegra_vde_picture_crop(ctx, &frame->crop);
+
+	submitted = vde_capture_begin();
+	start = vde_stats_begin();
+	vde_trace_begin(VDE_TRACE_DECODE, vde->id, vde->frame);
+	err = vde->ops->decode(vde, &args, size);
+	vde_trace_end(VDE_TRACE_DECODE, vde->id, vde->frame);
+	vde_stats_end(VDE_STAGE_DECODE, start);
+
+	if (vde_capture_enabled)
+		vde_capture_record(vde, &args, &frame, size, submitted, err);
+
+	return err;
+}
+
+static int tegra_vde_decode_staged(struct tegra_vde *vde,
+				   struct tegra_vde_frame **framep,
+				   struct h264_context *ctx, size_t size)
+{
+	struct tegra_vde_frame *frame;
+	int err;
+
+	/* frames decoded this way are always detiled into images */
+	err = tegra_vde_frame_create_for(&frame, vde, ctx,
+					 TEGRA_VDE_CONSUMER_CPU);
+	if (err < 0)
+		return err;
+
+	err = tegra_vde_decode_frame(vde, frame, ctx, size);
+	if (err < 0) {
+		tegra_vde_frame_free(frame);
+		return err;
+	}
+
+	*framep = frame;
+
+	return 0;
+}
+
+int tegra_vde_decode(struct tegra_vde *vde,
+		     struct tegra_vde_frame **framep,
+		     struct h264_context *ctx,
+		     const void *data, size_t size)
+{
+	ssize_t length;
+
+	length = tegra_vde_stage(vde, data, size);
+	if (length < 0)
+		return length;
+
+	return tegra_vde_decode_staged(vde, framep, ctx, length);
+}
+
+int tegra_vde_decode_sample(struct tegra_vde *vde,
+			    struct tegra_vde_frame **framep,
+			    struct h264_context *ctx,
+			    const void *data, size_t size)
+{
+	ssize_t length;
+
+	length = tegra_vde_stage_sample(vde, ctx, data, size);
+	if (length < 0)
+		return length;
+
+	return tegra_vde_decode_staged(vde, framep, ctx, length);
+}
@@ -0,0 +1,224 @@
+#ifndef VDE_H
+#define VDE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <sys/types.h>
+
+#include "tegra-vde.h"
+
+struct drm_tegra;
+struct drm_tegra_bo;
+struct h264_context;
+struct image;
+struct tegra_vde;
+struct vde_hash;
+
+/*
+ * Buffers are backed by DRM buffer objects if a DRM device is available and
+ * by memfd otherwise. Either way they can be shared with the decoder via the
+ * file descriptor.
+ */
+struct tegra_vde_buffer {
+	struct drm_tegra_bo *bo;
+	size_t size;
+	void *ptr;
+	int fd;
+};
+
+int tegra_vde_buffer_create(struct tegra_vde_buffer **bufferp,
+			    struct drm_tegra *drm, size_t size);
+int tegra_vde_buffer_import(struct tegra_vde_buffer **bufferp, int fd,
+			    size_t size);
+void tegra_vde_buffer_free(struct tegra_vde_buffer *buffer);
+int tegra_vde_buffer_map(struct tegra_vde_buffer *buffer, void **ptrp);
+void tegra_vde_buffer_unmap(struct tegra_vde_buffer *buffer);
+
+struct tegra_vde_rect {
+	unsigned int x;
+	unsigned int y;
+	unsigned int width;
+	unsigned int height;
+};
+
+struct tegra_vde_frame {
+	struct tegra_vde_buffer *buffer;
+
+	unsigned int width;
+	unsigned int height;
+	uint32_t format;
+	uint64_t modifier;
+
+	unsigned int pitch;
+	size_t offsets[3];
+	size_t size;
+
+	/*
+	 * visible part of the picture, as given by the SPS frame cropping;
+	 * only this part is detiled
+	 */
+	struct tegra_vde_rect crop;
+
+	/* stream and picture last decoded into the frame, for tracing */
+	unsigned int stream;
+	uint64_t sequence;
+};
+
+int tegra_get_block_height(uint64_t modifier);
+
+/*
+ * Returns the offset of the 16-byte chunk containing byte x of row y within
+ * a plane laid out in 16Bx2 block-linear format. Each GOB is 64 bytes wide
+ * and 8 rows high, and gobs is the number of GOBs per row of the plane.
+ *
+ * The offset is the sum of a part that only depends on x and a part that
+ * only depends on y, so that loops can compute these separately.
+ */
+static inline size_t tegra_block_linear_x_offset(unsigned int x,
+						 unsigned int block_height)
+{
+	return (x / 64) * 512 * block_height + ((x % 64) / 32) * 256 +
+	       ((x % 32) / 16) * 32 + (x % 16);
+}
+
+static inline size_t tegra_block_linear_y_offset(unsigned int y,
+						 unsigned int gobs,
+						 unsigned int block_height)
+{
+	return (y / (8 * block_height)) * 512 * block_height * gobs +
+	       (y % (8 * block_height) / 8) * 512 +
+	       ((y % 8) / 2) * 64 + (y % 2) * 16;
+}
+
+static inline size_t tegra_block_linear_offset(unsigned int x, unsigned int y,
+					       unsigned int gobs,
+					       unsigned int block_height)
+{
+	return tegra_block_linear_x_offset(x, block_height) +
+	       tegra_block_linear_y_offset(y, gobs, block_height);
+}
+
+void tegra_vde_tile_plane(void *dst, size_t size, const uint8_t *src,
+			  unsigned int pitch, unsigned int width,
+			  unsigned int height, unsigned int gobs,
+			  unsigned int block_height);
+
+/* what decoded frames are used for, which decides their layout */
+enum tegra_vde_consumer {
+	/* detiled by the CPU */
+	TEGRA_VDE_CONSUMER_CPU,
+	/* scanned out by the display controller */
+	TEGRA_VDE_CONSUMER_DISPLAY,
+	/* read by a hardware encoder */
+	TEGRA_VDE_CONSUMER_ENCODER,
+};
+
+size_t tegra_vde_frame_padding(unsigned int width, unsigned int height,
+			       unsigned int block_height);
+uint64_t tegra_vde_choose_modifier(unsigned int width, unsigned int height,
+				   enum tegra_vde_consumer consumer);
+
+int tegra_vde_frame_create(struct tegra_vde_frame **framep,
+			   struct tegra_vde *vde, unsigned int width,
+			   unsigned int height, uint32_t format,
+			   uint64_t modifier);
+int tegra_vde_frame_detile(struct tegra_vde_frame *frame,
+			   struct image **imagep);
+int tegra_vde_frame_detile_rect(struct tegra_vde_frame *frame,
+				const struct tegra_vde_rect *rect,
+				struct image **imagep);
+int tegra_vde_frame_detile_to(struct tegra_vde_frame *frame,
+			      const struct tegra_vde_rect *rect,
+			      uint32_t format, struct image **imagep);
+int tegra_vde_frame_hash(struct tegra_vde_frame *frame, struct vde_hash *hash);
+int tegra_vde_frame_thumbnail(struct tegra_vde_frame *frame,
+			      unsigned int width, unsigned int height,
+			      struct image **imagep);
+void tegra_vde_frame_dump(struct tegra_vde_frame *frame, FILE *fp);
+void tegra_vde_frame_free(struct tegra_vde_frame *frame);
+
+struct tegra_vde_ops {
+	const char *name;
+	int (*open)(struct tegra_vde *vde);
+	void (*close)(struct tegra_vde *vde);
+	int (*decode)(struct tegra_vde *vde,
+		      const struct tegra_vde_h264_decoder_ctx *args,
+		      size_t size);
+};
+
+/* TEGRA_VDE_IOCTL_DECODE_H264 on /dev/tegra_vde */
+extern const struct tegra_vde_ops tegra_vde_hw_ops;
+/* software stand-in backed by libavcodec, for use without Tegra hardware */
+extern const struct tegra_vde_ops tegra_vde_soft_ops;
+
+struct tegra_vde {
+	const struct tegra_vde_ops *ops;
+	struct drm_tegra *drm;
+	bool verbose;
+	int fd;
+
+	struct tegra_vde_buffer *bitstream;
+	struct tegra_vde_buffer *secure;
+
+	/* identifies the stream and the picture being decoded, for tracing */
+	unsigned int id;
+	uint64_t frame;
+
+	void *priv;
+};
+
+int tegra_vde_open(struct tegra_vde **vdep, struct drm_tegra *drm,
+		   const struct tegra_vde_ops *ops);
+void tegra_vde_close(struct tegra_vde *vde);
+
+/* sizes used until the stream is known */
+#define TEGRA_VDE_BITSTREAM_SIZE (256 * 1024)
+#define TEGRA_VDE_QUEUE_DEPTH 4
+
+/*
+ * Memory a stream needs, derived from the level limits of its SPS and the
+ * HRD parameters and bitstream restrictions of its VUI.
+ */
+struct tegra_vde_limits {
+	/* largest access unit, from MaxCPB or the HRD CPB size */
+	size_t bitstream_size;
+	/* DPB frames plus the one being decoded */
+	unsigned int num_frames;
+	/* access units to queue, enough for a fixed time at the frame rate */
+	unsigned int queue_depth;
+};
+
+int tegra_vde_get_limits(const struct h264_context *ctx,
+			 unsigned int frame_rate,
+			 struct tegra_vde_limits *limits);
+int tegra_vde_resize_bitstream(struct tegra_vde *vde, size_t size);
+void tegra_vde_picture_size(const struct h264_context *ctx,
+			    unsigned int *widthp, unsigned int *heightp);
+void tegra_vde_picture_crop(const struct h264_context *ctx,
+			    struct tegra_vde_rect *crop);
+int tegra_vde_frame_create_for(struct tegra_vde_frame **framep,
+			       struct tegra_vde *vde,
+			       const struct h264_context *ctx,
+			       enum tegra_vde_consumer consumer);
+ssize_t tegra_vde_stage(struct tegra_vde *vde, const void *data, size_t size);
+ssize_t tegra_vde_stage_sample(struct tegra_vde *vde,
+			       const struct h264_context *ctx,
+			       const void *data, size_t size);
+int tegra_vde_decode_frame(struct tegra_vde *vde,
+			   struct tegra_vde_frame *frame,
+			   struct h264_context *ctx, size_t size);
+
+/* stage the access unit and decode it into a newly created frame */
+int tegra_vde_decode(struct tegra_vde *vde,
+		     struct tegra_vde_frame **framep,
+		     struct h264_context *ctx,
+		     const void *data, size_t size);
+int tegra_vde_decode_sample(struct tegra_vde *vde,
+			    struct tegra_vde_frame **framep,
+			    struct h264_context *ctx,
+			    const void *data, size_t size);
+
+#endif